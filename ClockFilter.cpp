@@ -0,0 +1,62 @@
+#include <algorithm>
+
+#include "ClockFilter.hpp"
+
+// Frequency tolerance of the local clock in parts per million, as in RFC 5905
+#define CLOCK_PHI_PPM 15
+
+ClockFilter::ClockFilter(size_t depth) {
+    SetDepth(depth);
+}
+
+void ClockFilter::SetDepth(size_t depth) {
+    _depth = std::clamp<size_t>(depth, 1, MaxDepth);
+    while (_entries.size() > _depth)
+        _entries.pop_front();
+}
+
+void ClockFilter::Reset() {
+    _entries.clear();
+    _lastSelected = 0;
+}
+
+void ClockFilter::Add(const TimeSample &sample, unsigned __int64 timestamp) {
+    // a sample from before the current newest one means the clock was stepped backwards; history is meaningless
+    if (!_entries.empty() && timestamp < _entries.back().Timestamp)
+        Reset();
+
+    _entries.emplace_back(Entry{.Sample = sample, .Timestamp = timestamp});
+    while (_entries.size() > _depth)
+        _entries.pop_front();
+}
+
+unsigned __int64 ClockFilter::AgedDispersion(const Entry &entry, unsigned __int64 now) {
+    auto age = now > entry.Timestamp ? now - entry.Timestamp : 0;
+    return entry.Sample.tpDispersion + age * CLOCK_PHI_PPM / 1000000;
+}
+
+std::optional<TimeSample> ClockFilter::Select(unsigned __int64 now) {
+    if (_entries.empty())
+        return std::nullopt;
+
+    auto best = _entries.end();
+    unsigned __int64 bestDistance = 0;
+    for (auto it = _entries.begin(); it != _entries.end(); it++) {
+        auto distance = static_cast<unsigned __int64>(it->Sample.toDelay) / 2 + AgedDispersion(*it, now);
+        // prefer newer samples on ties
+        if (best == _entries.end() || distance <= bestDistance) {
+            best = it;
+            bestDistance = distance;
+        }
+    }
+
+    // Never hand out a sample older than one already used, w32time would see time going backwards. Use the newest
+    // sample instead, which is the best of the latest burst.
+    if (best->Timestamp <= _lastSelected)
+        best = std::prev(_entries.end());
+
+    _lastSelected = best->Timestamp;
+    auto sample = best->Sample;
+    sample.tpDispersion = AgedDispersion(*best, now);
+    return sample;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <deque>
+#include <optional>
+
+#include "Platform.hpp"
+
+// NTP-style clock filter: keeps the last few samples and selects the one with the lowest synchronization distance,
+// with the dispersion of older samples grown at PHI to account for the local clock drifting since they were taken.
+class ClockFilter {
+public:
+    static constexpr size_t DefaultDepth = 8;
+    static constexpr size_t MaxDepth = 32;
+
+    explicit ClockFilter(size_t depth = DefaultDepth);
+
+    void SetDepth(size_t depth);
+    void Reset();
+
+    // timestamp is the TSI_CurrentTime at which the sample was taken
+    void Add(const TimeSample &sample, unsigned __int64 timestamp);
+    std::optional<TimeSample> Select(unsigned __int64 now);
+
+private:
+    struct Entry {
+        TimeSample Sample;
+        unsigned __int64 Timestamp;
+    };
+
+    static unsigned __int64 AgedDispersion(const Entry &entry, unsigned __int64 now);
+
+    std::deque<Entry> _entries;
+    size_t _depth;
+    unsigned __int64 _lastSelected = 0;
+};
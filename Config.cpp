@@ -0,0 +1,35 @@
+#ifndef _WIN32
+#include <cstdlib>
+#include <string>
+#endif
+
+#include "Globals.hpp"
+#include "Config.hpp"
+
+#ifdef _WIN32
+#include <wil/registry.h>
+#endif
+
+#ifdef _WIN32
+HRESULT ConfigGetDword(_In_ PCWSTR name, _Out_ DWORD *value) {
+    return wil::reg::get_value_dword_nothrow(HKEY_LOCAL_MACHINE, XenTimeProviderParameters, name, value);
+}
+#else
+HRESULT ConfigGetDword(_In_ PCWSTR name, _Out_ DWORD *value) {
+    std::string variable("XENTIMEPROVIDER_");
+    for (auto p = name; *p; p++)
+        variable.push_back(static_cast<char>(*p));
+
+    auto str = getenv(variable.c_str());
+    if (!str)
+        return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+
+    char *end;
+    auto parsed = strtoul(str, &end, 0);
+    if (end == str || *end)
+        return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+    *value = static_cast<DWORD>(parsed);
+    return S_OK;
+}
+#endif
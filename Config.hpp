@@ -0,0 +1,7 @@
+#pragma once
+
+#include "Platform.hpp"
+
+// Reads a DWORD from the provider's Parameters key. On non-Windows hosts the value is taken from the environment
+// variable XENTIMEPROVIDER_<name> instead. Returns HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) if the value is not set.
+HRESULT ConfigGetDword(_In_ PCWSTR name, _Out_ DWORD *value);
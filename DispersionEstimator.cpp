@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <cmath>
+
+#include "DispersionEstimator.hpp"
+
+DispersionEstimator::DispersionEstimator(double weight) : _weight(std::clamp(weight, 0.001, 1.0)) {}
+
+void DispersionEstimator::Reset() {
+    _count = 0;
+    _history = 0;
+    _differenced = false;
+    _secondDifferenceSquares = 0;
+    _delayMean = 0;
+    _delayVariance = 0;
+}
+
+void DispersionEstimator::Add(signed __int64 offset, signed __int64 delay, unsigned __int64 timestamp) {
+    if (_history > 0 && timestamp <= _previousTimestamps[1])
+        _history = 0;
+    if (_history == 2) {
+        auto earlier = static_cast<double>(_previousTimestamps[1] - _previousTimestamps[0]);
+        auto later = static_cast<double>(timestamp - _previousTimestamps[1]);
+        auto slopeChange = static_cast<double>(offset - _previousOffsets[1]) / later -
+            static_cast<double>(_previousOffsets[1] - _previousOffsets[0]) / earlier;
+        // at even spacing h this is h, which makes it the plain second difference
+        auto sum = 1 / earlier + 1 / later;
+        auto scale = std::sqrt(6 / (1 / (earlier * earlier) + 1 / (later * later) + sum * sum));
+        auto secondDifference = slopeChange * scale;
+        auto square = secondDifference * secondDifference;
+        if (!_differenced)
+            _secondDifferenceSquares = square;
+        else
+            _secondDifferenceSquares += _weight * (square - _secondDifferenceSquares);
+        _differenced = true;
+    }
+    _previousOffsets[0] = _previousOffsets[1];
+    _previousOffsets[1] = offset;
+    _previousTimestamps[0] = _previousTimestamps[1];
+    _previousTimestamps[1] = timestamp;
+    if (_history < 2)
+        _history++;
+
+    auto value = static_cast<double>(delay);
+    if (_count == 0) {
+        _delayMean = value;
+        _delayVariance = 0;
+    } else {
+        auto difference = value - _delayMean;
+        _delayMean += _weight * difference;
+        _delayVariance = (1 - _weight) * (_delayVariance + _weight * difference * difference);
+    }
+
+    if (_count < WarmupSamples)
+        _count++;
+}
+
+double DispersionEstimator::OffsetJitter() const {
+    return std::sqrt(_secondDifferenceSquares / 6);
+}
+
+double DispersionEstimator::DelayDeviation() const {
+    return std::sqrt(_delayVariance);
+}
+
+unsigned __int64 DispersionEstimator::Estimate(signed __int64 delay) const {
+    if (_count < WarmupSamples || !_differenced)
+        return static_cast<unsigned __int64>((std::max)(delay, static_cast<signed __int64>(0)));
+
+    return static_cast<unsigned __int64>(std::ceil(OffsetJitter()));
+}
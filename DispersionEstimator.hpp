@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Platform.hpp"
+
+// Online estimate of the error of our samples from how much recent ones scatter, so that tpDispersion grows when the
+// host is loaded instead of being a constant.
+//
+// The estimate is the offset jitter, which RFC 5905 adds to the root distance and w32time has no other field for. It
+// is measured on second divided differences of consecutive offsets, the change in slope between them, which cancels
+// both the offset itself and a constant frequency error of the local clock however unevenly the rounds are spaced.
+// The change is scaled so that white noise of deviation s gives it a variance of 6 s^2 at any spacing, as the plain
+// second difference of evenly spaced offsets has. The bracket delay is tracked alongside for diagnostics; its own
+// contribution is already bounded by toDelay / 2. Both are exponentially weighted, so the estimate follows changes in
+// load within a few samples.
+class DispersionEstimator {
+public:
+    static constexpr double DefaultWeight = 1.0 / 8;
+    // number of samples before the estimate is based on observations at all
+    static constexpr unsigned int WarmupSamples = 3;
+
+    explicit DispersionEstimator(double weight = DefaultWeight);
+
+    void Reset();
+    // offset and delay of the sample used for a round, and when it was taken, all in 100 ns. A timestamp no later
+    // than the last one starts the differences over.
+    void Add(signed __int64 offset, signed __int64 delay, unsigned __int64 timestamp);
+
+    // Jitter in 100 ns to report for a sample with the given delay. Until warmed up, that is the whole delay.
+    unsigned __int64 Estimate(signed __int64 delay) const;
+
+    // in 100 ns
+    double OffsetJitter() const;
+    double DelayMean() const {
+        return _delayMean;
+    }
+    double DelayDeviation() const;
+
+private:
+    double _weight;
+    unsigned int _count = 0;
+    // offsets and timestamps so far, of up to two before the current one
+    unsigned int _history = 0;
+    signed __int64 _previousOffsets[2] = {};
+    unsigned __int64 _previousTimestamps[2] = {};
+    bool _differenced = false;
+    double _secondDifferenceSquares = 0;
+    double _delayMean = 0;
+    double _delayVariance = 0;
+};
@@ -0,0 +1,82 @@
+#include <cmath>
+
+#include "DriftModel.hpp"
+
+void DriftModel::Reset() {
+    _points.clear();
+    _intercept = 0;
+    _slope = 0;
+    _meanTick = 0;
+    _tickSquares = 0;
+    _residualDeviation = 0;
+}
+
+void DriftModel::Add(unsigned __int64 tick, unsigned __int64 hostTime) {
+    // the tick never goes backwards on its own; if it did, whatever was fitted to it is meaningless
+    if (!_points.empty() && tick <= _points.back().Tick)
+        Reset();
+
+    _points.emplace_back(Point{.Tick = tick, .HostTime = hostTime});
+    while (_points.size() > WindowSize)
+        _points.pop_front();
+    Fit();
+}
+
+void DriftModel::Fit() {
+    if (!IsReady())
+        return;
+
+    const auto &last = _points.back();
+    auto x = [&](const Point &point) {
+        return -static_cast<double>(last.Tick - point.Tick);
+    };
+    auto y = [&](const Point &point) {
+        return static_cast<double>(static_cast<signed __int64>(point.HostTime - last.HostTime)) - x(point);
+    };
+
+    auto n = static_cast<double>(_points.size());
+    double sumX = 0, sumY = 0;
+    for (const auto &point : _points) {
+        sumX += x(point);
+        sumY += y(point);
+    }
+    auto meanX = sumX / n, meanY = sumY / n;
+
+    double sxx = 0, sxy = 0;
+    for (const auto &point : _points) {
+        sxx += (x(point) - meanX) * (x(point) - meanX);
+        sxy += (x(point) - meanX) * (y(point) - meanY);
+    }
+    _slope = sxx > 0 ? sxy / sxx : 0;
+    _intercept = meanY - _slope * meanX;
+    _meanTick = meanX;
+    _tickSquares = sxx;
+
+    double squares = 0;
+    for (const auto &point : _points) {
+        auto residual = y(point) - (_intercept + _slope * x(point));
+        squares += residual * residual;
+    }
+    _residualDeviation = std::sqrt(squares / (n - 2));
+}
+
+HRESULT DriftModel::Predict(
+    unsigned __int64 tick,
+    _Out_ unsigned __int64 *hostTime,
+    _Out_ unsigned __int64 *error) const {
+    *hostTime = 0;
+    *error = 0;
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_READY), !IsReady());
+    const auto &last = _points.back();
+    RETURN_HR_IF(E_INVALIDARG, tick < last.Tick);
+
+    auto x = static_cast<double>(tick - last.Tick);
+    auto deviation = _intercept + _slope * x;
+    *hostTime = last.HostTime + (tick - last.Tick) + static_cast<signed __int64>(std::llround(deviation));
+
+    auto n = static_cast<double>(_points.size());
+    auto leverage = _tickSquares > 0 ? (x - _meanTick) * (x - _meanTick) / _tickSquares : 0;
+    auto standardError = _residualDeviation * std::sqrt(1 / n + leverage);
+    *error = static_cast<unsigned __int64>(std::ceil(RejectSigmas * standardError + FrequencyTolerance * x));
+    return S_OK;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <deque>
+
+#include "Platform.hpp"
+
+// Host time as a straight line in a monotonic tick, fitted by least squares over the recent rounds, for extrapolating
+// through a device outage (holdover).
+//
+// The line is fitted against the tick rather than the guest clock, which w32time keeps slewing and stepping with our
+// own samples: the offset to publish during holdover is the extrapolated host time minus wherever the guest clock has
+// got to by then. Its error bound grows with the distance from the points it was fitted to: RejectSigmas standard
+// errors of the fitted line at the tick, from the residual scatter, plus FrequencyTolerance of the time since the last
+// point for the drift changing meanwhile.
+class DriftModel {
+public:
+    static constexpr size_t WindowSize = 64;
+    // fewer points than this and nothing is extrapolated
+    static constexpr size_t MinPoints = 4;
+    static constexpr double RejectSigmas = 3;
+    // as NTP's PHI, 15 ppm
+    static constexpr double FrequencyTolerance = 15e-6;
+
+    DriftModel() = default;
+
+    void Reset();
+    // host time at tick, both in 100 ns
+    void Add(unsigned __int64 tick, unsigned __int64 hostTime);
+
+    bool IsReady() const {
+        return _points.size() >= MinPoints;
+    }
+    unsigned __int64 GetLastTick() const {
+        return _points.empty() ? 0 : _points.back().Tick;
+    }
+    // Extrapolated host time at tick, and the bound of its error, in 100 ns
+    HRESULT Predict(unsigned __int64 tick, _Out_ unsigned __int64 *hostTime, _Out_ unsigned __int64 *error) const;
+    // host clock frequency relative to the tick, in ppm
+    double FrequencyPpm() const {
+        return _slope * 1000000;
+    }
+
+private:
+    struct Point {
+        unsigned __int64 Tick;
+        unsigned __int64 HostTime;
+    };
+
+    void Fit();
+
+    std::deque<Point> _points;
+    // host time minus tick against tick, both relative to the last point, which keeps the doubles small
+    double _intercept = 0;
+    double _slope = 0;
+    double _meanTick = 0;
+    double _tickSquares = 0;
+    double _residualDeviation = 0;
+};
@@ -1,3 +1,13 @@
 #pragma once
 
 #define XenTimeProviderName L"XenTimeProvider"
+#define XenTimeProviderParameters \
+    L"SYSTEM\\CurrentControlSet\\Services\\W32Time\\TimeProviders\\" XenTimeProviderName L"\\Parameters"
+
+// FILETIME/w32time units of 100 ns
+#define TIME_US(_us) ((_us) * 10)
+#define TIME_MS(_ms) (TIME_US((_ms) * 1000))
+#define TIME_S(_s) (TIME_MS((_s) * 1000))
+
+// 100 ns intervals between the FILETIME epoch (1601) and the Unix epoch (1970)
+#define FILETIME_UNIX_EPOCH 116444736000000000ULL
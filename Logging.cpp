@@ -1,35 +1,341 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
-#include <cstdarg>
+#include <cstring>
+#include <cwchar>
+#include <mutex>
+#include <semaphore>
+#include <thread>
 
 #include "Globals.hpp"
 #include "Logging.hpp"
+#include "RequestQueue.hpp"
 
-void TimeProvVLog(LogTimeProvEventFunc *logger, LogTimeProvEventType level, PCWSTR format, va_list args) {
-    WCHAR buf[512];
+static constexpr size_t LogQueueSize = 256;
+static constexpr size_t LogMessageSize = 512;
+// Producers don't wake the writer for every message, it comes round this often or once half a queue has gone in
+static constexpr std::chrono::milliseconds LogDeliveryInterval{100};
 
-    vswprintf_s(buf, format, args);
-    logger(level, const_cast<PWSTR>(XenTimeProviderName), buf);
+struct LogState {
+    RequestQueue<LogRecord, LogQueueSize> Queue;
+    std::atomic<bool> Active = false;
+    std::counting_semaphore<> Wake{0};
+
+    std::atomic<unsigned __int64> Queued = 0;
+    std::atomic<unsigned __int64> Delivered = 0;
+    std::atomic<unsigned __int64> Suppressed = 0;
+    std::atomic<unsigned __int64> Dropped = 0;
+
+    std::mutex Mutex;
+    std::condition_variable Signal;
+    _Guarded_by_(Mutex) unsigned int Writers = 0;
+    _Guarded_by_(Mutex) bool Stopping = false;
+    // records taken off the queue, for LogFlush
+    _Guarded_by_(Mutex) unsigned __int64 Processed = 0;
+    _Guarded_by_(Mutex) std::thread Thread;
+};
+
+static LogState LogGlobals;
+
+static int LogPrint(_Out_writes_(size) PSTR buffer, size_t size, _In_ PCSTR spec, auto value) {
+#ifdef _WIN32
+    return _snprintf_s(buffer, size, _TRUNCATE, spec, value);
+#else
+    return snprintf(buffer, size, spec, value);
+#endif
+}
+
+static int LogPrint(_Out_writes_(size) PWSTR buffer, size_t size, _In_ PCWSTR spec, auto value) {
+#ifdef _WIN32
+    return _snwprintf_s(buffer, size, _TRUNCATE, spec, value);
+#else
+    return swprintf(buffer, size, spec, value);
+#endif
 }
 
-void TimeProvLog(LogTimeProvEventFunc *logger, LogTimeProvEventType level, PCWSTR format, ...) {
-    va_list args;
+template <typename TChar>
+static int LogPrintArgument(
+    _Out_writes_(size) TChar *buffer,
+    size_t size,
+    _In_ const TChar *spec,
+    _In_ const LogRecord &record,
+    _In_ const LogArgument &argument) {
+    switch (argument.Type) {
+    case LogArgumentType::Int:
+        return LogPrint(buffer, size, spec, argument.Int);
+    case LogArgumentType::UInt:
+        return LogPrint(buffer, size, spec, argument.UInt);
+    case LogArgumentType::Long:
+        return LogPrint(buffer, size, spec, argument.Long);
+    case LogArgumentType::ULong:
+        return LogPrint(buffer, size, spec, argument.ULong);
+    case LogArgumentType::LongLong:
+        return LogPrint(buffer, size, spec, argument.LongLong);
+    case LogArgumentType::ULongLong:
+        return LogPrint(buffer, size, spec, argument.ULongLong);
+    case LogArgumentType::Double:
+        return LogPrint(buffer, size, spec, argument.Double);
+    case LogArgumentType::Pointer:
+        return LogPrint(buffer, size, spec, argument.Pointer);
+    case LogArgumentType::String:
+        return LogPrint(
+            buffer,
+            size,
+            spec,
+            argument.Text == LogRecord::NoText ? "" : reinterpret_cast<PCSTR>(record.Text + argument.Text));
+    case LogArgumentType::WideString:
+        return LogPrint(
+            buffer,
+            size,
+            spec,
+            argument.Text == LogRecord::NoText ? L"" : reinterpret_cast<PCWSTR>(record.Text + argument.Text));
+    default:
+        return 0;
+    }
+}
 
-    va_start(args, format);
-    TimeProvVLog(logger, level, format, args);
-    va_end(args);
+static bool LogIsConversion(int c) {
+    switch (c) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+    case 'c':
+    case 'C':
+    case 's':
+    case 'S':
+    case 'p':
+    case 'n':
+    case '%':
+        return true;
+    default:
+        return false;
+    }
 }
 
-void VDebugLog(PCSTR format, va_list args) {
-    CHAR buf[512];
+// printf for a captured record: the format is split into its conversions, each printed with the argument it was
+// captured with
+template <typename TChar>
+static void LogFormat(_In_ const LogRecord &record, _Out_writes_z_(size) TChar *buffer, size_t size) {
+    auto format = static_cast<const TChar *>(record.Format);
+    size_t used = 0;
+    unsigned int next = 0;
+
+    while (*format && used < size - 1) {
+        if (*format != '%') {
+            buffer[used++] = *format++;
+            continue;
+        }
+
+        TChar spec[16];
+        size_t length = 0;
+        spec[length++] = *format++;
+        while (*format && !LogIsConversion(*format) && length < ARRAYSIZE(spec) - 2)
+            spec[length++] = *format++;
+        if (!LogIsConversion(*format))
+            break;
+        spec[length++] = *format++;
+        spec[length] = 0;
+
+        if (spec[length - 1] == '%') {
+            buffer[used++] = '%';
+            continue;
+        }
+        // more conversions than arguments, or one that would write through a captured pointer
+        if (next >= record.Count || spec[length - 1] == 'n')
+            break;
 
-    vsprintf_s(buf, format, args);
-    OutputDebugStringA(buf);
+        auto written = LogPrintArgument(buffer + used, size - used, spec, record, record.Arguments[next++]);
+        if (written < 0 || static_cast<size_t>(written) >= size - used) {
+            used = size - 1;
+            break;
+        }
+        used += written;
+    }
+    buffer[used] = 0;
 }
 
-void DebugLog(PCSTR format, ...) {
-    va_list args;
+static void LogDeliver(_In_ const LogRecord &record, unsigned __int64 suppressed) {
+    if (record.Logger) {
+        WCHAR buffer[LogMessageSize];
+
+        LogFormat(record, buffer, ARRAYSIZE(buffer));
+        if (suppressed) {
+            auto used = wcslen(buffer);
+            LogPrint(buffer + used, ARRAYSIZE(buffer) - used, L" (%llu similar messages suppressed)", suppressed);
+            buffer[ARRAYSIZE(buffer) - 1] = 0;
+        }
+        record.Logger(record.Level, const_cast<PWSTR>(XenTimeProviderName), buffer);
+    } else {
+        CHAR buffer[LogMessageSize];
+
+        LogFormat(record, buffer, ARRAYSIZE(buffer));
+        if (suppressed) {
+            auto used = strlen(buffer);
+            LogPrint(buffer + used, ARRAYSIZE(buffer) - used, " (%llu similar messages suppressed)", suppressed);
+            buffer[ARRAYSIZE(buffer) - 1] = 0;
+        }
+#ifdef _WIN32
+        OutputDebugStringA(buffer);
+#else
+        fprintf(stderr, "%s\n", buffer);
+#endif
+    }
+    LogGlobals.Delivered.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool LogRateLimiter::Admit(
+    _In_ const void *site,
+    std::chrono::steady_clock::time_point now,
+    _Out_ unsigned __int64 *suppressed) {
+    auto [it, inserted] = _sites.try_emplace(site);
+    auto &entry = it->second;
+    if (inserted)
+        entry.Refilled = now;
+
+    auto refills = (now - entry.Refilled) / RefillInterval;
+    if (refills > 0) {
+        entry.Tokens = static_cast<unsigned int>(
+            (std::min)(entry.Tokens + refills, static_cast<decltype(refills)>(Burst)));
+        entry.Refilled = entry.Tokens == Burst ? now : entry.Refilled + refills * RefillInterval;
+    }
+
+    *suppressed = 0;
+    if (entry.Tokens == 0) {
+        entry.Suppressed++;
+        return false;
+    }
+    entry.Tokens--;
+    *suppressed = std::exchange(entry.Suppressed, 0);
+    return true;
+}
+
+static void LogWriterFunc() {
+    LogRateLimiter limiter;
+    unsigned __int64 reportedDrops = 0;
+
+    while (1) {
+        (void)LogGlobals.Wake.try_acquire_for(LogDeliveryInterval);
+        while (LogGlobals.Wake.try_acquire())
+            ;
+
+        bool stopping;
+        {
+            std::lock_guard lock(LogGlobals.Mutex);
+            stopping = LogGlobals.Stopping;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        unsigned __int64 processed = 0;
+        LogRecord record;
+        while (LogGlobals.Queue.TryPop(&record)) {
+            unsigned __int64 suppressed;
+            if (limiter.Admit(record.Format, now, &suppressed))
+                LogDeliver(record, suppressed);
+            else
+                LogGlobals.Suppressed.fetch_add(1, std::memory_order_relaxed);
+            processed++;
+        }
+
+        auto dropped = LogGlobals.Dropped.load(std::memory_order_relaxed);
+        if (dropped != reportedDrops) {
+            LogRecord note{
+                .Logger = nullptr,
+                .Level = LogTimeProvEventTypeWarning,
+                .Format = "Log queue full, %llu messages dropped"};
+            note.Add(dropped - reportedDrops);
+            LogDeliver(note, 0);
+            reportedDrops = dropped;
+        }
+
+        {
+            std::lock_guard lock(LogGlobals.Mutex);
+            LogGlobals.Processed += processed;
+        }
+        LogGlobals.Signal.notify_all();
+
+        if (stopping)
+            break;
+    }
+}
+
+LogWriter::LogWriter() {
+    std::lock_guard lock(LogGlobals.Mutex);
+    if (LogGlobals.Writers++ == 0) {
+        // whatever raced with the last writer's shutdown may be for a logger that is gone by now
+        LogRecord record;
+        while (LogGlobals.Queue.TryPop(&record)) {
+            LogGlobals.Dropped.fetch_add(1, std::memory_order_relaxed);
+            LogGlobals.Processed++;
+        }
+
+        LogGlobals.Stopping = false;
+        LogGlobals.Thread = std::thread(LogWriterFunc);
+        LogGlobals.Active.store(true, std::memory_order_release);
+    }
+}
+
+LogWriter::~LogWriter() {
+    std::thread thread;
+    {
+        std::lock_guard lock(LogGlobals.Mutex);
+        if (--LogGlobals.Writers == 0) {
+            // from here on callers deliver their own messages, the writer's last pass takes care of the rest
+            LogGlobals.Active.store(false, std::memory_order_release);
+            LogGlobals.Stopping = true;
+            thread = std::move(LogGlobals.Thread);
+        }
+    }
+
+    if (thread.joinable()) {
+        LogGlobals.Wake.release();
+        thread.join();
+    } else {
+        LogFlush();
+    }
+}
+
+void LogSubmit(_In_ LogRecord &&record) {
+    if (!LogGlobals.Active.load(std::memory_order_acquire)) {
+        LogDeliver(record, 0);
+        return;
+    }
+
+    if (!LogGlobals.Queue.TryPush(std::move(record))) {
+        LogGlobals.Dropped.fetch_add(1, std::memory_order_relaxed);
+        LogGlobals.Wake.release();
+        return;
+    }
+    if (LogGlobals.Queued.fetch_add(1, std::memory_order_release) % (LogQueueSize / 2) == LogQueueSize / 2 - 1)
+        LogGlobals.Wake.release();
+}
+
+void LogFlush() {
+    auto target = LogGlobals.Queued.load(std::memory_order_acquire);
+
+    std::unique_lock lock(LogGlobals.Mutex);
+    while (LogGlobals.Writers && LogGlobals.Processed < target) {
+        LogGlobals.Wake.release();
+        // a record still being pushed holds up the ones behind it until the writer's next pass
+        LogGlobals.Signal.wait_for(lock, LogDeliveryInterval);
+    }
+}
 
-    va_start(args, format);
-    VDebugLog(format, args);
-    va_end(args);
+void LogGetStatistics(_Out_ LogStatistics *statistics) {
+    statistics->Queued = LogGlobals.Queued.load(std::memory_order_relaxed);
+    statistics->Delivered = LogGlobals.Delivered.load(std::memory_order_relaxed);
+    statistics->Suppressed = LogGlobals.Suppressed.load(std::memory_order_relaxed);
+    statistics->Dropped = LogGlobals.Dropped.load(std::memory_order_relaxed);
 }
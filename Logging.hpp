@@ -1,8 +1,10 @@
 #pragma once
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#include <TimeProv.h>
+#include <chrono>
+#include <unordered_map>
+#include <utility>
+
+#include "Platform.hpp"
 
 enum LogTimeProvEventType : WORD {
     LogTimeProvEventTypeError = 1,
@@ -10,8 +12,180 @@ enum LogTimeProvEventType : WORD {
     LogTimeProvEventTypeInformation = 3,
 };
 
-void TimeProvVLog(LogTimeProvEventFunc *logger, LogTimeProvEventType level, PCWSTR format, va_list args);
-void TimeProvLog(LogTimeProvEventFunc *logger, LogTimeProvEventType level, PCWSTR format, ...);
+// Logging never formats on the caller's thread while a LogWriter exists. A message is captured as its format string,
+// whose address identifies the call site, and its arguments by value, strings copied, into a fixed-size record on a
+// lock-free queue. The writer thread formats and delivers the records, and rate limits each call site so that a
+// condition repeating every round can't flood the event log; suppressed messages are counted and mentioned with the
+// next one from the same site. Formats must be string literals.
+
+enum class LogArgumentType : unsigned char {
+    Int,
+    UInt,
+    Long,
+    ULong,
+    LongLong,
+    ULongLong,
+    Double,
+    Pointer,
+    String,
+    WideString,
+};
+
+struct LogArgument {
+    LogArgumentType Type;
+    union {
+        int Int;
+        unsigned int UInt;
+        long Long;
+        unsigned long ULong;
+        long long LongLong;
+        unsigned long long ULongLong;
+        double Double;
+        const void *Pointer;
+        // offset of the copy in LogRecord::Text, NoText for a null string or one that didn't fit
+        unsigned short Text;
+    };
+};
+
+struct LogRecord {
+    static constexpr unsigned int MaxArguments = 8;
+    static constexpr size_t TextSize = 256;
+    static constexpr unsigned short NoText = 0xffff;
+
+    // null for debug output
+    LogTimeProvEventFunc *Logger;
+    LogTimeProvEventType Level;
+    // PCWSTR with a logger, PCSTR otherwise
+    const void *Format;
+    unsigned int Count;
+    unsigned short TextUsed;
+    LogArgument Arguments[MaxArguments];
+    // strings, truncated to whatever is left
+    unsigned char Text[TextSize];
+
+    void Add(int value) {
+        Arguments[Count].Type = LogArgumentType::Int;
+        Arguments[Count++].Int = value;
+    }
+    void Add(unsigned int value) {
+        Arguments[Count].Type = LogArgumentType::UInt;
+        Arguments[Count++].UInt = value;
+    }
+    void Add(long value) {
+        Arguments[Count].Type = LogArgumentType::Long;
+        Arguments[Count++].Long = value;
+    }
+    void Add(unsigned long value) {
+        Arguments[Count].Type = LogArgumentType::ULong;
+        Arguments[Count++].ULong = value;
+    }
+    void Add(long long value) {
+        Arguments[Count].Type = LogArgumentType::LongLong;
+        Arguments[Count++].LongLong = value;
+    }
+    void Add(unsigned long long value) {
+        Arguments[Count].Type = LogArgumentType::ULongLong;
+        Arguments[Count++].ULongLong = value;
+    }
+    void Add(double value) {
+        Arguments[Count].Type = LogArgumentType::Double;
+        Arguments[Count++].Double = value;
+    }
+    void Add(const void *value) {
+        Arguments[Count].Type = LogArgumentType::Pointer;
+        Arguments[Count++].Pointer = value;
+    }
+    void Add(PCSTR value) {
+        AddText(LogArgumentType::String, value);
+    }
+    void Add(PCWSTR value) {
+        AddText(LogArgumentType::WideString, value);
+    }
+
+private:
+    template <typename TChar> void AddText(LogArgumentType type, const TChar *value) {
+        Arguments[Count].Type = type;
+        Arguments[Count].Text = NoText;
+
+        auto offset = (TextUsed + alignof(TChar) - 1) & ~(alignof(TChar) - 1);
+        if (value && offset + sizeof(TChar) <= TextSize) {
+            auto text = reinterpret_cast<TChar *>(Text + offset);
+            auto capacity = (TextSize - offset) / sizeof(TChar);
+            size_t length = 0;
+            for (; length < capacity - 1 && value[length]; length++)
+                text[length] = value[length];
+            text[length] = 0;
+
+            Arguments[Count].Text = static_cast<unsigned short>(offset);
+            TextUsed = static_cast<unsigned short>(offset + (length + 1) * sizeof(TChar));
+        }
+        Count++;
+    }
+};
+
+struct LogStatistics {
+    // handed to the writer thread
+    unsigned __int64 Queued;
+    unsigned __int64 Delivered;
+    // withheld by rate limiting
+    unsigned __int64 Suppressed;
+    // lost to a full queue
+    unsigned __int64 Dropped;
+};
+
+// The writer's rate limit for each call site, identified by its format: Burst messages in a row, then one per
+// RefillInterval. Suppressed messages are counted and the count handed out with the next message admitted.
+class LogRateLimiter {
+public:
+    static constexpr unsigned int Burst = 10;
+    static constexpr std::chrono::seconds RefillInterval{30};
+
+    LogRateLimiter() = default;
+    LogRateLimiter(const LogRateLimiter &) = delete;
+    LogRateLimiter &operator=(const LogRateLimiter &) = delete;
+
+    // Takes a token from the site, or counts the message against it if there are none left. *suppressed is how many
+    // were counted since the last message admitted.
+    bool Admit(_In_ const void *site, std::chrono::steady_clock::time_point now, _Out_ unsigned __int64 *suppressed);
+
+private:
+    struct Site {
+        unsigned int Tokens = Burst;
+        std::chrono::steady_clock::time_point Refilled;
+        unsigned __int64 Suppressed = 0;
+    };
+
+    std::unordered_map<const void *, Site> _sites;
+};
+
+// Runs the writer thread for as long as any instance exists; until then, messages are formatted and delivered on the
+// caller's thread without rate limiting. Destroying the last instance delivers whatever is queued, so that loggers
+// are never called once their owner is gone: whoever owns a logger destroys its LogWriter after everything that logs
+// to it.
+class LogWriter {
+public:
+    LogWriter();
+    ~LogWriter();
+    LogWriter(const LogWriter &) = delete;
+    LogWriter &operator=(const LogWriter &) = delete;
+};
+
+void LogSubmit(_In_ LogRecord &&record);
+// Waits for whatever was queued before the call to be delivered or suppressed
+void LogFlush();
+void LogGetStatistics(_Out_ LogStatistics *statistics);
+
+template <typename... TArgs>
+void TimeProvLog(LogTimeProvEventFunc *logger, LogTimeProvEventType level, PCWSTR format, TArgs... args) {
+    static_assert(sizeof...(TArgs) <= LogRecord::MaxArguments, "Too many log arguments");
+    LogRecord record{.Logger = logger, .Level = level, .Format = format};
+    (record.Add(args), ...);
+    LogSubmit(std::move(record));
+}
 
-void VDebugLog(PCSTR format, va_list args);
-void DebugLog(PCSTR format, ...);
+template <typename... TArgs> void DebugLog(PCSTR format, TArgs... args) {
+    static_assert(sizeof...(TArgs) <= LogRecord::MaxArguments, "Too many log arguments");
+    LogRecord record{.Logger = nullptr, .Level = LogTimeProvEventTypeInformation, .Format = format};
+    (record.Add(args), ...);
+    LogSubmit(std::move(record));
+}
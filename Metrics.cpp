@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <bit>
+
+#include "Metrics.hpp"
+
+unsigned __int64 MetricsHistogramSnapshot::Percentile(double quantile) const {
+    if (Count == 0)
+        return 0;
+
+    auto target = static_cast<unsigned __int64>(quantile * static_cast<double>(Count));
+    target = std::clamp<unsigned __int64>(target, 1, Count);
+
+    unsigned __int64 seen = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        seen += Buckets[i];
+        if (seen >= target)
+            return (std::min)(MetricsHistogram::BucketUpperBound(i), Max);
+    }
+    return Max;
+}
+
+size_t MetricsHistogram::BucketIndex(unsigned __int64 value) {
+    return static_cast<size_t>(64 - std::countl_zero(static_cast<uint64_t>(value)));
+}
+
+unsigned __int64 MetricsHistogram::BucketUpperBound(size_t index) {
+    if (index == 0)
+        return 0;
+    if (index >= 64)
+        return ~0ULL;
+    return (1ULL << index) - 1;
+}
+
+void MetricsHistogram::Record(unsigned __int64 value) {
+    _buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+
+    auto max = _max.load(std::memory_order_relaxed);
+    while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+void MetricsHistogram::Snapshot(_Out_ MetricsHistogramSnapshot *snapshot) const {
+    snapshot->Count = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        snapshot->Buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+        snapshot->Count += snapshot->Buckets[i];
+    }
+    snapshot->Sum = _sum.load(std::memory_order_relaxed);
+    snapshot->Max = _max.load(std::memory_order_relaxed);
+}
+
+void XenTimeMetrics::Snapshot(_Out_ XenTimeMetricsSnapshot *snapshot) const {
+    snapshot->dwSize = sizeof(XenTimeMetricsSnapshot);
+    snapshot->dwVersion = XENTIME_METRICS_VERSION;
+
+    snapshot->Rounds = Rounds.Load();
+    snapshot->SamplesPublished = SamplesPublished.Load();
+    snapshot->PendingRounds = PendingRounds.Load();
+    snapshot->FailedRounds = FailedRounds.Load();
+    snapshot->IoctlFailures = IoctlFailures.Load();
+    snapshot->IoctlTimeouts = IoctlTimeouts.Load();
+    snapshot->FallbackActivations = FallbackActivations.Load();
+    snapshot->NegativeOffsets = NegativeOffsets.Load();
+    snapshot->RejectedOffsets = RejectedOffsets.Load();
+    snapshot->UntrustedRounds = UntrustedRounds.Load();
+    snapshot->HoldoverRounds = HoldoverRounds.Load();
+    snapshot->HostUnsyncedRounds = HostUnsyncedRounds.Load();
+    snapshot->HostSyncUpdates = HostSyncUpdates.Load();
+    snapshot->HostTimePageMaps = HostTimePageMaps.Load();
+
+    snapshot->DeviceOpens = DeviceOpens.Load();
+    snapshot->DeviceOpenFailures = DeviceOpenFailures.Load();
+    snapshot->DeviceRemovals = DeviceRemovals.Load();
+    snapshot->DeviceFailovers = DeviceFailovers.Load();
+    snapshot->DeviceRetries = DeviceRetries.Load();
+    snapshot->EventsCoalesced = EventsCoalesced.Load();
+    snapshot->EventOverflows = EventOverflows.Load();
+    snapshot->Resumes = Resumes.Load();
+    snapshot->PushNotifications = PushNotifications.Load();
+    snapshot->SuspendEpochs = SuspendEpochs.Load();
+    snapshot->StraddledBursts = StraddledBursts.Load();
+
+    snapshot->GetSamplesCalls = GetSamplesCalls.Load();
+    snapshot->SamplesReturned = SamplesReturned.Load();
+
+    IoctlLatency.Snapshot(&snapshot->IoctlLatency);
+    PvClockLatency.Snapshot(&snapshot->PvClockLatency);
+    HostTimePageLatency.Snapshot(&snapshot->HostTimePageLatency);
+    Delay.Snapshot(&snapshot->Delay);
+    Offset.Snapshot(&snapshot->Offset);
+    ResumeRecovery.Snapshot(&snapshot->ResumeRecovery);
+    PushLatency.Snapshot(&snapshot->PushLatency);
+    DeviceRecovery.Snapshot(&snapshot->DeviceRecovery);
+    StartupLatency.Snapshot(&snapshot->StartupLatency);
+}
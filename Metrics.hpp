@@ -0,0 +1,176 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+#include "Platform.hpp"
+
+// Bucket 0 counts zeros, bucket i > 0 counts values in [2^(i-1), 2^i)
+#define METRICS_HISTOGRAM_BUCKETS 65
+
+struct MetricsHistogramSnapshot {
+    unsigned __int64 Count;
+    unsigned __int64 Sum;
+    unsigned __int64 Max;
+    unsigned __int64 Buckets[METRICS_HISTOGRAM_BUCKETS];
+
+    // Upper bound of the bucket holding the given quantile, at most Max; 0 if empty
+    unsigned __int64 Percentile(double quantile) const;
+};
+
+// Log-bucketed histogram that any number of threads can record into without locking
+class MetricsHistogram {
+public:
+    MetricsHistogram() = default;
+    MetricsHistogram(const MetricsHistogram &) = delete;
+    MetricsHistogram &operator=(const MetricsHistogram &) = delete;
+
+    static size_t BucketIndex(unsigned __int64 value);
+    static unsigned __int64 BucketUpperBound(size_t index);
+
+    void Record(unsigned __int64 value);
+    // Fields are read one at a time, so a snapshot taken during Record may see the new bucket count before the new
+    // sum. Count is the sum of the buckets, so percentiles are always consistent.
+    void Snapshot(_Out_ MetricsHistogramSnapshot *snapshot) const;
+
+private:
+    std::atomic<unsigned __int64> _buckets[METRICS_HISTOGRAM_BUCKETS] = {};
+    std::atomic<unsigned __int64> _sum = 0;
+    std::atomic<unsigned __int64> _max = 0;
+};
+
+class alignas(64) MetricsCounter {
+public:
+    void Add(unsigned __int64 value = 1) {
+        _value.fetch_add(value, std::memory_order_relaxed);
+    }
+    unsigned __int64 Load() const {
+        return _value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<unsigned __int64> _value = 0;
+};
+
+#define XENTIME_METRICS_VERSION 13
+
+// Plain copy of XenTimeMetrics, as handed to diagnostic tools through MetricsSection
+struct XenTimeMetricsSnapshot {
+    DWORD dwSize;
+    DWORD dwVersion;
+
+    // sampling rounds, and how they ended
+    unsigned __int64 Rounds;
+    unsigned __int64 SamplesPublished;
+    unsigned __int64 PendingRounds;
+    unsigned __int64 FailedRounds;
+    unsigned __int64 IoctlFailures;
+    unsigned __int64 IoctlTimeouts;
+    unsigned __int64 FallbackActivations;
+    unsigned __int64 NegativeOffsets;
+    unsigned __int64 RejectedOffsets;
+    unsigned __int64 UntrustedRounds;
+    unsigned __int64 HoldoverRounds;
+    unsigned __int64 HostUnsyncedRounds;
+    unsigned __int64 HostSyncUpdates;
+    unsigned __int64 HostTimePageMaps;
+
+    unsigned __int64 DeviceOpens;
+    unsigned __int64 DeviceOpenFailures;
+    unsigned __int64 DeviceRemovals;
+    unsigned __int64 DeviceFailovers;
+    unsigned __int64 DeviceRetries;
+    unsigned __int64 EventsCoalesced;
+    unsigned __int64 EventOverflows;
+    unsigned __int64 Resumes;
+    unsigned __int64 PushNotifications;
+    unsigned __int64 SuspendEpochs;
+    unsigned __int64 StraddledBursts;
+
+    unsigned __int64 GetSamplesCalls;
+    unsigned __int64 SamplesReturned;
+
+    // ns
+    MetricsHistogramSnapshot IoctlLatency;
+    MetricsHistogramSnapshot PvClockLatency;
+    MetricsHistogramSnapshot HostTimePageLatency;
+    // 100 ns
+    MetricsHistogramSnapshot Delay;
+    MetricsHistogramSnapshot Offset;
+    // ns
+    MetricsHistogramSnapshot ResumeRecovery;
+    MetricsHistogramSnapshot PushLatency;
+    MetricsHistogramSnapshot DeviceRecovery;
+    MetricsHistogramSnapshot StartupLatency;
+};
+
+// Always-on counters of the provider. Every field is a separate atomic, updated without ordering, so recording
+// never waits and never makes anything else wait.
+class XenTimeMetrics {
+public:
+    XenTimeMetrics() = default;
+    XenTimeMetrics(const XenTimeMetrics &) = delete;
+    XenTimeMetrics &operator=(const XenTimeMetrics &) = delete;
+
+    void Snapshot(_Out_ XenTimeMetricsSnapshot *snapshot) const;
+
+    MetricsCounter Rounds;
+    MetricsCounter SamplesPublished;
+    // no open device
+    MetricsCounter PendingRounds;
+    MetricsCounter FailedRounds;
+    MetricsCounter IoctlFailures;
+    // host time reads abandoned at their deadline, not counted as failures
+    MetricsCounter IoctlTimeouts;
+    MetricsCounter FallbackActivations;
+    MetricsCounter NegativeOffsets;
+    // rounds withheld by the offset filter
+    MetricsCounter RejectedOffsets;
+    MetricsCounter UntrustedRounds;
+    // samples extrapolated by DriftModel while there was no device
+    MetricsCounter HoldoverRounds;
+    // rounds withheld because dom0 reports its own clock as unsynchronized
+    MetricsCounter HostUnsyncedRounds;
+    // dom0 sync states read after its XenStore watch fired
+    MetricsCounter HostSyncUpdates;
+    // host time pages mapped from dom0's grant
+    MetricsCounter HostTimePageMaps;
+
+    MetricsCounter DeviceOpens;
+    MetricsCounter DeviceOpenFailures;
+    MetricsCounter DeviceRemovals;
+    // changes of the active device between open ones
+    MetricsCounter DeviceFailovers;
+    // failed attempts at reopening devices, each followed by a backoff
+    MetricsCounter DeviceRetries;
+    // PnP events folded into an identical pending one
+    MetricsCounter EventsCoalesced;
+    // device events dropped for a full queue, each followed by a full enumeration
+    MetricsCounter EventOverflows;
+    MetricsCounter Resumes;
+    // notifications from dom0's time service acted upon
+    MetricsCounter PushNotifications;
+    // suspend count changes seen by the sampler, and bursts taken again because one happened during them
+    MetricsCounter SuspendEpochs;
+    MetricsCounter StraddledBursts;
+
+    MetricsCounter GetSamplesCalls;
+    MetricsCounter SamplesReturned;
+
+    // duration of host time reads through an IOCTL, the shared time page or dom0's host time page, in ns
+    MetricsHistogram IoctlLatency;
+    MetricsHistogram PvClockLatency;
+    MetricsHistogram HostTimePageLatency;
+    // end - begin of every bracketed read, in 100 ns
+    MetricsHistogram Delay;
+    // magnitude of the offset of every published sample, in 100 ns; see NegativeOffsets for the sign
+    MetricsHistogram Offset;
+    // from a resume notification to the first sample published after it, in ns
+    MetricsHistogram ResumeRecovery;
+    // from a push notification reaching the sampler to the first sample published after it, in ns
+    MetricsHistogram PushLatency;
+    // from losing a device to a vetoed removal or failing to open one, until all present interfaces are open, in ns
+    MetricsHistogram DeviceRecovery;
+    // from the provider being opened to the first sample handed to w32time, in ns
+    MetricsHistogram StartupLatency;
+};
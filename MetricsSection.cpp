@@ -0,0 +1,86 @@
+#include <cstring>
+
+#include "MetricsSection.hpp"
+
+#ifdef _WIN32
+#include <sddl.h>
+#endif
+
+#ifdef _WIN32
+HRESULT MetricsSection::Create() {
+    // w32time runs as LocalService
+    wil::unique_hlocal_security_descriptor descriptor;
+    RETURN_IF_WIN32_BOOL_FALSE(ConvertStringSecurityDescriptorToSecurityDescriptorW(
+        L"D:P(A;;GA;;;SY)(A;;GA;;;LS)(A;;GR;;;BA)",
+        SDDL_REVISION_1,
+        descriptor.put(),
+        nullptr));
+    SECURITY_ATTRIBUTES attributes{.nLength = sizeof(attributes), .lpSecurityDescriptor = descriptor.get()};
+
+    // a provider opened again in the same process finds its predecessor's section, and carries on with it
+    wil::unique_handle mapping(
+        CreateFileMappingW(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE, 0, sizeof(MetricsSharedSnapshot), Name));
+    RETURN_LAST_ERROR_IF(!mapping);
+    wil::unique_mapview_ptr<MetricsSharedSnapshot> view(static_cast<MetricsSharedSnapshot *>(
+        MapViewOfFile(mapping.get(), FILE_MAP_WRITE, 0, 0, sizeof(MetricsSharedSnapshot))));
+    RETURN_LAST_ERROR_IF(!view);
+
+    _shared = view.get();
+    _mapping = std::move(mapping);
+    _view = std::move(view);
+    return S_OK;
+}
+
+HRESULT MetricsSection::Open() {
+    wil::unique_handle mapping(OpenFileMappingW(FILE_MAP_READ, FALSE, Name));
+    RETURN_LAST_ERROR_IF(!mapping);
+    wil::unique_mapview_ptr<MetricsSharedSnapshot> view(static_cast<MetricsSharedSnapshot *>(
+        MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, sizeof(MetricsSharedSnapshot))));
+    RETURN_LAST_ERROR_IF(!view);
+
+    _shared = view.get();
+    _mapping = std::move(mapping);
+    _view = std::move(view);
+    return S_OK;
+}
+#else
+HRESULT MetricsSection::Create() {
+    _standIn = std::make_unique<MetricsSharedSnapshot>();
+    _shared = _standIn.get();
+    return S_OK;
+}
+
+HRESULT MetricsSection::Open() {
+    return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+}
+#endif
+
+void MetricsSection::Publish(_In_ const XenTimeMetricsSnapshot &snapshot) {
+    // odd even if a predecessor died while writing
+    auto writing = _shared->Sequence.load(std::memory_order_relaxed) | 1;
+    _shared->Sequence.store(writing, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&_shared->Snapshot, &snapshot, sizeof(snapshot));
+    _shared->Sequence.store(writing + 1, std::memory_order_release);
+}
+
+HRESULT MetricsSection::Read(_Out_ XenTimeMetricsSnapshot *snapshot) const {
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE), !_shared);
+
+    for (int attempt = 0; attempt < MaxAttempts; attempt++) {
+        auto before = _shared->Sequence.load(std::memory_order_acquire);
+        RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_READY), before == 0);
+        if (before & 1)
+            continue;
+        memcpy(snapshot, &_shared->Snapshot, sizeof(*snapshot));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (_shared->Sequence.load(std::memory_order_relaxed) != before)
+            continue;
+
+        RETURN_HR_IF(
+            HRESULT_FROM_WIN32(ERROR_REVISION_MISMATCH),
+            snapshot->dwSize != sizeof(*snapshot) || snapshot->dwVersion != XENTIME_METRICS_VERSION);
+        return S_OK;
+    }
+    return HRESULT_FROM_WIN32(ERROR_RETRY);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "Platform.hpp"
+#include "Metrics.hpp"
+
+#ifdef _WIN32
+#include <wil/resource.h>
+#endif
+
+// Layout of the section: Sequence is a seqlock, odd while Snapshot is being rewritten and zero until it first is
+struct MetricsSharedSnapshot {
+    std::atomic<unsigned __int64> Sequence;
+    XenTimeMetricsSnapshot Snapshot;
+};
+static_assert(std::atomic<unsigned __int64>::is_always_lock_free, "the sequence is shared across processes");
+
+// The provider's metrics in a named section, Global\XenTimeProviderMetrics, for diagnostic tools outside w32time's
+// process. The sampler republishes the snapshot after every round; a tool opens the section and reads it with Read,
+// checking the snapshot's size and version as it would any other copy. Where there are no named sections, Create
+// stands in plain memory, which only Read on the same object sees.
+class MetricsSection {
+public:
+    static constexpr PCWSTR Name = L"Global\\XenTimeProviderMetrics";
+    static constexpr int MaxAttempts = 16;
+
+    MetricsSection() = default;
+    MetricsSection(const MetricsSection &) = delete;
+    MetricsSection &operator=(const MetricsSection &) = delete;
+
+    // For publishing: w32time's account writes, administrators may read
+    HRESULT Create();
+    // For reading, from another process
+    HRESULT Open();
+    bool IsOpen() const {
+        return _shared != nullptr;
+    }
+
+    void Publish(_In_ const XenTimeMetricsSnapshot &snapshot);
+    // Fails with ERROR_NOT_READY before anything was published, with ERROR_RETRY if the snapshot kept changing under
+    // us and with ERROR_REVISION_MISMATCH if it is not a XENTIME_METRICS_VERSION snapshot
+    HRESULT Read(_Out_ XenTimeMetricsSnapshot *snapshot) const;
+
+private:
+#ifdef _WIN32
+    wil::unique_handle _mapping;
+    wil::unique_mapview_ptr<MetricsSharedSnapshot> _view;
+#else
+    std::unique_ptr<MetricsSharedSnapshot> _standIn;
+#endif
+    MetricsSharedSnapshot *_shared = nullptr;
+};
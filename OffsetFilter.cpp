@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "OffsetFilter.hpp"
+
+static double Median(_Inout_ std::vector<double> &values) {
+    auto middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    if (values.size() % 2)
+        return *middle;
+    auto lower = *std::max_element(values.begin(), middle);
+    return (lower + *middle) / 2;
+}
+
+void OffsetFilter::Reset() {
+    _window.clear();
+    _slope = 0;
+    _trusted = true;
+    _lastAccepted = 0;
+    _loopLocked = false;
+    _loopPhase = 0;
+    _loopFrequency = 0;
+    _loopTimestamp = 0;
+}
+
+double OffsetFilter::EstimateSlope() const {
+    std::vector<double> slopes;
+    slopes.reserve(_window.size() * (_window.size() - 1) / 2);
+
+    for (size_t i = 0; i < _window.size(); i++) {
+        for (size_t j = i + 1; j < _window.size(); j++) {
+            if (_window[j].Timestamp == _window[i].Timestamp)
+                continue;
+            auto dt = static_cast<double>(_window[j].Timestamp) - static_cast<double>(_window[i].Timestamp);
+            slopes.push_back((static_cast<double>(_window[j].Offset) - static_cast<double>(_window[i].Offset)) / dt);
+        }
+    }
+    return slopes.empty() ? 0 : Median(slopes);
+}
+
+bool OffsetFilter::IsLevelShift(_In_ const std::vector<double> &residuals, double threshold) const {
+    if (_window.size() <= MinWindow)
+        return false;
+    auto first = _window.size() - MinWindow;
+    for (auto i = first; i < _window.size(); i++) {
+        if (!_window[i].Rejected)
+            return false;
+    }
+
+    std::vector<double> recent(residuals.begin() + static_cast<ptrdiff_t>(first), residuals.end());
+    auto median = Median(recent);
+    return std::all_of(residuals.begin() + static_cast<ptrdiff_t>(first), residuals.end(), [&](double value) {
+        return std::abs(value - median) <= threshold;
+    });
+}
+
+void OffsetFilter::UpdateLoop(signed __int64 offset, unsigned __int64 timestamp) {
+    if (!_loopLocked) {
+        if (_window.size() < MinWindow)
+            return;
+        // frequency acquisition from the window, then hand over to phase tracking
+        _loopPhase = static_cast<double>(offset);
+        _loopFrequency = _slope;
+        _loopTimestamp = timestamp;
+        _loopLocked = true;
+        return;
+    }
+
+    auto dt = static_cast<double>(timestamp) - static_cast<double>(_loopTimestamp);
+    auto predicted = _loopPhase + _loopFrequency * dt;
+    auto error = static_cast<double>(offset) - predicted;
+    _loopPhase = predicted + PhaseGain * error;
+    if (dt > 0)
+        _loopFrequency += FrequencyGain * error / dt;
+    _loopTimestamp = timestamp;
+}
+
+OffsetVerdict OffsetFilter::Add(signed __int64 offset, signed __int64 delay, unsigned __int64 timestamp) {
+    _window.push_back(Entry{.Offset = offset, .Timestamp = timestamp, .Rejected = false});
+    if (_window.size() > WindowSize)
+        _window.pop_front();
+
+    if (_window.size() >= MinWindow) {
+        _slope = EstimateSlope();
+
+        std::vector<double> residuals;
+        residuals.reserve(_window.size());
+        for (const auto &entry : _window)
+            residuals.push_back(
+                static_cast<double>(entry.Offset) -
+                _slope * (static_cast<double>(entry.Timestamp) - static_cast<double>(timestamp)));
+        auto residual = residuals.back();
+
+        std::vector<double> deviations(residuals);
+        auto median = Median(deviations);
+        for (auto &value : deviations)
+            value = std::abs(value - median);
+        auto mad = Median(deviations);
+
+        auto floor = static_cast<double>((std::max)(delay, static_cast<signed __int64>(1)));
+        auto threshold = (std::max)(RejectSigmas * 1.4826 * mad, floor);
+        _window.back().Rejected = std::abs(residual - median) > threshold;
+
+        if (IsLevelShift(residuals, threshold)) {
+            // the offsets from before the shift no longer say anything about the ones to come, nor does the loop
+            _window.erase(_window.begin(), _window.end() - static_cast<ptrdiff_t>(MinWindow));
+            for (auto &entry : _window)
+                entry.Rejected = false;
+            _slope = EstimateSlope();
+            _loopLocked = false;
+        }
+
+        auto rejected = std::count_if(_window.begin(), _window.end(), [](const Entry &entry) {
+            return entry.Rejected;
+        });
+        auto size = static_cast<ptrdiff_t>(_window.size());
+        if (_trusted && rejected * 2 >= size)
+            _trusted = false;
+        else if (!_trusted && rejected * 4 < size)
+            _trusted = true;
+    }
+
+    if (_window.back().Rejected)
+        return OffsetVerdict::Rejected;
+
+    _lastAccepted = offset;
+    UpdateLoop(offset, timestamp);
+    return OffsetVerdict::Accepted;
+}
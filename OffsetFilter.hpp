@@ -0,0 +1,76 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "Platform.hpp"
+
+enum class OffsetVerdict {
+    Accepted,
+    Rejected,
+};
+
+// Robust filtering of the per-round offsets before they reach the clock filter.
+//
+// Outliers are rejected against the recent window: the offsets are detrended with the median of the pairwise slopes
+// (Theil-Sen), which also estimates the frequency error of the local clock, and a new offset whose residual is more
+// than RejectSigmas robust deviations (1.4826 MAD) from the median residual is rejected. A residual smaller than the
+// sample's own delay is never an outlier. Rejected offsets stay in the window. A lasting level shift, as from a host
+// clock step or a migration, shows as MinWindow offsets in a row rejected but agreeing with each other; the window
+// then starts over from them, so that the shift is the new normal right away.
+//
+// The source is considered untrustworthy while at least half of the window has been rejected, and trustworthy again
+// once that drops below a quarter.
+//
+// Optionally, accepted offsets are smoothed by a second order loop: it acquires frequency from the Theil-Sen slope
+// (FLL) and then tracks phase and frequency with fixed gains (PLL).
+class OffsetFilter {
+public:
+    static constexpr size_t WindowSize = 16;
+    // fewer offsets than this and everything is accepted
+    static constexpr size_t MinWindow = 5;
+    static constexpr double RejectSigmas = 3;
+    static constexpr double PhaseGain = 1.0 / 4;
+    static constexpr double FrequencyGain = 1.0 / 32;
+
+    OffsetFilter() = default;
+
+    void Reset();
+    // offset and delay of the round's best read, taken at timestamp, all in 100 ns
+    OffsetVerdict Add(signed __int64 offset, signed __int64 delay, unsigned __int64 timestamp);
+
+    bool IsTrusted() const {
+        return _trusted;
+    }
+    // Loop output for the last accepted offset; the offset itself until the loop has locked
+    signed __int64 SmoothedOffset() const {
+        return _loopLocked ? static_cast<signed __int64>(_loopPhase) : _lastAccepted;
+    }
+    // local clock frequency error relative to the host as seen over the window, in ppm
+    double FrequencyPpm() const {
+        return _slope * 1000000;
+    }
+
+private:
+    struct Entry {
+        signed __int64 Offset;
+        unsigned __int64 Timestamp;
+        bool Rejected;
+    };
+
+    double EstimateSlope() const;
+    // Whether the last MinWindow offsets have all been rejected, and their residuals lie within threshold of their own
+    // median
+    bool IsLevelShift(_In_ const std::vector<double> &residuals, double threshold) const;
+    void UpdateLoop(signed __int64 offset, unsigned __int64 timestamp);
+
+    std::deque<Entry> _window;
+    double _slope = 0;
+    bool _trusted = true;
+    signed __int64 _lastAccepted = 0;
+
+    bool _loopLocked = false;
+    double _loopPhase = 0;
+    double _loopFrequency = 0;
+    unsigned __int64 _loopTimestamp = 0;
+};
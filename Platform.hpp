@@ -0,0 +1,11 @@
+#pragma once
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <TimeProv.h>
+
+#include <wil/result_macros.h>
+#else
+#include "Win32Compat.hpp"
+#endif
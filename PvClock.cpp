@@ -0,0 +1,156 @@
+#include <atomic>
+#include <thread>
+
+#include "Globals.hpp"
+#include "PvClock.hpp"
+
+// The page is written by another party behind the compiler's back, so every field is read exactly once
+template <typename T> static T ReadOnce(const T &value) {
+    return *static_cast<const volatile T *>(&value);
+}
+
+uint64_t PvClockScaleDelta(uint64_t delta, uint32_t mul, int8_t shift) {
+    if (shift < 0)
+        delta >>= -shift;
+    else
+        delta <<= shift;
+
+    uint64_t low = (delta & 0xffffffff) * mul;
+    uint64_t high = (delta >> 32) * mul;
+    return high + (low >> 32);
+}
+
+void PvClockComputeScale(uint64_t tscHz, _Out_ uint32_t *mul, _Out_ int8_t *shift) {
+    constexpr uint64_t NsPerSec = 1000000000;
+    int8_t tscShift = 0;
+
+    // same normalization as Xen's set_time_scale, so that 1 s of ticks lands in (NsPerSec, 2 * NsPerSec]
+    while (tscHz > 2 * NsPerSec) {
+        tscHz >>= 1;
+        tscShift--;
+    }
+    while (tscHz <= NsPerSec) {
+        tscHz <<= 1;
+        tscShift++;
+    }
+
+    *mul = static_cast<uint32_t>((NsPerSec << 32) / tscHz);
+    *shift = tscShift;
+}
+
+PvClockReader::PvClockReader(_In_ std::shared_ptr<IXenSharedTimePage> page) : _page(std::move(page)) {}
+
+HRESULT PvClockReader::ReadSystemTime(_Out_ uint64_t *systemTime) const {
+    auto info = _page->GetVcpuTimeInfo();
+
+    for (int attempt = 0; attempt < MaxAttempts; attempt++) {
+        auto version = ReadOnce(info->Version);
+        if (version & 1)
+            continue;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        auto tscTimestamp = ReadOnce(info->TscTimestamp);
+        auto baseTime = ReadOnce(info->SystemTime);
+        auto mul = ReadOnce(info->TscToSystemMul);
+        auto shift = ReadOnce(info->TscShift);
+        auto flags = ReadOnce(info->Flags);
+        auto tsc = _page->ReadTsc();
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (ReadOnce(info->Version) != version)
+            continue;
+
+        RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), !(flags & PVCLOCK_TSC_STABLE_BIT));
+
+        // a TSC read just before an update may trail TscTimestamp slightly
+        uint64_t delta = tsc > tscTimestamp ? tsc - tscTimestamp : 0;
+        *systemTime = baseTime + PvClockScaleDelta(delta, mul, shift);
+        return S_OK;
+    }
+    return HRESULT_FROM_WIN32(ERROR_RETRY);
+}
+
+HRESULT PvClockReader::ReadWallClock(_Out_ uint64_t *wallClock) const {
+    auto wc = _page->GetWallClock();
+    auto secHi = _page->GetWallClockSecHi();
+
+    for (int attempt = 0; attempt < MaxAttempts; attempt++) {
+        auto version = ReadOnce(wc->Version);
+        if (version & 1)
+            continue;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        uint64_t sec = ReadOnce(wc->Sec);
+        if (secHi)
+            sec |= static_cast<uint64_t>(ReadOnce(*secHi)) << 32;
+        uint64_t nsec = ReadOnce(wc->Nsec);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (ReadOnce(wc->Version) != version)
+            continue;
+
+        *wallClock = sec * 1000000000 + nsec;
+        return S_OK;
+    }
+    return HRESULT_FROM_WIN32(ERROR_RETRY);
+}
+
+HRESULT PvClockReader::Read(_Out_ unsigned __int64 *time) const {
+    uint64_t wallClock, systemTime;
+
+    RETURN_IF_FAILED(ReadWallClock(&wallClock));
+    RETURN_IF_FAILED(ReadSystemTime(&systemTime));
+
+    *time = FILETIME_UNIX_EPOCH + (wallClock + systemTime) / 100;
+    return S_OK;
+}
+
+void PvClockPin::Revoke() {
+    _state.fetch_or(Revoked, std::memory_order_acq_rel);
+    // reads take a handful of loads, there is no point in sleeping
+    while (_state.load(std::memory_order_acquire) != Revoked)
+        std::this_thread::yield();
+}
+
+PvClockHostTimeReader::PvClockHostTimeReader(_In_ std::shared_ptr<IXenHostTimePage> page) : _page(std::move(page)) {}
+
+HRESULT PvClockHostTimeReader::ReadPinned(
+    _In_ const PvClockHostTime *info,
+    _Out_ unsigned __int64 *time,
+    _Out_ unsigned __int64 *error) const {
+    for (int attempt = 0; attempt < MaxAttempts; attempt++) {
+        auto version = ReadOnce(info->Version);
+        if (version & 1)
+            continue;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        auto flags = ReadOnce(info->Flags);
+        auto tscTimestamp = ReadOnce(info->TscTimestamp);
+        auto hostTime = ReadOnce(info->HostTime);
+        auto mul = ReadOnce(info->TscToSystemMul);
+        auto shift = ReadOnce(info->TscShift);
+        auto hostError = ReadOnce(info->Error);
+        auto tsc = _page->ReadTsc();
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (ReadOnce(info->Version) != version)
+            continue;
+
+        RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_READY), !(flags & PVCLOCK_HOST_TIME_VALID_BIT));
+
+        uint64_t delta = tsc > tscTimestamp ? tsc - tscTimestamp : 0;
+        *time = FILETIME_UNIX_EPOCH + (hostTime + PvClockScaleDelta(delta, mul, shift)) / 100;
+        *error = (hostError + 99) / 100;
+        return S_OK;
+    }
+    return HRESULT_FROM_WIN32(ERROR_RETRY);
+}
+
+HRESULT PvClockHostTimeReader::Read(_Out_ unsigned __int64 *time, _Out_ unsigned __int64 *error) const {
+    auto info = _page->Acquire();
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED), !info);
+
+    auto hr = ReadPinned(info, time, error);
+    _page->Release();
+    return hr;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "Platform.hpp"
+
+// Layout of struct vcpu_time_info (xen/include/public/xen.h). Xen keeps SystemTime, the nanoseconds since boot, at
+// the moment the TSC read TscTimestamp, along with the scale to extrapolate from there.
+struct PvClockVcpuTimeInfo {
+    uint32_t Version;
+    uint32_t Pad0;
+    uint64_t TscTimestamp;
+    uint64_t SystemTime;
+    uint32_t TscToSystemMul;
+    int8_t TscShift;
+    uint8_t Flags;
+    uint8_t Pad1[2];
+};
+static_assert(sizeof(PvClockVcpuTimeInfo) == 32, "vcpu_time_info is 32 bytes");
+
+#define PVCLOCK_TSC_STABLE_BIT 0x01
+
+// wc_version, wc_sec and wc_nsec of struct shared_info: UTC at system time 0
+struct PvClockWallClock {
+    uint32_t Version;
+    uint32_t Sec;
+    uint32_t Nsec;
+};
+
+// Memory the hypervisor keeps the time in, updated concurrently with the reads. Either a mapping of the real page or
+// a simulation of it.
+class IXenSharedTimePage {
+public:
+    virtual ~IXenSharedTimePage() = default;
+
+    virtual const PvClockVcpuTimeInfo *GetVcpuTimeInfo() const = 0;
+    virtual const PvClockWallClock *GetWallClock() const = 0;
+    // wc_sec_hi, or nullptr where the wallclock only has 32 bits of seconds
+    virtual const uint32_t *GetWallClockSecHi() const = 0;
+    // The TSC the vcpu_time_info scale applies to
+    virtual uint64_t ReadTsc() const = 0;
+};
+
+// ((delta << shift) * mul) >> 32 with a negative shift shifting right, without overflowing 64 bits
+uint64_t PvClockScaleDelta(uint64_t delta, uint32_t mul, int8_t shift);
+// The mul and shift pair Xen would publish for a TSC running at tscHz
+void PvClockComputeScale(uint64_t tscHz, _Out_ uint32_t *mul, _Out_ int8_t *shift);
+
+// Reads host time straight from the shared page the way the Linux pvclock driver does: each structure is copied
+// under its version seqlock and the system time is extrapolated from the TSC. No driver round trip is involved.
+class PvClockReader {
+public:
+    static constexpr int MaxAttempts = 16;
+
+    explicit PvClockReader(_In_ std::shared_ptr<IXenSharedTimePage> page);
+    PvClockReader(const PvClockReader &) = delete;
+    PvClockReader &operator=(const PvClockReader &) = delete;
+
+    // Host UTC in FILETIME units. Fails with ERROR_NOT_SUPPORTED if the TSC is not stable across vCPUs, since only
+    // the time info of vCPU 0 is looked at, and with ERROR_RETRY if the page kept changing under us.
+    HRESULT Read(_Out_ unsigned __int64 *time) const;
+
+private:
+    HRESULT ReadSystemTime(_Out_ uint64_t *systemTime) const;
+    HRESULT ReadWallClock(_Out_ uint64_t *wallClock) const;
+
+    std::shared_ptr<IXenSharedTimePage> _page;
+};
+
+// Layout of the page dom0's time service grants the guest, see XenHostSync::TimePagePath. HostTime is the host's UTC
+// in nanoseconds since the Unix epoch at the moment the guest's TSC read TscTimestamp, with the scale to extrapolate
+// from there as in vcpu_time_info: dom0 accounts for the TSC offset and scaling Xen applies to the guest. Error bounds
+// the extrapolation against the host clock until the next update. Version is a seqlock, odd while an update is in
+// progress.
+struct PvClockHostTime {
+    uint32_t Version;
+    uint32_t Flags;
+    uint64_t TscTimestamp;
+    uint64_t HostTime;
+    uint32_t TscToSystemMul;
+    int8_t TscShift;
+    uint8_t Pad[3];
+    uint64_t Error;
+};
+static_assert(sizeof(PvClockHostTime) == 40, "the host time page layout is fixed");
+
+// clear while dom0 has nothing trustworthy to publish, e.g. before its own clock has synchronized
+#define PVCLOCK_HOST_TIME_VALID_BIT 0x01
+
+// Keeps a mapping from being torn down under its readers. Readers pin it for the duration of a read, wait-free;
+// revoking turns new readers away and waits for those already in.
+class PvClockPin {
+public:
+    PvClockPin() = default;
+    PvClockPin(const PvClockPin &) = delete;
+    PvClockPin &operator=(const PvClockPin &) = delete;
+
+    bool Acquire() {
+        if (_state.fetch_add(1, std::memory_order_acquire) & Revoked) {
+            _state.fetch_sub(1, std::memory_order_release);
+            return false;
+        }
+        return true;
+    }
+    void Release() {
+        _state.fetch_sub(1, std::memory_order_release);
+    }
+    void Revoke();
+
+private:
+    static constexpr uint32_t Revoked = 0x80000000;
+
+    std::atomic<uint32_t> _state = 0;
+};
+
+// A mapping of the page dom0's time service publishes host time in. Acquire fails once the mapping is gone.
+class IXenHostTimePage {
+public:
+    virtual ~IXenHostTimePage() = default;
+
+    // nullptr once unmapped; otherwise Release must follow
+    virtual const PvClockHostTime *Acquire() = 0;
+    virtual void Release() = 0;
+    // The TSC the page's scale applies to
+    virtual uint64_t ReadTsc() const = 0;
+};
+
+// Reads host UTC straight from the page dom0's time service keeps, the same way PvClockReader does from Xen's.
+class PvClockHostTimeReader {
+public:
+    static constexpr int MaxAttempts = PvClockReader::MaxAttempts;
+
+    explicit PvClockHostTimeReader(_In_ std::shared_ptr<IXenHostTimePage> page);
+    PvClockHostTimeReader(const PvClockHostTimeReader &) = delete;
+    PvClockHostTimeReader &operator=(const PvClockHostTimeReader &) = delete;
+
+    // Host UTC and its error bound, both in FILETIME units. Fails with ERROR_DEVICE_NOT_CONNECTED once the page is
+    // unmapped, with ERROR_NOT_READY while dom0 has not marked it valid and with ERROR_RETRY if it kept changing
+    // under us.
+    HRESULT Read(_Out_ unsigned __int64 *time, _Out_ unsigned __int64 *error) const;
+
+private:
+    HRESULT ReadPinned(_In_ const PvClockHostTime *info, _Out_ unsigned __int64 *time, _Out_ unsigned __int64 *error)
+        const;
+
+    std::shared_ptr<IXenHostTimePage> _page;
+};
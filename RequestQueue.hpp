@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <type_traits>
+#include <utility>
+
+#include "Platform.hpp"
+
+// Bounded multi-producer/single-consumer queue that never allocates (Vyukov's bounded queue). Each slot carries a
+// sequence number: equal to the enqueue position when the slot is free for that position, one past it once the value
+// is in. Producers claim a position with a CAS on the tail and never wait on each other beyond that; a full queue
+// makes TryPush fail instead of blocking.
+template <typename T, size_t N> class RequestQueue {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "RequestQueue size must be a power of two");
+    static_assert(std::is_nothrow_move_assignable_v<T>, "RequestQueue values are moved in and out of slots");
+
+public:
+    RequestQueue() {
+        for (size_t i = 0; i < N; i++)
+            _slots[i].Sequence.store(i, std::memory_order_relaxed);
+    }
+    RequestQueue(const RequestQueue &) = delete;
+    RequestQueue &operator=(const RequestQueue &) = delete;
+
+    // Any thread. Leaves value alone and returns false if the queue is full.
+    bool TryPush(T &&value) {
+        auto position = _tail.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (1) {
+            slot = &_slots[position % N];
+            auto sequence = slot->Sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<signed __int64>(sequence - position);
+            if (difference == 0) {
+                if (_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = _tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->Value = std::move(value);
+        slot->Sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if the queue is empty, or if the oldest value is still being pushed.
+    bool TryPop(_Out_ T *value) {
+        auto &slot = _slots[_head % N];
+        if (slot.Sequence.load(std::memory_order_acquire) != _head + 1)
+            return false;
+
+        *value = std::move(slot.Value);
+        // don't hold on to whatever the value refers to until the slot is reused
+        slot.Value = T{};
+        slot.Sequence.store(_head + N, std::memory_order_release);
+        _head++;
+        return true;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<unsigned __int64> Sequence;
+        T Value{};
+    };
+
+    alignas(64) std::atomic<unsigned __int64> _tail = 0;
+    alignas(64) unsigned __int64 _head = 0;
+    Slot _slots[N];
+};
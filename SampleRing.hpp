@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+#include "Platform.hpp"
+
+// Single-producer/single-consumer ring of the most recently published values. The producer never waits: it always
+// writes the slot after the newest one, overwriting the oldest. Each slot carries a sequence number that is odd while
+// the slot is being written, so the consumer detects a slot that was overwritten under it and retries with the new
+// newest slot. Since the producer has to lap the whole ring to cause a retry, ReadLatest gives up after a bounded
+// number of attempts and is wait-free.
+template <typename T, size_t N> class SampleRing {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SampleRing size must be a power of two");
+    static_assert(std::is_trivially_copyable_v<T>, "SampleRing values are copied with memcpy");
+
+public:
+    SampleRing() = default;
+    SampleRing(const SampleRing &) = delete;
+    SampleRing &operator=(const SampleRing &) = delete;
+
+    // Producer only
+    void Push(const T &value) {
+        auto index = _head.load(std::memory_order_relaxed);
+        auto &slot = _slots[index % N];
+
+        slot.Sequence.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(&slot.Value, &value, sizeof(T));
+        slot.Sequence.store(2 * index + 2, std::memory_order_release);
+        _head.store(index + 1, std::memory_order_release);
+    }
+
+    // Copies the newest value into *value. Returns its sequence number, starting at 1, or 0 if nothing was published
+    // yet or every attempt raced with the producer.
+    unsigned __int64 ReadLatest(_Out_ T *value) const {
+        for (size_t attempt = 0; attempt < N; attempt++) {
+            auto head = _head.load(std::memory_order_acquire);
+            if (head == 0)
+                return 0;
+
+            auto &slot = _slots[(head - 1) % N];
+            auto before = slot.Sequence.load(std::memory_order_acquire);
+            if (before != 2 * (head - 1) + 2)
+                continue;
+            memcpy(value, &slot.Value, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.Sequence.load(std::memory_order_relaxed) == before)
+                return head;
+        }
+        return 0;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<unsigned __int64> Sequence = 0;
+        T Value;
+    };
+
+    alignas(64) std::atomic<unsigned __int64> _head = 0;
+    Slot _slots[N];
+};
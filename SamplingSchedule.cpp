@@ -0,0 +1,43 @@
+#include <algorithm>
+
+#include "SamplingSchedule.hpp"
+
+void SamplingSchedule::SetPollInterval(signed char pollInterval) {
+    if (pollInterval < 0) {
+        _pollInterval.reset();
+        return;
+    }
+    auto exponent = (std::min)(static_cast<int>(pollInterval), MaxPollInterval);
+    _pollInterval = std::chrono::milliseconds(1000LL << exponent);
+}
+
+void SamplingSchedule::OnPoll(Clock::time_point now) {
+    _lastPoll = now;
+}
+
+SamplingSchedule::Clock::time_point SamplingSchedule::Next(
+    Clock::time_point now,
+    std::chrono::milliseconds interval) const {
+    if (!_pollInterval || !_lastPoll || *_pollInterval / SpreadRounds <= interval)
+        return now + interval;
+
+    auto period = *_pollInterval;
+    auto spread = period / SpreadRounds;
+
+    // polls that didn't come are taken to be a period later each
+    auto cycle = *_lastPoll;
+    if (now >= cycle + period)
+        cycle += (now - cycle) / period * period;
+    auto due = cycle + period;
+    auto burst = due - BurstLead - (BurstRounds - 1) * BurstSpacing;
+
+    if (now < burst) {
+        auto slot = now < cycle ? 1 : (now - cycle) / spread + 1;
+        return (std::min)(cycle + slot * spread, burst);
+    }
+    auto slot = (now - burst) / BurstSpacing + 1;
+    if (slot < static_cast<decltype(slot)>(BurstRounds))
+        return burst + slot * BurstSpacing;
+    // the poll, then the next interval's first round unless it moves the schedule
+    return due + spread;
+}
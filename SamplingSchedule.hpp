@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+
+#include "Platform.hpp"
+
+// When the sampler's rounds are due, given how often w32time polls. Rounds at a fixed interval are mostly wasted while
+// w32time polls every few minutes, and still leave it a sample up to an interval old.
+//
+// Once a poll has been seen and polls are far enough apart, each poll interval gets SpreadRounds rounds spread evenly
+// from the last poll, which keep the filters' windows spanning it, and BurstRounds rounds BurstSpacing apart ending
+// BurstLead before the next poll is due, so that it finds the filters freshly fed. A poll that doesn't come when due
+// is taken to be a poll interval later. Otherwise, rounds are every interval as before.
+//
+// The caller passes the time in, so that the schedule can be driven by a virtual clock.
+class SamplingSchedule {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr unsigned int SpreadRounds = 16;
+    static constexpr unsigned int BurstRounds = 4;
+    static constexpr std::chrono::milliseconds BurstSpacing{100};
+    static constexpr std::chrono::milliseconds BurstLead{250};
+    // TSI_PollInterval beyond this is taken as this, over a day
+    static constexpr int MaxPollInterval = 17;
+
+    SamplingSchedule() = default;
+
+    // TSI_PollInterval, in log2 seconds; below one second, rounds stay every interval
+    void SetPollInterval(signed char pollInterval);
+    void OnPoll(Clock::time_point now);
+    // Forgets the last poll, rounds are every interval until the next one
+    void Reset() {
+        _lastPoll.reset();
+    }
+
+    // When the round after one taken at now is due, for rounds every interval otherwise
+    Clock::time_point Next(Clock::time_point now, std::chrono::milliseconds interval) const;
+
+    std::optional<std::chrono::milliseconds> GetPollInterval() const {
+        return _pollInterval;
+    }
+
+private:
+    std::optional<std::chrono::milliseconds> _pollInterval;
+    std::optional<Clock::time_point> _lastPoll;
+};
@@ -0,0 +1,912 @@
+#include <algorithm>
+#include <cctype>
+#include <random>
+#include <thread>
+#include <utility>
+
+#include "Globals.hpp"
+#include "SimXenIface.hpp"
+#include "TimeConverter.hpp"
+
+static std::mt19937_64 &SimRandom() {
+    thread_local std::mt19937_64 engine(std::random_device{}());
+    return engine;
+}
+
+static bool SimChance(double probability) {
+    if (probability <= 0)
+        return false;
+    return std::bernoulli_distribution((std::min)(probability, 1.0))(SimRandom());
+}
+
+static std::chrono::nanoseconds SimJitter(std::chrono::nanoseconds jitter) {
+    if (jitter.count() <= 0)
+        return std::chrono::nanoseconds(0);
+    return std::chrono::nanoseconds(
+        std::uniform_int_distribution<std::chrono::nanoseconds::rep>(0, jitter.count())(SimRandom()));
+}
+
+// sleep_for overshoots by tens of microseconds, so spin for short delays to keep simulated latencies meaningful
+static void SimDelay(std::chrono::nanoseconds delay) {
+    if (delay.count() <= 0)
+        return;
+    if (delay >= std::chrono::milliseconds(1)) {
+        std::this_thread::sleep_for(delay);
+        return;
+    }
+    auto deadline = std::chrono::steady_clock::now() + delay;
+    while (std::chrono::steady_clock::now() < deadline)
+        std::this_thread::yield();
+}
+
+static FILETIME UInt64ToFileTime(unsigned __int64 value) {
+    return FILETIME{
+        .dwLowDateTime = static_cast<DWORD>(value),
+        .dwHighDateTime = static_cast<DWORD>(value >> 32),
+    };
+}
+
+SimClock::SimClock() : _origin(std::chrono::steady_clock::now()) {
+    auto sinceEpoch = std::chrono::duration_cast<std::chrono::duration<unsigned __int64, std::ratio<1, 10000000>>>(
+        std::chrono::system_clock::now().time_since_epoch());
+    _base = FILETIME_UNIX_EPOCH + sinceEpoch.count();
+}
+
+unsigned __int64 SimClock::NowLocked(std::chrono::steady_clock::time_point now) const {
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - _origin).count();
+    auto scaled = static_cast<signed __int64>(static_cast<double>(elapsed) * (1.0 + _ppm / 1000000.0) / 100.0);
+    return _base + scaled + _offset;
+}
+
+unsigned __int64 SimClock::Now() const {
+    std::lock_guard lock(_mutex);
+    return NowLocked(std::chrono::steady_clock::now());
+}
+
+void SimClock::SetOffset(signed __int64 offset) {
+    std::lock_guard lock(_mutex);
+    _offset = offset;
+}
+
+void SimClock::Step(signed __int64 delta) {
+    std::lock_guard lock(_mutex);
+    _offset += delta;
+}
+
+void SimClock::SetFrequencyError(double ppm) {
+    std::lock_guard lock(_mutex);
+    // rebase so that the new rate only applies from now on
+    auto now = std::chrono::steady_clock::now();
+    _base = NowLocked(now) - _offset;
+    _origin = now;
+    _ppm = ppm;
+}
+
+// The page is read concurrently by design, so writes have to reach memory as they are made
+template <typename T> static void WriteOnce(T &field, T value) {
+    *static_cast<volatile T *>(&field) = value;
+}
+
+SimXenSharedTimePage::SimXenSharedTimePage(_In_ const SimClock &hostClock)
+    : _hostClock(hostClock), _boot(std::chrono::steady_clock::now()) {
+    uint32_t mul;
+    int8_t shift;
+    PvClockComputeScale(TscFrequency, &mul, &shift);
+
+    _info.TscToSystemMul = mul;
+    _info.TscShift = shift;
+    _info.Flags = PVCLOCK_TSC_STABLE_BIT;
+    Update();
+
+    _thread = std::jthread([this](std::stop_token stop) { CalibrationFunc(stop); });
+}
+
+SimXenSharedTimePage::~SimXenSharedTimePage() {
+    _thread.request_stop();
+    std::lock_guard lock(_mutex);
+    _signal.notify_one();
+}
+
+uint64_t SimXenSharedTimePage::TscAt(std::chrono::steady_clock::time_point now) const {
+    constexpr uint64_t NsPerSec = 1000000000;
+    auto elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - _boot).count());
+    return elapsed / NsPerSec * TscFrequency + elapsed % NsPerSec * TscFrequency / NsPerSec;
+}
+
+uint64_t SimXenSharedTimePage::ReadTsc() const {
+    return TscAt(std::chrono::steady_clock::now());
+}
+
+void SimXenSharedTimePage::Update() {
+    std::lock_guard lock(_mutex);
+
+    auto now = std::chrono::steady_clock::now();
+    auto tsc = TscAt(now);
+    auto systemTime = PvClockScaleDelta(tsc, _info.TscToSystemMul, _info.TscShift);
+    auto hostTime = (_hostClock.Now() - FILETIME_UNIX_EPOCH) * 100;
+    auto wallClock = hostTime - systemTime;
+
+    auto version = _info.Version;
+    WriteOnce(_info.Version, version + 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    WriteOnce(_info.TscTimestamp, tsc);
+    WriteOnce(_info.SystemTime, systemTime);
+    std::atomic_thread_fence(std::memory_order_release);
+    WriteOnce(_info.Version, version + 2);
+
+    version = _wallClock.Version;
+    WriteOnce(_wallClock.Version, version + 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    WriteOnce(_wallClock.Sec, static_cast<uint32_t>(wallClock / 1000000000));
+    WriteOnce(_wallClockSecHi, static_cast<uint32_t>(wallClock / 1000000000 >> 32));
+    WriteOnce(_wallClock.Nsec, static_cast<uint32_t>(wallClock % 1000000000));
+    std::atomic_thread_fence(std::memory_order_release);
+    WriteOnce(_wallClock.Version, version + 2);
+}
+
+void SimXenSharedTimePage::CalibrationFunc(std::stop_token stop) {
+    while (!stop.stop_requested()) {
+        {
+            std::unique_lock lock(_mutex);
+            if (_signal.wait_for(lock, stop, CalibrationInterval, [] { return false; }) || stop.stop_requested())
+                break;
+        }
+        Update();
+    }
+}
+
+SimXenIfaceDevice::SimXenIfaceDevice(
+    _In_ SimXenIfacePlatform *platform,
+    _In_ const std::wstring &path,
+    _In_ IXenIfaceEvents *events,
+    std::chrono::nanoseconds latency)
+    : _platform(platform), _path(path), _events(events), _latency(latency) {}
+
+SimXenIfaceDevice::~SimXenIfaceDevice() {
+    UnmapHostTimePage();
+    _platform->DeviceDestroyed();
+}
+
+void SimXenIfaceDevice::Close() {
+    UnmapHostTimePage();
+    _open.store(false, std::memory_order_release);
+}
+
+void SimXenIfaceRequest::Cancel() {
+    _platform->CancelStalled(this);
+}
+
+HRESULT SimXenIfaceDevice::Ioctl(
+    _In_ const SimXenIfaceOptions &options,
+    _In_ HRESULT persistentError,
+    XenIfaceDeadline deadline,
+    _In_ std::function<HRESULT(SimXenIfaceRequest &request)> work,
+    _Out_ std::shared_ptr<SimXenIfaceRequest> &request) {
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE), !IsOpen());
+
+    try {
+        request = std::make_shared<SimXenIfaceRequest>(_platform);
+    }
+    CATCH_RETURN();
+    RETURN_IF_FAILED(request->Start(_inFlight));
+
+    if (SimChance(options.StallRate)) {
+        request->Work = [persistentError, work = std::move(work)](SimXenIfaceRequest &stalled) {
+            RETURN_IF_FAILED(persistentError);
+            return work(stalled);
+        };
+        _platform->Stall(request, options.StallLatency, options.IgnoreCancel);
+    } else {
+        auto hr = BeginIoctl(options, persistentError);
+        if (SUCCEEDED(hr)) {
+            hr = work(*request);
+            EndIoctl(options);
+        }
+        request->Complete(hr);
+    }
+    return request->Wait(deadline);
+}
+
+HRESULT SimXenIfaceDevice::BeginIoctl(_In_ const SimXenIfaceOptions &options, _In_ HRESULT persistentError) {
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE), !IsOpen());
+
+    auto delay = options.RequestLatency + _latency + SimJitter(options.Jitter);
+    if (SimChance(options.SpikeRate))
+        delay += options.SpikeLatency;
+    SimDelay(delay);
+
+    RETURN_IF_FAILED(persistentError);
+    RETURN_HR_IF(options.FailureError, SimChance(options.FailureRate));
+    return S_OK;
+}
+
+void SimXenIfaceDevice::EndIoctl(_In_ const SimXenIfaceOptions &options) {
+    SimDelay(options.ResponseLatency + SimJitter(options.Jitter));
+}
+
+void SimXenIfaceDevice::MaybeSuspend(_In_ const SimXenIfaceOptions &options, SimSuspendPoint point, bool suspend) {
+    if (!suspend || options.SuspendPoint != point)
+        return;
+    _platform->Suspend();
+    if (options.OnSuspend)
+        options.OnSuspend();
+}
+
+HRESULT SimXenIfaceDevice::GetHostTime(_Out_ FILETIME *time, XenIfaceDeadline deadline) {
+    auto options = _platform->GetOptions();
+    auto suspend = SimChance(options.SuspendRate);
+
+    // a stalled request may outlive this device
+    std::shared_ptr<SimXenIfaceRequest> request;
+    RETURN_IF_FAILED(Ioctl(
+        options,
+        options.HostTimeError,
+        deadline,
+        [self = shared_from_this(), options, suspend](SimXenIfaceRequest &request) {
+            self->MaybeSuspend(options, SimSuspendPoint::BeforeRead, suspend);
+            request.Time = UInt64ToFileTime(self->_platform->GetHostClock().Now());
+            self->MaybeSuspend(options, SimSuspendPoint::AfterRead, suspend);
+            return S_OK;
+        },
+        request));
+
+    *time = request->Time;
+    return S_OK;
+}
+
+HRESULT SimXenIfaceDevice::GetTime(_Out_ FILETIME *time, _Out_ bool *local, XenIfaceDeadline deadline) {
+    auto options = _platform->GetOptions();
+
+    std::shared_ptr<SimXenIfaceRequest> request;
+    RETURN_IF_FAILED(Ioctl(
+        options,
+        options.TimeError,
+        deadline,
+        [self = shared_from_this()](SimXenIfaceRequest &request) {
+            // the shared info wallclock as seen by Windows guests is in local time
+            auto universal = UInt64ToFileTime(self->_platform->GetHostClock().Now());
+            RETURN_HR_IF(E_FAIL, !TimeConvertFileTime(&universal, &request.Time, TimeConvertUniversalToLocal, nullptr));
+            request.Local = true;
+            return S_OK;
+        },
+        request));
+
+    *time = request->Time;
+    *local = request->Local;
+    return S_OK;
+}
+
+HRESULT SimXenIfaceDevice::GetSuspendCount(_Out_ ULONG *count, XenIfaceDeadline deadline) {
+    auto options = _platform->GetOptions();
+
+    std::shared_ptr<SimXenIfaceRequest> request;
+    RETURN_IF_FAILED(Ioctl(
+        options,
+        S_OK,
+        deadline,
+        [self = shared_from_this()](SimXenIfaceRequest &request) {
+            request.Count = self->_platform->GetSuspendCount();
+            return S_OK;
+        },
+        request));
+
+    *count = request->Count;
+    return S_OK;
+}
+
+HRESULT SimXenIfaceDevice::Log(_In_ PCSTR message, XenIfaceDeadline deadline) {
+    auto options = _platform->GetOptions();
+
+    // the driver has its own copy of the input from here on
+    std::string copy(message);
+    std::shared_ptr<SimXenIfaceRequest> request;
+    return Ioctl(
+        options,
+        options.LogError,
+        deadline,
+        [self = shared_from_this(), copy = std::move(copy)](SimXenIfaceRequest &request) {
+            UNREFERENCED_PARAMETER(request);
+            auto printable = std::all_of(copy.begin(), copy.end(), [](char c) {
+                return isprint(static_cast<unsigned char>(c)) || c == '\n';
+            });
+            RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER), copy.size() >= MaxLogLength || !printable);
+            self->_platform->AppendLog(copy);
+            return S_OK;
+        },
+        request);
+}
+
+HRESULT SimXenIfaceDevice::StoreWrite(_In_ PCSTR path, _In_ PCSTR value, XenIfaceDeadline deadline) {
+    auto options = _platform->GetOptions();
+
+    std::string pathCopy(path), valueCopy(value);
+    std::shared_ptr<SimXenIfaceRequest> request;
+    return Ioctl(
+        options,
+        options.StoreError,
+        deadline,
+        [self = shared_from_this(), path = std::move(pathCopy), value = std::move(valueCopy)](
+            SimXenIfaceRequest &request) {
+            UNREFERENCED_PARAMETER(request);
+            // XENSTORE_PAYLOAD_MAX
+            RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER), path.empty() || value.size() > 4096);
+            self->_platform->StoreWriteFromGuest(path, value);
+            return S_OK;
+        },
+        request);
+}
+
+HRESULT SimXenIfaceDevice::StoreRead(_In_ PCSTR path, _Out_ std::string &value, XenIfaceDeadline deadline) {
+    auto options = _platform->GetOptions();
+
+    std::string pathCopy(path);
+    std::shared_ptr<SimXenIfaceRequest> request;
+    RETURN_IF_FAILED(Ioctl(
+        options,
+        options.StoreError,
+        deadline,
+        [self = shared_from_this(), path = std::move(pathCopy)](SimXenIfaceRequest &request) {
+            RETURN_HR_IF(
+                HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND),
+                !self->_platform->StoreRead(path, &request.Value));
+            return S_OK;
+        },
+        request));
+
+    try {
+        value = request->Value;
+    }
+    CATCH_RETURN();
+    return S_OK;
+}
+
+HRESULT SimXenIfaceDevice::WatchStore(_In_ PCSTR path) {
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE), !IsOpen());
+    RETURN_IF_FAILED(_platform->GetOptions().StoreError);
+    {
+        std::lock_guard lock(_mutex);
+        RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), !_watch.empty());
+        try {
+            _watch = path;
+        }
+        CATCH_RETURN();
+    }
+
+    // as XenStore does for every new watch
+    _events->OnDeviceEvent(shared_from_this(), XenIfaceAction::StoreChanged);
+    return S_OK;
+}
+
+HRESULT SimXenIfaceDevice::BindEventChannel(USHORT remoteDomain, ULONG remotePort, XenIfaceDeadline deadline) {
+    auto options = _platform->GetOptions();
+    {
+        std::lock_guard lock(_mutex);
+        RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), _eventChannel.has_value());
+    }
+
+    std::shared_ptr<SimXenIfaceRequest> request;
+    return Ioctl(
+        options,
+        S_OK,
+        deadline,
+        [self = shared_from_this(), remoteDomain, remotePort](SimXenIfaceRequest &request) {
+            UNREFERENCED_PARAMETER(request);
+            // the simulated dom0 is the only other domain
+            RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER), remoteDomain != 0);
+            RETURN_IF_FAILED(self->_platform->BindEventChannel(self, remotePort));
+            std::lock_guard lock(self->_mutex);
+            self->_eventChannel = remotePort;
+            return S_OK;
+        },
+        request);
+}
+
+HRESULT SimXenIfaceDevice::UnmaskEventChannel(XenIfaceDeadline deadline) {
+    auto options = _platform->GetOptions();
+    std::optional<ULONG> port;
+    {
+        std::lock_guard lock(_mutex);
+        port = _eventChannel;
+    }
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_READY), !port);
+
+    std::shared_ptr<SimXenIfaceRequest> request;
+    return Ioctl(
+        options,
+        S_OK,
+        deadline,
+        [self = shared_from_this(), port = *port](SimXenIfaceRequest &request) {
+            UNREFERENCED_PARAMETER(request);
+            return self->_platform->UnmaskEventChannel(port);
+        },
+        request);
+}
+
+void SimXenIfaceDevice::CloseEventChannel() {
+    std::optional<ULONG> port;
+    {
+        std::lock_guard lock(_mutex);
+        port = std::exchange(_eventChannel, std::nullopt);
+    }
+    if (port)
+        _platform->UnbindEventChannel(*port);
+}
+
+HRESULT SimXenIfaceDevice::MapHostTimePage(
+    USHORT remoteDomain,
+    ULONG reference,
+    _Out_ std::shared_ptr<IXenHostTimePage> &page) {
+    page.reset();
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE), !IsOpen());
+    RETURN_IF_FAILED(_platform->GetOptions().MapError);
+    // the simulated dom0 is the only other domain
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER), remoteDomain != 0);
+
+    auto granted = _platform->FindGrant(reference);
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER), !granted);
+
+    std::shared_ptr<SimXenHostTimePage> mapping;
+    try {
+        mapping = std::make_shared<SimXenHostTimePage>(std::move(granted), _platform->GetSharedTimePage());
+    }
+    CATCH_RETURN();
+    {
+        std::lock_guard lock(_mutex);
+        RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), _mapping != nullptr);
+        _mapping = mapping;
+    }
+
+    page = std::move(mapping);
+    return S_OK;
+}
+
+void SimXenIfaceDevice::UnmapHostTimePage() {
+    std::shared_ptr<SimXenHostTimePage> mapping;
+    {
+        std::lock_guard lock(_mutex);
+        mapping = std::move(_mapping);
+    }
+    if (mapping)
+        mapping->Revoke();
+}
+
+bool SimXenIfaceDevice::IsWatching(_In_ const std::string &path) const {
+    std::lock_guard lock(_mutex);
+    if (_watch.empty() || !path.starts_with(_watch))
+        return false;
+    return path.size() == _watch.size() || path[_watch.size()] == '/';
+}
+
+HRESULT SimXenIfaceDevice::GetSharedTimePage(_Out_ std::shared_ptr<IXenSharedTimePage> &page) {
+    page.reset();
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE), !IsOpen());
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), !_platform->GetOptions().SharedTimePage);
+
+    page = _platform->GetSharedTimePage();
+    return S_OK;
+}
+
+SimXenIfacePlatform::SimXenIfacePlatform()
+    : _sharedTimePage(std::make_shared<SimXenSharedTimePage>(_hostClock)),
+      _driver([this](std::stop_token stop) { DriverFunc(stop); }) {}
+
+HRESULT SimXenIfacePlatform::Subscribe(_In_ IXenIfaceEvents *events) {
+    std::lock_guard lock(_callbackMutex);
+    _events = events;
+    return S_OK;
+}
+
+void SimXenIfacePlatform::Unsubscribe() {
+    std::lock_guard lock(_callbackMutex);
+    _events = nullptr;
+}
+
+HRESULT SimXenIfacePlatform::Enumerate(_Out_ std::vector<std::wstring> &interfaces) {
+    std::lock_guard lock(_mutex);
+
+    interfaces.clear();
+    RETURN_IF_FAILED(_options.EnumerateError);
+    try {
+        interfaces = _interfaces;
+    }
+    CATCH_RETURN();
+    return S_OK;
+}
+
+HRESULT SimXenIfacePlatform::Open(
+    _In_ const std::wstring &path,
+    _In_ IXenIfaceEvents *events,
+    _Out_ std::shared_ptr<IXenIfaceDevice> &device) {
+    std::lock_guard lock(_mutex);
+
+    RETURN_IF_FAILED(_options.OpenError);
+    RETURN_HR_IF(
+        HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND),
+        std::find(_interfaces.begin(), _interfaces.end(), path) == _interfaces.end());
+    if (_failOpens) {
+        _failOpens--;
+        return _failOpenError;
+    }
+
+    try {
+        auto newDevice = std::make_shared<SimXenIfaceDevice>(this, path, events, _latencies[path]);
+        std::erase_if(_devices, [](const auto &weak) { return weak.expired(); });
+        _devices.emplace_back(newDevice);
+        device = std::move(newDevice);
+    }
+    CATCH_RETURN();
+    return S_OK;
+}
+
+void SimXenIfacePlatform::FailOpens(unsigned int count, HRESULT error) {
+    std::lock_guard lock(_mutex);
+    _failOpens = count;
+    _failOpenError = error;
+}
+
+std::vector<std::string> SimXenIfacePlatform::TakeLog() {
+    std::lock_guard lock(_mutex);
+    return std::exchange(_log, {});
+}
+
+std::vector<std::thread::id> SimXenIfacePlatform::TakeDestroyedOn() {
+    std::lock_guard lock(_mutex);
+    return std::exchange(_destroyedOn, {});
+}
+
+void SimXenIfacePlatform::DeviceDestroyed() {
+    std::lock_guard lock(_mutex);
+    _destroyedOn.emplace_back(std::this_thread::get_id());
+}
+
+void SimXenIfacePlatform::AppendLog(_In_ std::string message) {
+    std::lock_guard lock(_mutex);
+    _log.emplace_back(std::move(message));
+}
+
+bool SimXenIfacePlatform::StoreRead(_In_ const std::string &path, _Out_ std::string *value) const {
+    std::lock_guard lock(_mutex);
+    auto it = _store.find(path);
+    if (it == _store.end())
+        return false;
+    *value = it->second;
+    return true;
+}
+
+void SimXenIfacePlatform::StoreWrite(_In_ const std::string &path, _In_ const std::string &value) {
+    {
+        std::lock_guard lock(_mutex);
+        _store[path] = value;
+    }
+    NotifyWatches(path);
+}
+
+void SimXenIfacePlatform::StoreRemove(_In_ const std::string &path) {
+    {
+        std::lock_guard lock(_mutex);
+        std::erase_if(_store, [&](const auto &entry) {
+            return entry.first == path || entry.first.starts_with(path + "/");
+        });
+    }
+    NotifyWatches(path);
+}
+
+void SimXenIfacePlatform::StoreWriteFromGuest(_In_ const std::string &path, _In_ const std::string &value) {
+    StoreWrite(path, value);
+    _storeWrites.fetch_add(1, std::memory_order_acq_rel);
+}
+
+ULONG SimXenIfacePlatform::AllocateEventChannel() {
+    std::lock_guard lock(_mutex);
+    auto port = _nextPort++;
+    _eventChannels[port] = EventChannel{};
+    return port;
+}
+
+bool SimXenIfacePlatform::NotifyEventChannel(ULONG port) {
+    std::shared_ptr<SimXenIfaceDevice> device;
+    {
+        std::lock_guard lock(_mutex);
+        auto it = _eventChannels.find(port);
+        if (it == _eventChannels.end())
+            return false;
+        // closing a handle closes its channels
+        device = it->second.Device.lock();
+        if (!device || !device->IsOpen())
+            return false;
+        if (it->second.Masked) {
+            it->second.Pending = true;
+            return true;
+        }
+        it->second.Masked = true;
+    }
+    NotifyDevices({device}, XenIfaceAction::EventChannel);
+    return true;
+}
+
+HRESULT SimXenIfacePlatform::BindEventChannel(_In_ const std::shared_ptr<SimXenIfaceDevice> &device, ULONG port) {
+    std::lock_guard lock(_mutex);
+    auto it = _eventChannels.find(port);
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER), it == _eventChannels.end());
+    auto bound = it->second.Device.lock();
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_BUSY), bound && bound->IsOpen());
+
+    it->second = EventChannel{.Device = device};
+    return S_OK;
+}
+
+HRESULT SimXenIfacePlatform::UnmaskEventChannel(ULONG port) {
+    std::shared_ptr<SimXenIfaceDevice> device;
+    {
+        std::lock_guard lock(_mutex);
+        auto it = _eventChannels.find(port);
+        RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER), it == _eventChannels.end());
+        if (!it->second.Pending) {
+            it->second.Masked = false;
+            return S_OK;
+        }
+        // what came in while masked is delivered now, and masks the channel again
+        it->second.Pending = false;
+        device = it->second.Device.lock();
+    }
+    if (device && device->IsOpen())
+        NotifyDevices({device}, XenIfaceAction::EventChannel);
+    return S_OK;
+}
+
+void SimXenIfacePlatform::UnbindEventChannel(ULONG port) {
+    std::lock_guard lock(_mutex);
+    auto it = _eventChannels.find(port);
+    if (it != _eventChannels.end())
+        it->second = EventChannel{};
+}
+
+ULONG SimXenIfacePlatform::GrantPage(_In_ std::shared_ptr<const PvClockHostTime> page) {
+    std::lock_guard lock(_mutex);
+    auto reference = _nextReference++;
+    _grants[reference] = std::move(page);
+    return reference;
+}
+
+void SimXenIfacePlatform::EndGrant(ULONG reference) {
+    std::lock_guard lock(_mutex);
+    _grants.erase(reference);
+}
+
+std::shared_ptr<const PvClockHostTime> SimXenIfacePlatform::FindGrant(ULONG reference) const {
+    std::lock_guard lock(_mutex);
+    auto it = _grants.find(reference);
+    return it == _grants.end() ? nullptr : it->second;
+}
+
+SimXenIfaceOptions SimXenIfacePlatform::GetOptions() const {
+    std::lock_guard lock(_mutex);
+    return _options;
+}
+
+void SimXenIfacePlatform::SetOptions(_In_ const SimXenIfaceOptions &options) {
+    std::lock_guard lock(_mutex);
+    _options = options;
+}
+
+std::vector<std::shared_ptr<SimXenIfaceDevice>> SimXenIfacePlatform::GetOpenDevices(_In_opt_ const std::wstring *path) {
+    std::lock_guard lock(_mutex);
+    std::vector<std::shared_ptr<SimXenIfaceDevice>> devices;
+
+    for (const auto &weak : _devices) {
+        auto device = weak.lock();
+        if (device && (!path || device->GetPath() == *path))
+            devices.emplace_back(std::move(device));
+    }
+    return devices;
+}
+
+void SimXenIfacePlatform::NotifyDevices(
+    _In_ const std::vector<std::shared_ptr<SimXenIfaceDevice>> &devices,
+    XenIfaceAction action) {
+    for (const auto &device : devices)
+        device->GetEvents()->OnDeviceEvent(device, action);
+}
+
+void SimXenIfacePlatform::NotifyInterface(XenIfaceAction action) {
+    std::lock_guard lock(_callbackMutex);
+    if (_events)
+        _events->OnInterfaceEvent(action);
+}
+
+void SimXenIfacePlatform::NotifyWatches(_In_ const std::string &path) {
+    auto devices = GetOpenDevices(nullptr);
+    // closing a handle drops its watch
+    std::erase_if(devices, [&](const auto &device) { return !device->IsOpen() || !device->IsWatching(path); });
+    NotifyDevices(devices, XenIfaceAction::StoreChanged);
+}
+
+void SimXenIfacePlatform::AddInterface(_In_ const std::wstring &path, std::chrono::nanoseconds latency) {
+    {
+        std::lock_guard lock(_mutex);
+        if (std::find(_interfaces.begin(), _interfaces.end(), path) == _interfaces.end())
+            _interfaces.emplace_back(path);
+        _latencies[path] = latency;
+    }
+    NotifyInterface(XenIfaceAction::InterfaceArrival);
+}
+
+void SimXenIfacePlatform::RemoveInterface(_In_ const std::wstring &path, _In_ bool veto) {
+    auto devices = GetOpenDevices(&path);
+
+    NotifyDevices(devices, XenIfaceAction::QueryRemove);
+    if (veto) {
+        NotifyDevices(devices, XenIfaceAction::QueryRemoveFailed);
+        return;
+    }
+
+    {
+        std::lock_guard lock(_mutex);
+        std::erase(_interfaces, path);
+    }
+    NotifyDevices(devices, XenIfaceAction::RemovePending);
+    NotifyDevices(devices, XenIfaceAction::RemoveComplete);
+    NotifyInterface(XenIfaceAction::InterfaceRemoval);
+}
+
+void SimXenIfacePlatform::Resume() {
+    Suspend();
+    auto devices = GetOpenDevices(nullptr);
+    // closing a handle drops its registration
+    std::erase_if(devices, [](const auto &device) { return !device->IsOpen(); });
+    NotifyDevices(devices, XenIfaceAction::Resume);
+}
+
+void SimXenIfacePlatform::Stall(
+    _In_ std::shared_ptr<SimXenIfaceRequest> request,
+    std::chrono::nanoseconds latency,
+    bool ignoreCancel) {
+    auto due = latency.count() > 0 ? std::chrono::steady_clock::now() + latency
+                                   : std::chrono::steady_clock::time_point::max();
+    {
+        std::lock_guard lock(_stallMutex);
+        _stalled.emplace_back(StalledRequest{.Request = std::move(request), .Due = due, .IgnoreCancel = ignoreCancel});
+        _stallChanged = true;
+    }
+    _stallSignal.notify_one();
+}
+
+void SimXenIfacePlatform::CancelStalled(_In_ const SimXenIfaceRequest *request) {
+    {
+        std::lock_guard lock(_stallMutex);
+        auto it = std::find_if(_stalled.begin(), _stalled.end(), [&](const auto &stalled) {
+            return stalled.Request.get() == request;
+        });
+        if (it == _stalled.end() || it->IgnoreCancel)
+            return;
+        it->Cancelled = true;
+        _stallChanged = true;
+    }
+    _stallSignal.notify_one();
+}
+
+void SimXenIfacePlatform::DriverFunc(std::stop_token stop) {
+    while (!stop.stop_requested()) {
+        std::list<StalledRequest> ready;
+        {
+            std::unique_lock lock(_stallMutex);
+            auto next = std::chrono::steady_clock::time_point::max();
+            for (const auto &stalled : _stalled)
+                next = (std::min)(next, stalled.Cancelled ? std::chrono::steady_clock::time_point::min() : stalled.Due);
+            if (next == std::chrono::steady_clock::time_point::max())
+                _stallSignal.wait(lock, stop, [&] { return _stallChanged; });
+            else
+                _stallSignal.wait_until(lock, stop, next, [&] { return _stallChanged; });
+            _stallChanged = false;
+
+            auto now = std::chrono::steady_clock::now();
+            for (auto it = _stalled.begin(); it != _stalled.end();) {
+                auto current = it++;
+                if (current->Cancelled || current->Due <= now)
+                    ready.splice(ready.end(), _stalled, current);
+            }
+        }
+
+        // completion may drop the last reference to a request and with it its device
+        for (auto &stalled : ready)
+            stalled.Request->Complete(
+                stalled.Cancelled ? HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED)
+                                  : stalled.Request->Work(*stalled.Request));
+    }
+
+    // a driver that is going away completes whatever it still holds
+    std::list<StalledRequest> remaining;
+    {
+        std::lock_guard lock(_stallMutex);
+        remaining.swap(_stalled);
+    }
+    for (auto &stalled : remaining)
+        stalled.Request->Complete(HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+}
+
+SimTimeDaemon::SimTimeDaemon(_In_ SimXenIfacePlatform &platform, bool timePage)
+    : _platform(platform), _port(platform.AllocateEventChannel()) {
+    if (timePage) {
+        _timePage = std::make_shared<PvClockHostTime>();
+        PvClockComputeScale(SimXenSharedTimePage::TscFrequency, &_timePage->TscToSystemMul, &_timePage->TscShift);
+        _timePage->Error = TimePageError;
+        UpdateTimePage();
+
+        _timePageReference = _platform.GrantPage(_timePage);
+        _platform.StoreWrite(XenHostSync::TimePagePath, std::to_string(_timePageReference));
+        _thread = std::jthread([this](std::stop_token stop) { UpdateFunc(stop); });
+    }
+    _platform.StoreWrite(XenHostSync::EventChannelPath, std::to_string(_port));
+}
+
+SimTimeDaemon::~SimTimeDaemon() {
+    _platform.StoreRemove(XenHostSync::EventChannelPath);
+    if (_timePage) {
+        _platform.StoreRemove(XenHostSync::TimePagePath);
+        _platform.EndGrant(_timePageReference);
+        _thread.request_stop();
+        std::lock_guard lock(_mutex);
+        _signal.notify_one();
+    }
+}
+
+void SimTimeDaemon::UpdateTimePage() {
+    std::lock_guard lock(_mutex);
+    auto &page = *_timePage;
+
+    // The host clock is read between two TSC reads, as a daemon that disciplines it would sample them, and read
+    // again if the daemon was preempted in between: the pair stands until the next update. The narrowest bracket
+    // of a few goes in if none is tight enough.
+    auto timePage = _platform.GetSharedTimePage();
+    auto maxSpan = SimXenSharedTimePage::TscFrequency * TimePageError / 4 / 1000000000;
+    uint64_t tsc = 0, hostTime = 0, span = UINT64_MAX;
+    for (int attempt = 0; attempt < 8 && span > maxSpan; attempt++) {
+        auto before = timePage->ReadTsc();
+        auto now = _platform.GetHostClock().Now();
+        auto after = timePage->ReadTsc();
+        if (after - before < span) {
+            span = after - before;
+            tsc = before + span / 2;
+            hostTime = static_cast<uint64_t>((now - FILETIME_UNIX_EPOCH) * 100);
+        }
+    }
+
+    auto version = page.Version;
+    WriteOnce(page.Version, version + 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    WriteOnce(page.Flags, _timePageValid ? static_cast<uint32_t>(PVCLOCK_HOST_TIME_VALID_BIT) : 0U);
+    WriteOnce(page.TscTimestamp, tsc);
+    WriteOnce(page.HostTime, hostTime);
+    std::atomic_thread_fence(std::memory_order_release);
+    WriteOnce(page.Version, version + 2);
+}
+
+void SimTimeDaemon::SetTimePageValid(bool valid) {
+    if (!_timePage)
+        return;
+    {
+        std::lock_guard lock(_mutex);
+        _timePageValid = valid;
+    }
+    UpdateTimePage();
+}
+
+void SimTimeDaemon::UpdateFunc(std::stop_token stop) {
+    while (!stop.stop_requested()) {
+        {
+            std::unique_lock lock(_mutex);
+            if (_signal.wait_for(lock, stop, UpdateInterval, [] { return false; }) || stop.stop_requested())
+                break;
+        }
+        UpdateTimePage();
+    }
+}
+
+bool SimTimeDaemon::Step(signed __int64 delta) {
+    _platform.GetHostClock().Step(delta);
+    // as a daemon would once it has stepped the clock the guests read
+    _platform.GetSharedTimePage()->Update();
+    if (_timePage)
+        UpdateTimePage();
+    return Notify();
+}
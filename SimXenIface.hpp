@@ -0,0 +1,426 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Platform.hpp"
+#include "PvClock.hpp"
+#include "XenHostSync.hpp"
+#include "XenIface.hpp"
+
+// In-process stand-in for the xeniface driver and the PnP manager, for running the sampling core on hosts without a
+// Xen guest. Notifications are delivered synchronously on the thread that drives the simulation.
+
+// Clock in FILETIME units (100 ns since 1601) that follows the system clock with a configurable offset and frequency
+// error
+class SimClock {
+public:
+    SimClock();
+    SimClock(const SimClock &) = delete;
+    SimClock &operator=(const SimClock &) = delete;
+
+    unsigned __int64 Now() const;
+    void SetOffset(signed __int64 offset);
+    void Step(signed __int64 delta);
+    void SetFrequencyError(double ppm);
+
+private:
+    unsigned __int64 NowLocked(std::chrono::steady_clock::time_point now) const;
+
+    mutable std::mutex _mutex;
+    std::chrono::steady_clock::time_point _origin;
+    unsigned __int64 _base;
+    signed __int64 _offset = 0;
+    double _ppm = 0;
+};
+
+// vcpu_time_info and wallclock as Xen keeps them, for a TSC running off the steady clock at TscFrequency. Like Xen,
+// the page is recalibrated against the host clock once per CalibrationInterval and extrapolated in between, so host
+// clock steps and frequency changes show up with a delay.
+class SimXenSharedTimePage : public IXenSharedTimePage {
+public:
+    static constexpr uint64_t TscFrequency = 2500000000;
+    static constexpr std::chrono::seconds CalibrationInterval{1};
+
+    explicit SimXenSharedTimePage(_In_ const SimClock &hostClock);
+    ~SimXenSharedTimePage();
+    SimXenSharedTimePage(const SimXenSharedTimePage &) = delete;
+    SimXenSharedTimePage &operator=(const SimXenSharedTimePage &) = delete;
+
+    const PvClockVcpuTimeInfo *GetVcpuTimeInfo() const override {
+        return &_info;
+    }
+    const PvClockWallClock *GetWallClock() const override {
+        return &_wallClock;
+    }
+    const uint32_t *GetWallClockSecHi() const override {
+        return &_wallClockSecHi;
+    }
+    uint64_t ReadTsc() const override;
+
+    // Recalibrate now instead of waiting for the next interval
+    void Update();
+
+private:
+    uint64_t TscAt(std::chrono::steady_clock::time_point now) const;
+    void CalibrationFunc(std::stop_token stop);
+
+    const SimClock &_hostClock;
+    std::chrono::steady_clock::time_point _boot;
+
+    std::mutex _mutex;
+    std::condition_variable_any _signal;
+    PvClockVcpuTimeInfo _info{};
+    PvClockWallClock _wallClock{};
+    uint32_t _wallClockSecHi = 0;
+
+    std::jthread _thread;
+};
+
+enum class SimSuspendPoint {
+    // between the guest's begin timestamp and the read of the host clock
+    BeforeRead,
+    // between the read of the host clock and the guest's end timestamp
+    AfterRead,
+};
+
+struct SimXenIfaceOptions {
+    // Time spent in the driver before and after the host clock is read
+    std::chrono::nanoseconds RequestLatency{0};
+    std::chrono::nanoseconds ResponseLatency{0};
+    // Uniformly distributed extra latency on each leg
+    std::chrono::nanoseconds Jitter{0};
+    // Probability of an IOCTL being held up by SpikeLatency before reading the clock, as with a preempted vCPU
+    double SpikeRate = 0;
+    std::chrono::nanoseconds SpikeLatency{0};
+    // Probability of an IOCTL being pended by the driver for StallLatency, or until cancelled if that is zero, as with
+    // a driver wedged on something. Cancelling a stalled IOCTL completes it with ERROR_OPERATION_ABORTED unless
+    // IgnoreCancel, as with a driver that does not support cancellation. Other IOCTLs complete inline.
+    double StallRate = 0;
+    std::chrono::nanoseconds StallLatency{0};
+    bool IgnoreCancel = false;
+
+    // Persistent IOCTL results, e.g. HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED) for drivers without GET_HOST_TIME
+    HRESULT HostTimeError = S_OK;
+    HRESULT TimeError = S_OK;
+    HRESULT LogError = S_OK;
+    HRESULT StoreError = S_OK;
+    // e.g. HRESULT_FROM_WIN32(ERROR_INVALID_FUNCTION) for drivers without the _V2 grant table IOCTLs
+    HRESULT MapError = S_OK;
+    // Transient IOCTL failures
+    double FailureRate = 0;
+    HRESULT FailureError = HRESULT_FROM_WIN32(ERROR_GEN_FAILURE);
+
+    HRESULT EnumerateError = S_OK;
+    HRESULT OpenError = S_OK;
+
+    // Whether devices hand out the shared time page, as a driver mapping shared_info into user mode would
+    bool SharedTimePage = true;
+
+    // Probability of a host time IOCTL straddling a suspend at SuspendPoint: the suspend count goes up and OnSuspend,
+    // if any, is called there, e.g. to step the guest clock. No resume notification is sent.
+    double SuspendRate = 0;
+    SimSuspendPoint SuspendPoint = SimSuspendPoint::BeforeRead;
+    std::function<void()> OnSuspend;
+};
+
+class SimXenIfacePlatform;
+
+// A mapping of a page dom0 has granted, which is plain memory shared with the simulated dom0
+class SimXenHostTimePage : public IXenHostTimePage {
+public:
+    SimXenHostTimePage(
+        _In_ std::shared_ptr<const PvClockHostTime> page,
+        _In_ std::shared_ptr<const SimXenSharedTimePage> tscSource)
+        : _page(std::move(page)), _tscSource(std::move(tscSource)) {}
+
+    const PvClockHostTime *Acquire() override {
+        return _pin.Acquire() ? _page.get() : nullptr;
+    }
+    void Release() override {
+        _pin.Release();
+    }
+    uint64_t ReadTsc() const override {
+        return _tscSource->ReadTsc();
+    }
+
+    void Revoke() {
+        _pin.Revoke();
+    }
+
+private:
+    PvClockPin _pin;
+    std::shared_ptr<const PvClockHostTime> _page;
+    std::shared_ptr<const SimXenSharedTimePage> _tscSource;
+};
+
+// An IOCTL on a simulated device. Work is what the driver does once it gets to the request; it fills in the output.
+class SimXenIfaceRequest : public XenIfaceRequest {
+public:
+    explicit SimXenIfaceRequest(_In_ SimXenIfacePlatform *platform) : _platform(platform) {}
+
+    std::function<HRESULT(SimXenIfaceRequest &request)> Work;
+    FILETIME Time{};
+    bool Local = false;
+    ULONG Count = 0;
+    std::string Value;
+
+protected:
+    void Cancel() override;
+
+private:
+    SimXenIfacePlatform *_platform;
+};
+
+class SimXenIfaceDevice : public IXenIfaceDevice, public std::enable_shared_from_this<SimXenIfaceDevice> {
+public:
+    SimXenIfaceDevice(
+        _In_ SimXenIfacePlatform *platform,
+        _In_ const std::wstring &path,
+        _In_ IXenIfaceEvents *events,
+        std::chrono::nanoseconds latency);
+    ~SimXenIfaceDevice();
+    SimXenIfaceDevice(const SimXenIfaceDevice &) = delete;
+    SimXenIfaceDevice &operator=(const SimXenIfaceDevice &) = delete;
+
+    const std::wstring &GetPath() const override {
+        return _path;
+    }
+    bool IsOpen() const override {
+        return _open.load(std::memory_order_acquire);
+    }
+    void Close() override;
+
+    HRESULT GetHostTime(_Out_ FILETIME *time, XenIfaceDeadline deadline) override;
+    HRESULT GetTime(_Out_ FILETIME *time, _Out_ bool *local, XenIfaceDeadline deadline) override;
+    HRESULT GetSuspendCount(_Out_ ULONG *count, XenIfaceDeadline deadline) override;
+    HRESULT Log(_In_ PCSTR message, XenIfaceDeadline deadline) override;
+    HRESULT StoreWrite(_In_ PCSTR path, _In_ PCSTR value, XenIfaceDeadline deadline) override;
+    HRESULT StoreRead(_In_ PCSTR path, _Out_ std::string &value, XenIfaceDeadline deadline) override;
+    HRESULT WatchStore(_In_ PCSTR path) override;
+    HRESULT BindEventChannel(USHORT remoteDomain, ULONG remotePort, XenIfaceDeadline deadline) override;
+    HRESULT UnmaskEventChannel(XenIfaceDeadline deadline) override;
+    void CloseEventChannel() override;
+    HRESULT MapHostTimePage(USHORT remoteDomain, ULONG reference, _Out_ std::shared_ptr<IXenHostTimePage> &page)
+        override;
+    void UnmapHostTimePage() override;
+    HRESULT GetSharedTimePage(_Out_ std::shared_ptr<IXenSharedTimePage> &page) override;
+
+    IXenIfaceEvents *GetEvents() const {
+        return _events;
+    }
+    // Whether a change to path fires this device's watch
+    bool IsWatching(_In_ const std::string &path) const;
+
+private:
+    // Issues the request, then waits for it as a real device would
+    HRESULT Ioctl(
+        _In_ const SimXenIfaceOptions &options,
+        _In_ HRESULT persistentError,
+        XenIfaceDeadline deadline,
+        _In_ std::function<HRESULT(SimXenIfaceRequest &request)> work,
+        _Out_ std::shared_ptr<SimXenIfaceRequest> &request);
+    HRESULT BeginIoctl(_In_ const SimXenIfaceOptions &options, _In_ HRESULT persistentError);
+    void EndIoctl(_In_ const SimXenIfaceOptions &options);
+    void MaybeSuspend(_In_ const SimXenIfaceOptions &options, SimSuspendPoint point, bool suspend);
+
+    SimXenIfacePlatform *_platform;
+    std::wstring _path;
+    IXenIfaceEvents *_events;
+    std::chrono::nanoseconds _latency;
+    std::atomic<bool> _open = true;
+    mutable std::mutex _mutex;
+    _Guarded_by_(_mutex) std::string _watch;
+    // the remote port, there is no local one
+    _Guarded_by_(_mutex) std::optional<ULONG> _eventChannel;
+    _Guarded_by_(_mutex) std::shared_ptr<SimXenHostTimePage> _mapping;
+    XenIfaceInFlight _inFlight = std::make_shared<std::atomic<unsigned int>>(0);
+};
+
+class SimXenIfacePlatform : public IXenIfacePlatform {
+public:
+    SimXenIfacePlatform();
+    SimXenIfacePlatform(const SimXenIfacePlatform &) = delete;
+    SimXenIfacePlatform &operator=(const SimXenIfacePlatform &) = delete;
+
+    HRESULT Subscribe(_In_ IXenIfaceEvents *events) override;
+    void Unsubscribe() override;
+    HRESULT Enumerate(_Out_ std::vector<std::wstring> &interfaces) override;
+    HRESULT Open(
+        _In_ const std::wstring &path,
+        _In_ IXenIfaceEvents *events,
+        _Out_ std::shared_ptr<IXenIfaceDevice> &device) override;
+
+    SimClock &GetHostClock() {
+        return _hostClock;
+    }
+    const std::shared_ptr<SimXenSharedTimePage> &GetSharedTimePage() const {
+        return _sharedTimePage;
+    }
+    SimXenIfaceOptions GetOptions() const;
+    void SetOptions(_In_ const SimXenIfaceOptions &options);
+
+    // Makes an interface present and signals its arrival. Every IOCTL on it takes latency on top of the options.
+    void AddInterface(_In_ const std::wstring &path, std::chrono::nanoseconds latency = {});
+    // Orderly removal: QUERYREMOVE to every open handle, then either QUERYREMOVEFAILED if vetoed or
+    // REMOVEPENDING/REMOVECOMPLETE and interface removal
+    void RemoveInterface(_In_ const std::wstring &path, _In_ bool veto = false);
+    // Resume from suspend, as xeniface signals it to every open handle after save/restore or migration. Whatever the
+    // VM missed while paused is up to the caller, e.g. stepping the guest clock back.
+    void Resume();
+    ULONG GetSuspendCount() const {
+        return _suspendCount.load(std::memory_order_acquire);
+    }
+    // The next count opens fail with error, as when another driver briefly holds the device exclusively
+    void FailOpens(unsigned int count, HRESULT error = HRESULT_FROM_WIN32(ERROR_SHARING_VIOLATION));
+    // Messages logged to dom0 through any device since the last call, oldest first
+    std::vector<std::string> TakeLog();
+    // For SimXenIfaceDevice
+    void AppendLog(_In_ std::string message);
+    // The guest's part of XenStore, keyed by path relative to its domain path as the guest writes them. Writes from
+    // here are as from dom0 tooling, those from devices are counted. Either fires the watches of open devices.
+    bool StoreRead(_In_ const std::string &path, _Out_ std::string *value) const;
+    void StoreWrite(_In_ const std::string &path, _In_ const std::string &value);
+    // Removes path and everything below it
+    void StoreRemove(_In_ const std::string &path);
+    unsigned __int64 GetStoreWrites() const {
+        return _storeWrites.load(std::memory_order_acquire);
+    }
+    // For SimXenIfaceDevice
+    void StoreWriteFromGuest(_In_ const std::string &path, _In_ const std::string &value);
+    // Event channels as dom0 sees them: it allocates a port for the guest to bind, then notifies it. A notification
+    // on a masked channel is held pending until the guest unmasks it. Returns whether a device had port bound.
+    ULONG AllocateEventChannel();
+    bool NotifyEventChannel(ULONG port);
+    // For SimXenIfaceDevice
+    HRESULT BindEventChannel(_In_ const std::shared_ptr<SimXenIfaceDevice> &device, ULONG port);
+    HRESULT UnmaskEventChannel(ULONG port);
+    void UnbindEventChannel(ULONG port);
+    // Pages dom0 grants the guest, by grant reference. Ending a grant does not take the page from a guest that has
+    // mapped it, as with Xen until the guest unmaps it.
+    ULONG GrantPage(_In_ std::shared_ptr<const PvClockHostTime> page);
+    void EndGrant(ULONG reference);
+    // For SimXenIfaceDevice
+    std::shared_ptr<const PvClockHostTime> FindGrant(ULONG reference) const;
+    // Threads devices have been destroyed on since the last call, in order
+    std::vector<std::thread::id> TakeDestroyedOn();
+    // For SimXenIfaceDevice
+    void DeviceDestroyed();
+    // The suspend part of Resume, without notifying anyone
+    void Suspend() {
+        _suspendCount.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    // For SimXenIfaceDevice: pends a started request on the driver thread, which runs its work after latency, or fails
+    // it if cancelled first. Zero latency waits for cancellation, and with ignoreCancel for the platform to go away.
+    void Stall(_In_ std::shared_ptr<SimXenIfaceRequest> request, std::chrono::nanoseconds latency, bool ignoreCancel);
+    void CancelStalled(_In_ const SimXenIfaceRequest *request);
+
+private:
+    struct EventChannel {
+        std::weak_ptr<SimXenIfaceDevice> Device;
+        bool Masked = false;
+        bool Pending = false;
+    };
+
+    struct StalledRequest {
+        std::shared_ptr<SimXenIfaceRequest> Request;
+        std::chrono::steady_clock::time_point Due;
+        bool IgnoreCancel;
+        bool Cancelled = false;
+    };
+
+    // all open devices if path is null
+    std::vector<std::shared_ptr<SimXenIfaceDevice>> GetOpenDevices(_In_opt_ const std::wstring *path);
+    void NotifyDevices(_In_ const std::vector<std::shared_ptr<SimXenIfaceDevice>> &devices, XenIfaceAction action);
+    void NotifyInterface(XenIfaceAction action);
+    void NotifyWatches(_In_ const std::string &path);
+    void DriverFunc(std::stop_token stop);
+
+    mutable std::mutex _mutex;
+    _Guarded_by_(_mutex) SimXenIfaceOptions _options;
+    _Guarded_by_(_mutex) std::vector<std::wstring> _interfaces;
+    _Guarded_by_(_mutex) std::map<std::wstring, std::chrono::nanoseconds> _latencies;
+    _Guarded_by_(_mutex) std::vector<std::weak_ptr<SimXenIfaceDevice>> _devices;
+    _Guarded_by_(_mutex) unsigned int _failOpens = 0;
+    _Guarded_by_(_mutex) HRESULT _failOpenError = S_OK;
+    _Guarded_by_(_mutex) std::vector<std::string> _log;
+    _Guarded_by_(_mutex) std::vector<std::thread::id> _destroyedOn;
+    _Guarded_by_(_mutex) std::map<std::string, std::string> _store;
+    std::atomic<unsigned __int64> _storeWrites = 0;
+    _Guarded_by_(_mutex) std::map<ULONG, EventChannel> _eventChannels;
+    _Guarded_by_(_mutex) ULONG _nextPort = 1;
+    _Guarded_by_(_mutex) std::map<ULONG, std::shared_ptr<const PvClockHostTime>> _grants;
+    // the first few references are reserved
+    _Guarded_by_(_mutex) ULONG _nextReference = 8;
+
+    // held while delivering interface notifications so that Unsubscribe can wait for them
+    std::mutex _callbackMutex;
+    _Guarded_by_(_callbackMutex) IXenIfaceEvents *_events = nullptr;
+
+    SimClock _hostClock;
+    std::shared_ptr<SimXenSharedTimePage> _sharedTimePage;
+    std::atomic<ULONG> _suspendCount = 0;
+
+    std::mutex _stallMutex;
+    std::condition_variable_any _stallSignal;
+    _Guarded_by_(_stallMutex) std::list<StalledRequest> _stalled;
+    _Guarded_by_(_stallMutex) bool _stallChanged = false;
+    std::jthread _driver;
+};
+
+// Stand-in for a dom0 time daemon, the other end of the provider's push mode. It allocates an event channel for the
+// guest and advertises its port in XenStore for as long as it runs, and notifies the guest whenever it steps the host
+// clock or otherwise has news. With a time page, it also grants the guest a page it keeps host time in, republished
+// every UpdateInterval.
+class SimTimeDaemon {
+public:
+    static constexpr std::chrono::milliseconds UpdateInterval{100};
+    // what the page claims for its extrapolation until the next update, in ns
+    static constexpr uint64_t TimePageError = 1000;
+
+    explicit SimTimeDaemon(_In_ SimXenIfacePlatform &platform, bool timePage = true);
+    ~SimTimeDaemon();
+    SimTimeDaemon(const SimTimeDaemon &) = delete;
+    SimTimeDaemon &operator=(const SimTimeDaemon &) = delete;
+
+    ULONG GetPort() const {
+        return _port;
+    }
+    // Returns whether the guest had the channel bound
+    bool Notify() {
+        return _platform.NotifyEventChannel(_port);
+    }
+    ULONG GetTimePageReference() const {
+        return _timePageReference;
+    }
+    // Whether the page is marked valid, as when the daemon's own clock gains or loses sync
+    void SetTimePageValid(bool valid);
+    // Steps the host clock by delta (100 ns), republishes what the guest reads it from and notifies the guest
+    bool Step(signed __int64 delta);
+
+private:
+    void UpdateTimePage();
+    void UpdateFunc(std::stop_token stop);
+
+    SimXenIfacePlatform &_platform;
+    ULONG _port;
+
+    std::mutex _mutex;
+    std::condition_variable_any _signal;
+    // null without a time page
+    std::shared_ptr<PvClockHostTime> _timePage;
+    ULONG _timePageReference = 0;
+    _Guarded_by_(_mutex) bool _timePageValid = true;
+    std::jthread _thread;
+};
@@ -1,5 +1,11 @@
+#include <algorithm>
+#ifndef _WIN32
+#include <ctime>
+#endif
+
 #include "TimeConverter.hpp"
 
+#ifdef _WIN32
 _Success_(return) BOOL TimeConvertFileTime(
     _In_ CONST FILETIME *inputFileTime,
     _Out_ LPFILETIME outputFileTime,
@@ -29,3 +35,159 @@ _Success_(return) BOOL TimeConvertFileTime(
 
     return TRUE;
 }
+#else
+// Seconds between the FILETIME epoch (1601) and the Unix epoch
+#define UNIX_EPOCH_SECONDS 11644473600LL
+
+_Success_(return) BOOL TimeConvertFileTime(
+    _In_ CONST FILETIME *inputFileTime,
+    _Out_ LPFILETIME outputFileTime,
+    _In_ TIME_CONVERT_FILE_TIME_DIRECTION direction,
+    _In_opt_ PDYNAMIC_TIME_ZONE_INFORMATION dynamicTimeZone) {
+    // only the process time zone is supported here
+    if (dynamicTimeZone)
+        return FALSE;
+
+    auto value = static_cast<unsigned __int64>(inputFileTime->dwHighDateTime) << 32 |
+        static_cast<unsigned __int64>(inputFileTime->dwLowDateTime);
+    auto seconds = static_cast<time_t>(value / 10000000 - UNIX_EPOCH_SECONDS);
+    struct tm fields;
+    signed __int64 bias;
+
+    switch (direction) {
+    case TimeConvertUniversalToLocal:
+        if (!localtime_r(&seconds, &fields))
+            return FALSE;
+        bias = fields.tm_gmtoff;
+        break;
+    case TimeConvertLocalToUniversal: {
+        if (!gmtime_r(&seconds, &fields))
+            return FALSE;
+        fields.tm_isdst = -1;
+        auto universal = mktime(&fields);
+        if (universal == static_cast<time_t>(-1))
+            return FALSE;
+        bias = -static_cast<signed __int64>(seconds - universal);
+        break;
+    }
+    default:
+        return FALSE;
+    }
+
+    value += bias * 10000000;
+    outputFileTime->dwLowDateTime = static_cast<DWORD>(value);
+    outputFileTime->dwHighDateTime = static_cast<DWORD>(value >> 32);
+    return TRUE;
+}
+#endif
+
+// Transitions are searched for a week at a time up to a year away; DST rules never change more often than that
+#define TRANSITION_STEP TIME_S(7ULL * 24 * 3600)
+#define TRANSITION_PROBES 53
+
+HRESULT LocalTimeConverter::Lookup(_In_ unsigned __int64 local, _Out_ signed __int64 *offset) {
+    // offsets are whole seconds, so a lookup on a whole second doesn't suffer from SYSTEMTIME's truncation
+    local -= local % TIME_S(1);
+
+    FILETIME input{
+        .dwLowDateTime = static_cast<DWORD>(local),
+        .dwHighDateTime = static_cast<DWORD>(local >> 32),
+    };
+    FILETIME output;
+    RETURN_IF_WIN32_BOOL_FALSE(TimeConvertFileTime(&input, &output, TimeConvertLocalToUniversal, nullptr));
+
+    auto universal = static_cast<unsigned __int64>(output.dwHighDateTime) << 32 | output.dwLowDateTime;
+    *offset = static_cast<signed __int64>(universal - local);
+    return S_OK;
+}
+
+HRESULT LocalTimeConverter::FindTransition(
+    _In_ unsigned __int64 local,
+    _In_ bool forward,
+    _Out_ unsigned __int64 *transition,
+    _Out_ unsigned __int64 *shift) {
+    unsigned __int64 inside = local, outside = 0;
+    signed __int64 outsideOffset = _offset;
+
+    for (int i = 1; i <= TRANSITION_PROBES; i++) {
+        if (!forward && local < i * TRANSITION_STEP)
+            break;
+        auto probe = forward ? local + i * TRANSITION_STEP : local - i * TRANSITION_STEP;
+
+        signed __int64 offset;
+        RETURN_IF_FAILED(Lookup(probe, &offset));
+        if (offset != _offset) {
+            outside = probe;
+            outsideOffset = offset;
+            break;
+        }
+        inside = probe;
+    }
+
+    if (outsideOffset == _offset) {
+        *transition = inside;
+        *shift = 0;
+        return S_OK;
+    }
+
+    // transitions happen on whole seconds, bisect down to that
+    while ((forward ? outside - inside : inside - outside) > TIME_S(1)) {
+        auto middle = (inside + outside) / 2;
+        middle -= middle % TIME_S(1);
+
+        signed __int64 offset;
+        RETURN_IF_FAILED(Lookup(middle, &offset));
+        if (offset == _offset)
+            inside = middle;
+        else
+            outside = middle;
+    }
+
+    // _end is exclusive, _begin inclusive
+    *transition = forward ? outside : inside;
+    *shift = static_cast<unsigned __int64>(outsideOffset > _offset ? outsideOffset - _offset : _offset - outsideOffset);
+    return S_OK;
+}
+
+HRESULT LocalTimeConverter::Refresh(_In_ unsigned __int64 local) {
+    _valid = false;
+
+    local -= local % TIME_S(1);
+    RETURN_IF_FAILED(Lookup(local, &_offset));
+    RETURN_IF_FAILED(FindTransition(local, true, &_end, &_endShift));
+    RETURN_IF_FAILED(FindTransition(local, false, &_begin, &_beginShift));
+
+    _validated = local;
+    _valid = true;
+    return S_OK;
+}
+
+HRESULT LocalTimeConverter::LocalToUniversal(
+    _In_ unsigned __int64 local,
+    _Out_ unsigned __int64 *universal,
+    _Out_ unsigned __int64 *dispersion) {
+    if (!_valid || local < _begin || local >= _end) {
+        RETURN_IF_FAILED(Refresh(local));
+    } else if ((local > _validated ? local - _validated : _validated - local) >= RevalidateInterval) {
+        signed __int64 offset;
+        RETURN_IF_FAILED(Lookup(local, &offset));
+        if (offset == _offset)
+            _validated = local;
+        else
+            RETURN_IF_FAILED(Refresh(local));
+    }
+
+    *universal = local + _offset;
+
+    // a local time within one DST shift of a transition may have been meant for the other side of it
+    *dispersion = 1;
+    if (local - _begin < _beginShift)
+        *dispersion = (std::max)(*dispersion, _beginShift);
+    if (_end - local <= _endShift)
+        *dispersion = (std::max)(*dispersion, _endShift);
+    return S_OK;
+}
+
+void LocalTimeConverter::Invalidate() {
+    _valid = false;
+}
@@ -1,7 +1,7 @@
 #pragma once
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "Platform.hpp"
+#include "Globals.hpp"
 
 typedef enum _TIME_CONVERT_FILE_TIME_DIRECTION {
     TimeConvertUniversalToLocal,
@@ -13,3 +13,45 @@ _Success_(return) BOOL TimeConvertFileTime(
     _Out_ LPFILETIME outputFileTime,
     _In_ TIME_CONVERT_FILE_TIME_DIRECTION direction,
     _In_opt_ PDYNAMIC_TIME_ZONE_INFORMATION dynamicTimeZone);
+
+// Converts local FILETIME values to UTC without losing resolution. The UTC offset is looked up once for the whole DST
+// interval around the value and then added to the raw 100 ns value directly, so conversions within the interval cost
+// nothing but the comparisons. The cached offset is checked against a fresh lookup every RevalidateInterval to pick up
+// time zone changes, or right away after Invalidate.
+//
+// Not thread-safe.
+class LocalTimeConverter {
+public:
+    static constexpr unsigned __int64 RevalidateInterval = TIME_S(60ULL);
+
+    LocalTimeConverter() = default;
+    LocalTimeConverter(const LocalTimeConverter &) = delete;
+    LocalTimeConverter &operator=(const LocalTimeConverter &) = delete;
+
+    // *dispersion is the uncertainty of the conversion itself: the 100 ns resolution, or the size of the DST shift for
+    // local times close enough to a transition to be ambiguous.
+    HRESULT LocalToUniversal(
+        _In_ unsigned __int64 local,
+        _Out_ unsigned __int64 *universal,
+        _Out_ unsigned __int64 *dispersion);
+    void Invalidate();
+
+private:
+    static HRESULT Lookup(_In_ unsigned __int64 local, _Out_ signed __int64 *offset);
+    HRESULT FindTransition(
+        _In_ unsigned __int64 local,
+        _In_ bool forward,
+        _Out_ unsigned __int64 *transition,
+        _Out_ unsigned __int64 *shift);
+    HRESULT Refresh(_In_ unsigned __int64 local);
+
+    bool _valid = false;
+    // [_begin, _end) in local time has UTC offset _offset
+    unsigned __int64 _begin = 0;
+    unsigned __int64 _end = 0;
+    signed __int64 _offset = 0;
+    // size of the offset change at either end of the interval, 0 if none was found within the search range
+    unsigned __int64 _beginShift = 0;
+    unsigned __int64 _endShift = 0;
+    unsigned __int64 _validated = 0;
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+// Minimal stand-ins for the Win32, TimeProv.h and WIL definitions used by the portable sampling core, so that it can
+// be built and benchmarked on non-Windows hosts against SimXenIface. Never included on Windows; see Platform.hpp.
+
+#include <cstdint>
+#include <cstddef>
+#include <cwchar>
+#include <new>
+
+#define __int64 long long
+#define __stdcall
+#define CALLBACK
+#define APIENTRY
+#define CONST const
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint16_t USHORT;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef int32_t HRESULT;
+typedef int BOOL;
+typedef uint8_t BOOLEAN;
+typedef char CHAR;
+typedef wchar_t WCHAR;
+typedef CHAR *PSTR;
+typedef const CHAR *PCSTR;
+typedef WCHAR *PWSTR;
+typedef const WCHAR *PCWSTR;
+typedef void *HANDLE;
+typedef void *PVOID;
+
+#define TRUE 1
+#define FALSE 0
+
+typedef struct _FILETIME {
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME, *PFILETIME, *LPFILETIME;
+
+typedef struct _DYNAMIC_TIME_ZONE_INFORMATION *PDYNAMIC_TIME_ZONE_INFORMATION;
+
+#define INVALID_HANDLE_VALUE (reinterpret_cast<HANDLE>(static_cast<intptr_t>(-1)))
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#define ARRAYSIZE(A) (sizeof(A) / sizeof((A)[0]))
+
+#define S_OK (static_cast<HRESULT>(0L))
+#define S_FALSE (static_cast<HRESULT>(1L))
+#define E_NOTIMPL (static_cast<HRESULT>(0x80004001L))
+#define E_POINTER (static_cast<HRESULT>(0x80004003L))
+#define E_ABORT (static_cast<HRESULT>(0x80004004L))
+#define E_FAIL (static_cast<HRESULT>(0x80004005L))
+#define E_UNEXPECTED (static_cast<HRESULT>(0x8000FFFFL))
+#define E_PENDING (static_cast<HRESULT>(0x8000000AL))
+#define E_OUTOFMEMORY (static_cast<HRESULT>(0x8007000EL))
+#define E_INVALIDARG (static_cast<HRESULT>(0x80070057L))
+
+#define SUCCEEDED(hr) ((static_cast<HRESULT>(hr)) >= 0)
+#define FAILED(hr) ((static_cast<HRESULT>(hr)) < 0)
+
+#define FACILITY_WIN32 7
+#define __HRESULT_FROM_WIN32(x) \
+    (static_cast<HRESULT>(x) <= 0 ? static_cast<HRESULT>(x) \
+                                  : static_cast<HRESULT>(((x) & 0x0000FFFF) | (FACILITY_WIN32 << 16) | 0x80000000))
+#define HRESULT_FROM_WIN32(x) __HRESULT_FROM_WIN32(x)
+
+#define ERROR_SUCCESS 0L
+#define ERROR_INVALID_FUNCTION 1L
+#define ERROR_FILE_NOT_FOUND 2L
+#define ERROR_INVALID_HANDLE 6L
+#define ERROR_NOT_READY 21L
+#define ERROR_GEN_FAILURE 31L
+#define ERROR_SHARING_VIOLATION 32L
+#define ERROR_NOT_SUPPORTED 50L
+#define ERROR_INVALID_PARAMETER 87L
+#define ERROR_INSUFFICIENT_BUFFER 122L
+#define ERROR_BUSY 170L
+#define ERROR_ALREADY_EXISTS 183L
+#define ERROR_OPERATION_ABORTED 995L
+#define ERROR_IO_PENDING 997L
+#define ERROR_DEVICE_NOT_CONNECTED 1167L
+#define ERROR_RETRY 1237L
+#define ERROR_REVISION_MISMATCH 1306L
+#define ERROR_TIMEOUT 1460L
+
+// SAL annotations
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _In_reads_(size)
+#define _In_reads_bytes_(size)
+#define _Out_writes_(size)
+#define _Out_writes_z_(size)
+#define _Out_writes_bytes_(size)
+#define _Success_(expr)
+#define _Guarded_by_(lock)
+#define _Requires_lock_held_(lock)
+#define _Pre_satisfies_(expr)
+#define _Analysis_assume_(expr)
+#define _Analysis_assume_lock_held_(lock)
+
+// WIL error handling subset
+#define RETURN_HR(hr) \
+    do { \
+        return (hr); \
+    } while (0)
+#define RETURN_IF_FAILED(expr) \
+    do { \
+        HRESULT __hrRet = (expr); \
+        if (FAILED(__hrRet)) \
+            return __hrRet; \
+    } while (0)
+#define RETURN_HR_IF(hr, condition) \
+    do { \
+        if (condition) \
+            return (hr); \
+    } while (0)
+#define RETURN_IF_WIN32_BOOL_FALSE(expr) RETURN_HR_IF(E_FAIL, !(expr))
+#define CATCH_RETURN() \
+    catch (const std::bad_alloc &) { \
+        return E_OUTOFMEMORY; \
+    } \
+    catch (...) { \
+        return E_FAIL; \
+    }
+
+#define _TRUNCATE (static_cast<size_t>(-1))
+
+template <size_t N> inline int wcsncpy_s(WCHAR (&dest)[N], PCWSTR src, size_t count) {
+    size_t limit = count == _TRUNCATE ? N - 1 : (count < N - 1 ? count : N - 1);
+    size_t i = 0;
+    for (; i < limit && src[i]; i++)
+        dest[i] = src[i];
+    dest[i] = 0;
+    return 0;
+}
+
+// TimeProv.h subset
+typedef void *TimeProvHandle;
+typedef void *TimeProvArgs;
+
+typedef enum TimeProvCmd {
+    TPC_TimeJumped,
+    TPC_UpdateConfig,
+    TPC_PollIntervalChanged,
+    TPC_GetSamples,
+    TPC_NetTopoChange,
+    TPC_Query,
+    TPC_Shutdown,
+} TimeProvCmd;
+
+typedef enum TimeSysInfo {
+    TSI_LastSyncTime,
+    TSI_ClockTickSize,
+    TSI_ClockPrecision,
+    TSI_CurrentTime,
+    TSI_PhaseOffset,
+    TSI_TickCount,
+    TSI_LeapFlags,
+    TSI_Stratum,
+    TSI_ReferenceIdentifier,
+    TSI_PollInterval,
+    TSI_RootDelay,
+    TSI_RootDispersion,
+    TSI_TSFlags,
+} TimeSysInfo;
+
+#define TSF_Hardware 0x00000001
+#define TSF_Authenticated 0x00000002
+
+typedef struct TimeSample {
+    DWORD dwSize;
+    DWORD dwRefid;
+    signed __int64 toOffset;
+    signed __int64 toDelay;
+    unsigned __int64 tpDispersion;
+    unsigned __int64 nSysTickCount;
+    signed __int64 nSysPhaseOffset;
+    BYTE nLeapFlags;
+    BYTE nStratum;
+    DWORD dwTSFlags;
+    WCHAR wszUniqueName[256];
+} TimeSample;
+
+struct SetProviderStatusInfo;
+
+typedef HRESULT(__stdcall GetTimeSysInfoFunc)(TimeSysInfo eInfo, void *pvInfo);
+typedef HRESULT(__stdcall LogTimeProvEventFunc)(WORD wType, WCHAR *wszFacility, WCHAR *wszMessage);
+typedef HRESULT(__stdcall AlertSamplesAvailFunc)(void);
+typedef HRESULT(__stdcall SetProviderStatusFunc)(SetProviderStatusInfo *pspsi);
+
+typedef struct TimeProvSysCallbacks {
+    DWORD dwSize;
+    GetTimeSysInfoFunc *pfnGetTimeSysInfo;
+    LogTimeProvEventFunc *pfnLogTimeProvEvent;
+    AlertSamplesAvailFunc *pfnAlertSamplesAvail;
+    SetProviderStatusFunc *pfnSetProviderStatus;
+} TimeProvSysCallbacks;
+
+typedef enum TimeJumpedFlags {
+    TJF_Default = 0,
+    TJF_UserRequested = 1,
+} TimeJumpedFlags;
+
+typedef struct TpcTimeJumpedArgs {
+    TimeJumpedFlags tjfFlags;
+} TpcTimeJumpedArgs;
+
+typedef struct TpcGetSamplesArgs {
+    BYTE *pbSampleBuf;
+    DWORD cbSampleBuf;
+    DWORD dwSamplesReturned;
+    DWORD dwSamplesAvailable;
+} TpcGetSamplesArgs;
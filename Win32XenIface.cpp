@@ -0,0 +1,750 @@
+#include <cstring>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+#include "Platform.hpp"
+#include <winioctl.h>
+#include <intrin.h>
+
+#include <wil/result.h>
+#include <wil/filesystem.h>
+
+#include "Logging.hpp"
+#include "PvClock.hpp"
+#include "Win32XenIface.hpp"
+#include "xeniface_ioctls.h"
+
+#define RETURN_IF_CR_FAILED(cr) \
+    do { \
+        CONFIGRET _cr = (cr); \
+        if (_cr != CR_SUCCESS) { \
+            return HRESULT_FROM_WIN32(CM_MapCrToWin32Err(_cr, ERROR_GEN_FAILURE)); \
+        } \
+    } while (0)
+
+#define THROW_IF_CR_FAILED(cr) \
+    do { \
+        CONFIGRET _cr = (cr); \
+        if (_cr != CR_SUCCESS) { \
+            THROW_HR(HRESULT_FROM_WIN32(CM_MapCrToWin32Err(_cr, ERROR_GEN_FAILURE))); \
+        } \
+    } while (0)
+
+static std::vector<std::wstring> ParseMultiStrings(_In_reads_(count) const WCHAR *buf, size_t count) {
+    std::vector<std::wstring> strings;
+    size_t first = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (buf[i] == 0) {
+            strings.emplace_back(buf + first, i - first);
+            first = i + 1;
+        }
+    }
+    if (!strings.empty() && strings.back().empty()) {
+        strings.pop_back();
+    }
+    return strings;
+}
+
+static HRESULT GetDeviceInterfaceList(
+    _Out_ std::vector<WCHAR> &list,
+    _In_ LPCGUID interfaceClassGuid,
+    _In_opt_ DEVINSTID_W deviceID,
+    _In_ ULONG flags) {
+    ULONG devListLen = 0;
+    CONFIGRET cr;
+
+    list.clear();
+
+    do {
+        cr = CM_Get_Device_Interface_List_Size(&devListLen, const_cast<LPGUID>(interfaceClassGuid), nullptr, flags);
+        if (cr != CR_SUCCESS)
+            DebugLog("CM_Get_Device_Interface_List_Size failed %x", cr);
+        RETURN_IF_CR_FAILED(cr);
+
+        list.resize(devListLen);
+
+        cr = CM_Get_Device_Interface_List(
+            const_cast<LPGUID>(interfaceClassGuid),
+            deviceID,
+            list.data(),
+            static_cast<ULONG>(list.size()),
+            flags);
+    } while (cr == CR_BUFFER_SMALL);
+    if (cr != CR_SUCCESS)
+        DebugLog("CM_Get_Device_Interface_List failed %x", cr);
+    RETURN_IF_CR_FAILED(cr);
+
+    return S_OK;
+}
+
+struct Win32XenIfaceNoOutput {};
+
+static std::optional<XenIfaceAction> MapCmAction(CM_NOTIFY_ACTION action) {
+    switch (action) {
+    case CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL:
+        return XenIfaceAction::InterfaceArrival;
+    case CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL:
+        return XenIfaceAction::InterfaceRemoval;
+    case CM_NOTIFY_ACTION_DEVICEQUERYREMOVE:
+        return XenIfaceAction::QueryRemove;
+    case CM_NOTIFY_ACTION_DEVICEQUERYREMOVEFAILED:
+        return XenIfaceAction::QueryRemoveFailed;
+    case CM_NOTIFY_ACTION_DEVICEREMOVEPENDING:
+        return XenIfaceAction::RemovePending;
+    case CM_NOTIFY_ACTION_DEVICEREMOVECOMPLETE:
+        return XenIfaceAction::RemoveComplete;
+    default:
+        return std::nullopt;
+    }
+}
+
+_Pre_satisfies_(eventDataSize >= sizeof(CM_NOTIFY_EVENT_DATA)) DWORD CALLBACK Win32XenIfaceDevice::DeviceHandleCallback(
+    _In_ HCMNOTIFICATION notifyHandle,
+    _In_opt_ PVOID context,
+    _In_ CM_NOTIFY_ACTION action,
+    _In_reads_bytes_(eventDataSize) PCM_NOTIFY_EVENT_DATA eventData,
+    _In_ DWORD eventDataSize) {
+    _Analysis_assume_(context);
+    // the last reference may be dropped while a notification is in flight; the destructor then waits for us
+    auto self = static_cast<Win32XenIfaceDevice *>(context)->weak_from_this().lock();
+
+    UNREFERENCED_PARAMETER(notifyHandle);
+    UNREFERENCED_PARAMETER(eventData);
+    UNREFERENCED_PARAMETER(eventDataSize);
+
+    if (!self)
+        return ERROR_SUCCESS;
+
+    auto mapped = MapCmAction(action);
+    if (mapped)
+        self->_events->OnDeviceEvent(self, *mapped);
+
+    return ERROR_SUCCESS;
+}
+
+VOID CALLBACK Win32XenIfaceDevice::ResumeCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID context,
+    _Inout_ PTP_WAIT wait,
+    _In_ TP_WAIT_RESULT waitResult) {
+    _Analysis_assume_(context);
+    auto self = static_cast<Win32XenIfaceDevice *>(context)->weak_from_this().lock();
+    // If ours turns out to be the last reference, the destructor runs on this thread and must not wait for us
+    DisassociateCurrentThreadFromCallback(instance);
+
+    UNREFERENCED_PARAMETER(waitResult);
+
+    if (!self)
+        return;
+
+    // waits fire once, rearm before anything else can signal the event
+    SetThreadpoolWait(wait, self->_resumeEvent.get(), nullptr);
+    self->_events->OnDeviceEvent(self, XenIfaceAction::Resume);
+}
+
+VOID CALLBACK Win32XenIfaceDevice::WatchCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID context,
+    _Inout_ PTP_WAIT wait,
+    _In_ TP_WAIT_RESULT waitResult) {
+    _Analysis_assume_(context);
+    auto self = static_cast<Win32XenIfaceDevice *>(context)->weak_from_this().lock();
+    DisassociateCurrentThreadFromCallback(instance);
+
+    UNREFERENCED_PARAMETER(waitResult);
+
+    if (!self)
+        return;
+
+    SetThreadpoolWait(wait, self->_watchEvent.get(), nullptr);
+    self->_events->OnDeviceEvent(self, XenIfaceAction::StoreChanged);
+}
+
+VOID CALLBACK Win32XenIfaceDevice::EventChannelCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID context,
+    _Inout_ PTP_WAIT wait,
+    _In_ TP_WAIT_RESULT waitResult) {
+    _Analysis_assume_(context);
+    auto self = static_cast<Win32XenIfaceDevice *>(context)->weak_from_this().lock();
+    DisassociateCurrentThreadFromCallback(instance);
+
+    UNREFERENCED_PARAMETER(waitResult);
+
+    if (!self)
+        return;
+
+    // the channel stays masked until unmasked, the next signal is for a notification after that
+    SetThreadpoolWait(wait, self->_channelEvent.get(), nullptr);
+    self->_events->OnDeviceEvent(self, XenIfaceAction::EventChannel);
+}
+
+VOID CALLBACK Win32XenIfaceDevice::IoCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID context,
+    _Inout_opt_ PVOID overlapped,
+    _In_ ULONG ioResult,
+    _In_ ULONG_PTR bytesTransferred,
+    _Inout_ PTP_IO io) {
+    _Analysis_assume_(overlapped);
+    // Completing may drop the last reference to the handle and with it this I/O object, which must not wait for us
+    DisassociateCurrentThreadFromCallback(instance);
+
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(bytesTransferred);
+    UNREFERENCED_PARAMETER(io);
+
+    auto request = static_cast<Win32XenIfaceOverlapped *>(static_cast<OVERLAPPED *>(overlapped))->Request;
+    request->Complete(HRESULT_FROM_WIN32(ioResult));
+}
+
+Win32XenIfaceRequest::Win32XenIfaceRequest(_In_ std::shared_ptr<Win32XenIfaceHandle> handle)
+    : _handle(std::move(handle)) {
+    _overlapped.Request = this;
+}
+
+void Win32XenIfaceRequest::Issue(
+    DWORD code,
+    _In_reads_bytes_opt_(inSize) const void *in,
+    DWORD inSize,
+    _Out_writes_bytes_opt_(outSize) void *out,
+    DWORD outSize) {
+    StartThreadpoolIo(_handle->Io.get());
+    auto file = _handle->File.get();
+    if (!DeviceIoControl(file, code, const_cast<void *>(in), inSize, out, outSize, nullptr, &_overlapped)) {
+        auto err = GetLastError();
+        if (err != ERROR_IO_PENDING) {
+            // nothing was queued to the completion port
+            CancelThreadpoolIo(_handle->Io.get());
+            Complete(HRESULT_FROM_WIN32(err));
+        }
+    }
+}
+
+void Win32XenIfaceDevice::Close() {
+    // Cancelling below also cancels the map request, which takes the page away, so turn its readers away first. No
+    // unmap IOCTL here: it could hold up the removal for as long as ControlTimeout.
+    auto mapping = _mapping.exchange(nullptr, std::memory_order_acq_rel);
+    if (mapping)
+        mapping->Revoke();
+
+    // Requests in flight, abandoned ones included, keep the file open until they complete. Cancel them so that doing
+    // so doesn't hold up a removal.
+    auto handle = _handle.exchange(nullptr, std::memory_order_acq_rel);
+    if (handle && !CancelIoEx(handle->File.get(), nullptr) && GetLastError() != ERROR_NOT_FOUND)
+        DebugLog("CancelIoEx failed %x", GetLastError());
+}
+
+void Win32XenIfaceRequest::Cancel() {
+    // ERROR_NOT_FOUND if it has completed in the meantime
+    if (!CancelIoEx(_handle->File.get(), &_overlapped) && GetLastError() != ERROR_NOT_FOUND)
+        DebugLog("CancelIoEx failed %x", GetLastError());
+}
+
+template <typename TOut>
+HRESULT Win32XenIfaceDevice::Ioctl(
+    DWORD code,
+    _In_reads_bytes_opt_(inSize) const void *in,
+    DWORD inSize,
+    XenIfaceDeadline deadline,
+    _Out_ TOut *out) {
+    // the output buffer belongs to the request, which may outlive this call if abandoned
+    struct Request : Win32XenIfaceRequest {
+        using Win32XenIfaceRequest::Win32XenIfaceRequest;
+        TOut Output{};
+    };
+
+    auto handle = GetHandle();
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE), !handle);
+
+    std::shared_ptr<Request> request;
+    try {
+        request = std::make_shared<Request>(std::move(handle));
+    }
+    CATCH_RETURN();
+    RETURN_IF_FAILED(request->Start(_inFlight));
+
+    if constexpr (std::is_empty_v<TOut>)
+        request->Issue(code, in, inSize, nullptr, 0);
+    else
+        request->Issue(code, in, inSize, &request->Output, static_cast<DWORD>(sizeof(TOut)));
+
+    auto hr = request->Wait(deadline);
+    if (FAILED(hr))
+        DebugLog("IOCTL %x failed %x", code, hr);
+    RETURN_IF_FAILED(hr);
+
+    *out = request->Output;
+    return S_OK;
+}
+
+Win32XenIfaceDevice::Win32XenIfaceDevice(
+    _In_ Private pvt,
+    _In_ wil::unique_hfile &&file,
+    _In_ const std::wstring &path,
+    _In_ IXenIfaceEvents *events)
+    : _path(path), _events(events) {
+    UNREFERENCED_PARAMETER(pvt);
+
+    auto handle = std::make_shared<Win32XenIfaceHandle>();
+    handle->File = std::move(file);
+    handle->Io.reset(CreateThreadpoolIo(handle->File.get(), &IoCallback, nullptr, nullptr));
+    THROW_LAST_ERROR_IF_NULL(handle->Io.get());
+    _handle.store(std::move(handle), std::memory_order_release);
+
+    CM_NOTIFY_FILTER filter{
+        .cbSize = sizeof(CM_NOTIFY_FILTER),
+        .Flags = 0,
+        .FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEHANDLE,
+        .Reserved = 0,
+        .u = {.DeviceHandle = {.hTarget = GetHandle()->File.get()}},
+    };
+    auto cr = CM_Register_Notification(&filter, this, &DeviceHandleCallback, &_listener);
+    if (cr != CR_SUCCESS)
+        DebugLog("CM_Register_Notification failed %x", cr);
+    THROW_IF_CR_FAILED(cr);
+
+    // not fatal, the provider merely reacts to migrations more slowly
+    auto hr = RegisterResume();
+    if (FAILED(hr))
+        DebugLog("RegisterResume failed %x", hr);
+}
+
+Win32XenIfaceDevice::~Win32XenIfaceDevice() {
+    _resumeWait.reset();
+    DeregisterResume();
+    _watchWait.reset();
+    RemoveWatch();
+    CloseEventChannel();
+    // the pending map request holds the handle open, it would never be closed otherwise
+    UnmapHostTimePage();
+}
+
+HRESULT Win32XenIfaceDevice::make(
+    _Out_ std::shared_ptr<IXenIfaceDevice> &object,
+    _In_ wil::unique_hfile &&file,
+    _In_ const std::wstring &path,
+    _In_ IXenIfaceEvents *events) {
+    try {
+        object = std::make_shared<Win32XenIfaceDevice>(Private(), std::move(file), path, events);
+    }
+    CATCH_RETURN();
+    return S_OK;
+}
+
+HRESULT Win32XenIfaceDevice::RegisterResume() {
+    RETURN_IF_FAILED(_resumeEvent.create(wil::EventOptions::None));
+    _resumeWait.reset(CreateThreadpoolWait(&ResumeCallback, this, nullptr));
+    RETURN_LAST_ERROR_IF_NULL(_resumeWait.get());
+
+    XENIFACE_SUSPEND_REGISTER_IN in{.Event = _resumeEvent.get()};
+    XENIFACE_SUSPEND_REGISTER_OUT out;
+
+    RETURN_IF_FAILED(Ioctl(
+        IOCTL_XENIFACE_SUSPEND_REGISTER,
+        &in,
+        sizeof(in),
+        std::chrono::steady_clock::now() + ControlTimeout,
+        &out));
+
+    _resumeContext = out.Context;
+    SetThreadpoolWait(_resumeWait.get(), _resumeEvent.get(), nullptr);
+    return S_OK;
+}
+
+void Win32XenIfaceDevice::DeregisterResume() {
+    // xeniface drops the registration along with the handle if that is already closed
+    if (!_resumeContext || !GetHandle())
+        return;
+
+    XENIFACE_SUSPEND_REGISTER_OUT in{.Context = _resumeContext};
+    Win32XenIfaceNoOutput none;
+
+    (void)Ioctl(
+        IOCTL_XENIFACE_SUSPEND_DEREGISTER,
+        &in,
+        sizeof(in),
+        std::chrono::steady_clock::now() + ControlTimeout,
+        &none);
+    _resumeContext = nullptr;
+}
+
+HRESULT Win32XenIfaceDevice::WatchStore(_In_ PCSTR path) {
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), _watchContext != nullptr);
+
+    // the driver reads the path through the pointer in the input, keep it around
+    try {
+        _watchPath = path;
+    }
+    CATCH_RETURN();
+    RETURN_IF_FAILED(_watchEvent.create(wil::EventOptions::None));
+    _watchWait.reset(CreateThreadpoolWait(&WatchCallback, this, nullptr));
+    RETURN_LAST_ERROR_IF_NULL(_watchWait.get());
+
+    XENIFACE_STORE_ADD_WATCH_IN in{
+        .Path = _watchPath.data(),
+        .PathLength = static_cast<ULONG>(_watchPath.size() + 1),
+        .Event = _watchEvent.get(),
+    };
+    XENIFACE_STORE_ADD_WATCH_OUT out;
+
+    // armed first, XenStore fires the watch as soon as it is set
+    SetThreadpoolWait(_watchWait.get(), _watchEvent.get(), nullptr);
+    auto hr = Ioctl(
+        IOCTL_XENIFACE_STORE_ADD_WATCH,
+        &in,
+        sizeof(in),
+        std::chrono::steady_clock::now() + ControlTimeout,
+        &out);
+    if (FAILED(hr)) {
+        _watchWait.reset();
+        return hr;
+    }
+
+    _watchContext = out.Context;
+    return S_OK;
+}
+
+void Win32XenIfaceDevice::RemoveWatch() {
+    // xeniface drops the watch along with the handle if that is already closed
+    if (!_watchContext || !GetHandle())
+        return;
+
+    XENIFACE_STORE_REMOVE_WATCH_IN in{.Context = _watchContext};
+    Win32XenIfaceNoOutput none;
+
+    (void)Ioctl(
+        IOCTL_XENIFACE_STORE_REMOVE_WATCH,
+        &in,
+        sizeof(in),
+        std::chrono::steady_clock::now() + ControlTimeout,
+        &none);
+    _watchContext = nullptr;
+}
+
+HRESULT Win32XenIfaceDevice::BindEventChannel(USHORT remoteDomain, ULONG remotePort, XenIfaceDeadline deadline) {
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), _localPort.has_value());
+
+    RETURN_IF_FAILED(_channelEvent.create(wil::EventOptions::None));
+    _channelWait.reset(CreateThreadpoolWait(&EventChannelCallback, this, nullptr));
+    RETURN_LAST_ERROR_IF_NULL(_channelWait.get());
+
+    XENIFACE_EVTCHN_BIND_INTERDOMAIN_IN in{
+        .RemoteDomain = remoteDomain,
+        .RemotePort = remotePort,
+        .Mask = FALSE,
+        .Event = _channelEvent.get(),
+    };
+    XENIFACE_EVTCHN_BIND_INTERDOMAIN_OUT out;
+
+    SetThreadpoolWait(_channelWait.get(), _channelEvent.get(), nullptr);
+    auto hr = Ioctl(IOCTL_XENIFACE_EVTCHN_BIND_INTERDOMAIN, &in, sizeof(in), deadline, &out);
+    if (FAILED(hr)) {
+        _channelWait.reset();
+        return hr;
+    }
+
+    _localPort = out.LocalPort;
+    return S_OK;
+}
+
+HRESULT Win32XenIfaceDevice::UnmaskEventChannel(XenIfaceDeadline deadline) {
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_READY), !_localPort);
+
+    XENIFACE_EVTCHN_UNMASK_IN in{.LocalPort = *_localPort};
+    Win32XenIfaceNoOutput none;
+
+    RETURN_IF_FAILED(Ioctl(IOCTL_XENIFACE_EVTCHN_UNMASK, &in, sizeof(in), deadline, &none));
+    return S_OK;
+}
+
+void Win32XenIfaceDevice::CloseEventChannel() {
+    _channelWait.reset();
+    // xeniface closes the channel along with the handle if that is already closed
+    if (!_localPort || !GetHandle()) {
+        _localPort.reset();
+        return;
+    }
+
+    XENIFACE_EVTCHN_CLOSE_IN in{.LocalPort = *_localPort};
+    Win32XenIfaceNoOutput none;
+
+    (void)Ioctl(
+        IOCTL_XENIFACE_EVTCHN_CLOSE,
+        &in,
+        sizeof(in),
+        std::chrono::steady_clock::now() + ControlTimeout,
+        &none);
+    _localPort.reset();
+}
+
+HRESULT Win32XenIfaceDevice::GetHostTime(_Out_ FILETIME *time, XenIfaceDeadline deadline) {
+    XENIFACE_SHAREDINFO_GET_HOST_TIME_OUT buffer;
+
+    RETURN_IF_FAILED(Ioctl(IOCTL_XENIFACE_SHAREDINFO_GET_HOST_TIME, nullptr, 0, deadline, &buffer));
+
+    *time = buffer.Time;
+    return S_OK;
+}
+
+HRESULT Win32XenIfaceDevice::GetTime(_Out_ FILETIME *time, _Out_ bool *local, XenIfaceDeadline deadline) {
+    XENIFACE_SHAREDINFO_GET_TIME_OUT buffer;
+
+    RETURN_IF_FAILED(Ioctl(IOCTL_XENIFACE_SHAREDINFO_GET_TIME, nullptr, 0, deadline, &buffer));
+
+    *time = buffer.Time;
+    *local = buffer.Local;
+    return S_OK;
+}
+
+HRESULT Win32XenIfaceDevice::GetSuspendCount(_Out_ ULONG *count, XenIfaceDeadline deadline) {
+    RETURN_IF_FAILED(Ioctl(IOCTL_XENIFACE_SUSPEND_GET_COUNT, nullptr, 0, deadline, count));
+    return S_OK;
+}
+
+static_assert(IXenIfaceDevice::MaxLogLength == XENIFACE_LOG_MAX_LENGTH);
+
+HRESULT Win32XenIfaceDevice::Log(_In_ PCSTR message, XenIfaceDeadline deadline) {
+    Win32XenIfaceNoOutput none;
+
+    // METHOD_BUFFERED, the message is copied before DeviceIoControl returns
+    RETURN_IF_FAILED(Ioctl(IOCTL_XENIFACE_LOG, message, static_cast<DWORD>(strlen(message) + 1), deadline, &none));
+    return S_OK;
+}
+
+HRESULT Win32XenIfaceDevice::StoreWrite(_In_ PCSTR path, _In_ PCSTR value, XenIfaceDeadline deadline) {
+    Win32XenIfaceNoOutput none;
+    std::vector<CHAR> in;
+
+    // path, NUL, value, NUL, NUL
+    try {
+        auto pathLength = strlen(path), valueLength = strlen(value);
+        in.resize(pathLength + valueLength + 3);
+        memcpy(in.data(), path, pathLength);
+        memcpy(in.data() + pathLength + 1, value, valueLength);
+    }
+    CATCH_RETURN();
+
+    RETURN_IF_FAILED(
+        Ioctl(IOCTL_XENIFACE_STORE_WRITE, in.data(), static_cast<DWORD>(in.size()), deadline, &none));
+    return S_OK;
+}
+
+// XENSTORE_PAYLOAD_MAX and the NUL
+struct Win32XenIfaceStoreValue {
+    CHAR Value[4096 + 1];
+};
+
+HRESULT Win32XenIfaceDevice::StoreRead(_In_ PCSTR path, _Out_ std::string &value, XenIfaceDeadline deadline) {
+    Win32XenIfaceStoreValue out;
+
+    RETURN_IF_FAILED(Ioctl(IOCTL_XENIFACE_STORE_READ, path, static_cast<DWORD>(strlen(path) + 1), deadline, &out));
+
+    out.Value[ARRAYSIZE(out.Value) - 1] = 0;
+    try {
+        value = out.Value;
+    }
+    CATCH_RETURN();
+    return S_OK;
+}
+
+// METHOD_NEITHER: the driver works on the buffers in place, and pends the request for as long as the page is mapped
+struct Win32XenIfaceMapRequest : Win32XenIfaceRequest {
+    using Win32XenIfaceRequest::Win32XenIfaceRequest;
+    using Win32XenIfaceRequest::Cancel;
+
+    XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN_V2 Input{};
+    XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_OUT_V2 Output{};
+};
+
+class Win32XenIfaceHostTimePage : public IXenHostTimePage {
+public:
+    explicit Win32XenIfaceHostTimePage(_In_ std::shared_ptr<Win32XenIfaceMapRequest> request)
+        : _request(std::move(request)) {}
+
+    const PvClockHostTime *Acquire() override {
+        if (!_pin.Acquire())
+            return nullptr;
+        return static_cast<const PvClockHostTime *>(_request->Output.Address);
+    }
+    void Release() override {
+        _pin.Release();
+    }
+    uint64_t ReadTsc() const override {
+        return __rdtsc();
+    }
+
+    // Waits for reads in progress and turns away those to come, then hands over the map request for unmapping the
+    // page. Readers may hold on to the mapping for a while, but not to the request and with it the handle.
+    std::shared_ptr<Win32XenIfaceMapRequest> Revoke() {
+        _pin.Revoke();
+        return std::move(_request);
+    }
+
+private:
+    PvClockPin _pin;
+    std::shared_ptr<Win32XenIfaceMapRequest> _request;
+};
+
+HRESULT Win32XenIfaceDevice::MapHostTimePage(
+    USHORT remoteDomain,
+    ULONG reference,
+    _Out_ std::shared_ptr<IXenHostTimePage> &page) {
+    page.reset();
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), _mapping.load(std::memory_order_acquire) != nullptr);
+
+    auto handle = GetHandle();
+    RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE), !handle);
+
+    std::shared_ptr<Win32XenIfaceMapRequest> request;
+    std::shared_ptr<Win32XenIfaceHostTimePage> mapping;
+    try {
+        request = std::make_shared<Win32XenIfaceMapRequest>(std::move(handle));
+        mapping = std::make_shared<Win32XenIfaceHostTimePage>(request);
+    }
+    CATCH_RETURN();
+
+    request->Input = XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN_V2{
+        .RemoteDomain = remoteDomain,
+        .NumberPages = 1,
+        .Flags = XENIFACE_GNTTAB_READONLY,
+        .NotifyOffset = 0,
+        .NotifyPort = 0,
+        .References = {reference},
+    };
+    RETURN_IF_FAILED(request->Start(_inFlight));
+    request->Issue(
+        IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_V2,
+        &request->Input,
+        static_cast<DWORD>(sizeof(request->Input)),
+        &request->Output,
+        static_cast<DWORD>(sizeof(request->Output)));
+
+    // The address is filled in before the request pends; one that completes without it has failed, if not
+    // necessarily by the time DeviceIoControl returns.
+    if (!request->Output.Address) {
+        auto hr = request->Wait(std::chrono::steady_clock::now() + ControlTimeout);
+        DebugLog("IOCTL %x failed %x", IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_V2, hr);
+        return FAILED(hr) ? hr : E_UNEXPECTED;
+    }
+
+    std::shared_ptr<Win32XenIfaceHostTimePage> none;
+    if (!_mapping.compare_exchange_strong(none, mapping, std::memory_order_acq_rel)) {
+        request->Cancel();
+        return HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+    }
+    // Close may have come and gone meanwhile
+    if (!IsOpen()) {
+        UnmapHostTimePage();
+        return HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE);
+    }
+
+    page = std::move(mapping);
+    return S_OK;
+}
+
+void Win32XenIfaceDevice::UnmapHostTimePage() {
+    auto mapping = _mapping.exchange(nullptr, std::memory_order_acq_rel);
+    if (!mapping)
+        return;
+
+    auto request = mapping->Revoke();
+
+    XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES_IN_V2 in{.Address = request->Output.Address};
+    Win32XenIfaceNoOutput none;
+
+    auto hr = HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE);
+    if (GetHandle())
+        hr = Ioctl(
+            IOCTL_XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES_V2,
+            &in,
+            sizeof(in),
+            std::chrono::steady_clock::now() + ControlTimeout,
+            &none);
+    // the map request completes once the page is unmapped, and cancelling it unmaps the page as well
+    if (FAILED(hr))
+        request->Cancel();
+}
+
+HRESULT Win32XenIfaceDevice::GetSharedTimePage(_Out_ std::shared_ptr<IXenSharedTimePage> &page) {
+    // xeniface has no interface for mapping shared_info into user mode
+    page.reset();
+    return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+}
+
+_Pre_satisfies_(eventDataSize >= sizeof(CM_NOTIFY_EVENT_DATA)) DWORD CALLBACK Win32XenIfacePlatform::CmListenerCallback(
+    _In_ HCMNOTIFICATION notifyHandle,
+    _In_opt_ PVOID context,
+    _In_ CM_NOTIFY_ACTION action,
+    _In_reads_bytes_(eventDataSize) PCM_NOTIFY_EVENT_DATA eventData,
+    _In_ DWORD eventDataSize) {
+    _Analysis_assume_(context);
+    auto self = static_cast<Win32XenIfacePlatform *>(context);
+
+    UNREFERENCED_PARAMETER(notifyHandle);
+    UNREFERENCED_PARAMETER(eventData);
+    UNREFERENCED_PARAMETER(eventDataSize);
+
+    auto mapped = MapCmAction(action);
+    if (mapped)
+        self->_events->OnInterfaceEvent(*mapped);
+
+    return ERROR_SUCCESS;
+}
+
+HRESULT Win32XenIfacePlatform::Subscribe(_In_ IXenIfaceEvents *events) {
+    CM_NOTIFY_FILTER filter{
+        .cbSize = sizeof(CM_NOTIFY_FILTER),
+        .Flags = 0,
+        .FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE,
+        .Reserved = 0,
+        .u = {.DeviceInterface = {.ClassGuid = GUID_INTERFACE_XENIFACE}},
+    };
+
+    _events = events;
+    auto cr = CM_Register_Notification(&filter, this, &CmListenerCallback, &_listener);
+    if (cr != CR_SUCCESS)
+        DebugLog("CM_Register_Notification failed %x", cr);
+    RETURN_IF_CR_FAILED(cr);
+
+    return S_OK;
+}
+
+void Win32XenIfacePlatform::Unsubscribe() {
+    // CM_Unregister_Notification waits for callbacks to finish
+    _listener.reset();
+    _events = nullptr;
+}
+
+HRESULT Win32XenIfacePlatform::Enumerate(_Out_ std::vector<std::wstring> &interfaces) {
+    std::vector<WCHAR> buffer;
+
+    interfaces.clear();
+
+    auto hr = GetDeviceInterfaceList(buffer, &GUID_INTERFACE_XENIFACE, nullptr, CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+    if (FAILED(hr))
+        DebugLog("GetDeviceInterfaceList failed %x", hr);
+    RETURN_IF_FAILED(hr);
+
+    try {
+        interfaces = ParseMultiStrings(buffer.data(), buffer.size());
+    }
+    CATCH_RETURN();
+    return S_OK;
+}
+
+HRESULT Win32XenIfacePlatform::Open(
+    _In_ const std::wstring &path,
+    _In_ IXenIfaceEvents *events,
+    _Out_ std::shared_ptr<IXenIfaceDevice> &device) {
+    auto [newHandle, err] =
+        wil::try_open_file(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED);
+    if (!newHandle.is_valid())
+        DebugLog("open(%S) failed %x", path.c_str(), err);
+    RETURN_HR_IF(HRESULT_FROM_WIN32(err), !newHandle.is_valid());
+
+    RETURN_IF_FAILED(Win32XenIfaceDevice::make(device, std::move(newHandle), path, events));
+
+    return S_OK;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Platform.hpp"
+#include <cfgmgr32.h>
+
+#include <wil/resource.h>
+
+#include "XenIface.hpp"
+#include "XenIfaceRequest.hpp"
+
+// A device handle opened for overlapped I/O, with completions delivered to the thread pool
+struct Win32XenIfaceHandle {
+    wil::unique_hfile File;
+    // closed first, see Win32XenIfaceDevice::IoCallback
+    wil::unique_threadpool_io Io;
+};
+
+class Win32XenIfaceRequest;
+
+// The completion callback gets the OVERLAPPED back, and from it the request
+struct Win32XenIfaceOverlapped : OVERLAPPED {
+    Win32XenIfaceRequest *Request;
+};
+
+// An IOCTL on the handle it holds, which stays open until the request completes
+class Win32XenIfaceRequest : public XenIfaceRequest {
+public:
+    explicit Win32XenIfaceRequest(_In_ std::shared_ptr<Win32XenIfaceHandle> handle);
+
+    // After Start. Completes the request right away if the IOCTL cannot be issued.
+    void Issue(
+        DWORD code,
+        _In_reads_bytes_opt_(inSize) const void *in,
+        DWORD inSize,
+        _Out_writes_bytes_opt_(outSize) void *out,
+        DWORD outSize);
+
+protected:
+    void Cancel() override;
+
+private:
+    std::shared_ptr<Win32XenIfaceHandle> _handle;
+    Win32XenIfaceOverlapped _overlapped{};
+};
+
+class Win32XenIfaceHostTimePage;
+
+class Win32XenIfaceDevice : public IXenIfaceDevice, public std::enable_shared_from_this<Win32XenIfaceDevice> {
+private:
+    struct Private {
+        explicit Private() = default;
+    };
+
+public:
+    // for requests that don't come with a deadline of their own
+    static constexpr std::chrono::seconds ControlTimeout{5};
+
+    // file must have been opened with FILE_FLAG_OVERLAPPED
+    Win32XenIfaceDevice(
+        _In_ Private pvt,
+        _In_ wil::unique_hfile &&file,
+        _In_ const std::wstring &path,
+        _In_ IXenIfaceEvents *events);
+
+    static HRESULT make(
+        _Out_ std::shared_ptr<IXenIfaceDevice> &device,
+        _In_ wil::unique_hfile &&file,
+        _In_ const std::wstring &path,
+        _In_ IXenIfaceEvents *events);
+
+    ~Win32XenIfaceDevice();
+    Win32XenIfaceDevice(const Win32XenIfaceDevice &) = delete;
+    Win32XenIfaceDevice &operator=(const Win32XenIfaceDevice &) = delete;
+
+    const std::wstring &GetPath() const override {
+        return _path;
+    }
+    bool IsOpen() const override {
+        return _handle.load(std::memory_order_acquire) != nullptr;
+    }
+    // An IOCTL in flight keeps its own reference, so the handle is actually closed once it completes. Until then the
+    // handle value cannot be recycled under it. A mapped host time page is unmapped first, once its readers are out.
+    void Close() override;
+
+    HRESULT GetHostTime(_Out_ FILETIME *time, XenIfaceDeadline deadline) override;
+    HRESULT GetTime(_Out_ FILETIME *time, _Out_ bool *local, XenIfaceDeadline deadline) override;
+    HRESULT GetSuspendCount(_Out_ ULONG *count, XenIfaceDeadline deadline) override;
+    HRESULT Log(_In_ PCSTR message, XenIfaceDeadline deadline) override;
+    HRESULT StoreWrite(_In_ PCSTR path, _In_ PCSTR value, XenIfaceDeadline deadline) override;
+    HRESULT StoreRead(_In_ PCSTR path, _Out_ std::string &value, XenIfaceDeadline deadline) override;
+    HRESULT WatchStore(_In_ PCSTR path) override;
+    HRESULT BindEventChannel(USHORT remoteDomain, ULONG remotePort, XenIfaceDeadline deadline) override;
+    HRESULT UnmaskEventChannel(XenIfaceDeadline deadline) override;
+    void CloseEventChannel() override;
+    HRESULT MapHostTimePage(USHORT remoteDomain, ULONG reference, _Out_ std::shared_ptr<IXenHostTimePage> &page)
+        override;
+    void UnmapHostTimePage() override;
+    HRESULT GetSharedTimePage(_Out_ std::shared_ptr<IXenSharedTimePage> &page) override;
+
+private:
+    _Pre_satisfies_(eventDataSize >= sizeof(CM_NOTIFY_EVENT_DATA)) static DWORD CALLBACK DeviceHandleCallback(
+        _In_ HCMNOTIFICATION notifyHandle,
+        _In_opt_ PVOID context,
+        _In_ CM_NOTIFY_ACTION action,
+        _In_reads_bytes_(eventDataSize) PCM_NOTIFY_EVENT_DATA eventData,
+        _In_ DWORD eventDataSize);
+
+    static VOID CALLBACK ResumeCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE instance,
+        _Inout_opt_ PVOID context,
+        _Inout_ PTP_WAIT wait,
+        _In_ TP_WAIT_RESULT waitResult);
+
+    static VOID CALLBACK WatchCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE instance,
+        _Inout_opt_ PVOID context,
+        _Inout_ PTP_WAIT wait,
+        _In_ TP_WAIT_RESULT waitResult);
+
+    static VOID CALLBACK EventChannelCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE instance,
+        _Inout_opt_ PVOID context,
+        _Inout_ PTP_WAIT wait,
+        _In_ TP_WAIT_RESULT waitResult);
+
+    static VOID CALLBACK IoCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE instance,
+        _Inout_opt_ PVOID context,
+        _Inout_opt_ PVOID overlapped,
+        _In_ ULONG ioResult,
+        _In_ ULONG_PTR bytesTransferred,
+        _Inout_ PTP_IO io);
+
+    std::shared_ptr<Win32XenIfaceHandle> GetHandle() const {
+        return _handle.load(std::memory_order_acquire);
+    }
+    // Issues the IOCTL and waits for it until the deadline; TOut is empty for IOCTLs without output
+    template <typename TOut>
+    HRESULT Ioctl(
+        DWORD code,
+        _In_reads_bytes_opt_(inSize) const void *in,
+        DWORD inSize,
+        XenIfaceDeadline deadline,
+        _Out_ TOut *out);
+    HRESULT RegisterResume();
+    void DeregisterResume();
+    void RemoveWatch();
+
+    wil::unique_hcmnotification _listener;
+    // IOCTL_XENIFACE_SUSPEND_REGISTER
+    wil::unique_event_nothrow _resumeEvent;
+    wil::unique_threadpool_wait _resumeWait;
+    PVOID _resumeContext = nullptr;
+    // IOCTL_XENIFACE_STORE_ADD_WATCH
+    std::string _watchPath;
+    wil::unique_event_nothrow _watchEvent;
+    wil::unique_threadpool_wait _watchWait;
+    PVOID _watchContext = nullptr;
+    // IOCTL_XENIFACE_EVTCHN_BIND_INTERDOMAIN
+    wil::unique_event_nothrow _channelEvent;
+    wil::unique_threadpool_wait _channelWait;
+    std::optional<ULONG> _localPort;
+    // IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_V2: unmapped by UnmapHostTimePage, or by Close cancelling the request
+    std::atomic<std::shared_ptr<Win32XenIfaceHostTimePage>> _mapping;
+    std::atomic<std::shared_ptr<Win32XenIfaceHandle>> _handle;
+    XenIfaceInFlight _inFlight = std::make_shared<std::atomic<unsigned int>>(0);
+    std::wstring _path;
+    IXenIfaceEvents *_events;
+};
+
+class Win32XenIfacePlatform : public IXenIfacePlatform {
+public:
+    Win32XenIfacePlatform() = default;
+    Win32XenIfacePlatform(const Win32XenIfacePlatform &) = delete;
+    Win32XenIfacePlatform &operator=(const Win32XenIfacePlatform &) = delete;
+
+    HRESULT Subscribe(_In_ IXenIfaceEvents *events) override;
+    void Unsubscribe() override;
+    HRESULT Enumerate(_Out_ std::vector<std::wstring> &interfaces) override;
+    HRESULT Open(
+        _In_ const std::wstring &path,
+        _In_ IXenIfaceEvents *events,
+        _Out_ std::shared_ptr<IXenIfaceDevice> &device) override;
+
+private:
+    _Pre_satisfies_(eventDataSize >= sizeof(CM_NOTIFY_EVENT_DATA)) static DWORD CALLBACK CmListenerCallback(
+        _In_ HCMNOTIFICATION notifyHandle,
+        _In_opt_ PVOID context,
+        _In_ CM_NOTIFY_ACTION action,
+        _In_reads_bytes_(eventDataSize) PCM_NOTIFY_EVENT_DATA eventData,
+        _In_ DWORD eventDataSize);
+
+    IXenIfaceEvents *_events = nullptr;
+    wil::unique_hcmnotification _listener;
+};
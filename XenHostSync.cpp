@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#include "XenHostSync.hpp"
+
+static constexpr unsigned int HostSyncStratumShift = 58;
+static constexpr unsigned int HostSyncLeapShift = 56;
+static constexpr unsigned __int64 HostSyncValid = 1ULL << 63;
+static constexpr unsigned __int64 HostSyncMaxDispersion = (1ULL << HostSyncLeapShift) - 1;
+
+static bool HostSyncIsField(_In_ PCSTR name, size_t length, _In_ PCSTR field) {
+    return length == strlen(field) && !strncmp(name, field, length);
+}
+
+HRESULT XenHostSync::Parse(_In_ PCSTR value, _Out_ XenHostSyncState *state) {
+    bool stratum = false, leap = false;
+
+    *state = XenHostSyncState{};
+    while (*value) {
+        if (*value == ' ') {
+            value++;
+            continue;
+        }
+
+        auto name = value;
+        while (*value && *value != '=' && *value != ' ')
+            value++;
+        RETURN_HR_IF(E_INVALIDARG, *value != '=');
+        auto length = static_cast<size_t>(value - name);
+        value++;
+
+        // strtoull would take signs and leading blanks
+        RETURN_HR_IF(E_INVALIDARG, !isdigit(static_cast<unsigned char>(*value)));
+        char *end;
+        auto number = strtoull(value, &end, 10);
+        RETURN_HR_IF(E_INVALIDARG, *end && *end != ' ');
+        value = end;
+
+        if (HostSyncIsField(name, length, "stratum")) {
+            RETURN_HR_IF(E_INVALIDARG, number > XenHostSyncState::MaxStratum + 1);
+            state->Stratum = static_cast<unsigned int>(number);
+            stratum = true;
+        } else if (HostSyncIsField(name, length, "leap")) {
+            RETURN_HR_IF(E_INVALIDARG, number > XenHostLeapUnsynchronized);
+            state->Leap = static_cast<XenHostLeap>(number);
+            leap = true;
+        } else if (HostSyncIsField(name, length, "dispersion")) {
+            state->Dispersion = (std::min)(number / 100, HostSyncMaxDispersion);
+        }
+    }
+
+    RETURN_HR_IF(E_INVALIDARG, !stratum || !leap);
+    state->Valid = true;
+    return S_OK;
+}
+
+// Neither port 0 nor grant reference 0 is ever handed out
+static HRESULT HostSyncParseId(_In_ PCSTR value, _Out_ ULONG *id) {
+    *id = 0;
+    RETURN_HR_IF(E_INVALIDARG, !isdigit(static_cast<unsigned char>(*value)));
+    char *end;
+    auto number = strtoull(value, &end, 10);
+    RETURN_HR_IF(E_INVALIDARG, *end || number == 0 || number > (std::numeric_limits<ULONG>::max)());
+    *id = static_cast<ULONG>(number);
+    return S_OK;
+}
+
+HRESULT XenHostSync::ParseEventChannel(_In_ PCSTR value, _Out_ ULONG *port) {
+    return HostSyncParseId(value, port);
+}
+
+HRESULT XenHostSync::ParseTimePage(_In_ PCSTR value, _Out_ ULONG *reference) {
+    return HostSyncParseId(value, reference);
+}
+
+XenHostSyncState XenHostSync::Get() const {
+    auto packed = _packed.load(std::memory_order_acquire);
+    if (!(packed & HostSyncValid))
+        return XenHostSyncState{};
+
+    return XenHostSyncState{
+        .Valid = true,
+        .Stratum = static_cast<unsigned int>((packed >> HostSyncStratumShift) & 0x1f),
+        .Leap = static_cast<XenHostLeap>((packed >> HostSyncLeapShift) & 0x3),
+        .Dispersion = packed & HostSyncMaxDispersion,
+    };
+}
+
+void XenHostSync::Set(_In_ const XenHostSyncState &state) {
+    if (!state.Valid) {
+        Clear();
+        return;
+    }
+
+    _packed.store(
+        HostSyncValid | static_cast<unsigned __int64>(state.Stratum & 0x1f) << HostSyncStratumShift |
+            static_cast<unsigned __int64>(state.Leap & 0x3) << HostSyncLeapShift |
+            (std::min)(state.Dispersion, HostSyncMaxDispersion),
+        std::memory_order_release);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+
+#include "Platform.hpp"
+
+// NTP leap indicator
+enum XenHostLeap : unsigned int {
+    XenHostLeapNone = 0,
+    XenHostLeapInsert = 1,
+    XenHostLeapDelete = 2,
+    XenHostLeapUnsynchronized = 3,
+};
+
+// How well dom0's own clock is synchronized, as it last published it
+struct XenHostSyncState {
+    // NTP stratum 16 is unsynchronized
+    static constexpr unsigned int MaxStratum = 15;
+
+    // false while dom0 publishes nothing usable
+    bool Valid = false;
+    unsigned int Stratum = 0;
+    XenHostLeap Leap = XenHostLeapUnsynchronized;
+    // root dispersion, in 100 ns
+    unsigned __int64 Dispersion = 0;
+
+    bool IsSynchronized() const {
+        return Leap != XenHostLeapUnsynchronized && Stratum <= MaxStratum;
+    }
+};
+
+// What dom0's time service tells the guest through its XenStore, under control/xentimeprovider:
+//
+//   host-sync       dom0's sync state as a single key, so that it changes atomically, e.g.
+//                   "stratum=2 dispersion=1500000 leap=0": the stratum of the host's clock, its root dispersion in ns
+//                   and the NTP leap indicator. Fields may come in any order and unknown ones are ignored; dispersion
+//                   defaults to zero.
+//   event-channel   the port dom0 has allocated for the guest to bind, for notifying it of clock steps and leap
+//                   events as they happen
+//   time-page       the grant reference of a page dom0 keeps host time in, see PvClockHostTime, for the guest to map
+//                   read-only and read without a round trip to the driver
+//
+// The cache is updated from a XenStore watch by the worker thread and read wait-free by the sampler, which never
+// touches XenStore itself.
+class XenHostSync {
+public:
+    static constexpr PCSTR ControlPath = "control/xentimeprovider";
+    static constexpr PCSTR Path = "control/xentimeprovider/host-sync";
+    static constexpr PCSTR EventChannelPath = "control/xentimeprovider/event-channel";
+    static constexpr PCSTR TimePagePath = "control/xentimeprovider/time-page";
+    // the time service runs in dom0
+    static constexpr USHORT ServiceDomain = 0;
+
+    XenHostSync() = default;
+    XenHostSync(const XenHostSync &) = delete;
+    XenHostSync &operator=(const XenHostSync &) = delete;
+
+    static HRESULT Parse(_In_ PCSTR value, _Out_ XenHostSyncState *state);
+    static HRESULT ParseEventChannel(_In_ PCSTR value, _Out_ ULONG *port);
+    static HRESULT ParseTimePage(_In_ PCSTR value, _Out_ ULONG *reference);
+
+    XenHostSyncState Get() const;
+    void Set(_In_ const XenHostSyncState &state);
+    void Clear() {
+        _packed.store(0, std::memory_order_release);
+    }
+
+private:
+    // valid (1), stratum (5), leap (2), dispersion (56)
+    std::atomic<unsigned __int64> _packed = 0;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Platform.hpp"
+#include "XenIfaceRequest.hpp"
+
+class IXenSharedTimePage;
+class IXenHostTimePage;
+
+// Platform-neutral view of the PnP notifications the worker cares about
+enum class XenIfaceAction {
+    InterfaceArrival,
+    InterfaceRemoval,
+    QueryRemove,
+    QueryRemoveFailed,
+    RemovePending,
+    RemoveComplete,
+    // The VM has resumed from suspend, e.g. after save/restore or live migration. The guest clock is likely off from
+    // host time by however long the VM was paused.
+    Resume,
+    // A XenStore key watched with IXenIfaceDevice::WatchStore, or one below it, has been written or removed
+    StoreChanged,
+    // The remote end has notified the event channel bound with IXenIfaceDevice::BindEventChannel
+    EventChannel,
+};
+
+// An open xeniface device interface. Besides PnP notifications, an open device delivers XenIfaceAction::Resume and,
+// once it watches a key or has bound an event channel, XenIfaceAction::StoreChanged and XenIfaceAction::EventChannel.
+class IXenIfaceDevice {
+public:
+    // XENIFACE_LOG_MAX_LENGTH, NUL included
+    static constexpr size_t MaxLogLength = 256;
+
+    virtual ~IXenIfaceDevice() = default;
+
+    virtual const std::wstring &GetPath() const = 0;
+    virtual bool IsOpen() const = 0;
+    // Release the underlying handle without tearing down notifications
+    virtual void Close() = 0;
+
+    // IOCTLs are issued asynchronously and fail with HRESULT_FROM_WIN32(ERROR_TIMEOUT) if not complete by the deadline,
+    // see XenIfaceRequest.
+
+    // IOCTL_XENIFACE_SHAREDINFO_GET_HOST_TIME
+    virtual HRESULT GetHostTime(_Out_ FILETIME *time, XenIfaceDeadline deadline) = 0;
+    // IOCTL_XENIFACE_SHAREDINFO_GET_TIME
+    virtual HRESULT GetTime(_Out_ FILETIME *time, _Out_ bool *local, XenIfaceDeadline deadline) = 0;
+    // IOCTL_XENIFACE_SUSPEND_GET_COUNT, the number of times the VM has been suspended
+    virtual HRESULT GetSuspendCount(_Out_ ULONG *count, XenIfaceDeadline deadline) = 0;
+    // IOCTL_XENIFACE_LOG, a line for dom0's log. The driver rejects messages that are MaxLogLength or longer or that
+    // contain anything but printable characters and newlines.
+    virtual HRESULT Log(_In_ PCSTR message, XenIfaceDeadline deadline) = 0;
+    // IOCTL_XENIFACE_STORE_WRITE. Relative paths are under the guest's own domain path, e.g. data/... for
+    // /local/domain/<domid>/data/...
+    virtual HRESULT StoreWrite(_In_ PCSTR path, _In_ PCSTR value, XenIfaceDeadline deadline) = 0;
+    // IOCTL_XENIFACE_STORE_READ, HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) if there is no such key
+    virtual HRESULT StoreRead(_In_ PCSTR path, _Out_ std::string &value, XenIfaceDeadline deadline) = 0;
+    // IOCTL_XENIFACE_STORE_ADD_WATCH. Like any XenStore watch it fires once when set, then on every change to the key
+    // or below it until the device is closed. One watch per device.
+    virtual HRESULT WatchStore(_In_ PCSTR path) = 0;
+    // IOCTL_XENIFACE_EVTCHN_BIND_INTERDOMAIN, to a port remoteDomain has allocated for us. The channel is masked as
+    // each notification is delivered; further ones stay pending until UnmaskEventChannel, which is
+    // IOCTL_XENIFACE_EVTCHN_UNMASK. One channel per device, closed along with it or by CloseEventChannel
+    // (IOCTL_XENIFACE_EVTCHN_CLOSE).
+    virtual HRESULT BindEventChannel(USHORT remoteDomain, ULONG remotePort, XenIfaceDeadline deadline) = 0;
+    virtual HRESULT UnmaskEventChannel(XenIfaceDeadline deadline) = 0;
+    virtual void CloseEventChannel() = 0;
+    // IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_V2 of the page remoteDomain has granted under reference, read-only. The
+    // driver keeps the page mapped for as long as the IOCTL is pending, which ends with the calling thread: map from a
+    // thread that outlives the mapping. One mapping per device, unmapped by UnmapHostTimePage
+    // (IOCTL_XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES_V2) or along with the device; reads through the page fail from then
+    // on rather than fault.
+    virtual HRESULT MapHostTimePage(
+        USHORT remoteDomain,
+        ULONG reference,
+        _Out_ std::shared_ptr<IXenHostTimePage> &page) = 0;
+    virtual void UnmapHostTimePage() = 0;
+    // Direct access to the hypervisor's time structures, for reading host time without an IOCTL. The page must not be
+    // used once the device is closed.
+    virtual HRESULT GetSharedTimePage(_Out_ std::shared_ptr<IXenSharedTimePage> &page) = 0;
+};
+
+// Receives notifications from an IXenIfacePlatform. Called on arbitrary threads, possibly concurrently.
+class IXenIfaceEvents {
+public:
+    virtual ~IXenIfaceEvents() = default;
+
+    virtual void OnInterfaceEvent(XenIfaceAction action) = 0;
+    virtual void OnDeviceEvent(std::shared_ptr<IXenIfaceDevice> device, XenIfaceAction action) = 0;
+};
+
+// Device discovery and lifecycle: CM notifications and CreateFile on Windows, SimXenIface elsewhere
+class IXenIfacePlatform {
+public:
+    virtual ~IXenIfacePlatform() = default;
+
+    virtual HRESULT Subscribe(_In_ IXenIfaceEvents *events) = 0;
+    // Waits for in-flight interface notifications to finish
+    virtual void Unsubscribe() = 0;
+    virtual HRESULT Enumerate(_Out_ std::vector<std::wstring> &interfaces) = 0;
+    // Device notifications for the opened device are delivered to events until the device is destroyed
+    virtual HRESULT Open(
+        _In_ const std::wstring &path,
+        _In_ IXenIfaceEvents *events,
+        _Out_ std::shared_ptr<IXenIfaceDevice> &device) = 0;
+};
@@ -0,0 +1,37 @@
+#include "XenIfaceRequest.hpp"
+
+HRESULT XenIfaceRequest::Start(_In_ const XenIfaceInFlight &inFlight) {
+    if (inFlight->fetch_add(1, std::memory_order_acq_rel) >= MaxInFlight) {
+        inFlight->fetch_sub(1, std::memory_order_acq_rel);
+        return HRESULT_FROM_WIN32(ERROR_BUSY);
+    }
+    _inFlight = inFlight;
+
+    std::lock_guard lock(_mutex);
+    _self = shared_from_this();
+    return S_OK;
+}
+
+void XenIfaceRequest::Complete(HRESULT result) {
+    std::shared_ptr<XenIfaceRequest> self;
+    {
+        std::lock_guard lock(_mutex);
+        _completed = true;
+        _result = result;
+        self = std::move(_self);
+        _signal.notify_all();
+    }
+    _inFlight->fetch_sub(1, std::memory_order_acq_rel);
+    // self goes last, it may be all that keeps an abandoned request alive
+}
+
+HRESULT XenIfaceRequest::Wait(XenIfaceDeadline deadline) {
+    {
+        std::unique_lock lock(_mutex);
+        if (_signal.wait_until(lock, deadline, [&] { return _completed; }))
+            return _result;
+    }
+
+    Cancel();
+    return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "Platform.hpp"
+
+using XenIfaceDeadline = std::chrono::steady_clock::time_point;
+
+// Requests in flight on a device, abandoned ones included. Shared with the requests, which may outlive the device.
+using XenIfaceInFlight = std::shared_ptr<std::atomic<unsigned int>>;
+
+// An IOCTL issued asynchronously. The device completes it exactly once, on whatever thread the driver's completion
+// arrives, while the issuer waits for that until its deadline. Past the deadline the request is cancelled and
+// abandoned: it lives on, output buffer included, until the driver gets around to completing it, which a wedged one
+// may never do. Devices stop issuing new requests once MaxInFlight are outstanding, so that abandoned ones can't pile
+// up without bound.
+class XenIfaceRequest : public std::enable_shared_from_this<XenIfaceRequest> {
+public:
+    static constexpr unsigned int MaxInFlight = 16;
+
+    XenIfaceRequest() = default;
+    virtual ~XenIfaceRequest() = default;
+    XenIfaceRequest(const XenIfaceRequest &) = delete;
+    XenIfaceRequest &operator=(const XenIfaceRequest &) = delete;
+
+    // Before handing the request to the driver. Keeps it alive until Complete; fails with ERROR_BUSY if the device has
+    // too many requests in flight already.
+    HRESULT Start(_In_ const XenIfaceInFlight &inFlight);
+    // Exactly once for each successful Start. May drop the last reference to the request.
+    void Complete(HRESULT result);
+    // The request's result, or HRESULT_FROM_WIN32(ERROR_TIMEOUT) if it is not complete by the deadline, in which case
+    // it is cancelled
+    HRESULT Wait(XenIfaceDeadline deadline);
+
+protected:
+    // Asks the driver to complete the request early, which it may or may not do. Called at most once, unlocked.
+    virtual void Cancel() = 0;
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _signal;
+    _Guarded_by_(_mutex) bool _completed = false;
+    _Guarded_by_(_mutex) HRESULT _result = E_PENDING;
+    _Guarded_by_(_mutex) std::shared_ptr<XenIfaceRequest> _self;
+    XenIfaceInFlight _inFlight;
+};
@@ -1,276 +1,529 @@
+#include <algorithm>
+#include <chrono>
+#include <string>
 #include <vector>
 
-#include <wil/result.h>
-#include <wil/filesystem.h>
-
 #include "Logging.hpp"
 #include "XenIfaceWorker.hpp"
-#include "xeniface_ioctls.h"
-
-#define RETURN_IF_CR_FAILED(cr) \
-    do { \
-        CONFIGRET _cr = (cr); \
-        if (_cr != CR_SUCCESS) { \
-            return HRESULT_FROM_WIN32(CM_MapCrToWin32Err(_cr, ERROR_GEN_FAILURE)); \
-        } \
-    } while (0)
-
-#define THROW_IF_CR_FAILED(cr) \
-    do { \
-        CONFIGRET _cr = (cr); \
-        if (_cr != CR_SUCCESS) { \
-            THROW_HR(HRESULT_FROM_WIN32(CM_MapCrToWin32Err(_cr, ERROR_GEN_FAILURE))); \
-        } \
-    } while (0)
-
-static std::vector<std::wstring> ParseMultiStrings(_In_reads_(count) const WCHAR *buf, size_t count) {
-    std::vector<std::wstring> strings;
-    size_t first = 0;
-    for (size_t i = 0; i < count; i++) {
-        if (buf[i] == 0) {
-            strings.emplace_back(buf + first, i - first);
-            first = i + 1;
-        }
+
+XenIfaceWorker::XenIfaceWorker(_In_ std::shared_ptr<IXenIfacePlatform> platform, _In_ XenTimeMetrics &metrics)
+    : _platform(std::move(platform)), _metrics(metrics), _worker([this](std::stop_token stop) { WorkerFunc(stop); }) {}
+
+XenIfaceWorker::~XenIfaceWorker() {
+    _worker.request_stop();
+    _wake.release();
+    _worker.join();
+    // whatever was dropped after the worker thread had finished
+    DestroyRetired();
+}
+
+std::shared_ptr<IXenIfaceDevice> XenIfaceWorker::Track(std::shared_ptr<IXenIfaceDevice> device) {
+    auto raw = device.get();
+    auto retired = new XenIfaceRetiredDevice{.Device = std::move(device)};
+    return std::shared_ptr<IXenIfaceDevice>(raw, [this, retired](IXenIfaceDevice *) { Retire(retired); });
+}
+
+void XenIfaceWorker::Retire(_In_ XenIfaceRetiredDevice *retired) {
+    retired->Next = _retired.load(std::memory_order_relaxed);
+    while (!_retired.compare_exchange_weak(
+        retired->Next, retired, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    _wake.release();
+}
+
+void XenIfaceWorker::DestroyRetired() {
+    auto retired = _retired.exchange(nullptr, std::memory_order_acquire);
+    while (retired) {
+        std::unique_ptr<XenIfaceRetiredDevice> entry(retired);
+        retired = entry->Next;
     }
-    if (strings.back().empty()) {
-        strings.pop_back();
+}
+
+void XenIfaceWorker::QueueRequest(std::shared_ptr<IXenIfaceDevice> target, XenIfaceAction action) {
+    if (!_requests.TryPush(XenIfaceWorkerRequest{.Target = std::move(target), .Action = action})) {
+        // the worker resynchronizes from scratch instead
+        _overflow.store(true, std::memory_order_release);
+        _metrics.EventOverflows.Add();
     }
-    return strings;
+    _wake.release();
 }
 
-static HRESULT GetDeviceInterfaceList(
-    _Out_ std::vector<WCHAR> &list,
-    _In_ LPCGUID interfaceClassGuid,
-    _In_opt_ DEVINSTID_W deviceID,
-    _In_ ULONG flags) {
-    ULONG devListLen = 0;
-    CONFIGRET cr;
-
-    list.clear();
-
-    do {
-        cr = CM_Get_Device_Interface_List_Size(&devListLen, const_cast<LPGUID>(interfaceClassGuid), nullptr, flags);
-        if (cr != CR_SUCCESS)
-            DebugLog("CM_Get_Device_Interface_List_Size failed %x", cr);
-        RETURN_IF_CR_FAILED(cr);
-
-        list.resize(devListLen);
-
-        cr = CM_Get_Device_Interface_List(
-            const_cast<LPGUID>(interfaceClassGuid),
-            deviceID,
-            list.data(),
-            static_cast<ULONG>(list.size()),
-            flags);
-    } while (cr == CR_BUFFER_SMALL);
-    if (cr != CR_SUCCESS)
-        DebugLog("CM_Get_Device_Interface_List failed %x", cr);
-    RETURN_IF_CR_FAILED(cr);
-
-    return S_OK;
+void XenIfaceWorker::SetResumeHandler(_In_ std::function<void()> handler) {
+    std::lock_guard lock(_handlerMutex);
+    _resumeHandler = std::move(handler);
 }
 
-_Pre_satisfies_(eventDataSize >= sizeof(CM_NOTIFY_EVENT_DATA)) DWORD CALLBACK
-    XenIfaceWorker::XenIfaceDevice::DeviceHandleCallback(
-        _In_ HCMNOTIFICATION notifyHandle,
-        _In_opt_ PVOID context,
-        _In_ CM_NOTIFY_ACTION action,
-        _In_reads_bytes_(eventDataSize) PCM_NOTIFY_EVENT_DATA eventData,
-        _In_ DWORD eventDataSize) {
-    auto self = static_cast<XenIfaceDevice *>(context)->shared_from_this();
+void XenIfaceWorker::SetPushHandler(_In_ std::function<void()> handler) {
+    std::lock_guard lock(_handlerMutex);
+    _pushHandler = std::move(handler);
+}
 
-    UNREFERENCED_PARAMETER(notifyHandle);
-    UNREFERENCED_PARAMETER(eventData);
-    UNREFERENCED_PARAMETER(eventDataSize);
+void XenIfaceWorker::SetArrivalHandler(_In_ std::function<void()> handler) {
+    std::lock_guard lock(_handlerMutex);
+    _arrivalHandler = std::move(handler);
+}
 
+void XenIfaceWorker::OnInterfaceEvent(XenIfaceAction action) {
+    // interface events carry nothing but the action, one pending of each is as good as many
+    auto bit = 1U << static_cast<unsigned int>(action);
+    if (_interfaceEvents.fetch_or(bit, std::memory_order_acq_rel) & bit) {
+        _metrics.EventsCoalesced.Add();
+        return;
+    }
+    _wake.release();
+}
+
+void XenIfaceWorker::OnDeviceEvent(std::shared_ptr<IXenIfaceDevice> device, XenIfaceAction action) {
     switch (action) {
-    case CM_NOTIFY_ACTION_DEVICEQUERYREMOVE:
-    case CM_NOTIFY_ACTION_DEVICEQUERYREMOVEFAILED:
+    case XenIfaceAction::QueryRemove:
+    case XenIfaceAction::QueryRemoveFailed:
         // Must close immediately to avoid failing DEVICEQUERYREMOVE
-        OutputDebugStringA("CM_NOTIFY_ACTION_DEVICEQUERYREMOVE/FAILED");
-        self->GetHandle().reset();
+        DebugLog("XenIfaceAction::QueryRemove/Failed");
+        device->Close();
+        break;
+    default:
         break;
     }
 
-    self->_worker->QueueRequest(std::unique_lock(self->_worker->_mutex), self, action);
-
-    return ERROR_SUCCESS;
+    QueueRequest(std::move(device), action);
 }
 
-XenIfaceWorker::XenIfaceDevice::XenIfaceDevice(
-    _In_ Private pvt,
-    _In_ wil::unique_hfile &&handle,
-    _In_ const std::wstring &path,
-    _In_ XenIfaceWorker *worker)
-    : _handle(std::move(handle)), _path(path), _worker(worker) {
-    UNREFERENCED_PARAMETER(pvt);
-
-    CM_NOTIFY_FILTER filter{
-        .cbSize = sizeof(CM_NOTIFY_FILTER),
-        .Flags = 0,
-        .FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEHANDLE,
-        .Reserved = 0,
-        .u = {.DeviceHandle = {.hTarget = _handle.get()}},
-    };
-    wil::unique_hcmnotification newListener;
-    auto cr = CM_Register_Notification(&filter, this, &DeviceHandleCallback, &_listener);
-    if (cr != CR_SUCCESS)
-        DebugLog("CM_Register_Notification failed %x", cr);
-    THROW_IF_CR_FAILED(cr);
-}
+unsigned __int64 XenIfaceWorker::ProbeLatency(_In_ IXenIfaceDevice *device) {
+    // the best of a few, any single read may be held up by a preempted vCPU
+    auto best = ~0ULL;
+    for (unsigned int i = 0; i < ProbeCount; i++) {
+        FILETIME time;
+        bool local;
 
-HRESULT XenIfaceWorker::XenIfaceDevice::make(
-    _Out_ std::shared_ptr<XenIfaceDevice> &object,
-    _In_ wil::unique_hfile &&handle,
-    _In_ const std::wstring &path,
-    _In_ XenIfaceWorker *worker) {
-    try {
-        object = std::make_shared<XenIfaceDevice>(Private(), std::move(handle), path, worker);
+        auto start = std::chrono::steady_clock::now();
+        auto hr = device->GetHostTime(&time, start + ProbeTimeout);
+        if (FAILED(hr))
+            hr = device->GetTime(&time, &local, start + ProbeTimeout);
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        // no point in waiting on a stalled device again, it ranks last unless it did better already
+        if (hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT))
+            break;
+        if (SUCCEEDED(hr))
+            best = (std::min)(best, static_cast<unsigned __int64>(elapsed.count()));
     }
-    CATCH_RETURN();
-    return S_OK;
+    return best;
 }
 
-XenIfaceWorker::XenIfaceWorker() : _worker([this](std::stop_token stop) { WorkerFunc(stop); }) {}
+void XenIfaceWorker::Publish() {
+    std::stable_sort(_devices.begin(), _devices.end(), [](const auto &a, const auto &b) {
+        return a.LatencyNs < b.LatencyNs;
+    });
+
+    std::shared_ptr<IXenIfaceDevice> active, standby;
+    for (const auto &entry : _devices) {
+        if (!entry.Device->IsOpen())
+            continue;
+        if (!active) {
+            active = entry.Device;
+        } else {
+            standby = entry.Device;
+            break;
+        }
+    }
 
-XenIfaceWorker::~XenIfaceWorker() {
-    _worker.request_stop();
-    std::lock_guard lock(_mutex);
-    _signal.notify_one();
+    auto previous = _active.load(std::memory_order_relaxed);
+    if (previous && active && previous != active) {
+        DebugLog("Switching to %ls", active->GetPath().c_str());
+        _metrics.DeviceFailovers.Add();
+    }
+    auto arrived = !previous && active;
+    _active.store(std::move(active), std::memory_order_release);
+    _standby.store(std::move(standby), std::memory_order_release);
+
+    if (arrived) {
+        std::lock_guard lock(_handlerMutex);
+        if (_arrivalHandler)
+            _arrivalHandler();
+    }
 }
 
-std::tuple<std::unique_lock<std::mutex>, HANDLE, PCWSTR> XenIfaceWorker::GetDevice() {
-    std::unique_lock lock(_mutex);
-    if (_active)
-        return {std::move(lock), _active->GetHandle().get(), _active->GetPath().c_str()};
-    return {std::move(lock), nullptr, L""};
+HRESULT XenIfaceWorker::RefreshDevices(std::list<std::shared_ptr<IXenIfaceDevice>> &tombstones) {
+    DebugLog("XenIfaceWorker::RefreshDevices");
+
+    std::vector<std::wstring> interfaces;
+    auto hr = _platform->Enumerate(interfaces);
+    if (FAILED(hr))
+        DebugLog("Enumerate failed %x", hr);
+    RETURN_IF_FAILED(hr);
+
+    DebugLog("Interface list:");
+    for (const auto &iface : interfaces)
+        DebugLog("%ls", iface.c_str());
+
+    // closed devices are reopened below if their interface is still there
+    std::erase_if(_devices, [&](auto &entry) {
+        if (entry.Device->IsOpen() &&
+            std::find(interfaces.begin(), interfaces.end(), entry.Device->GetPath()) != interfaces.end())
+            return false;
+        tombstones.emplace_back(std::move(entry.Device));
+        return true;
+    });
+
+    auto result = S_FALSE;
+    auto failure = S_OK;
+    for (const auto &iface : interfaces) {
+        if (std::any_of(_devices.begin(), _devices.end(), [&](const auto &entry) {
+                return entry.Device->GetPath() == iface;
+            }))
+            continue;
+
+        std::shared_ptr<IXenIfaceDevice> device;
+        hr = _platform->Open(iface, this, device);
+        if (FAILED(hr)) {
+            DebugLog("Open(%ls) failed %x", iface.c_str(), hr);
+            _metrics.DeviceOpenFailures.Add();
+            failure = hr;
+            continue;
+        }
+
+        auto latency = ProbeLatency(device.get());
+        DebugLog("Opened %ls, %llu ns", iface.c_str(), latency);
+        // every device watches, so that dom0's updates keep coming whichever of them is left; the first read
+        // follows from the watch firing as it is set
+        hr = device->WatchStore(XenHostSync::ControlPath);
+        if (FAILED(hr))
+            DebugLog("WatchStore failed %x", hr);
+        _devices.emplace_back(XenIfaceDeviceEntry{.Device = Track(std::move(device)), .LatencyNs = latency});
+        _metrics.DeviceOpens.Add();
+        result = S_OK;
+    }
+
+    Publish();
+
+    // any interface left unopened is a failure, even with others open
+    RETURN_IF_FAILED(failure);
+    if (_devices.empty()) {
+        DebugLog("No device");
+        return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+    }
+    return result;
 }
 
-void XenIfaceWorker::QueueRequest(
-    std::unique_lock<std::mutex> &&lock,
-    std::shared_ptr<XenIfaceDevice> target,
-    CM_NOTIFY_ACTION action) {
-    _Analysis_assume_lock_held_(_mutex);
-    {
-        auto _lock = std::move(lock);
-        _requests.emplace_back(XenIfaceWorkerRequest{.Target = std::move(target), .Action = action});
+void XenIfaceWorker::UpdateHostSync(_In_ IXenIfaceDevice *device) {
+    if (!device->IsOpen())
+        return;
+
+    std::string value;
+    auto hr = device->StoreRead(XenHostSync::Path, value, std::chrono::steady_clock::now() + StoreTimeout);
+    if (hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) {
+        // not published, or no longer
+        if (_hostSync.Get().Valid)
+            DebugLog("Host sync state removed");
+        _hostSync.Clear();
+        return;
+    }
+    if (FAILED(hr)) {
+        // keep what we have, the next change fires the watch again
+        DebugLog("Reading host sync state failed %x", hr);
+        return;
     }
-    _signal.notify_one();
+
+    XenHostSyncState state;
+    hr = XenHostSync::Parse(value.c_str(), &state);
+    if (FAILED(hr)) {
+        DebugLog("Ignoring host sync state \"%s\"", value.c_str());
+        _hostSync.Clear();
+        return;
+    }
+
+    DebugLog(
+        "Host sync state: stratum %u, leap %u, dispersion %llu",
+        state.Stratum,
+        static_cast<unsigned int>(state.Leap),
+        state.Dispersion);
+    _hostSync.Set(state);
+    _metrics.HostSyncUpdates.Add();
 }
 
-_Pre_satisfies_(eventDataSize >= sizeof(CM_NOTIFY_EVENT_DATA)) DWORD CALLBACK XenIfaceWorker::CmListenerCallback(
-    _In_ HCMNOTIFICATION notifyHandle,
-    _In_opt_ PVOID context,
-    _In_ CM_NOTIFY_ACTION action,
-    _In_reads_bytes_(eventDataSize) PCM_NOTIFY_EVENT_DATA eventData,
-    _In_ DWORD eventDataSize) {
-    _Analysis_assume_(context);
-    auto self = static_cast<XenIfaceWorker *>(context);
-
-    UNREFERENCED_PARAMETER(notifyHandle);
-    UNREFERENCED_PARAMETER(eventData);
-    UNREFERENCED_PARAMETER(eventDataSize);
-
-    {
-        std::lock_guard lock(self->_mutex);
-        self->_requests.emplace_back(XenIfaceWorkerRequest{.Action = action});
+void XenIfaceWorker::UpdateAdvertisedId(
+    _In_ IXenIfaceDevice *device,
+    _In_ PCSTR path,
+    _In_ HRESULT (*parse)(_In_ PCSTR value, _Out_ ULONG *id),
+    _Inout_ std::optional<ULONG> &id) {
+    if (!device->IsOpen())
+        return;
+
+    std::string value;
+    auto hr = device->StoreRead(path, value, std::chrono::steady_clock::now() + StoreTimeout);
+    if (hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) {
+        // no time service, or it has gone away
+        id.reset();
+        return;
+    }
+    if (FAILED(hr)) {
+        DebugLog("Reading %s failed %x", path, hr);
+        return;
     }
-    self->_signal.notify_one();
 
-    return ERROR_SUCCESS;
+    ULONG parsed;
+    hr = parse(value.c_str(), &parsed);
+    if (FAILED(hr)) {
+        DebugLog("Ignoring %s \"%s\"", path, value.c_str());
+        id.reset();
+        return;
+    }
+    id = parsed;
 }
 
-HRESULT XenIfaceWorker::RefreshDevices(std::list<std::shared_ptr<XenIfaceDevice>> &tombstones) {
-    OutputDebugStringA("XenIfaceWorker::RefreshDevices");
+void XenIfaceWorker::UpdatePushChannel(std::list<std::shared_ptr<IXenIfaceDevice>> &tombstones) {
+    auto active = _active.load(std::memory_order_relaxed);
+    if (active && !active->IsOpen())
+        active.reset();
+    if (_pushDevice == active && _pushDevicePort == _pushPort.value_or(0))
+        return;
+
+    if (_pushDevice) {
+        DebugLog("Closing event channel to port %lu", static_cast<unsigned long>(_pushDevicePort));
+        _pushDevice->CloseEventChannel();
+        tombstones.emplace_back(std::move(_pushDevice));
+        _pushDevicePort = 0;
+    }
+    if (!active || !_pushPort)
+        return;
 
-    std::vector<WCHAR> buffer;
-    auto hr = GetDeviceInterfaceList(buffer, &GUID_INTERFACE_XENIFACE, nullptr, CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+    // A failure is not retried until the port or the active device changes; the sampler's own schedule carries on
+    // meanwhile.
+    auto hr = active->BindEventChannel(
+        XenHostSync::ServiceDomain,
+        *_pushPort,
+        std::chrono::steady_clock::now() + StoreTimeout);
     if (FAILED(hr))
-        DebugLog("GetDeviceInterfaceList failed %x", hr);
-    RETURN_IF_FAILED(hr);
+        DebugLog("Binding event channel to port %lu failed %x", static_cast<unsigned long>(*_pushPort), hr);
+    else
+        DebugLog("Bound event channel to port %lu", static_cast<unsigned long>(*_pushPort));
+    _pushDevice = std::move(active);
+    _pushDevicePort = *_pushPort;
+    if (FAILED(hr))
+        _pushDevice->CloseEventChannel();
+}
 
-    auto interfaces = ParseMultiStrings(buffer.data(), buffer.size());
-    if (interfaces.size() == 0) {
-        OutputDebugStringA("Interface list empty");
-        return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
-    }
+void XenIfaceWorker::UpdateHostTimePage(std::list<std::shared_ptr<IXenIfaceDevice>> &tombstones) {
+    auto active = _active.load(std::memory_order_relaxed);
+    if (active && !active->IsOpen())
+        active.reset();
+    if (_timePageDevice == active && _timePageDeviceReference == _timePageReference.value_or(0))
+        return;
 
-    OutputDebugStringA("Interface list:");
-    for (const auto &iface : interfaces)
-        OutputDebugString(iface.c_str());
+    if (_timePageDevice) {
+        DebugLog("Unmapping host time page %lu", static_cast<unsigned long>(_timePageDeviceReference));
+        // the sampler's reads fail from here on, and fall back to its other sources
+        _hostTimePage.store(nullptr, std::memory_order_release);
+        _timePageDevice->UnmapHostTimePage();
+        tombstones.emplace_back(std::move(_timePageDevice));
+        _timePageDeviceReference = 0;
+    }
+    if (!active || !_timePageReference)
+        return;
 
-    if (_active && _active->GetHandle().is_valid()) {
-        OutputDebugStringA("Device valid, skipping refresh");
-        return S_FALSE;
-    } else if (_active) {
-        tombstones.emplace_back(std::move(_active));
+    // not retried until the reference or the active device changes, as with the event channel
+    std::shared_ptr<IXenHostTimePage> page;
+    auto hr = active->MapHostTimePage(XenHostSync::ServiceDomain, *_timePageReference, page);
+    if (FAILED(hr)) {
+        DebugLog("Mapping host time page %lu failed %x", static_cast<unsigned long>(*_timePageReference), hr);
+    } else {
+        DebugLog("Mapped host time page %lu", static_cast<unsigned long>(*_timePageReference));
+        _metrics.HostTimePageMaps.Add();
+        _hostTimePage.store(std::move(page), std::memory_order_release);
     }
+    _timePageDevice = std::move(active);
+    _timePageDeviceReference = *_timePageReference;
+}
 
-    auto [newHandle, err] = wil::try_open_file(interfaces[0].c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE);
-    if (!newHandle.is_valid())
-        DebugLog("open(%S) failed %x", interfaces[0].c_str(), err);
-    RETURN_HR_IF(HRESULT_FROM_WIN32(err), !newHandle.is_valid());
+void XenIfaceWorker::Reacquire(std::list<std::shared_ptr<IXenIfaceDevice>> &tombstones) {
+    auto hr = RefreshDevices(tombstones);
+    auto now = std::chrono::steady_clock::now();
 
-    RETURN_IF_FAILED(XenIfaceDevice::make(_active, std::move(newHandle), interfaces[0], this));
+    // nothing present is not for us to fix, an arrival will follow
+    if (SUCCEEDED(hr) || hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) {
+        if (_recovery.Active) {
+            DebugLog("Devices reacquired after %u retries", _recovery.Retries);
+            _metrics.DeviceRecovery.Record(static_cast<unsigned __int64>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(now - _recovery.Since).count()));
+        }
+        _recovery = XenIfaceRecovery{};
+        return;
+    }
+
+    DebugLog("RefreshDevices failed %x", hr);
+    if (!_recovery.Active) {
+        _recovery.Active = true;
+        _recovery.Since = now;
+    }
+    auto delay = (std::min)(
+        std::chrono::milliseconds(RetryInitialDelay * (1LL << (std::min)(_recovery.Retries, 16U))), RetryMaxDelay);
+    DebugLog("Retrying in %lld ms", static_cast<long long>(delay.count()));
+    _recovery.NextAttempt = now + delay;
+    _recovery.Retries++;
+    _metrics.DeviceRetries.Add();
+}
 
-    return S_OK;
+void XenIfaceWorker::SetStartup(XenIfaceStartup startup) {
+    _startup.store(startup, std::memory_order_release);
+    // an arrival has been handled already if there was one
+    if (startup == XenIfaceStartup::NotFound) {
+        std::lock_guard lock(_handlerMutex);
+        if (_arrivalHandler)
+            _arrivalHandler();
+    }
 }
 
 void XenIfaceWorker::WorkerFunc(std::stop_token stop) {
     HRESULT hr;
-    std::list<std::shared_ptr<XenIfaceDevice>> tombstones;
-
-    CM_NOTIFY_FILTER filter{
-        .cbSize = sizeof(CM_NOTIFY_FILTER),
-        .Flags = 0,
-        .FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE,
-        .Reserved = 0,
-        .u = {.DeviceInterface = {.ClassGuid = GUID_INTERFACE_XENIFACE}},
-    };
-
-    wil::unique_hcmnotification cmListener;
-    auto cr = CM_Register_Notification(&filter, this, &CmListenerCallback, &cmListener);
-    if (cr != CR_SUCCESS)
-        return;
+    std::list<std::shared_ptr<IXenIfaceDevice>> tombstones;
 
-    {
-        std::lock_guard lock(_mutex);
-        hr = RefreshDevices(tombstones);
-        if (FAILED(hr))
-            DebugLog("RefreshDevices failed %x", hr);
+    hr = _platform->Subscribe(this);
+    if (FAILED(hr)) {
+        DebugLog("Subscribe failed %x", hr);
+        SetStartup(XenIfaceStartup::NotFound);
+        return;
     }
 
+    Reacquire(tombstones);
+    SetStartup(_devices.empty() && !_recovery.Active ? XenIfaceStartup::NotFound : XenIfaceStartup::Found);
+
+    std::vector<XenIfaceWorkerRequest> requests;
+    requests.reserve(QueueSize);
     while (1) {
-        {
-            std::unique_lock lock(_mutex);
-            _signal.wait(lock);
-            if (stop.stop_requested())
+        if (_recovery.Active)
+            (void)_wake.try_acquire_until(_recovery.NextAttempt);
+        else
+            _wake.acquire();
+        // one pass handles whatever the extra wakeups were for
+        while (_wake.try_acquire())
+            ;
+        if (stop.stop_requested())
+            break;
+
+        XenIfaceWorkerRequest request;
+        while (_requests.TryPop(&request)) {
+            if (std::any_of(requests.begin(), requests.end(), [&](const auto &pending) {
+                    return pending.Target == request.Target && pending.Action == request.Action;
+                })) {
+                _metrics.EventsCoalesced.Add();
+                tombstones.emplace_back(std::move(request.Target));
+                continue;
+            }
+            requests.emplace_back(std::move(request));
+        }
+        // after the device events, so that an arrival sees the removals that came before it
+        auto interfaceEvents = _interfaceEvents.exchange(0, std::memory_order_acq_rel);
+
+        for (auto &request : requests) {
+            switch (request.Action) {
+            case XenIfaceAction::QueryRemove:
+                // closed already, promote the standby for good
+                Publish();
                 break;
 
-            while (!_requests.empty()) {
-                auto request = _requests.front();
-                _requests.pop_front();
-                switch (request.Action) {
-                case CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL:
-                    OutputDebugStringA("CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL");
-                    hr = RefreshDevices(tombstones);
-                    if (FAILED(hr))
-                        DebugLog("RefreshDevices failed %x", hr);
-                    break;
+            case XenIfaceAction::QueryRemoveFailed:
+                // The removal was vetoed, but the handle is closed all the same and no arrival will tell us to reopen
+                // it. Do so right away, and keep trying if that fails.
+                DebugLog("XenIfaceAction::QueryRemoveFailed");
+                if (!_recovery.Active) {
+                    _recovery.Active = true;
+                    _recovery.Since = std::chrono::steady_clock::now();
+                }
+                Reacquire(tombstones);
+                break;
+
+            case XenIfaceAction::RemovePending:
+            case XenIfaceAction::RemoveComplete:
+                DebugLog("XenIfaceAction::RemovePending/Complete");
+                if (std::erase_if(_devices, [&](const auto &entry) { return entry.Device == request.Target; }))
+                    _metrics.DeviceRemovals.Add();
+                Publish();
+                break;
+
+            case XenIfaceAction::Resume:
+                DebugLog("XenIfaceAction::Resume");
+                if (request.Target == GetDevice()) {
+                    std::lock_guard lock(_handlerMutex);
+                    if (_resumeHandler)
+                        _resumeHandler();
+                }
+                break;
 
-                case CM_NOTIFY_ACTION_DEVICEREMOVEPENDING:
-                case CM_NOTIFY_ACTION_DEVICEREMOVECOMPLETE:
-                    OutputDebugStringA("CM_NOTIFY_ACTION_DEVICEREMOVEPENDING");
-                    if (request.Target == _active)
-                        _active.reset();
-                    tombstones.emplace_back(std::move(request.Target));
+            case XenIfaceAction::StoreChanged:
+                UpdateHostSync(request.Target.get());
+                UpdateAdvertisedId(
+                    request.Target.get(),
+                    XenHostSync::EventChannelPath,
+                    &XenHostSync::ParseEventChannel,
+                    _pushPort);
+                UpdateAdvertisedId(
+                    request.Target.get(),
+                    XenHostSync::TimePagePath,
+                    &XenHostSync::ParseTimePage,
+                    _timePageReference);
+                break;
+
+            case XenIfaceAction::EventChannel:
+                // a channel closed since may still have had a notification queued
+                if (request.Target != _pushDevice)
                     break;
+                {
+                    std::lock_guard lock(_handlerMutex);
+                    if (_pushHandler)
+                        _pushHandler();
                 }
+                hr = request.Target->UnmaskEventChannel(std::chrono::steady_clock::now() + StoreTimeout);
+                if (FAILED(hr))
+                    DebugLog("UnmaskEventChannel failed %x", hr);
+                break;
+
+            default:
+                break;
             }
+            tombstones.emplace_back(std::move(request.Target));
         }
+        requests.clear();
 
-        // Closing old listeners must be done outside of the lock, since CM_Unregister_Notification will wait for
-        // callbacks to finish
+        if (_overflow.exchange(false, std::memory_order_acq_rel)) {
+            // Device events were lost. Enumerating again drops whatever PnP has closed and reopens what is present; a
+            // lost resume is caught by the sampler's suspend count check.
+            DebugLog("Request queue overflow");
+            interfaceEvents |= 1U << static_cast<unsigned int>(XenIfaceAction::InterfaceArrival);
+        }
+        if (interfaceEvents & (1U << static_cast<unsigned int>(XenIfaceAction::InterfaceArrival))) {
+            DebugLog("XenIfaceAction::InterfaceArrival");
+            Reacquire(tombstones);
+        }
+
+        if (_recovery.Active && std::chrono::steady_clock::now() >= _recovery.NextAttempt)
+            Reacquire(tombstones);
+
+        UpdatePushChannel(tombstones);
+        UpdateHostTimePage(tombstones);
+
+        // Unregistering device notifications waits for callbacks to finish, so drop devices only once nothing else
+        // refers to them from here. A device still in a snapshot comes back through Retire once that is dropped.
         tombstones.clear();
+        DestroyRetired();
+    }
+
+    if (_pushDevice) {
+        _pushDevice->CloseEventChannel();
+        tombstones.emplace_back(std::move(_pushDevice));
+    }
+    if (_timePageDevice) {
+        _hostTimePage.store(nullptr, std::memory_order_release);
+        _timePageDevice->UnmapHostTimePage();
+        tombstones.emplace_back(std::move(_timePageDevice));
     }
+    XenIfaceWorkerRequest request;
+    while (_requests.TryPop(&request))
+        tombstones.emplace_back(std::move(request.Target));
+    _active.store(nullptr, std::memory_order_release);
+    _standby.store(nullptr, std::memory_order_release);
+    for (auto &entry : _devices)
+        tombstones.emplace_back(std::move(entry.Device));
+    _devices.clear();
+    tombstones.clear();
+    DestroyRetired();
+    _platform->Unsubscribe();
 }
@@ -1,96 +1,183 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <thread>
 #include <mutex>
-#include <condition_variable>
+#include <optional>
+#include <functional>
 #include <list>
+#include <semaphore>
 #include <string>
-#include <tuple>
-
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#include <cfgmgr32.h>
-
-#include <wil/resource.h>
+#include <vector>
+
+#include "Platform.hpp"
+#include "Metrics.hpp"
+#include "PvClock.hpp"
+#include "RequestQueue.hpp"
+#include "XenHostSync.hpp"
+#include "XenIface.hpp"
+
+// How the worker's first enumeration of xeniface interfaces went, which decides whether a device is on its way
+enum class XenIfaceStartup {
+    Enumerating,
+    // some interface is present, open or being retried
+    Found,
+    NotFound,
+};
 
-class XenIfaceWorker {
+// Keeps a handle open on every present xeniface interface. The one with the lowest IOCTL latency is active, and the
+// runner-up stands by to take over the moment PnP closes the active one.
+class XenIfaceWorker : public IXenIfaceEvents {
 public:
-    XenIfaceWorker();
+    // host time reads timed on each newly opened device to rank it
+    static constexpr unsigned int ProbeCount = 8;
+    static constexpr std::chrono::milliseconds ProbeTimeout{250};
+    // Backoff between attempts at reopening devices, doubling from the initial delay
+    static constexpr std::chrono::milliseconds RetryInitialDelay{100};
+    static constexpr std::chrono::milliseconds RetryMaxDelay{30000};
+    // device events queued for the worker, beyond which it resynchronizes by enumerating
+    static constexpr size_t QueueSize = 64;
+    // for reading what dom0 publishes when its watch fires, and for event channel IOCTLs
+    static constexpr std::chrono::milliseconds StoreTimeout{1000};
+
+    XenIfaceWorker(_In_ std::shared_ptr<IXenIfacePlatform> platform, _In_ XenTimeMetrics &metrics);
     ~XenIfaceWorker();
     XenIfaceWorker(const XenIfaceWorker &) = delete;
     XenIfaceWorker &operator=(const XenIfaceWorker &) = delete;
 
-    std::tuple<std::unique_lock<std::mutex>, HANDLE, PCWSTR> GetDevice();
+    // Lock-free snapshot of the active device. The device stays valid for as long as the caller holds the reference,
+    // but may be closed by PnP at any time, in which case IOCTLs on it fail.
+    std::shared_ptr<IXenIfaceDevice> GetDevice() const {
+        auto active = _active.load(std::memory_order_acquire);
+        if (active && active->IsOpen())
+            return active;
+        // closed by PnP but not handled by the worker yet, no need to wait for it
+        auto standby = _standby.load(std::memory_order_acquire);
+        if (standby && standby->IsOpen())
+            return standby;
+        return active;
+    }
+
+    // Wait-free. Once past Enumerating, the arrival handler has been called, see SetArrivalHandler.
+    XenIfaceStartup GetStartup() const {
+        return _startup.load(std::memory_order_acquire);
+    }
+
+    // Wait-free. dom0's sync state as last read from XenStore, see XenHostSync.
+    XenHostSyncState GetHostSync() const {
+        return _hostSync.Get();
+    }
+
+    // Lock-free snapshot of the page dom0's time service keeps host time in, mapped on the active device, or null.
+    // Reads through it start failing once it is unmapped, see PvClockHostTimeReader.
+    std::shared_ptr<IXenHostTimePage> GetHostTimePage() const {
+        return _hostTimePage.load(std::memory_order_acquire);
+    }
+
+    // handler is called on the worker thread whenever the active device reports a resume. Replacing it waits for a
+    // call in progress to finish.
+    void SetResumeHandler(_In_ std::function<void()> handler);
+    // Likewise for notifications from dom0's time service over the event channel it advertises, which the active
+    // device binds. The channel is unmasked once the handler returns, notifications in between are folded into one.
+    void SetPushHandler(_In_ std::function<void()> handler);
+    // Likewise whenever a device becomes active where there was none, as after the first open at startup, and once
+    // the first enumeration finds no interface
+    void SetArrivalHandler(_In_ std::function<void()> handler);
+
+    // Called from PnP notification callbacks; neither allocates nor takes locks. Identical interface events coalesce
+    // while pending, and so do identical device events drained together.
+    void OnInterfaceEvent(XenIfaceAction action) override;
+    void OnDeviceEvent(std::shared_ptr<IXenIfaceDevice> device, XenIfaceAction action) override;
 
 private:
-    class XenIfaceDevice : public std::enable_shared_from_this<XenIfaceDevice> {
-    private:
-        struct Private {
-            explicit Private() = default;
-        };
-
-    public:
-        XenIfaceDevice(
-            _In_ Private pvt,
-            _In_ wil::unique_hfile &&handle,
-            _In_ const std::wstring &path,
-            _In_ XenIfaceWorker *worker);
-
-        static HRESULT make(
-            _Out_ std::shared_ptr<XenIfaceDevice> &device,
-            _In_ wil::unique_hfile &&handle,
-            _In_ const std::wstring &path,
-            _In_ XenIfaceWorker *worker);
-
-        XenIfaceDevice(const XenIfaceDevice &) = delete;
-        XenIfaceDevice &operator=(const XenIfaceDevice &) = delete;
-        XenIfaceDevice(XenIfaceDevice &&) = default;
-        XenIfaceDevice &operator=(XenIfaceDevice &&) = default;
-
-        wil::unique_hfile &GetHandle() {
-            return _handle;
-        }
-        const std::wstring &GetPath() const {
-            return _path;
-        }
-
-        _Pre_satisfies_(eventDataSize >= sizeof(CM_NOTIFY_EVENT_DATA)) static DWORD CALLBACK DeviceHandleCallback(
-            _In_ HCMNOTIFICATION notifyHandle,
-            _In_opt_ PVOID context,
-            _In_ CM_NOTIFY_ACTION action,
-            _In_reads_bytes_(eventDataSize) PCM_NOTIFY_EVENT_DATA eventData,
-            _In_ DWORD eventDataSize);
-
-    private:
-        wil::unique_hcmnotification _listener;
-        wil::unique_hfile _handle;
-        std::wstring _path;
-        XenIfaceWorker *_worker;
+    struct XenIfaceWorkerRequest {
+        std::shared_ptr<IXenIfaceDevice> Target;
+        XenIfaceAction Action = XenIfaceAction::InterfaceArrival;
     };
 
-    struct XenIfaceWorkerRequest {
-        std::shared_ptr<XenIfaceDevice> Target;
-        CM_NOTIFY_ACTION Action;
+    struct XenIfaceDeviceEntry {
+        std::shared_ptr<IXenIfaceDevice> Device;
+        // best of ProbeCount host time reads, ~0 if none succeeded
+        unsigned __int64 LatencyNs;
     };
 
-    void WorkerFunc(std::stop_token stop);
-    HRESULT RefreshDevices(std::list<std::shared_ptr<XenIfaceDevice>> &tombstones);
-    void
-    QueueRequest(std::unique_lock<std::mutex> &&lock, std::shared_ptr<XenIfaceDevice> target, CM_NOTIFY_ACTION action);
-
-    _Pre_satisfies_(eventDataSize >= sizeof(CM_NOTIFY_EVENT_DATA)) static DWORD CALLBACK CmListenerCallback(
-        _In_ HCMNOTIFICATION notifyHandle,
-        _In_opt_ PVOID context,
-        _In_ CM_NOTIFY_ACTION action,
-        _In_reads_bytes_(eventDataSize) PCM_NOTIFY_EVENT_DATA eventData,
-        _In_ DWORD eventDataSize);
-
-    struct {
-        std::mutex _mutex;
-        std::condition_variable _signal;
-        _Guarded_by_(_mutex) std::list<XenIfaceWorkerRequest> _requests;
-        _Guarded_by_(_mutex) std::shared_ptr<XenIfaceDevice> _active;
+    // A device whose last snapshot has been dropped, handed back for the worker thread to destroy
+    struct XenIfaceRetiredDevice {
+        std::shared_ptr<IXenIfaceDevice> Device;
+        XenIfaceRetiredDevice *Next = nullptr;
     };
+
+    // Set while some present interface has no open device, from a vetoed removal or failed opens
+    struct XenIfaceRecovery {
+        bool Active = false;
+        unsigned int Retries = 0;
+        std::chrono::steady_clock::time_point Since;
+        std::chrono::steady_clock::time_point NextAttempt;
+    };
+
+    static unsigned __int64 ProbeLatency(_In_ IXenIfaceDevice *device);
+
+    void WorkerFunc(std::stop_token stop);
+    // Fails if any present interface could not be opened
+    HRESULT RefreshDevices(std::list<std::shared_ptr<IXenIfaceDevice>> &tombstones);
+    // RefreshDevices, and schedules the next attempt if it fails
+    void Reacquire(std::list<std::shared_ptr<IXenIfaceDevice>> &tombstones);
+    void SetStartup(XenIfaceStartup startup);
+    // Wraps a newly opened device so that whichever thread drops the last reference to it, the device is destroyed on
+    // the worker thread. Closing the handle and unregistering its notifications can wait on the driver and on PnP,
+    // which the sampler and w32time threads must not. Retire neither allocates nor takes locks.
+    std::shared_ptr<IXenIfaceDevice> Track(std::shared_ptr<IXenIfaceDevice> device);
+    void Retire(_In_ XenIfaceRetiredDevice *retired);
+    void DestroyRetired();
+    // Makes the fastest open device active and the next one the standby
+    void Publish();
+    // Read what dom0 publishes through device after its watch has fired
+    void UpdateHostSync(_In_ IXenIfaceDevice *device);
+    // One of the ids dom0 advertises under XenHostSync::ControlPath. A failed read keeps what we have.
+    void UpdateAdvertisedId(
+        _In_ IXenIfaceDevice *device,
+        _In_ PCSTR path,
+        _In_ HRESULT (*parse)(_In_ PCSTR value, _Out_ ULONG *id),
+        _Inout_ std::optional<ULONG> &id);
+    // Keeps the event channel bound on the active device, to the port dom0 advertises
+    void UpdatePushChannel(std::list<std::shared_ptr<IXenIfaceDevice>> &tombstones);
+    // Likewise for the mapping of the host time page dom0 grants. The mapping is made from the worker thread, which
+    // the driver ties it to.
+    void UpdateHostTimePage(std::list<std::shared_ptr<IXenIfaceDevice>> &tombstones);
+    void QueueRequest(std::shared_ptr<IXenIfaceDevice> target, XenIfaceAction action);
+
+    std::shared_ptr<IXenIfacePlatform> _platform;
+    XenTimeMetrics &_metrics;
+    RequestQueue<XenIfaceWorkerRequest, QueueSize> _requests;
+    // pending interface events, one bit per XenIfaceAction
+    std::atomic<unsigned int> _interfaceEvents = 0;
+    std::atomic<bool> _overflow = false;
+    // released after every event, the worker soaks up the extra counts
+    std::counting_semaphore<> _wake{0};
+    // pushed by Retire, newest first
+    std::atomic<XenIfaceRetiredDevice *> _retired = nullptr;
+    std::mutex _handlerMutex;
+    _Guarded_by_(_handlerMutex) std::function<void()> _resumeHandler;
+    _Guarded_by_(_handlerMutex) std::function<void()> _pushHandler;
+    _Guarded_by_(_handlerMutex) std::function<void()> _arrivalHandler;
+    // owned by the worker thread, fastest first
+    std::vector<XenIfaceDeviceEntry> _devices;
+    XenIfaceRecovery _recovery;
+    XenHostSync _hostSync;
+    // owned by the worker thread: the port dom0 advertises, and the device that has bound it and to which port
+    std::optional<ULONG> _pushPort;
+    std::shared_ptr<IXenIfaceDevice> _pushDevice;
+    ULONG _pushDevicePort = 0;
+    // likewise for the host time page's grant reference
+    std::optional<ULONG> _timePageReference;
+    std::shared_ptr<IXenIfaceDevice> _timePageDevice;
+    ULONG _timePageDeviceReference = 0;
+    std::atomic<std::shared_ptr<IXenHostTimePage>> _hostTimePage;
+    // only written by the worker thread
+    std::atomic<std::shared_ptr<IXenIfaceDevice>> _active;
+    std::atomic<std::shared_ptr<IXenIfaceDevice>> _standby;
+    std::atomic<XenIfaceStartup> _startup = XenIfaceStartup::Enumerating;
     std::jthread _worker;
 };
@@ -0,0 +1,2273 @@
+// Benchmarks for the portable sampling core, run against the simulated xeniface backend.
+//
+// Usage: xentimeprovider_bench <mode> [options]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Platform.hpp"
+#include "ClockFilter.hpp"
+#include "DispersionEstimator.hpp"
+#include "DriftModel.hpp"
+#include "Logging.hpp"
+#include "Metrics.hpp"
+#include "OffsetFilter.hpp"
+#include "PvClock.hpp"
+#include "SampleRing.hpp"
+#include "SimXenIface.hpp"
+#include "TimeConverter.hpp"
+#include "XenHostSync.hpp"
+#include "XenIfaceWorker.hpp"
+#include "XenTimeProvider.hpp"
+#include "XenTimeSampler.hpp"
+#include "XenTimeTelemetry.hpp"
+
+using BenchClock = std::chrono::steady_clock;
+
+struct BenchLatencies {
+    std::vector<unsigned __int64> Values;
+
+    void Add(BenchClock::duration duration) {
+        Values.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    }
+
+    void Merge(const BenchLatencies &other) {
+        Values.insert(Values.end(), other.Values.begin(), other.Values.end());
+    }
+
+    void Print(const char *name) {
+        if (Values.empty()) {
+            printf("%-24s no samples\n", name);
+            return;
+        }
+        std::sort(Values.begin(), Values.end());
+        auto percentile = [&](double p) {
+            auto index = static_cast<size_t>(p * static_cast<double>(Values.size()));
+            return Values[(std::min)(index, Values.size() - 1)];
+        };
+        printf(
+            "%-24s n=%zu p50=%lluns p99=%lluns p99.9=%lluns max=%lluns\n",
+            name,
+            Values.size(),
+            percentile(0.5),
+            percentile(0.99),
+            percentile(0.999),
+            Values.back());
+    }
+};
+
+template <typename F> static BenchLatencies BenchStage(unsigned long iterations, F &&stage) {
+    BenchLatencies latencies;
+    latencies.Values.reserve(iterations);
+    for (unsigned long i = 0; i < iterations; i++) {
+        auto begin = BenchClock::now();
+        stage();
+        latencies.Add(BenchClock::now() - begin);
+    }
+    return latencies;
+}
+
+// For IOCTLs issued directly by the benchmarks, which never expect to hit it
+static XenIfaceDeadline BenchDeadline() {
+    return BenchClock::now() + std::chrono::seconds(5);
+}
+
+// Keeps results of benchmarked code observable so that the compiler can't drop the work
+static const void *volatile BenchSink;
+
+static void BenchSpin(std::chrono::nanoseconds duration) {
+    if (duration.count() <= 0)
+        return;
+    auto deadline = BenchClock::now() + duration;
+    while (BenchClock::now() < deadline) {
+    }
+}
+
+// Stand-in for w32time: the system clock is a SimClock without offset, and every callback takes
+// BenchCallbackLatency
+static SimClock *BenchSystemClock;
+static std::chrono::nanoseconds BenchCallbackLatency{0};
+
+static HRESULT __stdcall BenchGetTimeSysInfo(TimeSysInfo info, void *value) {
+    BenchSpin(BenchCallbackLatency);
+    switch (info) {
+    case TSI_CurrentTime:
+        *static_cast<unsigned __int64 *>(value) = BenchSystemClock->Now();
+        return S_OK;
+    case TSI_TickCount:
+        *static_cast<unsigned __int64 *>(value) =
+            std::chrono::duration_cast<std::chrono::milliseconds>(BenchClock::now().time_since_epoch()).count();
+        return S_OK;
+    case TSI_PhaseOffset:
+        *static_cast<signed __int64 *>(value) = 0;
+        return S_OK;
+    case TSI_PollInterval:
+        *static_cast<signed char *>(value) = 6;
+        return S_OK;
+    default:
+        return E_NOTIMPL;
+    }
+}
+
+static HRESULT __stdcall BenchLogTimeProvEvent(WORD type, WCHAR *facility, WCHAR *message) {
+    UNREFERENCED_PARAMETER(type);
+    UNREFERENCED_PARAMETER(facility);
+    UNREFERENCED_PARAMETER(message);
+    return S_OK;
+}
+
+static HRESULT __stdcall BenchAlertSamplesAvail() {
+    return S_OK;
+}
+
+static TimeProvSysCallbacks BenchCallbacks{
+    .dwSize = sizeof(TimeProvSysCallbacks),
+    .pfnGetTimeSysInfo = BenchGetTimeSysInfo,
+    .pfnLogTimeProvEvent = BenchLogTimeProvEvent,
+    .pfnAlertSamplesAvail = BenchAlertSamplesAvail,
+    .pfnSetProviderStatus = nullptr,
+};
+
+static void PrintHistogram(const char *name, const MetricsHistogramSnapshot &histogram, const char *unit) {
+    if (histogram.Count == 0) {
+        printf("%-24s no samples\n", name);
+        return;
+    }
+    printf(
+        "%-24s n=%llu p50<=%llu%s p99<=%llu%s p99.9<=%llu%s max=%llu%s\n",
+        name,
+        histogram.Count,
+        histogram.Percentile(0.5),
+        unit,
+        histogram.Percentile(0.99),
+        unit,
+        histogram.Percentile(0.999),
+        unit,
+        histogram.Max,
+        unit);
+}
+
+static void PrintMetrics(const XenTimeMetrics &metrics) {
+    XenTimeMetricsSnapshot snapshot;
+    metrics.Snapshot(&snapshot);
+
+    printf(
+        "metrics: %llu rounds, %llu published, %llu pending, %llu failed, %llu IOCTL failures, %llu timeouts, "
+        "%llu fallbacks\n",
+        snapshot.Rounds,
+        snapshot.SamplesPublished,
+        snapshot.PendingRounds,
+        snapshot.FailedRounds,
+        snapshot.IoctlFailures,
+        snapshot.IoctlTimeouts,
+        snapshot.FallbackActivations);
+    printf(
+        "metrics: %llu rejected offsets, %llu untrusted rounds, %llu holdover rounds, %llu host unsynced rounds, "
+        "%llu host sync updates, %llu host time page maps\n",
+        snapshot.RejectedOffsets,
+        snapshot.UntrustedRounds,
+        snapshot.HoldoverRounds,
+        snapshot.HostUnsyncedRounds,
+        snapshot.HostSyncUpdates,
+        snapshot.HostTimePageMaps);
+    printf(
+        "metrics: %llu device opens, %llu open failures, %llu removals, %llu failovers, %llu retries\n",
+        snapshot.DeviceOpens,
+        snapshot.DeviceOpenFailures,
+        snapshot.DeviceRemovals,
+        snapshot.DeviceFailovers,
+        snapshot.DeviceRetries);
+    printf("metrics: %llu events coalesced, %llu event overflows\n", snapshot.EventsCoalesced, snapshot.EventOverflows);
+    printf(
+        "metrics: %llu resumes, %llu pushes, %llu suspend epochs, %llu straddled bursts\n",
+        snapshot.Resumes,
+        snapshot.PushNotifications,
+        snapshot.SuspendEpochs,
+        snapshot.StraddledBursts);
+    PrintHistogram("IoctlLatency", snapshot.IoctlLatency, "ns");
+    PrintHistogram("PvClockLatency", snapshot.PvClockLatency, "ns");
+    PrintHistogram("HostTimePageLatency", snapshot.HostTimePageLatency, "ns");
+    PrintHistogram("Delay", snapshot.Delay, "x100ns");
+    PrintHistogram("Offset", snapshot.Offset, "x100ns");
+    PrintHistogram("ResumeRecovery", snapshot.ResumeRecovery, "ns");
+    PrintHistogram("PushLatency", snapshot.PushLatency, "ns");
+    PrintHistogram("DeviceRecovery", snapshot.DeviceRecovery, "ns");
+    PrintHistogram("StartupLatency", snapshot.StartupLatency, "ns");
+}
+
+static bool ParseUnsigned(const char *text, unsigned long *value) {
+    char *end;
+    *value = strtoul(text, &end, 0);
+    return *text && !*end;
+}
+
+// Removes and re-adds interfaces every pause microseconds (0 for back to back) while sampler threads keep reading the
+// host clock through the active device. Samplers should never wait on the PnP side and vice versa, and with more than
+// one interface, never go without a device. Interface i is i x 5us slower than the first, so that ranking shows.
+static int BenchHotplug(int argc, char **argv) {
+    unsigned long seconds = 5, pause = 1000, samplers = 1, interfaces = 2;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &seconds))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &pause))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &samplers))
+        return -1;
+    if (argc > 3 && (!ParseUnsigned(argv[3], &interfaces) || interfaces == 0))
+        return -1;
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    platform->SetOptions(options);
+
+    std::vector<std::wstring> paths;
+    for (unsigned long i = 0; i < interfaces; i++) {
+        paths.emplace_back(L"\\\\?\\sim#xeniface#" + std::to_wstring(i));
+        platform->AddInterface(paths.back(), std::chrono::microseconds(5 * i));
+    }
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    auto ready = BenchClock::now() + std::chrono::seconds(1);
+    while (!worker.GetDevice() && BenchClock::now() < ready)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    std::atomic<bool> stop = false;
+    std::vector<BenchLatencies> snapshotLatencies(samplers), sampleLatencies(samplers), gapLatencies(samplers);
+    std::vector<unsigned __int64> noDevice(samplers), failed(samplers);
+    std::vector<std::thread> threads;
+
+    for (unsigned long i = 0; i < samplers; i++) {
+        threads.emplace_back([&, i] {
+            auto lastRead = BenchClock::now();
+            while (!stop.load(std::memory_order_relaxed)) {
+                auto begin = BenchClock::now();
+                auto device = worker.GetDevice();
+                auto snapshot = BenchClock::now();
+                snapshotLatencies[i].Add(snapshot - begin);
+                if (!device) {
+                    noDevice[i]++;
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                FILETIME time;
+                if (FAILED(device->GetHostTime(&time, BenchDeadline()))) {
+                    // a closed handle fails without reaching the driver, don't let that starve the PnP thread
+                    failed[i]++;
+                    std::this_thread::yield();
+                    continue;
+                }
+                auto now = BenchClock::now();
+                sampleLatencies[i].Add(now - begin);
+                gapLatencies[i].Add(now - lastRead);
+                lastRead = now;
+            }
+        });
+    }
+
+    BenchLatencies removals, arrivals;
+    unsigned __int64 vetoed = 0;
+    auto begin = BenchClock::now();
+    auto deadline = begin + std::chrono::seconds(seconds);
+    for (size_t round = 0; BenchClock::now() < deadline; round++) {
+        const auto &path = paths[round % paths.size()];
+        // every fourth removal is vetoed by another driver, which leaves the handle closed but the interface present
+        auto veto = round % 4 == 3;
+
+        auto start = BenchClock::now();
+        platform->RemoveInterface(path, veto);
+        auto removed = BenchClock::now();
+        platform->AddInterface(path);
+        arrivals.Add(BenchClock::now() - removed);
+
+        if (veto)
+            vetoed++;
+        else
+            removals.Add(removed - start);
+
+        if (pause)
+            std::this_thread::sleep_for(std::chrono::microseconds(pause));
+    }
+    auto elapsed = std::chrono::duration<double>(BenchClock::now() - begin).count();
+
+    stop.store(true, std::memory_order_relaxed);
+    for (auto &thread : threads)
+        thread.join();
+
+    BenchLatencies snapshots, samples, gaps;
+    unsigned __int64 totalNoDevice = 0, totalFailed = 0;
+    for (unsigned long i = 0; i < samplers; i++) {
+        snapshots.Merge(snapshotLatencies[i]);
+        samples.Merge(sampleLatencies[i]);
+        gaps.Merge(gapLatencies[i]);
+        totalNoDevice += noDevice[i];
+        totalFailed += failed[i];
+    }
+
+    printf(
+        "hotplug: %.2fs, %lu samplers, %lu interfaces, %zu removals (%llu vetoed), %.0f PnP rounds/s\n",
+        elapsed,
+        samplers,
+        interfaces,
+        arrivals.Values.size(),
+        vetoed,
+        static_cast<double>(arrivals.Values.size()) / elapsed);
+    snapshots.Print("GetDevice");
+    samples.Print("GetDevice+GetHostTime");
+    gaps.Print("between good reads");
+    removals.Print("RemoveInterface");
+    arrivals.Print("AddInterface");
+    printf(
+        "samples: %.0f/s, no device: %llu, failed IOCTLs: %llu\n",
+        static_cast<double>(samples.Values.size()) / elapsed,
+        totalNoDevice,
+        totalFailed);
+    PrintMetrics(metrics);
+    return 0;
+}
+
+// Reads host time through the shared page and through the IOCTL of a device with the given driver round trip, and
+// compares both against the simulated host clock.
+static int BenchPvClock(int argc, char **argv) {
+    unsigned long iterations = 1000000, latency = 20;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &iterations))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &latency))
+        return -1;
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(latency) / 2;
+    options.ResponseLatency = std::chrono::microseconds(latency) / 2;
+    platform->SetOptions(options);
+    std::wstring path(L"\\\\?\\sim#xeniface#0");
+    platform->AddInterface(path);
+
+    std::shared_ptr<IXenIfaceDevice> device;
+    std::shared_ptr<IXenSharedTimePage> page;
+    if (FAILED(platform->Open(path, nullptr, device)) || FAILED(device->GetSharedTimePage(page))) {
+        fprintf(stderr, "cannot open simulated device\n");
+        return 1;
+    }
+    PvClockReader reader(page);
+
+    BenchLatencies pvclockLatencies, ioctlLatencies, errors;
+    unsigned __int64 failed = 0;
+    for (unsigned long i = 0; i < iterations; i++) {
+        unsigned __int64 time;
+        auto begin = BenchClock::now();
+        auto hr = reader.Read(&time);
+        pvclockLatencies.Add(BenchClock::now() - begin);
+        if (FAILED(hr)) {
+            failed++;
+            continue;
+        }
+
+        signed __int64 error = time - platform->GetHostClock().Now();
+        errors.Values.push_back((error < 0 ? -error : error) * 100);
+    }
+
+    // the IOCTL path is dominated by the simulated round trip, a fraction of the iterations is plenty
+    for (unsigned long i = 0; i < (std::max)(iterations / 100, 1UL); i++) {
+        FILETIME time;
+        auto begin = BenchClock::now();
+        if (FAILED(device->GetHostTime(&time, BenchDeadline())))
+            failed++;
+        ioctlLatencies.Add(BenchClock::now() - begin);
+    }
+
+    printf("pvclock: %lu reads, %luus IOCTL round trip, %llu failed\n", iterations, latency, failed);
+    pvclockLatencies.Print("PvClockReader::Read");
+    ioctlLatencies.Print("GetHostTime");
+    errors.Print("|pvclock - host clock|");
+    return 0;
+}
+
+// Converts local times spaced step seconds apart, starting now, with both TimeConvertFileTime and LocalTimeConverter.
+// With a step of a few hours the run crosses DST transitions of the process time zone (TZ on Linux).
+static int BenchLocalTime(int argc, char **argv) {
+    unsigned long iterations = 100000, step = 1;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &iterations))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &step))
+        return -1;
+
+    SimClock clock;
+    auto start = clock.Now();
+    LocalTimeConverter converter;
+    BenchLatencies directLatencies, cachedLatencies;
+    unsigned __int64 failed = 0, mismatched = 0, ambiguous = 0;
+
+    for (unsigned long i = 0; i < iterations; i++) {
+        unsigned __int64 local = start + i * TIME_S(static_cast<unsigned __int64>(step)) + i % TIME_S(1);
+        FILETIME input{
+            .dwLowDateTime = static_cast<DWORD>(local),
+            .dwHighDateTime = static_cast<DWORD>(local >> 32),
+        };
+        FILETIME output;
+
+        auto begin = BenchClock::now();
+        auto ok = TimeConvertFileTime(&input, &output, TimeConvertLocalToUniversal, nullptr);
+        directLatencies.Add(BenchClock::now() - begin);
+
+        unsigned __int64 universal, dispersion;
+        begin = BenchClock::now();
+        auto hr = converter.LocalToUniversal(local, &universal, &dispersion);
+        cachedLatencies.Add(BenchClock::now() - begin);
+
+        if (!ok || FAILED(hr)) {
+            failed++;
+            continue;
+        }
+        if (dispersion > 1)
+            ambiguous++;
+        else if (universal != (static_cast<unsigned __int64>(output.dwHighDateTime) << 32 | output.dwLowDateTime))
+            mismatched++;
+    }
+
+    printf(
+        "localtime: %lu conversions %lus apart, %llu failed, %llu mismatched, %llu near a transition\n",
+        iterations,
+        step,
+        failed,
+        mismatched,
+        ambiguous);
+    directLatencies.Print("TimeConvertFileTime");
+    cachedLatencies.Print("LocalTimeConverter");
+    return 0;
+}
+
+// Times each stage of a sampling round in isolation against mock w32time callbacks and a simulated device, then runs
+// the sampler back to back for the given time to measure whole rounds. source is where host time comes from: ioctl
+// (GET_HOST_TIME), pvclock (the shared time page) or fallback (GET_TIME in local time).
+static int BenchSample(int argc, char **argv) {
+    unsigned long seconds = 2, latency = 20, callbackLatency = 0;
+    std::string source = "pvclock";
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &seconds))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &latency))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &callbackLatency))
+        return -1;
+    if (argc > 3)
+        source = argv[3];
+    if (source != "ioctl" && source != "pvclock" && source != "fallback")
+        return -1;
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(callbackLatency);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(latency) / 2;
+    options.ResponseLatency = std::chrono::microseconds(latency) / 2;
+    if (source == "fallback")
+        options.HostTimeError = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+    platform->SetOptions(options);
+    std::wstring path(L"\\\\?\\sim#xeniface#0");
+    platform->AddInterface(path);
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    auto deadline = BenchClock::now() + std::chrono::seconds(1);
+    while (!worker.GetDevice() && BenchClock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto device = worker.GetDevice();
+    std::shared_ptr<IXenSharedTimePage> page;
+    if (!device || FAILED(device->GetSharedTimePage(page))) {
+        fprintf(stderr, "cannot open simulated device\n");
+        return 1;
+    }
+
+    const unsigned long iterations = 100000;
+    // IOCTLs are dominated by the simulated round trip, fewer iterations are plenty
+    const unsigned long ioctlIterations = 10000;
+
+    printf(
+        "sample: %luus IOCTL round trip, %luns per callback, host time from %s\n",
+        latency,
+        callbackLatency,
+        source.c_str());
+
+    unsigned __int64 time;
+    BenchStage(iterations, [&] {
+        BenchCallbacks.pfnGetTimeSysInfo(TSI_CurrentTime, &time);
+    }).Print("pfnGetTimeSysInfo");
+
+    BenchStage(iterations, [&] {
+        auto snapshot = worker.GetDevice();
+        BenchSink = snapshot.get();
+    }).Print("GetDevice");
+
+    FILETIME fileTime;
+    bool local;
+    BenchStage(ioctlIterations, [&] { device->GetHostTime(&fileTime, BenchDeadline()); }).Print("GetHostTime IOCTL");
+    BenchStage(ioctlIterations, [&] { device->GetTime(&fileTime, &local, BenchDeadline()); }).Print("GetTime IOCTL");
+
+    PvClockReader reader(page);
+    BenchStage(iterations, [&] { reader.Read(&time); }).Print("PvClockReader::Read");
+
+    FILETIME localTime{
+        .dwLowDateTime = static_cast<DWORD>(systemClock.Now()),
+        .dwHighDateTime = static_cast<DWORD>(systemClock.Now() >> 32),
+    };
+    BenchStage(iterations, [&] {
+        TimeConvertFileTime(&localTime, &fileTime, TimeConvertLocalToUniversal, nullptr);
+    }).Print("TimeConvertFileTime");
+
+    LocalTimeConverter converter;
+    unsigned __int64 dispersion;
+    auto localValue = static_cast<unsigned __int64>(localTime.dwHighDateTime) << 32 | localTime.dwLowDateTime;
+    BenchStage(iterations, [&] { converter.LocalToUniversal(localValue++, &time, &dispersion); })
+        .Print("LocalTimeConverter");
+
+    TimeSample sample;
+    BenchStage(iterations, [&] {
+        sample = TimeSample{
+            .dwSize = sizeof(TimeSample),
+            .dwRefid = ' NEX',
+            .toOffset = static_cast<signed __int64>(time),
+            .toDelay = TIME_US(20),
+            .tpDispersion = 0,
+            .nSysTickCount = time,
+            .nSysPhaseOffset = 0,
+            .nLeapFlags = 3,
+            .nStratum = 0,
+            .dwTSFlags = TSF_Hardware,
+        };
+        wcsncpy_s(sample.wszUniqueName, path.c_str(), _TRUNCATE);
+        BenchSink = &sample;
+    }).Print("TimeSample");
+
+    ClockFilter filter;
+    unsigned __int64 timestamp = systemClock.Now();
+    BenchStage(iterations, [&] {
+        filter.Add(sample, timestamp);
+        auto selected = filter.Select(timestamp);
+        BenchSink = &selected;
+        timestamp += TIME_MS(1);
+    }).Print("ClockFilter");
+
+    SampleRing<TimeSample, 8> ring;
+    BenchStage(iterations, [&] { ring.Push(sample); }).Print("SampleRing::Push");
+    BenchStage(iterations, [&] { ring.ReadLatest(&sample); }).Print("SampleRing::ReadLatest");
+
+    // whole rounds, with the reader polling the way GetSamples does
+    XenTimeSamplerConfig config;
+    config.Interval = std::chrono::milliseconds(0);
+    config.PvClock = source == "pvclock";
+    config.AllowFallback = source == "fallback";
+
+    BenchLatencies getLatest, delays;
+    unsigned __int64 first = 0, sequence = 0;
+    double elapsed;
+    {
+        XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+        sampler.Configure(config);
+
+        auto begin = BenchClock::now();
+        auto end = begin + std::chrono::seconds(seconds);
+        while (BenchClock::now() < end) {
+            auto start = BenchClock::now();
+            auto found = sampler.GetLatest(&sample, &sequence);
+            getLatest.Add(BenchClock::now() - start);
+            if (found) {
+                if (!first)
+                    first = sequence;
+                delays.Values.push_back(static_cast<unsigned __int64>(sample.toDelay) * 100);
+            }
+            // leave the CPU to the sampler on small machines
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        elapsed = std::chrono::duration<double>(BenchClock::now() - begin).count();
+    }
+
+    auto rounds = sequence > first ? sequence - first : 0;
+    printf(
+        "rounds: %.0f/s (%.0f host time reads/s), %.1fus per round\n",
+        static_cast<double>(rounds) / elapsed,
+        static_cast<double>(rounds * config.BurstCount) / elapsed,
+        rounds ? elapsed * 1000000 / static_cast<double>(rounds) : 0.0);
+    getLatest.Print("GetLatest");
+    delays.Print("selected toDelay");
+    PrintMetrics(metrics);
+    return 0;
+}
+
+// Records values spread over the whole range from several threads at once, then checks that the snapshot accounts
+// for every one of them and that percentiles land in the right buckets.
+static int BenchMetrics(int argc, char **argv) {
+    unsigned long iterations = 1000000, threadCount = 4;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &iterations))
+        return -1;
+    if (argc > 1 && (!ParseUnsigned(argv[1], &threadCount) || threadCount == 0))
+        return -1;
+
+    MetricsHistogram histogram;
+    std::vector<BenchLatencies> latencies(threadCount);
+    std::vector<std::thread> threads;
+    for (unsigned long t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t] {
+            latencies[t].Values.reserve(iterations);
+            for (unsigned long i = 0; i < iterations; i++) {
+                // 0, 1, 2, 4, ... 2^63 and the values just below them
+                auto shift = i % 65;
+                unsigned __int64 value = shift == 0 ? 0 : (1ULL << (shift - 1)) - (i & 64 ? 1 : 0);
+                auto begin = BenchClock::now();
+                histogram.Record(value);
+                latencies[t].Add(BenchClock::now() - begin);
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    MetricsHistogramSnapshot snapshot;
+    histogram.Snapshot(&snapshot);
+
+    BenchLatencies recordLatencies;
+    for (const auto &threadLatencies : latencies)
+        recordLatencies.Merge(threadLatencies);
+
+    int errors = 0;
+    if (snapshot.Count != iterations * threadCount) {
+        printf("count mismatch: %llu != %lu\n", snapshot.Count, iterations * threadCount);
+        errors++;
+    }
+    if (snapshot.Max != 1ULL << 63) {
+        printf("max mismatch: %llx\n", snapshot.Max);
+        errors++;
+    }
+
+    printf("metrics: %lu threads x %lu records, %d errors\n", threadCount, iterations, errors);
+    recordLatencies.Print("MetricsHistogram::Record");
+    PrintHistogram("recorded", snapshot, "");
+    return errors ? 1 : 0;
+}
+
+struct BenchTraceEntry {
+    signed __int64 Offset;
+    signed __int64 Delay;
+    // true offset if known
+    bool HasTruth;
+    signed __int64 Truth;
+};
+
+// Lines of "offset delay [true-offset]" in 100 ns units, e.g. recorded from a guest
+static bool LoadTrace(const char *path, std::vector<BenchTraceEntry> &trace) {
+    auto file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        long long offset, delay, truth;
+        auto fields = sscanf(line, "%lld %lld %lld", &offset, &delay, &truth);
+        if (fields < 2)
+            continue;
+        trace.emplace_back(BenchTraceEntry{
+            .Offset = offset,
+            .Delay = delay,
+            .HasTruth = fields == 3,
+            .Truth = fields == 3 ? truth : 0,
+        });
+    }
+    fclose(file);
+    return true;
+}
+
+// One read per second from a local clock off by driftPpm. Each read has Gaussian noise of noiseUs, and the host is
+// loaded every other 100 s: reads then get exponentially distributed extra latency averaging loadUs on one random leg.
+static void SimulateTrace(
+    std::vector<BenchTraceEntry> &trace,
+    unsigned long count,
+    double noiseUs,
+    double driftPpm,
+    double loadUs) {
+    std::mt19937_64 random(42);
+    std::normal_distribution<double> noise(0, TIME_US(noiseUs));
+    std::exponential_distribution<double> load(1 / (std::max)(static_cast<double>(TIME_US(loadUs)), 1.0));
+    std::bernoulli_distribution leg(0.5);
+
+    for (unsigned long i = 0; i < count; i++) {
+        auto truth = static_cast<signed __int64>(driftPpm * TIME_S(static_cast<double>(i)) / 1000000);
+        auto loaded = (i / 100) % 2 == 1;
+        auto extra = loaded ? load(random) : 0.0;
+        auto delay = TIME_US(20) + extra;
+        auto offset = static_cast<double>(truth) + noise(random) + (leg(random) ? extra / 2 : -extra / 2);
+        trace.emplace_back(BenchTraceEntry{
+            .Offset = static_cast<signed __int64>(offset),
+            .Delay = static_cast<signed __int64>(delay),
+            .HasTruth = true,
+            .Truth = truth,
+        });
+    }
+}
+
+// Feeds a trace through DispersionEstimator and reports how often the true offset lies within the resulting root
+// distance (delay / 2 + dispersion), compared with the constant dispersion of 0 used before.
+static int BenchDispersion(int argc, char **argv) {
+    std::vector<BenchTraceEntry> trace;
+
+    if (argc > 0 && strcmp(argv[0], "sim")) {
+        if (!LoadTrace(argv[0], trace)) {
+            fprintf(stderr, "cannot read %s\n", argv[0]);
+            return 1;
+        }
+    } else {
+        unsigned long count = 10000, noise = 2, load = 200;
+        long drift = 15;
+        if (argc > 1 && !ParseUnsigned(argv[1], &count))
+            return -1;
+        if (argc > 2 && !ParseUnsigned(argv[2], &noise))
+            return -1;
+        if (argc > 3)
+            drift = strtol(argv[3], nullptr, 0);
+        if (argc > 4 && !ParseUnsigned(argv[4], &load))
+            return -1;
+        SimulateTrace(trace, count, static_cast<double>(noise), static_cast<double>(drift), static_cast<double>(load));
+    }
+
+    DispersionEstimator estimator;
+    BenchLatencies estimates, errors;
+    unsigned __int64 known = 0, covered = 0, coveredBefore = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        const auto &entry = trace[i];
+        estimator.Add(entry.Offset, entry.Delay, TIME_S(static_cast<unsigned __int64>(i)));
+        auto estimate = estimator.Estimate(entry.Delay);
+        estimates.Values.push_back(estimate * 100);
+        if (!entry.HasTruth)
+            continue;
+
+        auto error = entry.Offset > entry.Truth ? entry.Offset - entry.Truth : entry.Truth - entry.Offset;
+        errors.Values.push_back(static_cast<unsigned __int64>(error) * 100);
+        known++;
+        if (static_cast<unsigned __int64>(error) <= static_cast<unsigned __int64>(entry.Delay / 2) + estimate)
+            covered++;
+        if (error <= entry.Delay / 2)
+            coveredBefore++;
+    }
+
+    printf(
+        "dispersion: %zu samples, delay %.0f +- %.0f x100ns at the end\n",
+        trace.size(),
+        estimator.DelayMean(),
+        estimator.DelayDeviation());
+    estimates.Print("estimated dispersion");
+    if (known) {
+        errors.Print("actual |error|");
+        printf(
+            "within root distance: %.2f%% (%.2f%% with dispersion 0)\n",
+            100.0 * static_cast<double>(covered) / static_cast<double>(known),
+            100.0 * static_cast<double>(coveredBefore) / static_cast<double>(known));
+    }
+    return 0;
+}
+
+// Simulated reads with spikes of spikeUs on a random fraction of them, through OffsetFilter. Reports how many spikes
+// are rejected, how many clean reads are lost, and the offset error with and without the loop.
+static int BenchOutliers(int argc, char **argv) {
+    unsigned long count = 10000, noise = 2, rate = 5, spike = 500;
+    long drift = 15;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &count))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &noise))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &rate))
+        return -1;
+    if (argc > 3 && !ParseUnsigned(argv[3], &spike))
+        return -1;
+    if (argc > 4)
+        drift = strtol(argv[4], nullptr, 0);
+
+    std::vector<BenchTraceEntry> trace;
+    SimulateTrace(trace, count, static_cast<double>(noise), static_cast<double>(drift), 0);
+
+    std::mt19937_64 random(7);
+    std::bernoulli_distribution spiked(static_cast<double>(rate) / 100);
+    std::bernoulli_distribution sign(0.5);
+    std::exponential_distribution<double> size(1 / static_cast<double>(TIME_US(spike)));
+
+    OffsetFilter filter;
+    BenchLatencies rawErrors, loopErrors;
+    unsigned __int64 spikes = 0, caught = 0, lost = 0, untrusted = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        auto entry = trace[i];
+        auto isSpike = spiked(random);
+        if (isSpike) {
+            // a spike always exceeds the bracket, or it would not be an outlier
+            auto extra = static_cast<signed __int64>(size(random)) + entry.Delay * 2;
+            entry.Offset += sign(random) ? extra : -extra;
+            spikes++;
+        }
+
+        auto verdict = filter.Add(entry.Offset, entry.Delay, TIME_S(static_cast<unsigned __int64>(i)));
+        if (!filter.IsTrusted())
+            untrusted++;
+        if (verdict == OffsetVerdict::Rejected) {
+            if (isSpike)
+                caught++;
+            else
+                lost++;
+            continue;
+        }
+
+        auto rawError = entry.Offset - entry.Truth;
+        auto loopError = filter.SmoothedOffset() - entry.Truth;
+        rawErrors.Values.push_back(static_cast<unsigned __int64>(rawError < 0 ? -rawError : rawError) * 100);
+        loopErrors.Values.push_back(static_cast<unsigned __int64>(loopError < 0 ? -loopError : loopError) * 100);
+    }
+
+    printf(
+        "outliers: %zu samples, %llu spikes, %llu rejected (%.2f%%), %llu clean samples rejected, %llu untrusted\n",
+        trace.size(),
+        spikes,
+        caught,
+        spikes ? 100.0 * static_cast<double>(caught) / static_cast<double>(spikes) : 0.0,
+        lost,
+        untrusted);
+    printf("frequency error at the end: %.2f ppm (simulated %ld)\n", filter.FrequencyPpm(), drift);
+    rawErrors.Print("accepted |error|");
+    loopErrors.Print("loop |error|");
+    return 0;
+}
+
+// Live migrations against a sampler that has settled at a round every interval-ms: each one sets the guest clock back
+// by pause-ms, as if the VM had been paused for that long, and has xeniface signal a resume unless noresume is given.
+// Reports how long until a sample reflecting the new offset is there for GetSamples to hand out.
+static int BenchMigrate(int argc, char **argv) {
+    unsigned long migrations = 3, pause = 500, interval = 100;
+    std::string mode = "resume";
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &migrations))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &pause))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &interval))
+        return -1;
+    if (argc > 3)
+        mode = argv[3];
+    if (mode != "resume" && mode != "noresume")
+        return -1;
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    platform->SetOptions(options);
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+    XenTimeSamplerConfig config;
+    config.Interval = std::chrono::milliseconds(interval);
+    sampler.Configure(config);
+
+    TimeSample sample;
+    unsigned __int64 sequence = 0;
+    auto waitForOffset = [&](signed __int64 expected, BenchClock::duration timeout, BenchClock::duration *elapsed) {
+        auto begin = BenchClock::now();
+        while (BenchClock::now() - begin < timeout) {
+            if (sampler.GetLatest(&sample, &sequence) && sample.toOffset > expected - TIME_MS(1) &&
+                sample.toOffset < expected + TIME_MS(1)) {
+                *elapsed = BenchClock::now() - begin;
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    };
+
+    // until the filters are full
+    BenchClock::duration elapsed;
+    for (size_t i = 0; i < 2 * OffsetFilter::WindowSize; i++) {
+        if (!waitForOffset(0, std::chrono::seconds(5), &elapsed)) {
+            fprintf(stderr, "no initial samples\n");
+            return 1;
+        }
+    }
+
+    printf("migrate: %lu migrations, %lums pause, %lums interval, %s\n", migrations, pause, interval, mode.c_str());
+    signed __int64 expected = 0;
+    unsigned long failures = 0;
+    for (unsigned long i = 0; i < migrations; i++) {
+        expected += TIME_MS(static_cast<signed __int64>(pause));
+        systemClock.Step(-TIME_MS(static_cast<signed __int64>(pause)));
+        if (mode == "resume")
+            platform->Resume();
+
+        if (waitForOffset(expected, std::chrono::seconds(60), &elapsed)) {
+            auto ms = std::chrono::duration<double, std::milli>(elapsed).count();
+            printf("migration %lu: recovered in %.1fms\n", i, ms);
+        } else {
+            printf("migration %lu: not recovered after 60s\n", i);
+            failures++;
+        }
+    }
+    PrintMetrics(metrics);
+    return failures ? 1 : 0;
+}
+
+// Suspends injected into host time IOCTLs at the given point of the bracket, each setting the guest clock back by
+// pause-ms. A sample whose bracket straddled one has a negative delay, clamped to 0, and must never be published.
+static int BenchSuspend(int argc, char **argv) {
+    unsigned long seconds = 2, rate = 5, pause = 100;
+    std::string point = "before";
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &seconds))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &rate))
+        return -1;
+    if (argc > 2)
+        point = argv[2];
+    if (argc > 3 && !ParseUnsigned(argv[3], &pause))
+        return -1;
+    if (point != "before" && point != "after")
+        return -1;
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    std::atomic<unsigned long> injected = 0;
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    options.SuspendRate = static_cast<double>(rate) / 100;
+    options.SuspendPoint = point == "before" ? SimSuspendPoint::BeforeRead : SimSuspendPoint::AfterRead;
+    options.OnSuspend = [&] {
+        systemClock.Step(-TIME_MS(static_cast<signed __int64>(pause)));
+        injected.fetch_add(1, std::memory_order_relaxed);
+    };
+    platform->SetOptions(options);
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+
+    unsigned long samples = 0, straddled = 0;
+    {
+        XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+        XenTimeSamplerConfig config;
+        config.Interval = std::chrono::milliseconds(10);
+        config.PvClock = false;
+        sampler.Configure(config);
+
+        TimeSample sample;
+        unsigned __int64 sequence = 0;
+        auto end = BenchClock::now() + std::chrono::seconds(seconds);
+        while (BenchClock::now() < end) {
+            if (sampler.GetLatest(&sample, &sequence)) {
+                samples++;
+                if (sample.toDelay <= 0)
+                    straddled++;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    printf(
+        "suspend: %lu suspends %s the read, %lu samples handed out, %lu of them straddling a suspend\n",
+        injected.load(),
+        point.c_str(),
+        samples,
+        straddled);
+    PrintMetrics(metrics);
+    return straddled ? 1 : 0;
+}
+
+// A random stream of PnP events on a single interface: removals vetoed by another driver, and removals followed by
+// the interface coming back. Each one is followed by up to failed-opens failing opens. Reports how long until the
+// worker has an open device again, which with backoff should be close to the sum of the retry delays.
+static int BenchReacquire(int argc, char **argv) {
+    unsigned long events = 8, failures = 3, seed = 1;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &events))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &failures))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &seed))
+        return -1;
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    platform->SetOptions(options);
+    std::wstring path(L"\\\\?\\sim#xeniface#0");
+    platform->AddInterface(path);
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    auto waitForDevice = [&](BenchClock::duration timeout, BenchClock::duration *elapsed) {
+        auto begin = BenchClock::now();
+        while (BenchClock::now() - begin < timeout) {
+            auto device = worker.GetDevice();
+            if (device && device->IsOpen()) {
+                *elapsed = BenchClock::now() - begin;
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    };
+
+    BenchClock::duration elapsed;
+    if (!waitForDevice(std::chrono::seconds(1), &elapsed)) {
+        fprintf(stderr, "no initial device\n");
+        return 1;
+    }
+
+    printf("reacquire: %lu events, up to %lu failed opens each, seed %lu\n", events, failures, seed);
+    std::mt19937 random(seed);
+    unsigned long missed = 0;
+    for (unsigned long i = 0; i < events; i++) {
+        auto veto = std::bernoulli_distribution(0.5)(random);
+        auto failed = std::uniform_int_distribution<unsigned long>(0, failures)(random);
+
+        BenchClock::duration expected{0};
+        for (unsigned long k = 0; k < failed; k++)
+            expected += (std::min)(
+                std::chrono::milliseconds(XenIfaceWorker::RetryInitialDelay * (1LL << (std::min)(k, 16UL))),
+                XenIfaceWorker::RetryMaxDelay);
+
+        platform->FailOpens(static_cast<unsigned int>(failed));
+        platform->RemoveInterface(path, veto);
+        if (!veto)
+            platform->AddInterface(path);
+
+        auto timeout = expected + std::chrono::seconds(1);
+        if (waitForDevice(timeout, &elapsed)) {
+            printf(
+                "event %lu: %s, %lu failed opens, recovered in %.1fms (backoff %.0fms)\n",
+                i,
+                veto ? "vetoed removal" : "removal",
+                failed,
+                std::chrono::duration<double, std::milli>(elapsed).count(),
+                std::chrono::duration<double, std::milli>(expected).count());
+        } else {
+            auto ms = std::chrono::duration<double, std::milli>(timeout).count();
+            printf("event %lu: not recovered after %.0fms\n", i, ms);
+            missed++;
+        }
+    }
+    PrintMetrics(metrics);
+    return missed ? 1 : 0;
+}
+
+// A driver that pends stall-% of the IOCTLs, for stall-ms or until cancelled if 0, and that ignores cancellation with
+// nocancel. The sampler takes a round every 10ms with IOCTLs abandoned after timeout-ms, and must keep going: reports
+// the time between published samples, which should stay within a few timeouts.
+static int BenchStall(int argc, char **argv) {
+    unsigned long seconds = 2, rate = 10, stall = 0, timeout = 20;
+    std::string mode = "cancel";
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &seconds))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &rate))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &stall))
+        return -1;
+    if (argc > 3 && (!ParseUnsigned(argv[3], &timeout) || timeout == 0))
+        return -1;
+    if (argc > 4)
+        mode = argv[4];
+    if (mode != "cancel" && mode != "nocancel")
+        return -1;
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    options.StallRate = static_cast<double>(rate) / 100;
+    options.StallLatency = std::chrono::milliseconds(stall);
+    options.IgnoreCancel = mode == "nocancel";
+    platform->SetOptions(options);
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+
+    BenchLatencies gaps;
+    {
+        XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+        XenTimeSamplerConfig config;
+        config.Interval = std::chrono::milliseconds(10);
+        config.IoctlTimeout = std::chrono::milliseconds(timeout);
+        config.PvClock = false;
+        sampler.Configure(config);
+
+        TimeSample sample;
+        unsigned __int64 sequence = 0;
+        auto last = BenchClock::now();
+        auto end = last + std::chrono::seconds(seconds);
+        while (BenchClock::now() < end) {
+            if (sampler.GetLatest(&sample, &sequence)) {
+                auto now = BenchClock::now();
+                gaps.Add(now - last);
+                last = now;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    printf(
+        "stall: %lu%% of IOCTLs stalled for %s, %lums timeout, %s\n",
+        rate,
+        stall ? (std::to_string(stall) + "ms").c_str() : "ever",
+        timeout,
+        mode.c_str());
+    gaps.Print("between samples");
+    PrintMetrics(metrics);
+    return gaps.Values.empty() ? 1 : 0;
+}
+
+// Passes everything through to the simulation, and timestamps enumerations: each one is the worker handling an
+// interface arrival
+class BenchCountingPlatform : public IXenIfacePlatform {
+public:
+    explicit BenchCountingPlatform(_In_ std::shared_ptr<SimXenIfacePlatform> platform)
+        : _platform(std::move(platform)) {}
+
+    HRESULT Subscribe(_In_ IXenIfaceEvents *events) override {
+        return _platform->Subscribe(events);
+    }
+    void Unsubscribe() override {
+        _platform->Unsubscribe();
+    }
+    HRESULT Enumerate(_Out_ std::vector<std::wstring> &interfaces) override {
+        {
+            std::lock_guard lock(_mutex);
+            _count++;
+            _last = BenchClock::now();
+        }
+        return _platform->Enumerate(interfaces);
+    }
+    HRESULT Open(
+        _In_ const std::wstring &path,
+        _In_ IXenIfaceEvents *events,
+        _Out_ std::shared_ptr<IXenIfaceDevice> &device) override {
+        return _platform->Open(path, events, device);
+    }
+
+    // number of enumerations so far, and when the last one started
+    size_t GetEnumerations(_Out_opt_ BenchClock::time_point *last = nullptr) {
+        std::lock_guard lock(_mutex);
+        if (last)
+            *last = _last;
+        return _count;
+    }
+
+private:
+    std::shared_ptr<SimXenIfacePlatform> _platform;
+    std::mutex _mutex;
+    _Guarded_by_(_mutex) size_t _count = 0;
+    _Guarded_by_(_mutex) BenchClock::time_point _last;
+};
+
+// Bursts of PnP notifications fired at the worker from several threads at once, as CM may deliver them: interface
+// arrivals, which coalesce into enumerations, and resumes on the active device, which coalesce into resume handler
+// calls. Reports the cost of each notification callback, and how long after the last notification of a burst the
+// enumeration and the resume handler that cover it start.
+static int BenchEvents(int argc, char **argv) {
+    unsigned long bursts = 100, size = 64, producers = 4;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &bursts))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &size))
+        return -1;
+    if (argc > 2 && (!ParseUnsigned(argv[2], &producers) || producers == 0))
+        return -1;
+
+    auto sim = std::make_shared<SimXenIfacePlatform>();
+    sim->AddInterface(L"\\\\?\\sim#xeniface#0");
+    auto platform = std::make_shared<BenchCountingPlatform>(sim);
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    std::mutex handlerMutex;
+    size_t resumeCount = 0;
+    BenchClock::time_point lastResumeCall;
+    auto getResumes = [&](BenchClock::time_point *last) {
+        std::lock_guard lock(handlerMutex);
+        if (last)
+            *last = lastResumeCall;
+        return resumeCount;
+    };
+    worker.SetResumeHandler([&] {
+        std::lock_guard lock(handlerMutex);
+        resumeCount++;
+        lastResumeCall = BenchClock::now();
+    });
+
+    auto ready = BenchClock::now() + std::chrono::seconds(1);
+    while (!worker.GetDevice() && BenchClock::now() < ready)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto device = worker.GetDevice();
+    if (!device) {
+        fprintf(stderr, "no initial device\n");
+        return 1;
+    }
+
+    BenchLatencies callbacks, arrivalLatencies, resumeLatencies, enumerations, resumeCalls;
+    unsigned long missed = 0;
+    for (unsigned long burst = 0; burst < bursts; burst++) {
+        auto enumerationsBefore = platform->GetEnumerations();
+        auto resumesBefore = getResumes(nullptr);
+
+        std::atomic<bool> go = false;
+        std::vector<BenchLatencies> threadCallbacks(producers);
+        std::vector<BenchClock::time_point> lastArrival(producers), lastResume(producers);
+        std::vector<std::thread> threads;
+        for (unsigned long i = 0; i < producers; i++) {
+            threads.emplace_back([&, i] {
+                while (!go.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                for (unsigned long n = i; n < size; n += producers) {
+                    auto begin = BenchClock::now();
+                    if (n % 2)
+                        worker.OnDeviceEvent(device, XenIfaceAction::Resume);
+                    else
+                        worker.OnInterfaceEvent(XenIfaceAction::InterfaceArrival);
+                    auto end = BenchClock::now();
+                    threadCallbacks[i].Add(end - begin);
+                    (n % 2 ? lastResume : lastArrival)[i] = end;
+                }
+            });
+        }
+        go.store(true, std::memory_order_release);
+        for (auto &thread : threads)
+            thread.join();
+        auto lastArrivalTime = *std::max_element(lastArrival.begin(), lastArrival.end());
+        auto lastResumeTime = *std::max_element(lastResume.begin(), lastResume.end());
+        for (auto &latencies : threadCallbacks)
+            callbacks.Merge(latencies);
+
+        // until the worker has been idle for a while
+        size_t enumerationsAfter = enumerationsBefore, resumesAfter = resumesBefore;
+        auto quiet = BenchClock::now();
+        while (BenchClock::now() - quiet < std::chrono::milliseconds(5)) {
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+            auto enumerationsNow = platform->GetEnumerations();
+            auto resumesNow = getResumes(nullptr);
+            if (enumerationsNow != enumerationsAfter || resumesNow != resumesAfter) {
+                enumerationsAfter = enumerationsNow;
+                resumesAfter = resumesNow;
+                quiet = BenchClock::now();
+            }
+        }
+
+        if (enumerationsAfter == enumerationsBefore || (size > 1 && resumesAfter == resumesBefore)) {
+            missed++;
+            continue;
+        }
+        enumerations.Values.push_back(enumerationsAfter - enumerationsBefore);
+        resumeCalls.Values.push_back(resumesAfter - resumesBefore);
+        BenchClock::time_point handled;
+        platform->GetEnumerations(&handled);
+        arrivalLatencies.Add((std::max)(handled - lastArrivalTime, BenchClock::duration{}));
+        if (size > 1) {
+            getResumes(&handled);
+            resumeLatencies.Add((std::max)(handled - lastResumeTime, BenchClock::duration{}));
+        }
+    }
+    worker.SetResumeHandler(nullptr);
+
+    printf(
+        "events: %lu bursts of %lu notifications from %lu threads, %lu not handled\n",
+        bursts,
+        size,
+        producers,
+        missed);
+    callbacks.Print("notification callback");
+    arrivalLatencies.Print("arrival to enumeration");
+    resumeLatencies.Print("resume to handler");
+    std::sort(enumerations.Values.begin(), enumerations.Values.end());
+    std::sort(resumeCalls.Values.begin(), resumeCalls.Values.end());
+    if (!enumerations.Values.empty())
+        printf(
+            "per burst: %llu-%llu enumerations, %llu-%llu resume handler calls\n",
+            enumerations.Values.front(),
+            enumerations.Values.back(),
+            resumeCalls.Values.front(),
+            resumeCalls.Values.back());
+    PrintMetrics(metrics);
+    return missed ? 1 : 0;
+}
+
+// Records what reaches the event log, for checking what the log writer delivers
+static std::mutex BenchLogMutex;
+static std::vector<std::wstring> BenchLogMessages;
+
+static HRESULT __stdcall BenchRecordLogTimeProvEvent(WORD type, WCHAR *facility, WCHAR *message) {
+    UNREFERENCED_PARAMETER(type);
+    UNREFERENCED_PARAMETER(facility);
+    std::lock_guard lock(BenchLogMutex);
+    BenchLogMessages.emplace_back(message);
+    return S_OK;
+}
+
+// An outage logged from several threads at once, as by samplers all failing every round: the cost of each log call
+// on the caller's thread, formatting there as without a log writer and deferred to the writer thread, and what the
+// writer's rate limiting lets through to the event log. Without a pause, the producers outrun the writer and most
+// messages are dropped instead.
+static int BenchLogging(int argc, char **argv) {
+    unsigned long messages = 100000, producers = 4, pause = 10;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &messages))
+        return -1;
+    if (argc > 1 && (!ParseUnsigned(argv[1], &producers) || producers == 0))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &pause))
+        return -1;
+
+    auto path = L"\\\\?\\sim#xeniface#0";
+    auto run = [&] {
+        std::vector<BenchLatencies> threadLatencies(producers);
+        std::vector<std::thread> threads;
+        for (unsigned long i = 0; i < producers; i++) {
+            threads.emplace_back([&, i] {
+                threadLatencies[i].Values.reserve(messages / producers + 1);
+                for (unsigned long n = i; n < messages; n += producers) {
+                    auto begin = BenchClock::now();
+                    if (n % 2)
+                        TimeProvLog(
+                            BenchRecordLogTimeProvEvent,
+                            LogTimeProvEventTypeError,
+                            L"Update failed: %x",
+                            HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND));
+                    else
+                        TimeProvLog(
+                            BenchRecordLogTimeProvEvent,
+                            LogTimeProvEventTypeWarning,
+                            L"Open(%ls) failed %x",
+                            path,
+                            HRESULT_FROM_WIN32(ERROR_SHARING_VIOLATION));
+                    threadLatencies[i].Add(BenchClock::now() - begin);
+                    if (pause)
+                        std::this_thread::sleep_for(std::chrono::microseconds(pause));
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        BenchLatencies latencies;
+        for (auto &thread : threadLatencies)
+            latencies.Merge(thread);
+        return latencies;
+    };
+
+    auto direct = run();
+    size_t directDelivered;
+    {
+        std::lock_guard lock(BenchLogMutex);
+        directDelivered = BenchLogMessages.size();
+        BenchLogMessages.clear();
+    }
+
+    LogStatistics before, after;
+    BenchLatencies deferred;
+    LogGetStatistics(&before);
+    {
+        LogWriter writer;
+        deferred = run();
+        LogFlush();
+        LogGetStatistics(&after);
+    }
+
+    std::vector<std::wstring> delivered;
+    {
+        std::lock_guard lock(BenchLogMutex);
+        delivered = std::move(BenchLogMessages);
+        BenchLogMessages.clear();
+    }
+    auto queued = after.Queued - before.Queued;
+    auto suppressed = after.Suppressed - before.Suppressed;
+    auto dropped = after.Dropped - before.Dropped;
+
+    printf("logging: %lu messages from %lu threads, %lu us apart\n", messages, producers, pause);
+    direct.Print("formatted by caller");
+    deferred.Print("deferred");
+    printf(
+        "deferred: %llu queued, %zu delivered, %llu suppressed, %llu dropped\n",
+        queued,
+        delivered.size(),
+        suppressed,
+        dropped);
+    for (const auto &message : delivered)
+        printf("  %ls\n", message.c_str());
+
+    WCHAR expectedUpdate[256], expectedOpen[256];
+    swprintf(
+        expectedUpdate,
+        ARRAYSIZE(expectedUpdate),
+        L"Update failed: %x",
+        static_cast<unsigned int>(HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)));
+    swprintf(
+        expectedOpen,
+        ARRAYSIZE(expectedOpen),
+        L"Open(%ls) failed %x",
+        path,
+        static_cast<unsigned int>(HRESULT_FROM_WIN32(ERROR_SHARING_VIOLATION)));
+    auto formatted = std::all_of(delivered.begin(), delivered.end(), [&](const auto &message) {
+        return message == expectedUpdate || message == expectedOpen;
+    });
+    if (directDelivered != messages || queued + dropped != messages || delivered.size() + suppressed != queued ||
+        !formatted) {
+        fprintf(stderr, "log messages unaccounted for or misformatted\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Clock-health lines for dom0: first a fixed window against its expected encoding, then the sampler sending them
+// while a share of the IOCTLs fail, as captured by the simulated driver's log
+static int BenchTelemetry(int argc, char **argv) {
+    unsigned long seconds = 2, interval = 200, rate = 5;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &seconds))
+        return -1;
+    if (argc > 1 && (!ParseUnsigned(argv[1], &interval) || interval == 0))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &rate))
+        return -1;
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    options.FailureRate = static_cast<double>(rate) / 100;
+    platform->SetOptions(options);
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    {
+        XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+        XenTimeSamplerConfig config;
+        config.Interval = std::chrono::milliseconds(10);
+        config.PvClock = false;
+        config.TelemetryInterval = std::chrono::milliseconds(interval);
+        sampler.Configure(config);
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    }
+
+    auto lines = platform->TakeLog();
+    XenTimeMetricsSnapshot snapshot;
+    metrics.Snapshot(&snapshot);
+
+    printf("telemetry: %lus, %lums windows, %lu%% of IOCTLs failing\n", seconds, interval, rate);
+    unsigned __int64 rounds = 0;
+    bool valid = true;
+    for (const auto &line : lines) {
+        printf("  %s\n", line.c_str());
+        unsigned long long n;
+        auto fields = strstr(line.c_str(), " n=");
+        if (!fields || sscanf(fields, " n=%llu", &n) != 1)
+            valid = false;
+        else
+            rounds += n;
+        valid = valid && line.size() < IXenIfaceDevice::MaxLogLength && line.find('\n') == std::string::npos;
+    }
+    printf("%zu lines covering %llu of %llu rounds\n", lines.size(), rounds, snapshot.Rounds);
+
+    // The last window is cut short. The injected failures hit the log IOCTL too, whose line is then sent again a
+    // round later, so that no window's rounds go missing, but those of the last one.
+    auto windows = seconds * 1000 / interval;
+    auto lastRounds = 2 * interval / 10;
+    if (!valid || lines.size() + 1 < windows || lines.size() > windows || rounds > snapshot.Rounds ||
+        rounds + lastRounds < snapshot.Rounds) {
+        fprintf(stderr, "unexpected telemetry\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Clock status in the simulated XenStore: how many writes the thresholds and coalescing leave of one per key per
+// round, and whether a host clock step still makes it there
+static int BenchStatus(int argc, char **argv) {
+    unsigned long seconds = 2, interval = 50, threshold = 100;
+
+    if (argc > 0 && (!ParseUnsigned(argv[0], &seconds) || seconds == 0))
+        return -1;
+    if (argc > 1 && (!ParseUnsigned(argv[1], &interval) || interval == 0))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &threshold))
+        return -1;
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    options.Jitter = std::chrono::microseconds(20);
+    platform->SetOptions(options);
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+
+    auto read = [&](PCSTR key) {
+        std::string value;
+        platform->StoreRead(std::string(XenTimeStatus::Path) + "/" + key, &value);
+        return value;
+    };
+    auto readOffset = [&] { return strtoll(read("offset").c_str(), nullptr, 10); };
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    long long before, after;
+    {
+        XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+        XenTimeSamplerConfig config;
+        config.Interval = std::chrono::milliseconds(10);
+        config.PvClock = false;
+        config.RejectOutliers = false;
+        config.StatusInterval = std::chrono::milliseconds(interval);
+        config.StatusThreshold = TIME_US(threshold);
+        sampler.Configure(config);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(seconds * 500));
+        before = readOffset();
+        platform->GetHostClock().Step(TIME_S(1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(seconds * 500));
+        after = readOffset();
+    }
+
+    XenTimeMetricsSnapshot snapshot;
+    metrics.Snapshot(&snapshot);
+    auto writes = platform->GetStoreWrites();
+
+    printf("status: %lus, %lums interval, %luus threshold\n", seconds, interval, threshold);
+    for (auto key : {"offset", "delay", "dispersion", "source", "rate", "error"})
+        printf("  %s/%s = %s\n", XenTimeStatus::Path, key, read(key).c_str());
+    printf(
+        "%llu writes for %llu rounds, %llu passes at most; offset %lldns before the 1s host step, %lldns after\n",
+        writes,
+        snapshot.Rounds,
+        static_cast<unsigned long long>(seconds * 1000 / interval),
+        before,
+        after);
+
+    // the step must show, to within the jitter
+    auto step = after - before - 1000000000LL;
+    if (read("source") != "ioctl" || writes == 0 || writes > 6 * (seconds * 1000 / interval) ||
+        (step < 0 ? -step : step) > 1000000) {
+        fprintf(stderr, "unexpected status\n");
+        return 1;
+    }
+    return 0;
+}
+
+// dom0 publishes a new sync state every pause milliseconds while the sampler runs; each one must show in the published
+// samples, and only the XenStore watch may read it. Then the host goes unsynchronized, which must withhold samples,
+// and finally stops publishing, which must bring back the defaults.
+static int BenchHostSync(int argc, char **argv) {
+    unsigned long updates = 20, pause = 50;
+
+    if (argc > 0 && (!ParseUnsigned(argv[0], &updates) || updates == 0))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &pause))
+        return -1;
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    platform->SetOptions(options);
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+    XenTimeSamplerConfig config;
+    config.Interval = std::chrono::milliseconds(10);
+    config.RejectOutliers = false;
+    sampler.Configure(config);
+
+    TimeSample sample;
+    unsigned __int64 sequence = 0;
+    auto waitForSample = [&](auto &&predicate, BenchClock::duration timeout, BenchClock::duration *elapsed) {
+        auto begin = BenchClock::now();
+        while (BenchClock::now() - begin < timeout) {
+            if (sampler.GetLatest(&sample, &sequence) && predicate()) {
+                *elapsed = BenchClock::now() - begin;
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    };
+
+    BenchClock::duration elapsed;
+    auto isDefault = [&] { return sample.nStratum == 0 && sample.nLeapFlags == 3; };
+    if (!waitForSample(isDefault, std::chrono::seconds(5), &elapsed)) {
+        fprintf(stderr, "no initial samples\n");
+        return 1;
+    }
+
+    BenchLatencies propagation;
+    for (unsigned long i = 0; i < updates; i++) {
+        auto stratum = 1 + i % XenHostSyncState::MaxStratum;
+        auto dispersion = 1000000ULL * (i + 1);
+        char value[64];
+        snprintf(value, sizeof(value), "stratum=%lu dispersion=%llu leap=%lu", stratum, dispersion, i % 2);
+        platform->StoreWrite(XenHostSync::Path, value);
+
+        if (!waitForSample(
+                [&] {
+                    return sample.nStratum == stratum && sample.nLeapFlags == i % 2 &&
+                        sample.tpDispersion >= dispersion / 100;
+                },
+                std::chrono::seconds(5),
+                &elapsed)) {
+            fprintf(stderr, "\"%s\" not seen in samples\n", value);
+            return 1;
+        }
+        propagation.Add(elapsed);
+        std::this_thread::sleep_for(std::chrono::milliseconds(pause));
+    }
+
+    platform->StoreWrite(XenHostSync::Path, "stratum=16 leap=3");
+    auto withheldBefore = metrics.HostUnsyncedRounds.Load();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // the last synchronized sample may have been published as the state changed
+    (void)sampler.GetLatest(&sample, &sequence);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto published = sampler.GetLatest(&sample, &sequence);
+    auto withheld = metrics.HostUnsyncedRounds.Load() - withheldBefore;
+
+    platform->StoreRemove(XenHostSync::Path);
+    auto restored = waitForSample(isDefault, std::chrono::seconds(5), &elapsed);
+
+    XenTimeMetricsSnapshot snapshot;
+    metrics.Snapshot(&snapshot);
+
+    printf("hostsync: %lu updates, %lums apart\n", updates, pause);
+    propagation.Print("XenStore to sample");
+    printf(
+        "unsynchronized host: %llu rounds withheld, %s; defaults %s after removal\n",
+        withheld,
+        published ? "samples published" : "no samples",
+        restored ? "restored" : "not restored");
+    PrintMetrics(metrics);
+
+    // one read for the watch firing as it was set, one per write after that
+    if (published || withheld == 0 || !restored || snapshot.HostSyncUpdates > updates + 2) {
+        fprintf(stderr, "unexpected host sync handling\n");
+        return 1;
+    }
+    return 0;
+}
+
+// dom0's time service steps the host clock back and forth by a second every pause milliseconds and notifies the
+// guest. Times from each step to the first published sample showing it, against a sampling interval far longer than
+// that; with nopush, the provider only finds out on its own schedule.
+static int BenchPush(int argc, char **argv) {
+    unsigned long steps = 10, pause = 200, interval = 2000;
+    bool push = true;
+
+    if (argc > 0 && (!ParseUnsigned(argv[0], &steps) || steps == 0))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &pause))
+        return -1;
+    if (argc > 2 && (!ParseUnsigned(argv[2], &interval) || interval == 0))
+        return -1;
+    if (argc > 3) {
+        if (!strcmp(argv[3], "push"))
+            push = true;
+        else if (!strcmp(argv[3], "nopush"))
+            push = false;
+        else
+            return -1;
+    }
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    platform->SetOptions(options);
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+    SimTimeDaemon daemon(*platform);
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+    XenTimeSamplerConfig config;
+    config.Interval = std::chrono::milliseconds(interval);
+    config.Push = push;
+    sampler.Configure(config);
+
+    TimeSample sample;
+    unsigned __int64 sequence = 0;
+    auto waitForOffset = [&](signed __int64 expected, BenchClock::duration timeout, BenchClock::duration *elapsed) {
+        auto begin = BenchClock::now();
+        while (BenchClock::now() - begin < timeout) {
+            if (sampler.GetLatest(&sample, &sequence) && sample.toOffset > expected - TIME_MS(1) &&
+                sample.toOffset < expected + TIME_MS(1)) {
+                *elapsed = BenchClock::now() - begin;
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        return false;
+    };
+
+    BenchClock::duration elapsed;
+    if (!waitForOffset(0, std::chrono::seconds(5), &elapsed)) {
+        fprintf(stderr, "no initial samples\n");
+        return 1;
+    }
+    // until the event channel is bound
+    auto bound = BenchClock::now();
+    while (!daemon.Notify()) {
+        if (BenchClock::now() - bound > std::chrono::seconds(5)) {
+            fprintf(stderr, "event channel not bound\n");
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    BenchLatencies latencies;
+    unsigned long missed = 0;
+    signed __int64 offset = 0;
+    for (unsigned long i = 0; i < steps; i++) {
+        auto delta = i % 2 ? -TIME_S(1) : TIME_S(1);
+        offset += delta;
+        (void)daemon.Step(delta);
+        if (waitForOffset(offset, std::chrono::milliseconds(2 * interval + 1000), &elapsed))
+            latencies.Add(elapsed);
+        else
+            missed++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(pause));
+    }
+
+    printf("push: %lu steps, %lums apart, %lums interval, %s\n", steps, pause, interval, push ? "push" : "nopush");
+    latencies.Print("step to sample");
+    PrintMetrics(metrics);
+
+    std::sort(latencies.Values.begin(), latencies.Values.end());
+    auto worst = latencies.Values.empty() ? 0 : latencies.Values.back();
+    // pushed steps must show well within one interval
+    if (missed || (push && worst >= interval * 1000000ULL / 2)) {
+        fprintf(stderr, "%lu steps missed, slowest %lluns\n", missed, worst);
+        return 1;
+    }
+    return 0;
+}
+
+// Reads host time through dom0's host time page against the IOCTL, unmaps the page under a concurrent reader, then
+// runs the sampler on it across a removal and while dom0 marks the page invalid.
+static int BenchTimePage(int argc, char **argv) {
+    unsigned long iterations = 1000000, latency = 20;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &iterations))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &latency))
+        return -1;
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(latency) / 2;
+    options.ResponseLatency = std::chrono::microseconds(latency) / 2;
+    platform->SetOptions(options);
+    std::wstring path(L"\\\\?\\sim#xeniface#0");
+    platform->AddInterface(path);
+    SimTimeDaemon daemon(*platform);
+
+    std::shared_ptr<IXenIfaceDevice> device;
+    std::shared_ptr<IXenHostTimePage> page;
+    if (FAILED(platform->Open(path, nullptr, device)) ||
+        FAILED(device->MapHostTimePage(0, daemon.GetTimePageReference(), page))) {
+        fprintf(stderr, "cannot map simulated host time page\n");
+        return 1;
+    }
+    PvClockHostTimeReader reader(page);
+
+    BenchLatencies pageLatencies, ioctlLatencies, errors;
+    unsigned __int64 failed = 0, outOfBounds = 0;
+    for (unsigned long i = 0; i < iterations; i++) {
+        unsigned __int64 time, bound;
+        auto before = platform->GetHostClock().Now();
+        auto begin = BenchClock::now();
+        auto hr = reader.Read(&time, &bound);
+        pageLatencies.Add(BenchClock::now() - begin);
+        auto after = platform->GetHostClock().Now();
+        if (FAILED(hr)) {
+            failed++;
+            continue;
+        }
+
+        signed __int64 error = time - after;
+        errors.Values.push_back((error < 0 ? -error : error) * 100);
+        // whatever the page says must fall within its bound of the host clock around the read
+        if (time + bound < before || time > after + bound)
+            outOfBounds++;
+    }
+    for (unsigned long i = 0; i < (std::max)(iterations / 100, 1UL); i++) {
+        FILETIME time;
+        auto begin = BenchClock::now();
+        if (FAILED(device->GetHostTime(&time, BenchDeadline())))
+            failed++;
+        ioctlLatencies.Add(BenchClock::now() - begin);
+    }
+
+    printf("timepage: %lu reads, %luus IOCTL round trip, %llu failed\n", iterations, latency, failed);
+    pageLatencies.Print("PvClockHostTimeReader::Read");
+    ioctlLatencies.Print("GetHostTime");
+    errors.Print("|host time page - host clock|");
+
+    // a reader hammering the page while it is unmapped must stop cleanly
+    std::atomic<bool> stop = false;
+    std::atomic<unsigned __int64> reads = 0, refused = 0, other = 0;
+    std::thread hammer([&] {
+        while (!stop.load(std::memory_order_acquire)) {
+            unsigned __int64 time, bound;
+            auto hr = reader.Read(&time, &bound);
+            if (SUCCEEDED(hr))
+                reads.fetch_add(1, std::memory_order_relaxed);
+            else if (hr == HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED))
+                refused.fetch_add(1, std::memory_order_relaxed);
+            else
+                other.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    device->Close();
+    // a read that was in when unmapping began may still be counting itself
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto readsAtClose = reads.load(std::memory_order_acquire);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    stop.store(true, std::memory_order_release);
+    hammer.join();
+    printf(
+        "timepage: unmapped under a reader after %llu reads, %llu later, %llu refused\n",
+        readsAtClose,
+        reads.load() - readsAtClose,
+        refused.load());
+    if (reads.load() != readsAtClose || !refused.load() || other.load()) {
+        fprintf(stderr, "reads went on after unmapping\n");
+        return 1;
+    }
+    device.reset();
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+    XenTimeSamplerConfig config;
+    config.Interval = std::chrono::milliseconds(50);
+    sampler.Configure(config);
+
+    auto waitFor = [&](auto condition) {
+        auto begin = BenchClock::now();
+        while (!condition()) {
+            if (BenchClock::now() - begin > std::chrono::seconds(5))
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    };
+    auto published = [&] { return metrics.SamplesPublished.Load(); };
+    auto pageReads = [&] {
+        MetricsHistogramSnapshot snapshot;
+        metrics.HostTimePageLatency.Snapshot(&snapshot);
+        return snapshot.Count;
+    };
+    // the shared time page or the IOCTL
+    auto otherReads = [&] {
+        MetricsHistogramSnapshot pvclock, ioctl;
+        metrics.PvClockLatency.Snapshot(&pvclock);
+        metrics.IoctlLatency.Snapshot(&ioctl);
+        return pvclock.Count + ioctl.Count;
+    };
+
+    if (!waitFor([&] { return metrics.HostTimePageMaps.Load() >= 1 && pageReads() > 0 && published() > 0; })) {
+        fprintf(stderr, "sampler never read the host time page\n");
+        return 1;
+    }
+
+    platform->RemoveInterface(path);
+    platform->AddInterface(path);
+    auto before = published();
+    if (!waitFor([&] { return metrics.HostTimePageMaps.Load() >= 2 && published() > before + 2; })) {
+        fprintf(stderr, "host time page not mapped again after removal\n");
+        return 1;
+    }
+
+    daemon.SetTimePageValid(false);
+    before = published();
+    auto otherBefore = otherReads();
+    if (!waitFor([&] { return published() > before + 2 && otherReads() > otherBefore; })) {
+        fprintf(stderr, "no samples while the host time page is invalid\n");
+        return 1;
+    }
+    daemon.SetTimePageValid(true);
+
+    PrintMetrics(metrics);
+    if (failed || outOfBounds) {
+        fprintf(stderr, "%llu reads failed, %llu out of bounds\n", failed, outOfBounds);
+        return 1;
+    }
+    return 0;
+}
+
+// Holdover through a device outage. DriftModel is first checked on its own: fitted to a minute of rounds off a clock
+// with a frequency error and noise, its extrapolations over the next minutes must stay within their error bound. Then
+// the sampler runs with both the host and the guest clock off frequency, the interface is removed for outage-ms and
+// every sample published meanwhile must be within its dispersion of the true offset, with the dispersion growing,
+// until limit-ms after the last real one, and none after it.
+static int BenchHoldover(int argc, char **argv) {
+    unsigned long outage = 3000, limit = 2000, drift = 50, interval = 50;
+
+    if (argc > 0 && !ParseUnsigned(argv[0], &outage))
+        return -1;
+    if (argc > 1 && (!ParseUnsigned(argv[1], &limit) || limit == 0))
+        return -1;
+    if (argc > 2 && !ParseUnsigned(argv[2], &drift))
+        return -1;
+    if (argc > 3 && (!ParseUnsigned(argv[3], &interval) || interval == 0))
+        return -1;
+
+    std::mt19937_64 random(11);
+    std::normal_distribution<double> noise(0, static_cast<double>(TIME_US(5)));
+    auto ppm = static_cast<double>(drift);
+    auto truth = [&](unsigned __int64 tick) {
+        return TIME_S(1000000000ULL) + tick + static_cast<unsigned __int64>(static_cast<double>(tick) * ppm / 1000000);
+    };
+    DriftModel model;
+    for (unsigned __int64 i = 1; i <= DriftModel::WindowSize; i++) {
+        auto tick = TIME_S(i);
+        model.Add(tick, truth(tick) + static_cast<signed __int64>(noise(random)));
+    }
+
+    unsigned long outside = 0;
+    unsigned __int64 previousError = 0;
+    bool growing = true;
+    for (unsigned __int64 ahead = 0; ahead <= 600; ahead += 60) {
+        auto tick = TIME_S(DriftModel::WindowSize + ahead);
+        unsigned __int64 hostTime, error;
+        if (FAILED(model.Predict(tick, &hostTime, &error))) {
+            fprintf(stderr, "no prediction\n");
+            return 1;
+        }
+        auto actual = static_cast<signed __int64>(hostTime - truth(tick));
+        printf("model: %4llus ahead, error %8.1fus, bound %8.1fus\n",
+            ahead,
+            static_cast<double>(actual) / 10,
+            static_cast<double>(error) / 10);
+        if (static_cast<unsigned __int64>(actual < 0 ? -actual : actual) > error)
+            outside++;
+        growing = growing && error >= previousError;
+        previousError = error;
+    }
+    printf("model: %.2f ppm fitted (simulated %lu)\n", model.FrequencyPpm(), drift);
+
+    SimClock systemClock;
+    systemClock.SetFrequencyError(-ppm / 2);
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    platform->SetOptions(options);
+    platform->GetHostClock().SetFrequencyError(ppm);
+    const std::wstring path = L"\\\\?\\sim#xeniface#0";
+    platform->AddInterface(path);
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    XenTimeSampler sampler(BenchCallbacks, worker, metrics);
+    XenTimeSamplerConfig config;
+    config.Interval = std::chrono::milliseconds(interval);
+    config.HoldoverLimit = std::chrono::milliseconds(limit);
+    // the simulated shared time page follows a host clock off frequency only once per calibration
+    config.PvClock = false;
+    sampler.Configure(config);
+
+    // Errors are taken against what the device itself was giving, which the simulated IOCTL's completion skews a
+    // little on its own
+    TimeSample sample;
+    unsigned __int64 sequence = 0;
+    auto trueOffset = [&] {
+        return static_cast<signed __int64>(platform->GetHostClock().Now() - systemClock.Now());
+    };
+    signed __int64 deviceError = 0;
+    auto begin = BenchClock::now();
+    for (size_t published = 0; published < 2 * OffsetFilter::WindowSize;) {
+        if (BenchClock::now() - begin > std::chrono::seconds(10)) {
+            fprintf(stderr, "no initial samples\n");
+            return 1;
+        }
+        if (sampler.GetLatest(&sample, &sequence)) {
+            deviceError = sample.toOffset - trueOffset();
+            published++;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    auto holdovers = metrics.HoldoverRounds.Load();
+    auto removed = BenchClock::now();
+    platform->RemoveInterface(path);
+
+    // the true offset moves by the frequency difference while a sample waits to be picked up
+    auto lag = static_cast<signed __int64>(static_cast<double>(TIME_MS(interval + 10)) * ppm * 1.5 / 1000000);
+    unsigned long samples = 0, wrong = 0, shrinking = 0;
+    unsigned __int64 lastDispersion = 0;
+    BenchClock::duration lastSample{};
+    BenchLatencies errors;
+    while (BenchClock::now() - removed < std::chrono::milliseconds(outage)) {
+        if (sampler.GetLatest(&sample, &sequence) && metrics.HoldoverRounds.Load() > holdovers) {
+            auto error = sample.toOffset - trueOffset() - deviceError;
+            auto magnitude = static_cast<unsigned __int64>(error < 0 ? -error : error);
+            errors.Values.push_back(magnitude * 100);
+            if (magnitude > sample.tpDispersion + lag)
+                wrong++;
+            if (sample.tpDispersion < lastDispersion)
+                shrinking++;
+            lastDispersion = sample.tpDispersion;
+            lastSample = BenchClock::now() - removed;
+            samples++;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto holdoverRounds = metrics.HoldoverRounds.Load() - holdovers;
+
+    platform->AddInterface(path);
+    auto back = BenchClock::now();
+    auto resumed = false;
+    while (!resumed && BenchClock::now() - back < std::chrono::seconds(5)) {
+        resumed = sampler.GetLatest(&sample, &sequence);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2 * interval));
+    auto after = metrics.HoldoverRounds.Load() - holdovers - holdoverRounds;
+
+    auto lastMs = std::chrono::duration<double, std::milli>(lastSample).count();
+    printf(
+        "holdover: %lums outage, %lums limit, %lu ppm, %lums interval: %lu samples (%llu rounds), last after %.0fms, "
+        "final dispersion %.1fus, device error %.1fus\n",
+        outage,
+        limit,
+        drift,
+        interval,
+        samples,
+        holdoverRounds,
+        lastMs,
+        static_cast<double>(lastDispersion) / 10,
+        static_cast<double>(deviceError) / 10);
+    errors.Print("holdover |error|");
+    PrintMetrics(metrics);
+
+    // the limit runs from the last real sample, which is up to an interval before the removal
+    auto stoppedEarly = outage > limit + 2 * interval && lastMs < static_cast<double>(limit) - 2.0 * interval;
+    auto overran = lastMs > static_cast<double>(limit) + interval + 50;
+    if (outside || !growing || !samples || wrong || shrinking || stoppedEarly || overran || !resumed || after) {
+        fprintf(
+            stderr,
+            "%lu predictions out of bounds%s, %lu samples beyond their dispersion, %lu with less than the one before, "
+            "%s%s%s%llu holdover rounds after the device came back\n",
+            outside,
+            growing ? "" : " with the bound not growing",
+            wrong,
+            shrinking,
+            samples ? "" : "no holdover samples, ",
+            stoppedEarly || overran ? "holdover not ending at the limit, " : "",
+            resumed ? "" : "no samples after the outage, ",
+            after);
+        return 1;
+    }
+    return 0;
+}
+
+// Time to first sample: w32time's first poll, made right after opening the provider, against interfaces whose IOCTLs
+// take probe-us on top of the usual round trip, which the worker's first open spends ProbeCount of. Every first poll
+// must return a sample. Without an interface, the first poll must only wait for the worker to find none and the next
+// poll must not wait.
+static int BenchStartup(int argc, char **argv) {
+    unsigned long iterations = 20, probe = 500;
+
+    if (argc > 0 && (!ParseUnsigned(argv[0], &iterations) || iterations == 0))
+        return -1;
+    if (argc > 1 && !ParseUnsigned(argv[1], &probe))
+        return -1;
+
+    SimClock systemClock;
+    BenchSystemClock = &systemClock;
+    BenchCallbackLatency = std::chrono::nanoseconds(0);
+
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+
+    TimeSample sample;
+    TpcGetSamplesArgs args{
+        .pbSampleBuf = reinterpret_cast<BYTE *>(&sample),
+        .cbSampleBuf = sizeof(sample),
+    };
+    BenchLatencies firstPolls, filled;
+    unsigned long missed = 0, slowFill = 0;
+    for (unsigned long i = 0; i < iterations; i++) {
+        auto platform = std::make_shared<SimXenIfacePlatform>();
+        platform->SetOptions(options);
+        platform->AddInterface(L"\\\\?\\sim#xeniface#0", std::chrono::microseconds(probe));
+
+        auto begin = BenchClock::now();
+        XenTimeProvider provider(&BenchCallbacks, platform);
+        if (FAILED(provider.GetSamples(&args)) || args.dwSamplesReturned != 1)
+            missed++;
+        firstPolls.Add(BenchClock::now() - begin);
+
+        // the startup rounds, which fill the filter well within the usual interval
+        auto filling = BenchClock::now();
+        XenTimeMetricsSnapshot snapshot;
+        do {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            provider.GetMetrics(&snapshot);
+        } while (snapshot.SamplesPublished < XenTimeSampler::StartupRounds &&
+                 BenchClock::now() - filling < std::chrono::seconds(5));
+        if (snapshot.SamplesPublished < XenTimeSampler::StartupRounds)
+            slowFill++;
+        filled.Add(BenchClock::now() - begin);
+        if (i + 1 == iterations) {
+            printf("startup: %lu opens, %luus per probe IOCTL, %lu first polls without a sample\n",
+                iterations,
+                probe,
+                missed);
+            firstPolls.Print("open to first sample");
+            filled.Print("open to filter filled");
+            PrintHistogram("StartupLatency", snapshot.StartupLatency, "ns");
+        }
+    }
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    platform->SetOptions(options);
+    XenTimeProvider provider(&BenchCallbacks, platform);
+    auto begin = BenchClock::now();
+    auto hr = provider.GetSamples(&args);
+    auto waited = BenchClock::now() - begin;
+    auto nothing = SUCCEEDED(hr) && args.dwSamplesReturned == 0;
+    begin = BenchClock::now();
+    hr = provider.GetSamples(&args);
+    auto again = BenchClock::now() - begin;
+    nothing = nothing && SUCCEEDED(hr) && args.dwSamplesReturned == 0;
+    printf(
+        "startup: without an interface, first poll returned after %.1fms, the next after %.3fms\n",
+        std::chrono::duration<double, std::milli>(waited).count(),
+        std::chrono::duration<double, std::milli>(again).count());
+
+    if (missed || slowFill || !nothing || waited > std::chrono::milliseconds(100) ||
+        again > std::chrono::milliseconds(10)) {
+        fprintf(
+            stderr,
+            "%lu first polls without a sample, %lu slow to fill, first poll without an interface %s\n",
+            missed,
+            slowFill,
+            nothing ? "waited too long" : "returned a sample");
+        return 1;
+    }
+    return 0;
+}
+
+struct BenchMode {
+    const char *Name;
+    const char *Arguments;
+    int (*Run)(int argc, char **argv);
+};
+
+static const BenchMode BenchModes[] = {
+    {"hotplug", "[seconds] [pause-us] [samplers] [interfaces]", BenchHotplug},
+    {"pvclock", "[iterations] [ioctl-us]", BenchPvClock},
+    {"localtime", "[iterations] [step-s]", BenchLocalTime},
+    {"sample", "[seconds] [ioctl-us] [callback-ns] [ioctl|pvclock|fallback]", BenchSample},
+    {"metrics", "[iterations] [threads]", BenchMetrics},
+    {"dispersion", "<trace> | sim [samples] [noise-us] [drift-ppm] [load-us]", BenchDispersion},
+    {"outliers", "[samples] [noise-us] [spike-%] [spike-us] [drift-ppm]", BenchOutliers},
+    {"migrate", "[migrations] [pause-ms] [interval-ms] [resume|noresume]", BenchMigrate},
+    {"suspend", "[seconds] [suspend-%] [before|after] [pause-ms]", BenchSuspend},
+    {"reacquire", "[events] [failed-opens] [seed]", BenchReacquire},
+    {"stall", "[seconds] [stall-%] [stall-ms] [timeout-ms] [cancel|nocancel]", BenchStall},
+    {"events", "[bursts] [notifications] [threads]", BenchEvents},
+    {"logging", "[messages] [threads] [pause-us]", BenchLogging},
+    {"telemetry", "[seconds] [interval-ms] [failure-%]", BenchTelemetry},
+    {"status", "[seconds] [interval-ms] [threshold-us]", BenchStatus},
+    {"hostsync", "[updates] [pause-ms]", BenchHostSync},
+    {"push", "[steps] [pause-ms] [interval-ms] [push|nopush]", BenchPush},
+    {"timepage", "[iterations] [ioctl-us]", BenchTimePage},
+    {"holdover", "[outage-ms] [limit-ms] [drift-ppm] [interval-ms]", BenchHoldover},
+    {"startup", "[iterations] [probe-us]", BenchStartup},
+};
+
+static void Usage(const char *program) {
+    fprintf(stderr, "usage: %s <mode> [options]\n", program);
+    for (const auto &mode : BenchModes)
+        fprintf(stderr, "    %s %s\n", mode.Name, mode.Arguments);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    for (const auto &mode : BenchModes) {
+        if (!strcmp(argv[1], mode.Name)) {
+            auto result = mode.Run(argc - 2, argv + 2);
+            if (result < 0) {
+                Usage(argv[0]);
+                return 2;
+            }
+            return result;
+        }
+    }
+
+    Usage(argv[0]);
+    return 2;
+}
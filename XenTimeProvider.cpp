@@ -1,44 +1,56 @@
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#include <winioctl.h>
-
-#include <wil/registry.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <utility>
 
 #include "Globals.hpp"
+#include "Config.hpp"
 #include "XenTimeProvider.hpp"
-#include "TimeConverter.hpp"
-
-#include "xeniface_ioctls.h"
-
-#define TIME_US(_us) ((_us) * 10)
-#define TIME_MS(_ms) (TIME_US((_ms) * 1000))
-#define TIME_S(_s) (TIME_MS((_s) * 1000))
 
-XenTimeProvider::XenTimeProvider(_In_ TimeProvSysCallbacks *callbacks) : _callbacks(*callbacks), _worker() {
+XenTimeProvider::XenTimeProvider(
+    _In_ TimeProvSysCallbacks *callbacks,
+    _In_ std::shared_ptr<IXenIfacePlatform> platform)
+    : _callbacks(*callbacks), _openedAt(std::chrono::steady_clock::now()), _worker(std::move(platform), _metrics),
+      _sampler(_callbacks, _worker, _metrics) {
     UpdateConfig();
+    // w32time only calls PollIntervalChanged for changes
+    signed char pollInterval;
+    if (SUCCEEDED(_callbacks.pfnGetTimeSysInfo(TSI_PollInterval, &pollInterval)))
+        _sampler.SetPollInterval(pollInterval);
 }
 
 HRESULT XenTimeProvider::TimeJumped(_In_ TpcTimeJumpedArgs *args) {
     UNREFERENCED_PARAMETER(args);
 
     Log(LogTimeProvEventTypeInformation, L"TimeJumped");
-    _sample = std::nullopt;
+    _sampler.Invalidate();
     return S_OK;
 }
 
 HRESULT XenTimeProvider::GetSamples(_Out_ TpcGetSamplesArgs *args) {
-    HRESULT hr = Update();
-
-    if (FAILED(hr))
-        Log(LogTimeProvEventTypeError, L"Update failed: %x", hr);
-
-    if (_sample) {
+    TimeSample sample;
+
+    _metrics.GetSamplesCalls.Add();
+    _sampler.OnPoll();
+
+    // Never hand out the same sample twice, w32time would count it as a second measurement
+    auto first = !std::exchange(_polled, true);
+    auto found = _sampler.GetLatest(&sample, &_lastSequence);
+    // only a device the worker is opening or has opened is worth waiting for, w32time would rather hear there is none
+    if (!found && first && _worker.GetStartup() != XenIfaceStartup::NotFound)
+        found = _sampler.WaitForLatest(StartupWait, &sample, &_lastSequence);
+    if (found) {
         args->dwSamplesAvailable = 1;
         if (args->cbSampleBuf < sizeof(TimeSample))
             return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
 
-        memcpy(args->pbSampleBuf, &*_sample, sizeof(TimeSample));
+        memcpy(args->pbSampleBuf, &sample, sizeof(TimeSample));
         args->dwSamplesReturned = 1;
+        _metrics.SamplesReturned.Add();
+        if (!std::exchange(_sampled, true))
+            _metrics.StartupLatency.Record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _openedAt)
+                    .count());
     } else {
         args->dwSamplesAvailable = args->dwSamplesReturned = 0;
     }
@@ -46,151 +58,116 @@ HRESULT XenTimeProvider::GetSamples(_Out_ TpcGetSamplesArgs *args) {
 }
 
 HRESULT XenTimeProvider::PollIntervalChanged() {
-    Log(LogTimeProvEventTypeInformation, L"PollIntervalChanged");
+    signed char pollInterval;
+    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_PollInterval, &pollInterval));
+
+    Log(LogTimeProvEventTypeInformation, L"PollIntervalChanged: 2^%ds", static_cast<int>(pollInterval));
+    _sampler.SetPollInterval(pollInterval);
     return S_OK;
 }
 
 HRESULT XenTimeProvider::UpdateConfig() {
     HRESULT hr;
+    XenTimeSamplerConfig config;
 
     Log(LogTimeProvEventTypeInformation, L"UpdateConfig");
 
-    _allow_fallback = false;
-    _need_fallback = false;
     DWORD value;
-    hr = wil::reg::get_value_dword_nothrow(
-        HKEY_LOCAL_MACHINE,
-        L"SYSTEM\\CurrentControlSet\\Services\\W32Time\\TimeProviders\\" XenTimeProviderName L"\\Parameters",
-        L"AllowFallback",
-        &value);
+    hr = ConfigGetDword(L"AllowFallback", &value);
     if (SUCCEEDED(hr))
-        _allow_fallback = value;
+        config.AllowFallback = value;
     else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
         return hr;
 
-    return S_OK;
-}
+    hr = ConfigGetDword(L"BurstCount", &value);
+    if (SUCCEEDED(hr))
+        config.BurstCount = value;
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-HRESULT XenTimeProvider::Shutdown() {
-    Log(LogTimeProvEventTypeInformation, L"Shutdown");
-    return S_OK;
-}
+    hr = ConfigGetDword(L"FilterDepth", &value);
+    if (SUCCEEDED(hr))
+        config.FilterDepth = value;
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-static HRESULT GetXenTime(_In_ HANDLE handle, _Out_ unsigned __int64 *xenTime, _Out_ unsigned __int64 *dispersion) {
-    XENIFACE_SHAREDINFO_GET_TIME_OUT buffer;
-    DWORD dummy;
-    FILETIME universalTime;
-
-    RETURN_IF_WIN32_BOOL_FALSE(DeviceIoControl(
-        handle,
-        IOCTL_XENIFACE_SHAREDINFO_GET_TIME,
-        nullptr,
-        0,
-        &buffer,
-        sizeof(buffer),
-        &dummy,
-        nullptr));
-
-    RETURN_IF_WIN32_BOOL_FALSE(TimeConvertFileTime(&buffer.Time, &universalTime, TimeConvertLocalToUniversal, nullptr));
-    auto value = static_cast<unsigned __int64>(universalTime.dwHighDateTime) << 32 |
-        static_cast<unsigned __int64>(universalTime.dwLowDateTime);
-
-    *xenTime = value;
-    // inherent inaccuracy of TimeConvertFileTime
-    *dispersion = TIME_MS(1);
+    hr = ConfigGetDword(L"HoldoverLimit", &value);
+    if (SUCCEEDED(hr))
+        config.HoldoverLimit = std::chrono::milliseconds(value);
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-    return S_OK;
-}
+    hr = ConfigGetDword(L"HostTimePage", &value);
+    if (SUCCEEDED(hr))
+        config.HostTimePage = value;
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-static HRESULT GetXenHostTime(_In_ HANDLE handle, _Out_ unsigned __int64 *xenTime, _Out_ unsigned __int64 *dispersion) {
-    XENIFACE_SHAREDINFO_GET_HOST_TIME_OUT buffer;
-    DWORD dummy;
+    hr = ConfigGetDword(L"IoctlTimeout", &value);
+    if (SUCCEEDED(hr))
+        config.IoctlTimeout = std::chrono::milliseconds((std::max)(value, static_cast<DWORD>(1)));
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-    RETURN_IF_WIN32_BOOL_FALSE(DeviceIoControl(
-        handle,
-        IOCTL_XENIFACE_SHAREDINFO_GET_HOST_TIME,
-        nullptr,
-        0,
-        &buffer,
-        sizeof(buffer),
-        &dummy,
-        nullptr));
+    hr = ConfigGetDword(L"OffsetLoop", &value);
+    if (SUCCEEDED(hr))
+        config.OffsetLoop = value;
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-    auto value = static_cast<unsigned __int64>(buffer.Time.dwHighDateTime) << 32 |
-        static_cast<unsigned __int64>(buffer.Time.dwLowDateTime);
+    hr = ConfigGetDword(L"PollSchedule", &value);
+    if (SUCCEEDED(hr))
+        config.PollSchedule = value;
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-    *xenTime = value;
-    *dispersion = 0;
+    hr = ConfigGetDword(L"PushNotifications", &value);
+    if (SUCCEEDED(hr))
+        config.Push = value;
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-    return S_OK;
-}
+    hr = ConfigGetDword(L"PvClock", &value);
+    if (SUCCEEDED(hr))
+        config.PvClock = value;
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-HRESULT XenTimeProvider::GetTimeOrFallback(
-    _In_ HANDLE handle,
-    _Out_ unsigned __int64 *xenTime,
-    _Out_ unsigned __int64 *dispersion) {
-    if (!_allow_fallback) {
-        return GetXenHostTime(handle, xenTime, dispersion);
-    } else if (!_need_fallback) {
-        auto hr = GetXenHostTime(handle, xenTime, dispersion);
-        switch (hr) {
-        case __HRESULT_FROM_WIN32(ERROR_INVALID_FUNCTION):
-        case __HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED):
-            _callbacks.pfnLogTimeProvEvent(
-                LogTimeProvEventTypeError,
-                const_cast<PWSTR>(XenTimeProviderName),
-                const_cast<PWSTR>(L"The Xen PV interface driver has indicated that Xen host time is not supported. "
-                                  L"Falling back to guest time; reliability issues are likely."));
-            _need_fallback = true;
-            // retry right here and not later, just to avoid a prefast warning
-            return GetXenTime(handle, xenTime, dispersion);
-        default:
-            return hr;
-        }
-    } else {
-        return GetXenTime(handle, xenTime, dispersion);
-    }
-}
+    hr = ConfigGetDword(L"RejectOutliers", &value);
+    if (SUCCEEDED(hr))
+        config.RejectOutliers = value;
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
+
+    hr = ConfigGetDword(L"SampleInterval", &value);
+    if (SUCCEEDED(hr))
+        config.Interval = std::chrono::milliseconds((std::max)(value, static_cast<DWORD>(10)));
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
-HRESULT XenTimeProvider::Update() {
-    _sample = std::nullopt;
-    auto [lock, handle, path] = _worker.GetDevice();
-    if (!handle || handle == INVALID_HANDLE_VALUE)
-        return E_PENDING;
-
-    unsigned __int64 tickCount;
-    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_TickCount, &tickCount));
-
-    signed __int64 phaseOffset;
-    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_PhaseOffset, &phaseOffset));
-
-    unsigned __int64 begin;
-    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_CurrentTime, &begin));
-
-    unsigned __int64 xenTime, dispersion;
-    RETURN_IF_FAILED(GetTimeOrFallback(handle, &xenTime, &dispersion));
-
-    unsigned __int64 end;
-    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_CurrentTime, &end));
-
-    signed __int64 delay = end - begin;
-    if (delay < 0)
-        delay = 0;
-
-    TimeSample sample{
-        .dwSize = sizeof(TimeSample),
-        .dwRefid = ' NEX',
-        .toOffset = static_cast<signed __int64>(xenTime - begin + delay / 2),
-        .toDelay = delay,
-        .tpDispersion = dispersion,
-        .nSysTickCount = tickCount,
-        .nSysPhaseOffset = phaseOffset,
-        .nLeapFlags = 3,
-        .nStratum = 0,
-        .dwTSFlags = TSF_Hardware,
-    };
-    wcsncpy_s(sample.wszUniqueName, path, _TRUNCATE);
-    _sample = sample;
+    hr = ConfigGetDword(L"StatusInterval", &value);
+    if (SUCCEEDED(hr))
+        config.StatusInterval = std::chrono::milliseconds(value ? (std::max)(value, static_cast<DWORD>(1000)) : 0);
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
 
+    hr = ConfigGetDword(L"StatusThreshold", &value);
+    if (SUCCEEDED(hr))
+        config.StatusThreshold = TIME_US(static_cast<unsigned __int64>(value));
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
+
+    hr = ConfigGetDword(L"TelemetryInterval", &value);
+    if (SUCCEEDED(hr))
+        config.TelemetryInterval = std::chrono::milliseconds(value ? (std::max)(value, static_cast<DWORD>(1000)) : 0);
+    else if (hr != __HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND))
+        return hr;
+
+    _sampler.Configure(config);
+    return S_OK;
+}
+
+HRESULT XenTimeProvider::Shutdown() {
+    Log(LogTimeProvEventTypeInformation, L"Shutdown");
     return S_OK;
 }
@@ -1,21 +1,24 @@
 #pragma once
 
-#include <optional>
-
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#include <TimeProv.h>
+#include <chrono>
+#include <memory>
 
+#include "Platform.hpp"
 #include "Logging.hpp"
+#include "Metrics.hpp"
+#include "XenIface.hpp"
 #include "XenIfaceWorker.hpp"
+#include "XenTimeSampler.hpp"
 
 class XenTimeProvider {
 public:
-    XenTimeProvider(_In_ TimeProvSysCallbacks *callbacks);
+    // w32time polls right after opening the provider, likely before the worker has opened a device and the sampler
+    // has taken a round; unless the worker finds no interface, the first poll waits this long at most for them
+    static constexpr std::chrono::milliseconds StartupWait{1000};
+
+    XenTimeProvider(_In_ TimeProvSysCallbacks *callbacks, _In_ std::shared_ptr<IXenIfacePlatform> platform);
     XenTimeProvider(const XenTimeProvider &) = delete;
     XenTimeProvider &operator=(const XenTimeProvider &) = delete;
-    XenTimeProvider(XenTimeProvider &&) = default;
-    XenTimeProvider &operator=(XenTimeProvider &&) = default;
 
     HRESULT TimeJumped(_In_ TpcTimeJumpedArgs *args);
     HRESULT GetSamples(_Out_ TpcGetSamplesArgs *args);
@@ -26,23 +29,26 @@ public:
     const TimeProvSysCallbacks &GetCallbacks() {
         return _callbacks;
     }
+    void GetMetrics(_Out_ XenTimeMetricsSnapshot *snapshot) const {
+        _metrics.Snapshot(snapshot);
+    }
 
 private:
-    HRESULT Update();
-    HRESULT GetTimeOrFallback(_In_ HANDLE handle, _Out_ unsigned __int64 *xenTime, _Out_ unsigned __int64 *dispersion);
-
-    void Log(LogTimeProvEventType level, PCWSTR format, ...) {
-        va_list args;
-
-        va_start(args, format);
-        TimeProvVLog(_callbacks.pfnLogTimeProvEvent, level, format, args);
-        va_end(args);
+    template <typename... TArgs> void Log(LogTimeProvEventType level, PCWSTR format, TArgs... args) {
+        TimeProvLog(_callbacks.pfnLogTimeProvEvent, level, format, args...);
     }
 
+    // delivers what the others log until they are gone, and nothing after w32time closes the provider
+    LogWriter _logWriter;
     TimeProvSysCallbacks _callbacks;
+    XenTimeMetrics _metrics;
+    // for StartupLatency
+    std::chrono::steady_clock::time_point _openedAt;
     XenIfaceWorker _worker;
-    std::optional<TimeSample> _sample;
-
-    bool _allow_fallback = false;
-    bool _need_fallback = false;
+    // must be destroyed before the worker it samples from
+    XenTimeSampler _sampler;
+    unsigned __int64 _lastSequence = 0;
+    // GetSamples has been called, and has handed out a sample
+    bool _polled = false;
+    bool _sampled = false;
 };
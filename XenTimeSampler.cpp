@@ -0,0 +1,732 @@
+#include <algorithm>
+#include <chrono>
+
+#include "Globals.hpp"
+#include "TimeConverter.hpp"
+#include "XenTimeSampler.hpp"
+
+XenTimeSampler::XenTimeSampler(
+    _In_ const TimeProvSysCallbacks &callbacks,
+    _In_ XenIfaceWorker &worker,
+    _In_ XenTimeMetrics &metrics)
+    : _callbacks(callbacks), _worker(worker), _metrics(metrics), _telemetry(metrics),
+      _thread([this](std::stop_token stop) { SamplerFunc(stop); }) {
+    _worker.SetResumeHandler([this] { OnResume(); });
+    _worker.SetPushHandler([this] { OnPush(); });
+    _worker.SetArrivalHandler([this] { OnArrival(); });
+    // the worker may have opened one before there was a handler
+    if (_worker.GetDevice())
+        OnArrival();
+}
+
+XenTimeSampler::~XenTimeSampler() {
+    _worker.SetResumeHandler(nullptr);
+    _worker.SetPushHandler(nullptr);
+    _worker.SetArrivalHandler(nullptr);
+    _thread.request_stop();
+    std::lock_guard lock(_mutex);
+    _signal.notify_one();
+}
+
+void XenTimeSampler::Configure(_In_ const XenTimeSamplerConfig &config) {
+    {
+        std::lock_guard lock(_mutex);
+        _config = config;
+        _config.BurstCount = std::clamp<DWORD>(_config.BurstCount, 1, MaxBurstCount);
+        _configChanged = true;
+    }
+    _signal.notify_one();
+}
+
+void XenTimeSampler::Invalidate() {
+    _generation.fetch_add(1, std::memory_order_acq_rel);
+    {
+        std::lock_guard lock(_mutex);
+        _wake = true;
+    }
+    _signal.notify_one();
+}
+
+void XenTimeSampler::SetPollInterval(signed char pollInterval) {
+    {
+        std::lock_guard lock(_mutex);
+        _schedule.SetPollInterval(pollInterval);
+        _rescheduled = true;
+    }
+    _signal.notify_one();
+}
+
+void XenTimeSampler::OnPoll() {
+    // Without _mutex, the notification can slip in between the sampler checking _polled and going to sleep. The
+    // round then comes when it was due before the poll, which picks the poll up for the one after.
+    _polledAt.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    _polled.store(true, std::memory_order_release);
+    _signal.notify_one();
+}
+
+void XenTimeSampler::OnResume() {
+    _metrics.Resumes.Add();
+    // the guest clock has been standing still while the VM was paused, whatever we had is stale
+    _generation.fetch_add(1, std::memory_order_acq_rel);
+    {
+        std::lock_guard lock(_mutex);
+        _resumeRounds = ResumeRounds;
+        _resumedAt = std::chrono::steady_clock::now();
+        _wake = true;
+    }
+    _signal.notify_one();
+}
+
+void XenTimeSampler::OnPush() {
+    {
+        std::lock_guard lock(_mutex);
+        if (!_config.Push)
+            return;
+        _metrics.PushNotifications.Add();
+        // The host clock has stepped or is about to, what we had is stale. Unlike after a resume, a few quick rounds
+        // are enough to fill the filter again.
+        _generation.fetch_add(1, std::memory_order_acq_rel);
+        _resumeRounds = (std::max)(_resumeRounds, PushRounds);
+        if (!_pushedAt)
+            _pushedAt = std::chrono::steady_clock::now();
+        _wake = true;
+    }
+    _signal.notify_one();
+}
+
+void XenTimeSampler::OnArrival() {
+    // no need to wait out the interval of a round that found no device
+    {
+        std::lock_guard lock(_mutex);
+        _wake = true;
+    }
+    _signal.notify_one();
+    // nor for WaitForLatest to wait for a sample if there is no device to come
+    _publishedSignal.notify_all();
+}
+
+bool XenTimeSampler::GetLatest(_Out_ TimeSample *sample, _Inout_ unsigned __int64 *sequence) const {
+    PublishedSample published;
+
+    auto latest = _ring.ReadLatest(&published);
+    if (latest == 0 || latest == *sequence)
+        return false;
+    if (published.Generation != _generation.load(std::memory_order_acquire))
+        return false;
+
+    *sample = published.Sample;
+    *sequence = latest;
+    return true;
+}
+
+bool XenTimeSampler::WaitForLatest(
+    std::chrono::milliseconds timeout,
+    _Out_ TimeSample *sample,
+    _Inout_ unsigned __int64 *sequence) {
+    auto found = false;
+    std::unique_lock lock(_mutex);
+    _publishedSignal.wait_for(lock, timeout, [&] {
+        found = GetLatest(sample, sequence);
+        return found || _worker.GetStartup() == XenIfaceStartup::NotFound;
+    });
+    return found;
+}
+
+static unsigned __int64 ElapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+using HoldoverTicks = std::chrono::duration<unsigned __int64, std::ratio<1, 10000000>>;
+
+// The tick DriftModel is fitted against: monotonic, and out of reach of w32time's discipline of the guest clock
+static unsigned __int64 HoldoverTick() {
+    return std::chrono::duration_cast<HoldoverTicks>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned __int64 FileTimeToUInt64(_In_ const FILETIME &time) {
+    return static_cast<unsigned __int64>(time.dwHighDateTime) << 32 | static_cast<unsigned __int64>(time.dwLowDateTime);
+}
+
+static XenIfaceDeadline IoctlDeadline(_In_ const XenTimeSamplerConfig &config) {
+    return std::chrono::steady_clock::now() + config.IoctlTimeout;
+}
+
+static HRESULT GetXenTime(
+    _In_ IXenIfaceDevice *device,
+    _In_ LocalTimeConverter &converter,
+    XenIfaceDeadline deadline,
+    _Out_ unsigned __int64 *xenTime,
+    _Out_ unsigned __int64 *dispersion) {
+    FILETIME time;
+    bool local;
+
+    RETURN_IF_FAILED(device->GetTime(&time, &local, deadline));
+
+    if (!local) {
+        *xenTime = FileTimeToUInt64(time);
+        *dispersion = 1;
+        return S_OK;
+    }
+    return converter.LocalToUniversal(FileTimeToUInt64(time), xenTime, dispersion);
+}
+
+static HRESULT GetXenHostTime(
+    _In_ IXenIfaceDevice *device,
+    XenIfaceDeadline deadline,
+    _Out_ unsigned __int64 *xenTime,
+    _Out_ unsigned __int64 *dispersion) {
+    FILETIME time;
+
+    RETURN_IF_FAILED(device->GetHostTime(&time, deadline));
+
+    *xenTime = FileTimeToUInt64(time);
+    *dispersion = 0;
+
+    return S_OK;
+}
+
+HRESULT XenTimeSampler::GetTimeOrFallback(
+    _In_ const XenTimeSamplerConfig &config,
+    _In_ IXenIfaceDevice *device,
+    _Out_ unsigned __int64 *xenTime,
+    _Out_ unsigned __int64 *dispersion) {
+    if (!config.AllowFallback) {
+        return GetXenHostTime(device, IoctlDeadline(config), xenTime, dispersion);
+    } else if (!_need_fallback) {
+        auto hr = GetXenHostTime(device, IoctlDeadline(config), xenTime, dispersion);
+        switch (hr) {
+        case __HRESULT_FROM_WIN32(ERROR_INVALID_FUNCTION):
+        case __HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED):
+            Log(LogTimeProvEventTypeError,
+                L"The Xen PV interface driver has indicated that Xen host time is not supported. Falling back to guest "
+                L"time; reliability issues are likely.");
+            _need_fallback = true;
+            _metrics.FallbackActivations.Add();
+            // retry right here and not later, just to avoid a prefast warning
+            return GetXenTime(device, _localTime, IoctlDeadline(config), xenTime, dispersion);
+        default:
+            return hr;
+        }
+    } else {
+        return GetXenTime(device, _localTime, IoctlDeadline(config), xenTime, dispersion);
+    }
+}
+
+void XenTimeSampler::AttachPvClock(_In_ const std::shared_ptr<IXenIfaceDevice> &device) {
+    if (_pvclockDevice.lock() == device)
+        return;
+
+    DetachPvClock();
+    _pvclockDevice = device;
+
+    std::shared_ptr<IXenSharedTimePage> page;
+    auto hr = device->GetSharedTimePage(page);
+    if (FAILED(hr)) {
+        DebugLog("GetSharedTimePage failed %x, using IOCTLs", hr);
+        // PvClock is on by default, yet Windows' xeniface never offers the page: say once that IOCTLs are used instead
+        if (!_pvclockUnavailableLogged) {
+            Log(LogTimeProvEventTypeInformation,
+                L"The Xen shared time page is not available (%x), reading Xen host time through IOCTLs",
+                hr);
+            _pvclockUnavailableLogged = true;
+        }
+        return;
+    }
+    _pvclock.emplace(std::move(page));
+}
+
+void XenTimeSampler::DetachPvClock() {
+    _pvclock.reset();
+    _pvclockDevice.reset();
+}
+
+void XenTimeSampler::AttachHostTimePage() {
+    auto page = _worker.GetHostTimePage();
+    if (page == _hostTimePage)
+        return;
+
+    _hostTimeReader.reset();
+    _hostTimePage = std::move(page);
+    if (_hostTimePage)
+        _hostTimeReader.emplace(_hostTimePage);
+}
+
+HRESULT XenTimeSampler::ReadHostTime(
+    _In_ const XenTimeSamplerConfig &config,
+    _In_ IXenIfaceDevice *device,
+    _Out_ unsigned __int64 *xenTime,
+    _Out_ unsigned __int64 *dispersion) {
+    if (_hostTimeReader) {
+        auto start = std::chrono::steady_clock::now();
+        auto hr = _hostTimeReader->Read(xenTime, dispersion);
+        _metrics.HostTimePageLatency.Record(ElapsedNs(start));
+        if (SUCCEEDED(hr)) {
+            return S_OK;
+        } else if (hr == HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED)) {
+            // until the worker maps it again; meanwhile, and while dom0 marks it invalid, the other sources stand in
+            DebugLog("Host time page unmapped");
+            _hostTimeReader.reset();
+        }
+    }
+
+    if (_pvclock) {
+        auto start = std::chrono::steady_clock::now();
+        auto hr = _pvclock->Read(xenTime);
+        _metrics.PvClockLatency.Record(ElapsedNs(start));
+        if (SUCCEEDED(hr)) {
+            *dispersion = 0;
+            return S_OK;
+        } else if (hr == HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED)) {
+            // unstable TSC, stay on IOCTLs for as long as this device is around
+            DebugLog("PvClock not usable, using IOCTLs");
+            _pvclock.reset();
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto hr = GetTimeOrFallback(config, device, xenTime, dispersion);
+    _metrics.IoctlLatency.Record(ElapsedNs(start));
+    if (hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT))
+        _metrics.IoctlTimeouts.Add();
+    else if (FAILED(hr))
+        _metrics.IoctlFailures.Add();
+    return hr;
+}
+
+HRESULT XenTimeSampler::TakeSample(
+    _In_ const XenTimeSamplerConfig &config,
+    _In_ IXenIfaceDevice *device,
+    _Out_ TimeSample *sample,
+    _Out_ unsigned __int64 *timestamp) {
+    unsigned __int64 tickCount;
+    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_TickCount, &tickCount));
+
+    signed __int64 phaseOffset;
+    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_PhaseOffset, &phaseOffset));
+
+    unsigned __int64 begin;
+    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_CurrentTime, &begin));
+
+    unsigned __int64 xenTime, dispersion;
+    RETURN_IF_FAILED(ReadHostTime(config, device, &xenTime, &dispersion));
+
+    unsigned __int64 end;
+    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_CurrentTime, &end));
+
+    signed __int64 delay = end - begin;
+    if (delay < 0)
+        delay = 0;
+    _metrics.Delay.Record(delay);
+
+    *sample = TimeSample{
+        .dwSize = sizeof(TimeSample),
+        .dwRefid = ' NEX',
+        .toOffset = static_cast<signed __int64>(xenTime - begin + delay / 2),
+        .toDelay = delay,
+        .tpDispersion = dispersion,
+        .nSysTickCount = tickCount,
+        .nSysPhaseOffset = phaseOffset,
+        .nLeapFlags = 3,
+        .nStratum = 0,
+        .dwTSFlags = TSF_Hardware,
+    };
+    wcsncpy_s(sample->wszUniqueName, device->GetPath().c_str(), _TRUNCATE);
+    *timestamp = begin;
+
+    return S_OK;
+}
+
+HRESULT XenTimeSampler::TakeBurst(
+    _In_ const XenTimeSamplerConfig &config,
+    _In_ IXenIfaceDevice *device,
+    _Out_ TimeSample *best,
+    _Out_ unsigned __int64 *bestTimestamp) {
+    // Keep the read with the lowest delay; a preempted vCPU or a slow IOCTL only costs one read of the burst instead
+    // of the whole round.
+    bool found = false;
+    for (DWORD i = 0; i < config.BurstCount; i++) {
+        TimeSample current;
+        unsigned __int64 timestamp;
+        auto hr = TakeSample(config, device, &current, &timestamp);
+        if (FAILED(hr)) {
+            if (found)
+                break;
+            return hr;
+        }
+        if (!found || current.toDelay < best->toDelay) {
+            *best = current;
+            *bestTimestamp = timestamp;
+            found = true;
+        }
+    }
+    return S_OK;
+}
+
+void XenTimeSampler::ResetState() {
+    _filter.Reset();
+    _dispersion.Reset();
+    _offsetFilter.Reset();
+    _drift.Reset();
+    _lastSample.reset();
+    _holdingOver = false;
+    _localTime.Invalidate();
+}
+
+void XenTimeSampler::CheckEpoch(ULONG suspendCount) {
+    if (_epoch && _epoch->SuspendCount == suspendCount)
+        return;
+
+    if (_epoch) {
+        auto elapsed = std::chrono::steady_clock::now() - _epoch->Start;
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(elapsed);
+        Log(LogTimeProvEventTypeInformation,
+            L"VM was suspended (count %lu to %lu), dropping samples. The last epoch had %llu samples in %llu rounds "
+            L"over %llds.",
+            static_cast<unsigned long>(_epoch->SuspendCount),
+            static_cast<unsigned long>(suspendCount),
+            _epoch->Samples,
+            _epoch->Rounds,
+            static_cast<long long>(seconds.count()));
+        _metrics.SuspendEpochs.Add();
+        // a migration leaves the status behind on the old host
+        _status.Invalidate();
+
+        // as after a resume notification, which may not have come or not yet
+        _sampledGeneration = _generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+        ResetState();
+        {
+            std::lock_guard lock(_mutex);
+            _resumeRounds = ResumeRounds;
+        }
+    }
+    _epoch = SuspendEpoch{.SuspendCount = suspendCount, .Start = std::chrono::steady_clock::now()};
+}
+
+HRESULT XenTimeSampler::TakeBracketedBurst(
+    _In_ const XenTimeSamplerConfig &config,
+    _In_ const std::shared_ptr<IXenIfaceDevice> &device,
+    _Out_ TimeSample *best,
+    _Out_ unsigned __int64 *bestTimestamp) {
+    if (config.PvClock)
+        AttachPvClock(device);
+    else
+        DetachPvClock();
+    if (config.HostTimePage) {
+        AttachHostTimePage();
+    } else {
+        _hostTimeReader.reset();
+        _hostTimePage.reset();
+    }
+
+    // A suspend between the TSI_CurrentTime reads of a sample leaves it with a wrong offset, and its delay need not
+    // show it. The suspend count is checked around the whole burst rather than each read, which would double the cost
+    // of the pvclock path; a straddled burst is taken again. Drivers without SUSPEND_GET_COUNT go unchecked.
+    for (DWORD attempt = 1;; attempt++) {
+        ULONG before, after;
+        auto counted = SUCCEEDED(device->GetSuspendCount(&before, IoctlDeadline(config)));
+        if (counted)
+            CheckEpoch(before);
+
+        RETURN_IF_FAILED(TakeBurst(config, device.get(), best, bestTimestamp));
+        if (!counted)
+            return S_OK;
+
+        RETURN_IF_FAILED(device->GetSuspendCount(&after, IoctlDeadline(config)));
+        if (after == before)
+            return S_OK;
+
+        _metrics.StraddledBursts.Add();
+        CheckEpoch(after);
+        RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_RETRY), attempt >= MaxStraddledBursts);
+    }
+}
+
+void XenTimeSampler::SendTelemetry(_In_ const XenTimeSamplerConfig &config) {
+    // without a device the window goes on, so that the next line covers the outage
+    auto device = _worker.GetDevice();
+    if (!device || !device->IsOpen())
+        return;
+
+    CHAR line[IXenIfaceDevice::MaxLogLength];
+    _telemetry.Summarize(std::chrono::steady_clock::now(), _need_fallback, line, ARRAYSIZE(line));
+    auto hr = device->Log(line, IoctlDeadline(config));
+    if (FAILED(hr)) {
+        // the window goes on, and the next round tries again with a line covering this one's rounds too
+        DebugLog("Telemetry failed %x", hr);
+        return;
+    }
+    _telemetry.Advance();
+}
+
+void XenTimeSampler::PublishStatus(_In_ const XenTimeSamplerConfig &config) {
+    // tried again next round
+    auto device = _worker.GetDevice();
+    if (!device || !device->IsOpen())
+        return;
+
+    auto hr = _status.Publish(
+        std::chrono::steady_clock::now(),
+        config.StatusThreshold,
+        device.get(),
+        IoctlDeadline(config));
+    if (FAILED(hr))
+        DebugLog("Status update failed %x", hr);
+}
+
+HRESULT XenTimeSampler::Holdover(_In_ const XenTimeSamplerConfig &config, HRESULT hr, _Out_ TimeSample *sample) {
+    if (!config.HoldoverLimit.count() || !_lastSample || !_drift.IsReady())
+        return hr;
+
+    unsigned __int64 now;
+    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_CurrentTime, &now));
+    auto tick = HoldoverTick();
+
+    auto outage = HoldoverTicks(tick - _drift.GetLastTick());
+    if (outage > config.HoldoverLimit) {
+        if (_holdingOver)
+            Log(LogTimeProvEventTypeWarning,
+                L"No Xen interface device for %llds, no longer extrapolating host time",
+                static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(outage).count()));
+        _holdingOver = false;
+        return hr;
+    }
+
+    unsigned __int64 hostTime, error;
+    RETURN_IF_FAILED(_drift.Predict(tick, &hostTime, &error));
+
+    unsigned __int64 tickCount;
+    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_TickCount, &tickCount));
+    signed __int64 phaseOffset;
+    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_PhaseOffset, &phaseOffset));
+
+    if (!_holdingOver)
+        Log(LogTimeProvEventTypeWarning,
+            L"No Xen interface device, extrapolating host time for up to %llds (host frequency %.3f ppm)",
+            static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(config.HoldoverLimit).count()),
+            _drift.FrequencyPpm());
+    _holdingOver = true;
+    _metrics.HoldoverRounds.Add();
+
+    *sample = *_lastSample;
+    sample->toOffset = static_cast<signed __int64>(hostTime - now);
+    sample->tpDispersion += error;
+    sample->nSysTickCount = tickCount;
+    sample->nSysPhaseOffset = phaseOffset;
+    return S_OK;
+}
+
+HRESULT XenTimeSampler::Update(_In_ const XenTimeSamplerConfig &config, _Out_ TimeSample *sample) {
+    auto device = _worker.GetDevice();
+    if (!device || !device->IsOpen()) {
+        DetachPvClock();
+        return Holdover(config, E_PENDING, sample);
+    }
+
+    TimeSample best{};
+    unsigned __int64 bestTimestamp = 0;
+    auto hr = TakeBracketedBurst(config, device, &best, &bestTimestamp);
+    if (FAILED(hr) && !device->IsOpen()) {
+        // closed by PnP under us, the standby can still make this round
+        auto standby = _worker.GetDevice();
+        if (standby && standby != device && standby->IsOpen())
+            hr = TakeBracketedBurst(config, standby, &best, &bestTimestamp);
+        if (FAILED(hr))
+            return Holdover(config, hr, sample);
+    }
+    RETURN_IF_FAILED(hr);
+    if (_holdingOver)
+        Log(LogTimeProvEventTypeInformation, L"Xen interface device is back, no longer extrapolating host time");
+    _holdingOver = false;
+
+    auto wasTrusted = _offsetFilter.IsTrusted();
+    auto verdict = _offsetFilter.Add(best.toOffset, best.toDelay, bestTimestamp);
+    if (config.RejectOutliers) {
+        if (_offsetFilter.IsTrusted() != wasTrusted) {
+            if (_offsetFilter.IsTrusted())
+                Log(LogTimeProvEventTypeInformation, L"Xen host time is consistent again, resuming samples");
+            else
+                Log(LogTimeProvEventTypeWarning,
+                    L"Xen host time is inconsistent, withholding samples (frequency error %.1f ppm)",
+                    _offsetFilter.FrequencyPpm());
+        }
+        if (!_offsetFilter.IsTrusted()) {
+            _metrics.UntrustedRounds.Add();
+            return S_FALSE;
+        }
+        if (verdict == OffsetVerdict::Rejected) {
+            _metrics.RejectedOffsets.Add();
+            return S_FALSE;
+        }
+    }
+    auto measuredOffset = best.toOffset;
+    if (config.OffsetLoop && verdict == OffsetVerdict::Accepted)
+        best.toOffset = _offsetFilter.SmoothedOffset();
+
+    // the read's own uncertainty (resolution, DST ambiguity) plus what recent rounds say about the current conditions
+    _dispersion.Add(best.toOffset, best.toDelay, bestTimestamp);
+    best.tpDispersion += _dispersion.Estimate(best.toDelay);
+    _filter.Add(best, bestTimestamp);
+
+    unsigned __int64 now;
+    RETURN_IF_FAILED(_callbacks.pfnGetTimeSysInfo(TSI_CurrentTime, &now));
+    auto selected = _filter.Select(now);
+    RETURN_HR_IF(E_UNEXPECTED, !selected);
+
+    // The host clock is what w32time syncs to through us, so the sample carries its sync state. Without one from
+    // dom0, samples go out as from an unsynchronized reference clock, as they always have.
+    auto host = _worker.GetHostSync();
+    if (host.Valid && !host.IsSynchronized()) {
+        if (!_hostUnsynced)
+            Log(LogTimeProvEventTypeWarning, L"The Xen host reports its clock as unsynchronized, withholding samples");
+        _hostUnsynced = true;
+        _metrics.HostUnsyncedRounds.Add();
+        return S_FALSE;
+    }
+    if (_hostUnsynced)
+        Log(LogTimeProvEventTypeInformation, L"The Xen host clock is synchronized again, resuming samples");
+    _hostUnsynced = false;
+
+    *sample = *selected;
+    if (host.Valid) {
+        sample->nLeapFlags = host.Leap;
+        sample->nStratum = host.Stratum;
+        sample->tpDispersion += host.Dispersion;
+    }
+    // the offset is taken to hold from the best read until now, a few reads at most
+    _drift.Add(HoldoverTick(), now + measuredOffset);
+    _lastSample = *sample;
+    return S_OK;
+}
+
+void XenTimeSampler::SamplerFunc(std::stop_token stop) {
+    XenTimeSamplerConfig config;
+    // time of the last resume or push until a sample has been published after it
+    bool recovering = false;
+    std::chrono::steady_clock::time_point resumedAt;
+    bool pushed = false;
+    std::chrono::steady_clock::time_point pushedAt;
+    auto startupRounds = StartupRounds;
+
+    auto created = _metricsSection.Create();
+    if (FAILED(created))
+        Log(LogTimeProvEventTypeWarning, L"Metrics will not be published for diagnostic tools: %x", created);
+
+    while (!stop.stop_requested()) {
+        bool resuming;
+        {
+            std::lock_guard lock(_mutex);
+            if (_configChanged) {
+                config = _config;
+                _configChanged = false;
+                _filter.SetDepth(config.FilterDepth);
+                _dispersion.Reset();
+                _offsetFilter.Reset();
+                _need_fallback = false;
+            }
+            if (_resumedAt) {
+                recovering = true;
+                resumedAt = *_resumedAt;
+                _resumedAt.reset();
+            }
+            if (_pushedAt) {
+                pushed = true;
+                pushedAt = *_pushedAt;
+                _pushedAt.reset();
+            }
+            resuming = _resumeRounds > 0;
+            if (resuming)
+                _resumeRounds--;
+            _wake = false;
+        }
+
+        auto currentGeneration = _generation.load(std::memory_order_acquire);
+        if (currentGeneration != _sampledGeneration) {
+            ResetState();
+            _sampledGeneration = currentGeneration;
+        }
+
+        TimeSample sample;
+        auto hr = Update(config, &sample);
+        _metrics.Rounds.Add();
+        if (_epoch)
+            _epoch->Rounds++;
+        if (hr == S_OK) {
+            {
+                // only for WaitForLatest, GetLatest never waits on the lock
+                std::lock_guard lock(_mutex);
+                _ring.Push(PublishedSample{.Sample = sample, .Generation = _sampledGeneration});
+            }
+            _publishedSignal.notify_all();
+            _metrics.SamplesPublished.Add();
+            if (_epoch)
+                _epoch->Samples++;
+            _metrics.Offset.Record(sample.toOffset < 0 ? -sample.toOffset : sample.toOffset);
+            if (sample.toOffset < 0)
+                _metrics.NegativeOffsets.Add();
+            if (recovering) {
+                _metrics.ResumeRecovery.Record(ElapsedNs(resumedAt));
+                recovering = false;
+            }
+            if (pushed) {
+                _metrics.PushLatency.Record(ElapsedNs(pushedAt));
+                pushed = false;
+            }
+            if (resuming)
+                _callbacks.pfnAlertSamplesAvail();
+        } else if (hr == S_FALSE) {
+            // withheld by the offset filter or for the host, counted by Update
+        } else if (hr == E_PENDING) {
+            _metrics.PendingRounds.Add();
+        } else {
+            _metrics.FailedRounds.Add();
+        }
+
+        _telemetry.AddRound(hr, hr == S_OK ? &sample : nullptr);
+        if (config.TelemetryInterval.count() &&
+            _telemetry.IsDue(std::chrono::steady_clock::now(), config.TelemetryInterval))
+            SendTelemetry(config);
+
+        auto source = hr == S_OK && _holdingOver ? XenTimeSource::Holdover
+            : hr == E_PENDING                    ? XenTimeSource::None
+            : _hostTimeReader                    ? XenTimeSource::HostTimePage
+            : _need_fallback                     ? XenTimeSource::Fallback
+            : _pvclock                           ? XenTimeSource::PvClock
+                                                 : XenTimeSource::Ioctl;
+        _status.AddRound(hr, hr == S_OK ? &sample : nullptr, source);
+        if (config.StatusInterval.count() && _status.IsDue(std::chrono::steady_clock::now(), config.StatusInterval))
+            PublishStatus(config);
+        if (_metricsSection.IsOpen()) {
+            XenTimeMetricsSnapshot snapshot;
+            _metrics.Snapshot(&snapshot);
+            _metricsSection.Publish(snapshot);
+        }
+
+        if (FAILED(hr) && hr != _lastError) {
+            // only report changes, this runs far more often than w32time polls
+            Log(LogTimeProvEventTypeError, L"Update failed: %x", hr);
+        }
+        _lastError = hr;
+
+        // startup rounds only count once there is a device, whose arrival wakes us
+        auto starting = startupRounds > 0 && hr != E_PENDING;
+        if (starting)
+            startupRounds--;
+
+        auto taken = std::chrono::steady_clock::now();
+        std::unique_lock lock(_mutex);
+        while (!stop.stop_requested() && !_wake && !_configChanged) {
+            // a poll or a new poll interval only moves the next round
+            _rescheduled = false;
+            if (_polled.exchange(false, std::memory_order_acquire))
+                _schedule.OnPoll(std::chrono::steady_clock::time_point(
+                    std::chrono::steady_clock::duration(_polledAt.load(std::memory_order_relaxed))));
+            auto due = resuming || starting ? taken + (std::min)(config.Interval, ResumeInterval)
+                : config.PollSchedule       ? _schedule.Next(taken, config.Interval)
+                                            : taken + config.Interval;
+            if (!_signal.wait_until(lock, stop, due, [&] {
+                    return _wake || _configChanged || _rescheduled || _polled.load(std::memory_order_acquire);
+                }))
+                break;
+        }
+    }
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "Platform.hpp"
+#include "ClockFilter.hpp"
+#include "DispersionEstimator.hpp"
+#include "DriftModel.hpp"
+#include "Logging.hpp"
+#include "Metrics.hpp"
+#include "MetricsSection.hpp"
+#include "OffsetFilter.hpp"
+#include "PvClock.hpp"
+#include "SampleRing.hpp"
+#include "SamplingSchedule.hpp"
+#include "TimeConverter.hpp"
+#include "XenIface.hpp"
+#include "XenIfaceWorker.hpp"
+#include "XenTimeStatus.hpp"
+#include "XenTimeTelemetry.hpp"
+
+struct XenTimeSamplerConfig {
+    DWORD BurstCount = 4;
+    size_t FilterDepth = ClockFilter::DefaultDepth;
+    std::chrono::milliseconds Interval{1000};
+    bool AllowFallback = false;
+    // Each IOCTL is abandoned if the driver has not completed it by then, so that a wedged driver costs a round
+    // rather than the sampler thread
+    std::chrono::milliseconds IoctlTimeout{250};
+    // Read host time from the shared time page where the device offers it, rather than with an IOCTL. Only the
+    // simulated backend offers one so far; elsewhere, attaching logs once that the IOCTLs are used.
+    bool PvClock = true;
+    // Read host time from the page dom0's time service keeps where it grants one, ahead of any other source, see
+    // XenIfaceWorker::GetHostTimePage
+    bool HostTimePage = true;
+    // Withhold offsets that stand out from the recent ones, and every offset while too many do
+    bool RejectOutliers = true;
+    // Publish the offset smoothed by OffsetFilter's loop instead of the raw one. Off by default, since w32time runs a
+    // loop of its own on top.
+    bool OffsetLoop = false;
+    // How often a summary of the rounds goes to dom0's log, see XenTimeTelemetry; never if zero
+    std::chrono::milliseconds TelemetryInterval{300000};
+    // How often the status in XenStore may be rewritten, see XenTimeStatus; never if zero. Offsets, delays and
+    // dispersions that have moved less than StatusThreshold (100 ns) since they were written are left alone.
+    std::chrono::milliseconds StatusInterval{60000};
+    unsigned __int64 StatusThreshold = 1000;
+    // Sample right away when dom0's time service notifies us of a clock step or leap event, see
+    // XenIfaceWorker::SetPushHandler
+    bool Push = true;
+    // While there is no device, keep publishing host time extrapolated by DriftModel, with its growing error bound
+    // added to the dispersion, for up to this long after the last real sample; never if zero
+    std::chrono::milliseconds HoldoverLimit{300000};
+    // Time rounds against w32time's polls rather than every Interval, see SamplingSchedule
+    bool PollSchedule = true;
+};
+
+// Collects host time samples on its own thread and publishes the filtered result, so that the w32time thread never
+// waits on the driver.
+class XenTimeSampler {
+public:
+    static constexpr DWORD MaxBurstCount = 16;
+    // After a resume, this many rounds are taken at ResumeInterval and each one is announced to w32time, so that it
+    // re-converges in seconds rather than over several poll intervals
+    static constexpr unsigned int ResumeRounds = 16;
+    static constexpr std::chrono::milliseconds ResumeInterval{100};
+    // Rounds taken at ResumeInterval and announced after a push from dom0
+    static constexpr unsigned int PushRounds = 4;
+    // Rounds taken at ResumeInterval once there is a device at startup, so that the filter is full by the time
+    // w32time is through its first polls
+    static constexpr unsigned int StartupRounds = 4;
+    // attempts at a burst that does not straddle a suspend
+    static constexpr DWORD MaxStraddledBursts = 3;
+
+    XenTimeSampler(
+        _In_ const TimeProvSysCallbacks &callbacks,
+        _In_ XenIfaceWorker &worker,
+        _In_ XenTimeMetrics &metrics);
+    ~XenTimeSampler();
+    XenTimeSampler(const XenTimeSampler &) = delete;
+    XenTimeSampler &operator=(const XenTimeSampler &) = delete;
+
+    void Configure(_In_ const XenTimeSamplerConfig &config);
+    // Drops every sample taken so far and samples again right away
+    void Invalidate();
+    // w32time's poll interval, from TSI_PollInterval, and its polls, for scheduling rounds ahead of them
+    void SetPollInterval(signed char pollInterval);
+    // Lock-free, the sampler thread takes the poll into account when it next schedules a round
+    void OnPoll();
+
+    // Wait-free. Returns true and updates *sequence if a sample newer than *sequence has been published.
+    bool GetLatest(_Out_ TimeSample *sample, _Inout_ unsigned __int64 *sequence) const;
+    // Likewise, but waits up to timeout for one to be published, unless the worker has found no interface to take one
+    // from
+    bool WaitForLatest(
+        std::chrono::milliseconds timeout,
+        _Out_ TimeSample *sample,
+        _Inout_ unsigned __int64 *sequence);
+
+private:
+    struct PublishedSample {
+        TimeSample Sample;
+        unsigned __int64 Generation;
+    };
+
+    // Time between two suspends, as told by the suspend count
+    struct SuspendEpoch {
+        ULONG SuspendCount;
+        std::chrono::steady_clock::time_point Start;
+        unsigned __int64 Rounds = 0;
+        unsigned __int64 Samples = 0;
+    };
+
+    void SamplerFunc(std::stop_token stop);
+    void OnResume();
+    void OnPush();
+    void OnArrival();
+    HRESULT Update(_In_ const XenTimeSamplerConfig &config, _Out_ TimeSample *sample);
+    // A sample extrapolated from the last ones for a round the device missed, or hr if there can't be one
+    HRESULT Holdover(_In_ const XenTimeSamplerConfig &config, HRESULT hr, _Out_ TimeSample *sample);
+    HRESULT TakeBurst(
+        _In_ const XenTimeSamplerConfig &config,
+        _In_ IXenIfaceDevice *device,
+        _Out_ TimeSample *best,
+        _Out_ unsigned __int64 *bestTimestamp);
+    HRESULT TakeBracketedBurst(
+        _In_ const XenTimeSamplerConfig &config,
+        _In_ const std::shared_ptr<IXenIfaceDevice> &device,
+        _Out_ TimeSample *best,
+        _Out_ unsigned __int64 *bestTimestamp);
+    // Drops everything learned from past samples
+    void ResetState();
+    void CheckEpoch(ULONG suspendCount);
+    void SendTelemetry(_In_ const XenTimeSamplerConfig &config);
+    void PublishStatus(_In_ const XenTimeSamplerConfig &config);
+    HRESULT TakeSample(
+        _In_ const XenTimeSamplerConfig &config,
+        _In_ IXenIfaceDevice *device,
+        _Out_ TimeSample *sample,
+        _Out_ unsigned __int64 *timestamp);
+    void AttachPvClock(_In_ const std::shared_ptr<IXenIfaceDevice> &device);
+    void DetachPvClock();
+    void AttachHostTimePage();
+    HRESULT ReadHostTime(
+        _In_ const XenTimeSamplerConfig &config,
+        _In_ IXenIfaceDevice *device,
+        _Out_ unsigned __int64 *xenTime,
+        _Out_ unsigned __int64 *dispersion);
+    HRESULT GetTimeOrFallback(
+        _In_ const XenTimeSamplerConfig &config,
+        _In_ IXenIfaceDevice *device,
+        _Out_ unsigned __int64 *xenTime,
+        _Out_ unsigned __int64 *dispersion);
+
+    template <typename... TArgs> void Log(LogTimeProvEventType level, PCWSTR format, TArgs... args) {
+        TimeProvLog(_callbacks.pfnLogTimeProvEvent, level, format, args...);
+    }
+
+    TimeProvSysCallbacks _callbacks;
+    XenIfaceWorker &_worker;
+    XenTimeMetrics &_metrics;
+
+    std::mutex _mutex;
+    std::condition_variable_any _signal;
+    // for WaitForLatest, notified with every sample published
+    std::condition_variable _publishedSignal;
+    _Guarded_by_(_mutex) XenTimeSamplerConfig _config;
+    _Guarded_by_(_mutex) bool _configChanged = true;
+    _Guarded_by_(_mutex) bool _wake = false;
+    _Guarded_by_(_mutex) SamplingSchedule _schedule;
+    // the next round may be due at another time
+    _Guarded_by_(_mutex) bool _rescheduled = false;
+    _Guarded_by_(_mutex) unsigned int _resumeRounds = 0;
+    _Guarded_by_(_mutex) std::optional<std::chrono::steady_clock::time_point> _resumedAt;
+    _Guarded_by_(_mutex) std::optional<std::chrono::steady_clock::time_point> _pushedAt;
+    // the last OnPoll, fed to _schedule by the sampler thread; _polled is set until it has been
+    std::atomic<std::chrono::steady_clock::rep> _polledAt = 0;
+    std::atomic<bool> _polled = false;
+
+    std::atomic<unsigned __int64> _generation = 0;
+    SampleRing<PublishedSample, 8> _ring;
+
+    // owned by the sampler thread
+    unsigned __int64 _sampledGeneration = 0;
+    std::optional<SuspendEpoch> _epoch;
+    ClockFilter _filter;
+    DispersionEstimator _dispersion;
+    OffsetFilter _offsetFilter;
+    bool _need_fallback = false;
+    // samples are being withheld for dom0's clock
+    bool _hostUnsynced = false;
+    DriftModel _drift;
+    // the last sample published from the device, which holdover samples are made from
+    std::optional<TimeSample> _lastSample;
+    // the last round was one
+    bool _holdingOver = false;
+    LocalTimeConverter _localTime;
+    std::weak_ptr<IXenIfaceDevice> _pvclockDevice;
+    std::optional<PvClockReader> _pvclock;
+    bool _pvclockUnavailableLogged = false;
+    // the page as the worker last published it, and a reader of it until it turns out to be unmapped
+    std::shared_ptr<IXenHostTimePage> _hostTimePage;
+    std::optional<PvClockHostTimeReader> _hostTimeReader;
+    HRESULT _lastError = S_OK;
+    XenTimeTelemetry _telemetry;
+    XenTimeStatus _status;
+    MetricsSection _metricsSection;
+
+    std::jthread _thread;
+};
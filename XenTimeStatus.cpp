@@ -0,0 +1,123 @@
+#include <cstdio>
+
+#include "XenTimeStatus.hpp"
+
+static int StatusPrint(_Out_writes_z_(size) PSTR buffer, size_t size, _In_ PCSTR format, auto... args) {
+#ifdef _WIN32
+    return _snprintf_s(buffer, size, _TRUNCATE, format, args...);
+#else
+    return snprintf(buffer, size, format, args...);
+#endif
+}
+
+static bool StatusMoved(signed __int64 value, signed __int64 written, unsigned __int64 threshold) {
+    auto difference = value > written ? value - written : written - value;
+    return static_cast<unsigned __int64>(difference) > threshold;
+}
+
+static PCSTR StatusSourceName(XenTimeSource source) {
+    switch (source) {
+    case XenTimeSource::Ioctl:
+        return "ioctl";
+    case XenTimeSource::PvClock:
+        return "pvclock";
+    case XenTimeSource::HostTimePage:
+        return "hostpage";
+    case XenTimeSource::Fallback:
+        return "fallback";
+    case XenTimeSource::Holdover:
+        return "holdover";
+    default:
+        return "none";
+    }
+}
+
+XenTimeStatus::XenTimeStatus() : _lastPass(std::chrono::steady_clock::now()) {}
+
+void XenTimeStatus::AddRound(HRESULT hr, _In_opt_ const TimeSample *sample, XenTimeSource source) {
+    // withheld rounds are no failure
+    _current.Error = FAILED(hr) ? hr : S_OK;
+    _current.Source = source;
+    if (!sample)
+        return;
+
+    _current.HasSample = true;
+    _current.Offset = sample->toOffset;
+    _current.Delay = sample->toDelay;
+    _current.Dispersion = sample->tpDispersion;
+    _samples++;
+}
+
+bool XenTimeStatus::WriteKey(
+    _In_ IXenIfaceDevice *device,
+    Key key,
+    _In_ PCSTR name,
+    _In_ PCSTR value,
+    XenIfaceDeadline deadline,
+    _Inout_ HRESULT *result) {
+    CHAR path[64];
+    StatusPrint(path, ARRAYSIZE(path), "%s/%s", Path, name);
+
+    auto hr = device->StoreWrite(path, value, deadline);
+    if (FAILED(hr)) {
+        if (SUCCEEDED(*result))
+            *result = hr;
+        return false;
+    }
+    _written |= key;
+    return true;
+}
+
+HRESULT XenTimeStatus::Publish(
+    std::chrono::steady_clock::time_point now,
+    unsigned __int64 threshold,
+    _In_ IXenIfaceDevice *device,
+    XenIfaceDeadline deadline) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - _lastPass).count();
+    if (elapsed > 0)
+        _current.Rate = _samples * 60000 / static_cast<unsigned __int64>(elapsed);
+    _samples = 0;
+    _lastPass = now;
+
+    auto result = S_OK;
+    CHAR value[32];
+    if (_current.HasSample) {
+        if (!(_written & KeyOffset) || StatusMoved(_current.Offset, _published.Offset, threshold)) {
+            StatusPrint(value, ARRAYSIZE(value), "%lld", static_cast<long long>(_current.Offset * 100));
+            if (WriteKey(device, KeyOffset, "offset", value, deadline, &result))
+                _published.Offset = _current.Offset;
+        }
+        if (!(_written & KeyDelay) || StatusMoved(_current.Delay, _published.Delay, threshold)) {
+            StatusPrint(value, ARRAYSIZE(value), "%lld", static_cast<long long>(_current.Delay * 100));
+            if (WriteKey(device, KeyDelay, "delay", value, deadline, &result))
+                _published.Delay = _current.Delay;
+        }
+        if (!(_written & KeyDispersion) ||
+            StatusMoved(
+                static_cast<signed __int64>(_current.Dispersion),
+                static_cast<signed __int64>(_published.Dispersion),
+                threshold)) {
+            StatusPrint(value, ARRAYSIZE(value), "%llu", static_cast<unsigned long long>(_current.Dispersion * 100));
+            if (WriteKey(device, KeyDispersion, "dispersion", value, deadline, &result))
+                _published.Dispersion = _current.Dispersion;
+        }
+    }
+    if ((!(_written & KeySource) || _current.Source != _published.Source) &&
+        WriteKey(device, KeySource, "source", StatusSourceName(_current.Source), deadline, &result))
+        _published.Source = _current.Source;
+    if (!(_written & KeyRate) ||
+        StatusMoved(
+            static_cast<signed __int64>(_current.Rate),
+            static_cast<signed __int64>(_published.Rate),
+            static_cast<unsigned __int64>(static_cast<double>(_published.Rate) * RateThreshold))) {
+        StatusPrint(value, ARRAYSIZE(value), "%llu", static_cast<unsigned long long>(_current.Rate));
+        if (WriteKey(device, KeyRate, "rate", value, deadline, &result))
+            _published.Rate = _current.Rate;
+    }
+    if (!(_written & KeyError) || _current.Error != _published.Error) {
+        StatusPrint(value, ARRAYSIZE(value), "%x", static_cast<unsigned int>(_current.Error));
+        if (WriteKey(device, KeyError, "error", value, deadline, &result))
+            _published.Error = _current.Error;
+    }
+    return result;
+}
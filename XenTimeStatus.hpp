@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+
+#include "Platform.hpp"
+#include "XenIface.hpp"
+
+// Where the last sample's host time came from
+enum class XenTimeSource {
+    None,
+    // IOCTL_XENIFACE_SHAREDINFO_GET_HOST_TIME
+    Ioctl,
+    // the shared time page
+    PvClock,
+    // the host time page dom0's time service keeps
+    HostTimePage,
+    // guest time, with AllowFallback on a driver without host time
+    Fallback,
+    // none, extrapolated from the last ones while the device is away
+    Holdover,
+};
+
+// The provider's clock status in XenStore, for dom0 tooling to scrape across a fleet without an agent in each VM.
+// Each value is a key of its own under data/xentimeprovider:
+//
+//   offset, delay, dispersion  of the last published sample, in ns
+//   source                     none, ioctl, pvclock, hostpage, fallback or holdover
+//   rate                       samples published per minute
+//   error                      the last round's failure as a hex HRESULT, 0 if it succeeded
+//
+// Writes are coalesced to one pass per interval at most, and a pass only rewrites the keys that have moved beyond
+// their threshold since they were last written. Owned by the sampler thread.
+class XenTimeStatus {
+public:
+    static constexpr PCSTR Path = "data/xentimeprovider";
+    // sample rates within this fraction of the one in XenStore are not rewritten
+    static constexpr double RateThreshold = 0.1;
+
+    XenTimeStatus();
+    XenTimeStatus(const XenTimeStatus &) = delete;
+    XenTimeStatus &operator=(const XenTimeStatus &) = delete;
+
+    // A round as Update ended it, with the sample it published if any
+    void AddRound(HRESULT hr, _In_opt_ const TimeSample *sample, XenTimeSource source);
+    // Whether interval has passed since the last pass
+    bool IsDue(std::chrono::steady_clock::time_point now, std::chrono::milliseconds interval) const {
+        return now - _lastPass >= interval;
+    }
+    // Rewrites every key on the next pass, e.g. after a migration to a host whose XenStore has none of them
+    void Invalidate() {
+        _written = 0;
+    }
+    // Writes whatever has changed by more than threshold (offset, delay and dispersion, in 100 ns) or at all (source,
+    // error). Keys whose write fails are tried again on the next pass. Returns the first failure.
+    HRESULT Publish(
+        std::chrono::steady_clock::time_point now,
+        unsigned __int64 threshold,
+        _In_ IXenIfaceDevice *device,
+        XenIfaceDeadline deadline);
+
+private:
+    struct Values {
+        bool HasSample = false;
+        signed __int64 Offset = 0;
+        signed __int64 Delay = 0;
+        unsigned __int64 Dispersion = 0;
+        XenTimeSource Source = XenTimeSource::None;
+        unsigned __int64 Rate = 0;
+        HRESULT Error = S_OK;
+    };
+
+    enum Key : unsigned int {
+        KeyOffset = 1 << 0,
+        KeyDelay = 1 << 1,
+        KeyDispersion = 1 << 2,
+        KeySource = 1 << 3,
+        KeyRate = 1 << 4,
+        KeyError = 1 << 5,
+    };
+
+    // Writes one key and marks it written, or keeps the first failure in *result
+    bool WriteKey(
+        _In_ IXenIfaceDevice *device,
+        Key key,
+        _In_ PCSTR name,
+        _In_ PCSTR value,
+        XenIfaceDeadline deadline,
+        _Inout_ HRESULT *result);
+
+    Values _current;
+    // what XenStore has for each key in _written
+    Values _published;
+    unsigned int _written = 0;
+    std::chrono::steady_clock::time_point _lastPass;
+    unsigned __int64 _samples = 0;
+};
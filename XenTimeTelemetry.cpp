@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "XenTimeTelemetry.hpp"
+
+XenTimeTelemetry::XenTimeTelemetry(_In_ const XenTimeMetrics &metrics) : _metrics(metrics) {
+    Reset(std::chrono::steady_clock::now());
+}
+
+XenTimeTelemetry::Counters XenTimeTelemetry::LoadCounters() const {
+    return Counters{
+        .IoctlFailures = _metrics.IoctlFailures.Load(),
+        .IoctlTimeouts = _metrics.IoctlTimeouts.Load(),
+        .Resumes = _metrics.Resumes.Load(),
+        .DeviceFailovers = _metrics.DeviceFailovers.Load(),
+    };
+}
+
+void XenTimeTelemetry::Reset(std::chrono::steady_clock::time_point now) {
+    _start = _summarizedAt = now;
+    _window = Window{.Start = LoadCounters()};
+}
+
+void XenTimeTelemetry::AddRound(HRESULT hr, _In_opt_ const TimeSample *sample) {
+    _window.Rounds++;
+    if (hr == S_FALSE) {
+        _window.Withheld++;
+    } else if (hr == E_PENDING) {
+        _window.Pending++;
+    } else if (FAILED(hr)) {
+        _window.Failed++;
+        _window.LastError = hr;
+    }
+    if (!sample)
+        return;
+
+    if (_window.Samples == 0) {
+        _window.MinOffset = _window.MaxOffset = sample->toOffset;
+    } else {
+        _window.MinOffset = (std::min)(_window.MinOffset, sample->toOffset);
+        _window.MaxOffset = (std::max)(_window.MaxOffset, sample->toOffset);
+    }
+    _window.SumOffset += static_cast<double>(sample->toOffset);
+    _window.SumDelay += static_cast<double>(sample->toDelay);
+    _window.MaxDelay = (std::max)(_window.MaxDelay, sample->toDelay);
+    _window.SumDispersion += static_cast<double>(sample->tpDispersion);
+    _window.MaxDispersion = (std::max)(_window.MaxDispersion, sample->tpDispersion);
+    _window.Samples++;
+}
+
+static int TelemetryPrint(_Out_writes_z_(size) PSTR line, size_t size, _In_ PCSTR format, auto... args) {
+#ifdef _WIN32
+    return _snprintf_s(line, size, _TRUNCATE, format, args...);
+#else
+    return snprintf(line, size, format, args...);
+#endif
+}
+
+void XenTimeTelemetry::Summarize(
+    std::chrono::steady_clock::time_point now,
+    bool fallback,
+    _Out_writes_z_(size) PSTR line,
+    size_t size) {
+    // 100 ns to us
+    auto us = [](double value) { return value / 10; };
+
+    _summarizedAt = now;
+    _summarized = LoadCounters();
+
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(now - _start).count();
+    auto used = TelemetryPrint(
+        line,
+        size,
+        "XenTimeProvider: w=%llds n=%llu ok=%llu held=%llu pend=%llu fail=%llu err=%x ioerr=%llu tmo=%llu res=%llu "
+        "fo=%llu fb=%d",
+        static_cast<long long>(seconds),
+        _window.Rounds,
+        _window.Samples,
+        _window.Withheld,
+        _window.Pending,
+        _window.Failed,
+        static_cast<unsigned int>(_window.LastError),
+        _summarized.IoctlFailures - _window.Start.IoctlFailures,
+        _summarized.IoctlTimeouts - _window.Start.IoctlTimeouts,
+        _summarized.Resumes - _window.Start.Resumes,
+        _summarized.DeviceFailovers - _window.Start.DeviceFailovers,
+        fallback ? 1 : 0);
+    if (used >= 0 && static_cast<size_t>(used) < size && _window.Samples) {
+        auto samples = static_cast<double>(_window.Samples);
+        TelemetryPrint(
+            line + used,
+            size - used,
+            " off=%.1f/%.1f/%.1fus dly=%.1f/%.1fus disp=%.1f/%.1fus",
+            us(static_cast<double>(_window.MinOffset)),
+            us(_window.SumOffset / samples),
+            us(static_cast<double>(_window.MaxOffset)),
+            us(_window.SumDelay / samples),
+            us(static_cast<double>(_window.MaxDelay)),
+            us(_window.SumDispersion / samples),
+            us(static_cast<double>(_window.MaxDispersion)));
+    }
+    line[size - 1] = 0;
+}
+
+void XenTimeTelemetry::Advance() {
+    _start = _summarizedAt;
+    _window = Window{.Start = _summarized};
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+
+#include "Platform.hpp"
+#include "Metrics.hpp"
+
+// The sampler's rounds over a window, summarized as one line for dom0's log so that host operators can see how well
+// the guest clock follows host time without logging into the VM. The line is printable ASCII, as IOCTL_XENIFACE_LOG
+// requires:
+//
+//   XenTimeProvider: w=300s n=300 ok=297 held=1 pend=0 fail=2 err=800705b4 ioerr=0 tmo=2 res=0 fo=0 fb=0
+//   off=-1.2/0.3/4.5us dly=2.1/5.5us disp=3.0/8.2us
+//
+// w is the window's length; n the rounds in it, and how they ended; err the last failure; ioerr, tmo, res and fo the
+// IOCTL failures, timeouts, resumes and device failovers; fb whether guest time is used instead of host time. off is
+// the published offsets' min/mean/max, dly and disp their delays' and dispersions' mean/max, left out without any.
+class XenTimeTelemetry {
+public:
+    explicit XenTimeTelemetry(_In_ const XenTimeMetrics &metrics);
+    XenTimeTelemetry(const XenTimeTelemetry &) = delete;
+    XenTimeTelemetry &operator=(const XenTimeTelemetry &) = delete;
+
+    // Starts a new window
+    void Reset(std::chrono::steady_clock::time_point now);
+    // A round as Update ended it, with the sample it published if any
+    void AddRound(HRESULT hr, _In_opt_ const TimeSample *sample);
+    // Whether the window has lasted interval; it stays due until a line is delivered
+    bool IsDue(std::chrono::steady_clock::time_point now, std::chrono::milliseconds interval) const {
+        return now - _start >= interval;
+    }
+    // Writes the window's line so far, truncated to size. The window goes on until Advance, so that a line that never
+    // reaches dom0 is covered by the next attempt.
+    void Summarize(
+        std::chrono::steady_clock::time_point now,
+        bool fallback,
+        _Out_writes_z_(size) PSTR line,
+        size_t size);
+    // The line Summarize last wrote was delivered: starts the next window where it ended
+    void Advance();
+
+private:
+    struct Counters {
+        unsigned __int64 IoctlFailures = 0;
+        unsigned __int64 IoctlTimeouts = 0;
+        unsigned __int64 Resumes = 0;
+        unsigned __int64 DeviceFailovers = 0;
+    };
+
+    struct Window {
+        unsigned __int64 Rounds = 0;
+        unsigned __int64 Samples = 0;
+        unsigned __int64 Withheld = 0;
+        unsigned __int64 Pending = 0;
+        unsigned __int64 Failed = 0;
+        HRESULT LastError = S_OK;
+
+        // 100 ns
+        signed __int64 MinOffset = 0;
+        signed __int64 MaxOffset = 0;
+        double SumOffset = 0;
+        double SumDelay = 0;
+        signed __int64 MaxDelay = 0;
+        double SumDispersion = 0;
+        unsigned __int64 MaxDispersion = 0;
+
+        // metrics counters as of the start of the window
+        Counters Start;
+    };
+
+    Counters LoadCounters() const;
+
+    const XenTimeMetrics &_metrics;
+    std::chrono::steady_clock::time_point _start;
+    Window _window;
+    // when the last line was written, and the counters it was written with
+    std::chrono::steady_clock::time_point _summarizedAt;
+    Counters _summarized;
+};
@@ -0,0 +1,1528 @@
+// Deterministic checks of the portable core's building blocks, one ctest test per mode. Nothing here depends on
+// timing: schedules run on a virtual clock and shared pages are plain buffers written by the test itself. Where a
+// check needs the worker, sampler or simulated driver thread to have acted, it waits for that with a generous
+// timeout, and asserts only on what the outcome must be however long it took. The simulated end-to-end runs stay in
+// xentimeprovider_bench.
+//
+// Usage: xentimeprovider_tests <test>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Platform.hpp"
+#include "Globals.hpp"
+#include "ClockFilter.hpp"
+#include "DispersionEstimator.hpp"
+#include "DriftModel.hpp"
+#include "Logging.hpp"
+#include "Metrics.hpp"
+#include "MetricsSection.hpp"
+#include "OffsetFilter.hpp"
+#include "PvClock.hpp"
+#include "RequestQueue.hpp"
+#include "SampleRing.hpp"
+#include "SamplingSchedule.hpp"
+#include "SimXenIface.hpp"
+#include "TimeConverter.hpp"
+#include "XenHostSync.hpp"
+#include "XenIface.hpp"
+#include "XenIfaceRequest.hpp"
+#include "XenIfaceWorker.hpp"
+#include "XenTimeSampler.hpp"
+#include "XenTimeStatus.hpp"
+#include "XenTimeTelemetry.hpp"
+
+static int TestFailures;
+
+#define TEST_CHECK(condition)                                                                                          \
+    do {                                                                                                               \
+        if (!(condition)) {                                                                                            \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                             \
+            TestFailures++;                                                                                            \
+        }                                                                                                              \
+    } while (0)
+
+// For other threads: whether condition became true within a few seconds
+static bool WaitUntil(_In_ const std::function<bool()> &condition) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() >= deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// w32time's side for the sampler tests: the system clock is a SimClock the test can step. While TestHold is set, the
+// sampler is held in its next read of it, and TestHeld tells the test it got there.
+static SimClock *TestSystemClock;
+static std::atomic<bool> TestHold;
+static std::atomic<bool> TestHeld;
+static std::atomic<unsigned int> TestAlerts;
+
+static HRESULT __stdcall TestGetTimeSysInfo(TimeSysInfo info, void *value) {
+    switch (info) {
+    case TSI_CurrentTime:
+        while (TestHold.load()) {
+            TestHeld.store(true);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        *static_cast<unsigned __int64 *>(value) = TestSystemClock->Now();
+        return S_OK;
+    case TSI_TickCount:
+        *static_cast<unsigned __int64 *>(value) = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        return S_OK;
+    case TSI_PhaseOffset:
+        *static_cast<signed __int64 *>(value) = 0;
+        return S_OK;
+    case TSI_PollInterval:
+        *static_cast<signed char *>(value) = 6;
+        return S_OK;
+    default:
+        return E_NOTIMPL;
+    }
+}
+
+static HRESULT __stdcall TestLogTimeProvEvent(WORD type, WCHAR *facility, WCHAR *message) {
+    UNREFERENCED_PARAMETER(type);
+    UNREFERENCED_PARAMETER(facility);
+    UNREFERENCED_PARAMETER(message);
+    return S_OK;
+}
+
+static HRESULT __stdcall TestAlertSamplesAvail() {
+    TestAlerts++;
+    return S_OK;
+}
+
+static TimeProvSysCallbacks TestCallbacks{
+    .dwSize = sizeof(TimeProvSysCallbacks),
+    .pfnGetTimeSysInfo = TestGetTimeSysInfo,
+    .pfnLogTimeProvEvent = TestLogTimeProvEvent,
+    .pfnAlertSamplesAvail = TestAlertSamplesAvail,
+    .pfnSetProviderStatus = nullptr,
+};
+
+// IOCTLs with next to no latency, for the sampler tests to run many rounds quickly
+static SimXenIfaceOptions TestFastOptions() {
+    SimXenIfaceOptions options;
+    options.RequestLatency = std::chrono::microseconds(10);
+    options.ResponseLatency = std::chrono::microseconds(10);
+    return options;
+}
+
+// Rounds every 10 ms from IOCTLs alone
+static XenTimeSamplerConfig TestSamplerConfig() {
+    XenTimeSamplerConfig config;
+    config.Interval = std::chrono::milliseconds(10);
+    config.PvClock = false;
+    config.HostTimePage = false;
+    config.PollSchedule = false;
+    return config;
+}
+
+static void TestHistogram() {
+    for (size_t i = 0; i < 64; i++) {
+        unsigned __int64 value = 1ULL << i;
+        TEST_CHECK(MetricsHistogram::BucketIndex(value) == i + 1);
+        TEST_CHECK(MetricsHistogram::BucketIndex(value - 1) == i);
+        TEST_CHECK(MetricsHistogram::BucketUpperBound(i + 1) >= value);
+    }
+    TEST_CHECK(MetricsHistogram::BucketUpperBound(0) == 0);
+    TEST_CHECK(MetricsHistogram::BucketUpperBound(64) == ~0ULL);
+
+    MetricsHistogram histogram;
+    MetricsHistogramSnapshot snapshot;
+    histogram.Snapshot(&snapshot);
+    TEST_CHECK(snapshot.Count == 0);
+    TEST_CHECK(snapshot.Percentile(0.5) == 0);
+
+    for (unsigned __int64 value = 0; value <= 100; value++)
+        histogram.Record(value);
+    histogram.Snapshot(&snapshot);
+    TEST_CHECK(snapshot.Count == 101);
+    TEST_CHECK(snapshot.Sum == 5050);
+    TEST_CHECK(snapshot.Max == 100);
+    // 0, 1, 2-3, 4-7, ... 32-63 make up the first 64 values
+    TEST_CHECK(snapshot.Percentile(0) == 0);
+    TEST_CHECK(snapshot.Percentile(0.5) == 63);
+    TEST_CHECK(snapshot.Percentile(0.99) == 100);
+    TEST_CHECK(snapshot.Percentile(1) == 100);
+
+    histogram.Record(1ULL << 63);
+    histogram.Snapshot(&snapshot);
+    TEST_CHECK(snapshot.Max == 1ULL << 63);
+    TEST_CHECK(snapshot.Buckets[64] == 1);
+}
+
+static void TestMetricsSection() {
+    MetricsSection section;
+    XenTimeMetricsSnapshot snapshot;
+    TEST_CHECK(section.Read(&snapshot) == HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+    TEST_CHECK(SUCCEEDED(section.Create()));
+    TEST_CHECK(section.Read(&snapshot) == HRESULT_FROM_WIN32(ERROR_NOT_READY));
+
+    XenTimeMetrics metrics;
+    metrics.Rounds.Add(3);
+    metrics.IoctlLatency.Record(1000);
+    XenTimeMetricsSnapshot published;
+    metrics.Snapshot(&published);
+    section.Publish(published);
+    TEST_CHECK(SUCCEEDED(section.Read(&snapshot)));
+    TEST_CHECK(!memcmp(&snapshot, &published, sizeof(snapshot)));
+
+    metrics.Rounds.Add();
+    metrics.Snapshot(&published);
+    section.Publish(published);
+    TEST_CHECK(SUCCEEDED(section.Read(&snapshot)));
+    TEST_CHECK(snapshot.Rounds == 4 && snapshot.IoctlLatency.Count == 1);
+
+    // a tool built against another layout must not make sense of this one
+    published.dwVersion = XENTIME_METRICS_VERSION + 1;
+    section.Publish(published);
+    TEST_CHECK(section.Read(&snapshot) == HRESULT_FROM_WIN32(ERROR_REVISION_MISMATCH));
+}
+
+static void TestTelemetry() {
+    XenTimeMetrics metrics;
+    XenTimeTelemetry telemetry(metrics);
+    auto start = std::chrono::steady_clock::time_point(std::chrono::hours(1));
+    telemetry.Reset(start);
+
+    const signed __int64 offsets[] = {-10, 20, 50}, delays[] = {20, 40, 60};
+    const unsigned __int64 dispersions[] = {30, 30, 90};
+    for (size_t i = 0; i < ARRAYSIZE(offsets); i++) {
+        TimeSample sample{.toOffset = offsets[i], .toDelay = delays[i], .tpDispersion = dispersions[i]};
+        telemetry.AddRound(S_OK, &sample);
+    }
+    telemetry.AddRound(S_FALSE, nullptr);
+    telemetry.AddRound(E_PENDING, nullptr);
+    telemetry.AddRound(HRESULT_FROM_WIN32(ERROR_GEN_FAILURE), nullptr);
+    metrics.IoctlTimeouts.Add(2);
+    metrics.Resumes.Add();
+
+    CHAR line[IXenIfaceDevice::MaxLogLength];
+    telemetry.Summarize(start + std::chrono::seconds(300), true, line, ARRAYSIZE(line));
+    TEST_CHECK(!strcmp(
+        line,
+        "XenTimeProvider: w=300s n=6 ok=3 held=1 pend=1 fail=1 err=8007001f ioerr=0 tmo=2 res=1 fo=0 fb=1 "
+        "off=-1.0/2.0/5.0us dly=4.0/6.0us disp=5.0/9.0us"));
+    for (auto c = line; *c; c++)
+        TEST_CHECK(*c >= 0x20 && *c < 0x7f);
+
+    // a line that was not delivered leaves the window going on, to be covered by the next one
+    TEST_CHECK(telemetry.IsDue(start + std::chrono::seconds(301), std::chrono::seconds(300)));
+    telemetry.AddRound(S_FALSE, nullptr);
+    metrics.IoctlFailures.Add();
+    telemetry.Summarize(start + std::chrono::seconds(301), true, line, ARRAYSIZE(line));
+    TEST_CHECK(!strcmp(
+        line,
+        "XenTimeProvider: w=301s n=7 ok=3 held=2 pend=1 fail=1 err=8007001f ioerr=1 tmo=2 res=1 fo=0 fb=1 "
+        "off=-1.0/2.0/5.0us dly=4.0/6.0us disp=5.0/9.0us"));
+
+    // once it is, the next window starts from it, counters included; without samples there are no statistics
+    telemetry.Advance();
+    TEST_CHECK(!telemetry.IsDue(start + std::chrono::seconds(360), std::chrono::seconds(60)));
+    TEST_CHECK(telemetry.IsDue(start + std::chrono::seconds(361), std::chrono::seconds(60)));
+    metrics.Resumes.Add();
+    telemetry.AddRound(E_PENDING, nullptr);
+    telemetry.Summarize(start + std::chrono::seconds(361), false, line, ARRAYSIZE(line));
+    TEST_CHECK(!strcmp(
+        line,
+        "XenTimeProvider: w=60s n=1 ok=0 held=0 pend=1 fail=0 err=0 ioerr=0 tmo=0 res=1 fo=0 fb=0"));
+    telemetry.Advance();
+
+    // a short buffer truncates and stays terminated
+    CHAR shortLine[24];
+    telemetry.Summarize(start + std::chrono::seconds(421), false, shortLine, ARRAYSIZE(shortLine));
+    TEST_CHECK(strlen(shortLine) == ARRAYSIZE(shortLine) - 1);
+    TEST_CHECK(!strncmp(shortLine, "XenTimeProvider: w=60s n", ARRAYSIZE(shortLine) - 1));
+}
+
+static void TestSchedule() {
+    using namespace std::chrono_literals;
+    auto interval = std::chrono::milliseconds(1000);
+    auto start = SamplingSchedule::Clock::time_point(std::chrono::hours(24));
+
+    SamplingSchedule schedule;
+    // neither a poll interval nor a poll yet
+    TEST_CHECK(schedule.Next(start, interval) == start + interval);
+    schedule.SetPollInterval(6);
+    TEST_CHECK(schedule.GetPollInterval() == std::chrono::milliseconds(64000));
+    TEST_CHECK(schedule.Next(start, interval) == start + interval);
+
+    // 16 rounds 4 s apart from the poll, then 4 rounds 100 ms apart ending 250 ms before the next one is due
+    schedule.OnPoll(start);
+    TEST_CHECK(schedule.Next(start + 500ms, interval) == start + 4s);
+    TEST_CHECK(schedule.Next(start + 4s, interval) == start + 8s);
+    TEST_CHECK(schedule.Next(start + 60s, interval) == start + 63450ms);
+    TEST_CHECK(schedule.Next(start + 63450ms, interval) == start + 63550ms);
+    TEST_CHECK(schedule.Next(start + 63650ms, interval) == start + 63750ms);
+    // past the burst, the first spread round after the poll that is due
+    TEST_CHECK(schedule.Next(start + 63750ms, interval) == start + 68s);
+    // a missed poll is taken to be a poll interval later
+    TEST_CHECK(schedule.Next(start + 68s, interval) == start + 72s);
+    TEST_CHECK(schedule.Next(start + 127600ms, interval) == start + 127650ms);
+
+    // polls no further apart than SpreadRounds intervals leave rounds every interval
+    schedule.SetPollInterval(4);
+    TEST_CHECK(schedule.Next(start + 4s, interval) == start + 5s);
+    schedule.SetPollInterval(40);
+    TEST_CHECK(
+        schedule.GetPollInterval() == std::chrono::milliseconds(1000LL << SamplingSchedule::MaxPollInterval));
+    schedule.SetPollInterval(-1);
+    TEST_CHECK(!schedule.GetPollInterval());
+    TEST_CHECK(schedule.Next(start + 4s, interval) == start + 5s);
+
+    schedule.SetPollInterval(6);
+    schedule.Reset();
+    TEST_CHECK(schedule.Next(start + 4s, interval) == start + 5s);
+}
+
+// w32time polling every 2^6 s and then 2^7 s, each poll up to 50 ms off and every seventh one missed. A poll no
+// earlier than the burst must find a round no older than BurstLead plus however late it came, after at most
+// SpreadRounds + BurstRounds rounds for each poll interval since the poll before.
+static void TestSchedulePolls() {
+    using Clock = SamplingSchedule::Clock;
+    constexpr unsigned long Polls = 200, Poll = 6;
+    constexpr long Jitter = 50;
+    std::mt19937_64 random(5);
+    std::uniform_int_distribution<long> offset(-Jitter, Jitter);
+    auto interval = std::chrono::milliseconds(1000);
+    // from the first round of the burst to the poll
+    auto burst = SamplingSchedule::BurstLead + (SamplingSchedule::BurstRounds - 1) * SamplingSchedule::BurstSpacing;
+    auto roundsPerPoll = SamplingSchedule::SpreadRounds + SamplingSchedule::BurstRounds;
+
+    SamplingSchedule schedule;
+    schedule.SetPollInterval(Poll);
+    auto period = std::chrono::milliseconds(1000LL << Poll);
+    auto start = Clock::time_point(std::chrono::hours(24));
+    auto round = start;
+    auto nextPoll = start + period;
+    auto lastPoll = start;
+
+    unsigned long rounds = 1, roundsSincePoll = 1, fixedRounds = 0, checked = 0;
+    for (unsigned long i = 0, scheduledPolls = 0, periods = 1; i < Polls; periods++) {
+        auto next = schedule.Next(round, interval);
+        if (next <= nextPoll) {
+            round = next;
+            rounds++;
+            roundsSincePoll++;
+            periods--;
+            continue;
+        }
+
+        auto pollAt = nextPoll;
+        nextPoll = pollAt + period + std::chrono::milliseconds(offset(random));
+        if (scheduledPolls++ % 7 == 6)
+            continue;
+
+        schedule.OnPoll(pollAt);
+        // the first poll finds rounds at the fixed interval, the schedule only starts from it
+        if (i > 0) {
+            auto late = pollAt - (lastPoll + static_cast<long long>(periods) * period);
+            if (late >= -burst) {
+                TEST_CHECK(pollAt - round <= SamplingSchedule::BurstLead + (std::max)(late, decltype(late)::zero()));
+                checked++;
+            }
+            TEST_CHECK(roundsSincePoll <= periods * roundsPerPoll + 1);
+        }
+        fixedRounds += static_cast<unsigned long>((pollAt - lastPoll) / interval);
+        lastPoll = pollAt;
+        roundsSincePoll = 0;
+        periods = 0;
+        if (++i == Polls / 2) {
+            period *= 2;
+            nextPoll = pollAt + period + std::chrono::milliseconds(offset(random));
+            schedule.SetPollInterval(Poll + 1);
+        }
+    }
+
+    TEST_CHECK(checked > Polls / 2);
+    // a fifth of the rounds at 2^6 s, a tenth at 2^7 s
+    TEST_CHECK(rounds * 4 < fixedRounds);
+}
+
+static void TestDriftModel() {
+    // 1 s apart, host time running 20 ppm fast
+    constexpr unsigned __int64 Second = 10000000, Base = 130000000000000000ULL;
+    auto host = [](unsigned __int64 tick) {
+        return Base + tick + tick / 50000;
+    };
+
+    DriftModel model;
+    unsigned __int64 hostTime, error;
+    for (unsigned __int64 i = 1; i < DriftModel::MinPoints; i++)
+        model.Add(i * Second, host(i * Second));
+    TEST_CHECK(!model.IsReady());
+    TEST_CHECK(model.Predict(4 * Second, &hostTime, &error) == HRESULT_FROM_WIN32(ERROR_NOT_READY));
+    TEST_CHECK(hostTime == 0 && error == 0);
+
+    for (unsigned __int64 i = DriftModel::MinPoints; i <= 32; i++)
+        model.Add(i * Second, host(i * Second));
+    TEST_CHECK(model.IsReady());
+    TEST_CHECK(model.GetLastTick() == 32 * Second);
+    TEST_CHECK(std::fabs(model.FrequencyPpm() - 20) < 0.01);
+
+    // a perfect fit leaves only the frequency tolerance
+    TEST_CHECK(SUCCEEDED(model.Predict(42 * Second, &hostTime, &error)));
+    TEST_CHECK(hostTime + 1 >= host(42 * Second) && hostTime <= host(42 * Second) + 1);
+    TEST_CHECK(error >= 1500 && error <= 1501);
+    TEST_CHECK(model.Predict(31 * Second, &hostTime, &error) == E_INVALIDARG);
+
+    // the window slides, and the error of a scattered fit grows with the distance from it
+    DriftModel noisy;
+    for (unsigned __int64 i = 1; i <= 2 * DriftModel::WindowSize; i++)
+        noisy.Add(i * Second, host(i * Second) + 100 * (i & 1) - 50);
+    unsigned __int64 nearError, farError;
+    TEST_CHECK(SUCCEEDED(noisy.Predict(noisy.GetLastTick(), &hostTime, &nearError)));
+    TEST_CHECK(SUCCEEDED(noisy.Predict(noisy.GetLastTick() + 100 * Second, &hostTime, &farError)));
+    TEST_CHECK(nearError > 0 && nearError < 1000);
+    TEST_CHECK(farError > nearError + 15000);
+    TEST_CHECK(std::fabs(noisy.FrequencyPpm() - 20) < 1);
+
+    // a tick going backwards drops everything fitted so far
+    noisy.Add(Second, host(Second));
+    TEST_CHECK(!noisy.IsReady());
+    TEST_CHECK(noisy.GetLastTick() == Second);
+}
+
+// Offsets at the spacing SamplingSchedule gives rounds: spread rounds 4 s apart, a burst 100 ms apart ending 250 ms
+// before the poll. A constant frequency error must not show up as jitter, and white noise must show up as itself.
+static TimeSample TestSample(signed __int64 offset, signed __int64 delay, unsigned __int64 dispersion) {
+    TimeSample sample{};
+    sample.dwSize = sizeof(sample);
+    sample.toOffset = offset;
+    sample.toDelay = delay;
+    sample.tpDispersion = dispersion;
+    return sample;
+}
+
+// Selection by synchronization distance, half the delay plus the dispersion aged at 15 ppm, never going back in time
+static void TestClockFilter() {
+    constexpr unsigned __int64 Start = 130000000000000000ULL;
+    ClockFilter filter;
+    TEST_CHECK(!filter.Select(Start));
+
+    filter.Add(TestSample(1, 1000, 0), Start);
+    filter.Add(TestSample(2, 200, 0), Start + TIME_S(1ULL));
+    filter.Add(TestSample(3, 600, 0), Start + TIME_S(2ULL));
+    // 100 + 150 for a second of aging beats 300 + 0 and 500 + 300
+    auto selected = filter.Select(Start + TIME_S(2ULL));
+    TEST_CHECK(selected && selected->toOffset == 2 && selected->tpDispersion == 150);
+    // the same one again, or anything older, would be time going backwards; the newest goes out instead
+    selected = filter.Select(Start + TIME_S(2ULL));
+    TEST_CHECK(selected && selected->toOffset == 3 && selected->tpDispersion == 0);
+
+    // 150 + 150 against 300 + 0, the newer one wins the tie
+    filter.Reset();
+    filter.Add(TestSample(4, 300, 0), Start);
+    filter.Add(TestSample(5, 600, 0), Start + TIME_S(1ULL));
+    selected = filter.Select(Start + TIME_S(1ULL));
+    TEST_CHECK(selected && selected->toOffset == 5);
+
+    // the best one falls out of a shallower filter
+    filter.Reset();
+    filter.SetDepth(2);
+    filter.Add(TestSample(6, 100, 0), Start);
+    filter.Add(TestSample(7, 500, 0), Start + TIME_S(1ULL));
+    filter.Add(TestSample(8, 1000, 0), Start + TIME_S(2ULL));
+    selected = filter.Select(Start + TIME_S(2ULL));
+    TEST_CHECK(selected && selected->toOffset == 7 && selected->tpDispersion == 150);
+
+    // a depth of zero still keeps the newest sample
+    filter.SetDepth(0);
+    selected = filter.Select(Start + TIME_S(3ULL));
+    TEST_CHECK(selected && selected->toOffset == 8 && selected->tpDispersion == 150);
+
+    // a sample from before the newest one means the clock was stepped back: the history goes, and with it the
+    // last selection
+    filter.SetDepth(ClockFilter::DefaultDepth);
+    filter.Add(TestSample(9, 1000, 20), Start + TIME_S(3ULL));
+    filter.Add(TestSample(10, 2000, 20), Start);
+    selected = filter.Select(Start + TIME_S(1ULL));
+    TEST_CHECK(selected && selected->toOffset == 10 && selected->tpDispersion == 170);
+}
+
+// Local time in FILETIME units for a calendar date and time
+static unsigned __int64 TestLocalTime(
+    int year,
+    unsigned int month,
+    unsigned int day,
+    int hour,
+    int minute,
+    int second) {
+    auto time = std::chrono::sys_days{std::chrono::year{year} / month / day} + std::chrono::hours(hour) +
+        std::chrono::minutes(minute) + std::chrono::seconds(second);
+    return FILETIME_UNIX_EPOCH + static_cast<unsigned __int64>(time.time_since_epoch().count()) * TIME_S(1ULL);
+}
+
+// UTC minus local time at local, looked up on its own
+static signed __int64 TestUtcOffset(unsigned __int64 local) {
+    FILETIME input{.dwLowDateTime = static_cast<DWORD>(local), .dwHighDateTime = static_cast<DWORD>(local >> 32)};
+    FILETIME output{};
+    TEST_CHECK(TimeConvertFileTime(&input, &output, TimeConvertLocalToUniversal, nullptr));
+    auto universal = static_cast<unsigned __int64>(output.dwHighDateTime) << 32 | output.dwLowDateTime;
+    return static_cast<signed __int64>(universal - local);
+}
+
+// DST transitions of a POSIX TZ rule, which needs no time zone database: the cached interval must end on the very
+// second a lookup of its own says the offset changes, and local times within one shift of it are flagged as ambiguous.
+static void TestLocalTimeConverter() {
+    setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+    tzset();
+    constexpr signed __int64 Winter = -TIME_S(3600LL), Summer = -TIME_S(7200LL);
+    constexpr unsigned __int64 Shift = TIME_S(3600ULL);
+
+    // far from either transition, exact to the 100 ns
+    LocalTimeConverter converter;
+    unsigned __int64 universal, dispersion;
+    auto january = TestLocalTime(2024, 1, 15, 12, 0, 0) + 1234567;
+    TEST_CHECK(SUCCEEDED(converter.LocalToUniversal(january, &universal, &dispersion)));
+    TEST_CHECK(static_cast<signed __int64>(universal - january) == Winter && dispersion == 1);
+    auto july = TestLocalTime(2024, 7, 1, 12, 0, 0) + 7654321;
+    TEST_CHECK(SUCCEEDED(converter.LocalToUniversal(july, &universal, &dispersion)));
+    TEST_CHECK(static_cast<signed __int64>(universal - july) == Summer && dispersion == 1);
+
+    // spring forward, half a second into every second from midnight to 5 am
+    auto midnight = TestLocalTime(2024, 3, 31, 0, 0, 0);
+    unsigned __int64 transition = 0;
+    for (unsigned __int64 second = 0; second < 5 * 3600 && !transition; second++) {
+        if (TestUtcOffset(midnight + second * TIME_S(1ULL)) != Winter)
+            transition = midnight + second * TIME_S(1ULL);
+    }
+    TEST_CHECK(transition > midnight);
+    LocalTimeConverter spring;
+    for (unsigned __int64 second = 0; second < 5 * 3600; second++) {
+        auto local = midnight + second * TIME_S(1ULL) + TIME_MS(500ULL);
+        TEST_CHECK(SUCCEEDED(spring.LocalToUniversal(local, &universal, &dispersion)));
+        TEST_CHECK(static_cast<signed __int64>(universal - local) == (local < transition ? Winter : Summer));
+        auto ambiguous = local < transition ? transition - local <= Shift : local - transition < Shift;
+        TEST_CHECK(dispersion == (ambiguous ? Shift : 1));
+    }
+
+    // fall back: the hour that happens twice may be either, and says so
+    LocalTimeConverter autumn;
+    auto evening = TestLocalTime(2024, 10, 26, 22, 0, 0);
+    for (unsigned __int64 minute = 0; minute < 10 * 60; minute++) {
+        auto local = evening + minute * TIME_S(60ULL);
+        TEST_CHECK(SUCCEEDED(autumn.LocalToUniversal(local, &universal, &dispersion)));
+        auto offset = static_cast<signed __int64>(universal - local);
+        if (local < TestLocalTime(2024, 10, 27, 1, 0, 0)) {
+            TEST_CHECK(offset == Summer && dispersion == 1);
+        } else if (local >= TestLocalTime(2024, 10, 27, 2, 0, 0) && local < TestLocalTime(2024, 10, 27, 3, 0, 0)) {
+            TEST_CHECK((offset == Summer || offset == Winter) && dispersion == Shift);
+        } else if (local >= TestLocalTime(2024, 10, 27, 4, 0, 0)) {
+            TEST_CHECK(offset == Winter && dispersion == 1);
+        }
+    }
+
+    // a time zone change shows once the cached offset is due for a check, or right away after Invalidate
+    TEST_CHECK(SUCCEEDED(converter.LocalToUniversal(january, &universal, &dispersion)));
+    setenv("TZ", "UTC0", 1);
+    tzset();
+    TEST_CHECK(SUCCEEDED(converter.LocalToUniversal(january + TIME_S(30ULL), &universal, &dispersion)));
+    TEST_CHECK(static_cast<signed __int64>(universal - (january + TIME_S(30ULL))) == Winter);
+    auto later = january + LocalTimeConverter::RevalidateInterval;
+    TEST_CHECK(SUCCEEDED(converter.LocalToUniversal(later, &universal, &dispersion)));
+    TEST_CHECK(universal == later && dispersion == 1);
+    setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+    tzset();
+    converter.Invalidate();
+    TEST_CHECK(SUCCEEDED(converter.LocalToUniversal(later, &universal, &dispersion)));
+    TEST_CHECK(static_cast<signed __int64>(universal - later) == Winter);
+}
+
+static void TestDispersion() {
+    constexpr unsigned __int64 Millisecond = 10000, Start = 130000000000000000ULL;
+    std::vector<unsigned __int64> spacings(15, 4000 * Millisecond);
+    spacings.insert(spacings.end(), 4, 100 * Millisecond);
+    spacings.push_back(250 * Millisecond);
+
+    DispersionEstimator estimator;
+    // until there is a difference to go by, the whole delay
+    estimator.Add(0, 300, Start);
+    estimator.Add(0, 300, Start + spacings[0]);
+    TEST_CHECK(estimator.Estimate(300) == 300);
+
+    // 20 ppm, which every spacing above makes a whole number of 100 ns
+    estimator.Reset();
+    auto timestamp = Start;
+    for (size_t i = 0; i < 10 * spacings.size(); i++) {
+        timestamp += spacings[i % spacings.size()];
+        estimator.Add(static_cast<signed __int64>((timestamp - Start) / 50000) - 300, 200, timestamp);
+        if (i >= DispersionEstimator::WarmupSamples)
+            TEST_CHECK(estimator.OffsetJitter() < 0.01);
+    }
+    TEST_CHECK(estimator.Estimate(200) <= 1);
+
+    // a timestamp standing still or going back starts the differences over instead of dividing by it
+    auto offset = static_cast<signed __int64>((timestamp - Start) / 50000) - 300;
+    estimator.Add(offset, 200, timestamp);
+    auto restart = timestamp - spacings[0];
+    estimator.Add(offset - 1000, 200, restart);
+    for (unsigned __int64 i = 1; i <= 3; i++)
+        estimator.Add(offset - 1000 + static_cast<signed __int64>(i) * 800, 200, restart + i * spacings[0]);
+    TEST_CHECK(std::isfinite(estimator.OffsetJitter()) && estimator.OffsetJitter() < 0.01);
+
+    // 2 us of white noise on top of the drift, measured as such whatever the spacing
+    std::mt19937_64 random(9);
+    std::normal_distribution<double> noise(0, 20);
+    estimator.Reset();
+    timestamp = Start;
+    double squares = 0;
+    size_t measured = 0;
+    for (size_t i = 0; i < 200 * spacings.size(); i++) {
+        timestamp += spacings[i % spacings.size()];
+        auto drift = static_cast<double>(timestamp - Start) / 50000;
+        estimator.Add(std::llround(drift + noise(random)), 200, timestamp);
+        if (i >= DispersionEstimator::WarmupSamples) {
+            squares += estimator.OffsetJitter() * estimator.OffsetJitter();
+            measured++;
+        }
+    }
+    auto jitter = std::sqrt(squares / static_cast<double>(measured));
+    TEST_CHECK(jitter > 18 && jitter < 22);
+
+    // the delay is tracked with the same weight: 100, then 300, is a mean of 125 and a variance of 7/8 * 5000
+    estimator.Reset();
+    estimator.Add(0, 100, Start);
+    TEST_CHECK(estimator.DelayMean() == 100 && estimator.DelayDeviation() == 0);
+    estimator.Add(0, 300, Start + spacings[0]);
+    TEST_CHECK(estimator.DelayMean() == 125 && std::abs(estimator.DelayDeviation() - std::sqrt(4375.0)) < 1e-9);
+
+    // load coming and going: offsets alternating by 500 raise the estimate within a few rounds, and once they stop it
+    // decays as fast
+    estimator.Reset();
+    timestamp = Start;
+    for (int i = 0; i < 50; i++)
+        estimator.Add(0, 200, timestamp += spacings[0]);
+    TEST_CHECK(estimator.Estimate(200) <= 1);
+    for (int i = 0; i < 16; i++)
+        estimator.Add(i % 2 ? -500 : 500, 200, timestamp += spacings[0]);
+    TEST_CHECK(estimator.Estimate(200) > 500);
+    for (int i = 0; i < 48; i++)
+        estimator.Add(0, 200, timestamp += spacings[0]);
+    TEST_CHECK(estimator.Estimate(200) < 100);
+}
+
+// Rounds 4 s apart from a clock 10 ppm fast, with a little noise well within the delay
+static signed __int64 TestOffsetAt(size_t round) {
+    static const signed __int64 noise[] = {0, 30, -20, 10, -40, 25, -5, 15};
+    return static_cast<signed __int64>(round) * 400 + noise[round % ARRAYSIZE(noise)];
+}
+
+static unsigned __int64 TestTimestampAt(size_t round) {
+    return 130000000000000000ULL + round * 40000000ULL;
+}
+
+// Outlier rejection against the detrended window, the hysteresis of trust in the source, and the loop smoothing the
+// accepted offsets
+static void TestOffsetFilter() {
+    // as TestOffsetAt, with less noise so that it is clear what stands out from it
+    auto line = [](size_t round) { return static_cast<signed __int64>(round * 400); };
+    auto noisy = [&](size_t round) { return line(round) + static_cast<signed __int64>(round * 7 % 5) - 2; };
+
+    // too few to judge by, anything goes
+    OffsetFilter filter;
+    size_t round = 0;
+    for (; round < OffsetFilter::MinWindow - 1; round++)
+        TEST_CHECK(filter.Add(round == 3 ? TIME_S(1000LL) : noisy(round), 100, TestTimestampAt(round)) ==
+                   OffsetVerdict::Accepted);
+
+    filter.Reset();
+    for (round = 0; round < OffsetFilter::WindowSize; round++)
+        TEST_CHECK(filter.Add(noisy(round), 100, TestTimestampAt(round)) == OffsetVerdict::Accepted);
+    TEST_CHECK(std::abs(filter.FrequencyPpm() - 10) < 0.1);
+    TEST_CHECK(filter.Add(line(round) + 100000, 100, TestTimestampAt(round)) == OffsetVerdict::Rejected);
+    round++;
+    // 50 out is far beyond the noise, but not beyond the sample's own delay
+    TEST_CHECK(filter.Add(line(round) + 50, 10, TestTimestampAt(round)) == OffsetVerdict::Rejected);
+    round++;
+    TEST_CHECK(filter.Add(line(round) + 50, 100, TestTimestampAt(round)) == OffsetVerdict::Accepted);
+    round++;
+    TEST_CHECK(filter.IsTrusted());
+
+    // Spikes that agree on nothing, not even a level shift. Trust goes once half the window has been rejected; by then
+    // the spikes are common enough to be accepted. It comes back only once fewer than a quarter are left in the
+    // window, not as soon as fewer than half are.
+    filter.Reset();
+    for (round = 0; round < OffsetFilter::WindowSize; round++)
+        filter.Add(noisy(round), 100, TestTimestampAt(round));
+    for (int spike = 0; spike < 10; spike++, round++) {
+        auto size = TIME_MS(1LL) + spike * TIME_US(300LL);
+        auto verdict = filter.Add(line(round) + (spike % 2 ? -size : size), 100, TestTimestampAt(round));
+        if (spike < 8)
+            TEST_CHECK(verdict == OffsetVerdict::Rejected);
+        TEST_CHECK(filter.IsTrusted() == (spike < 7));
+    }
+    for (int good = 0; good < 16; good++, round++) {
+        TEST_CHECK(filter.Add(noisy(round), 100, TestTimestampAt(round)) == OffsetVerdict::Accepted);
+        TEST_CHECK(filter.IsTrusted() == (good >= 10));
+    }
+
+    // The loop takes the offset as it is until the window is full enough to acquire frequency from, and then tracks
+    // a clean line exactly. With noise on top, it spreads less than the offsets do.
+    filter.Reset();
+    for (round = 0; round < OffsetFilter::MinWindow - 1; round++) {
+        filter.Add(noisy(round), 100, TestTimestampAt(round));
+        TEST_CHECK(filter.SmoothedOffset() == noisy(round));
+    }
+    filter.Reset();
+    for (round = 0; round < 4 * OffsetFilter::WindowSize; round++) {
+        filter.Add(line(round), 100, TestTimestampAt(round));
+        TEST_CHECK(std::abs(filter.SmoothedOffset() - line(round)) <= 1);
+    }
+    std::mt19937_64 random(3);
+    std::normal_distribution<double> noise(0, 20);
+    filter.Reset();
+    double rawSquares = 0, smoothedSquares = 0;
+    for (round = 0; round < 500; round++) {
+        auto offset = line(round) + std::llround(noise(random));
+        TEST_CHECK(filter.Add(offset, 200, TestTimestampAt(round)) == OffsetVerdict::Accepted);
+        if (round < 50)
+            continue;
+        auto raw = static_cast<double>(offset - line(round));
+        auto smoothed = static_cast<double>(filter.SmoothedOffset() - line(round));
+        rawSquares += raw * raw;
+        smoothedSquares += smoothed * smoothed;
+    }
+    TEST_CHECK(smoothedSquares < 0.5 * rawSquares);
+}
+
+// A lasting level shift is accepted after MinWindow rounds instead of withholding samples until it makes up most of
+// the window, while spikes that disagree with each other stay rejected
+static void TestOffsetFilterStep() {
+    constexpr signed __int64 Delay = 100, Step = 5000;
+    OffsetFilter filter;
+    size_t round = 0;
+    for (; round < 2 * OffsetFilter::WindowSize; round++)
+        TEST_CHECK(filter.Add(TestOffsetAt(round), Delay, TestTimestampAt(round)) == OffsetVerdict::Accepted);
+    TEST_CHECK(std::fabs(filter.FrequencyPpm() - 10) < 0.5);
+
+    // spikes either way, then the clock as it was
+    for (size_t i = 0; i < OffsetFilter::MinWindow; i++, round++) {
+        auto spike = i % 2 ? Step : -Step;
+        TEST_CHECK(filter.Add(TestOffsetAt(round) + spike, Delay, TestTimestampAt(round)) == OffsetVerdict::Rejected);
+    }
+    TEST_CHECK(filter.IsTrusted());
+    for (size_t i = 0; i < OffsetFilter::WindowSize; i++, round++)
+        TEST_CHECK(filter.Add(TestOffsetAt(round), Delay, TestTimestampAt(round)) == OffsetVerdict::Accepted);
+
+    // the host clock steps: the first rounds after it are held back, until there are enough to call it a shift
+    for (size_t i = 1; i < OffsetFilter::MinWindow; i++, round++) {
+        TEST_CHECK(filter.Add(TestOffsetAt(round) + Step, Delay, TestTimestampAt(round)) == OffsetVerdict::Rejected);
+        TEST_CHECK(filter.IsTrusted());
+    }
+    TEST_CHECK(filter.Add(TestOffsetAt(round) + Step, Delay, TestTimestampAt(round)) == OffsetVerdict::Accepted);
+    TEST_CHECK(filter.SmoothedOffset() == TestOffsetAt(round) + Step);
+    round++;
+    for (size_t i = 0; i < OffsetFilter::WindowSize; i++, round++) {
+        TEST_CHECK(filter.Add(TestOffsetAt(round) + Step, Delay, TestTimestampAt(round)) == OffsetVerdict::Accepted);
+        TEST_CHECK(filter.IsTrusted());
+    }
+    TEST_CHECK(std::fabs(filter.FrequencyPpm() - 10) < 0.5);
+}
+
+// Xen's shared page as a plain buffer. A concurrent update is simulated by bumping the version while a read is in
+// progress, as often as Updates says.
+class TestSharedTimePage : public IXenSharedTimePage {
+public:
+    const PvClockVcpuTimeInfo *GetVcpuTimeInfo() const override {
+        return &Info;
+    }
+    const PvClockWallClock *GetWallClock() const override {
+        return &WallClock;
+    }
+    const uint32_t *GetWallClockSecHi() const override {
+        return &WallClockSecHi;
+    }
+    uint64_t ReadTsc() const override {
+        if (Updates) {
+            Updates--;
+            Info.Version += 2;
+        }
+        return Tsc;
+    }
+
+    mutable PvClockVcpuTimeInfo Info{};
+    PvClockWallClock WallClock{};
+    uint32_t WallClockSecHi = 0;
+    uint64_t Tsc = 0;
+    mutable int Updates = 0;
+};
+
+class TestHostTimePage : public IXenHostTimePage {
+public:
+    const PvClockHostTime *Acquire() override {
+        if (!Mapped)
+            return nullptr;
+        Pins++;
+        return &Info;
+    }
+    void Release() override {
+        Pins--;
+    }
+    uint64_t ReadTsc() const override {
+        return Tsc;
+    }
+
+    PvClockHostTime Info{};
+    bool Mapped = true;
+    int Pins = 0;
+    uint64_t Tsc = 0;
+};
+
+static void TestPvClock() {
+    constexpr uint64_t TscHz = 3000000000, NsPerSec = 1000000000;
+
+    uint32_t mul;
+    int8_t shift;
+    PvClockComputeScale(TscHz, &mul, &shift);
+    auto second = PvClockScaleDelta(TscHz, mul, shift);
+    TEST_CHECK(second + 2 >= NsPerSec && second <= NsPerSec);
+    TEST_CHECK(PvClockScaleDelta(0, mul, shift) == 0);
+
+    auto page = std::make_shared<TestSharedTimePage>();
+    page->Info.TscTimestamp = 1000;
+    page->Info.SystemTime = 5 * NsPerSec;
+    page->Info.TscToSystemMul = mul;
+    page->Info.TscShift = shift;
+    page->Info.Flags = PVCLOCK_TSC_STABLE_BIT;
+    page->WallClock.Sec = 0x80000000;
+    page->WallClockSecHi = 1;
+    page->Tsc = 1000 + TscHz;
+    // system time 6 s, on top of a wallclock past 2106 that needs wc_sec_hi
+    auto expected = FILETIME_UNIX_EPOCH + (0x180000000ULL * NsPerSec + 6 * NsPerSec) / 100;
+
+    PvClockReader reader(page);
+    unsigned __int64 time;
+    TEST_CHECK(SUCCEEDED(reader.Read(&time)));
+    TEST_CHECK(time + 1 >= expected && time <= expected);
+
+    // a TSC just behind the timestamp reads as the timestamp
+    page->Tsc = 900;
+    TEST_CHECK(SUCCEEDED(reader.Read(&time)));
+    TEST_CHECK(time == FILETIME_UNIX_EPOCH + (0x180000000ULL * NsPerSec + 5 * NsPerSec) / 100);
+
+    page->Updates = PvClockReader::MaxAttempts - 1;
+    TEST_CHECK(SUCCEEDED(reader.Read(&time)));
+    page->Updates = PvClockReader::MaxAttempts;
+    TEST_CHECK(reader.Read(&time) == HRESULT_FROM_WIN32(ERROR_RETRY));
+
+    page->Info.Version = 1;
+    TEST_CHECK(reader.Read(&time) == HRESULT_FROM_WIN32(ERROR_RETRY));
+    page->Info.Version = 2;
+    page->WallClock.Version = 3;
+    TEST_CHECK(reader.Read(&time) == HRESULT_FROM_WIN32(ERROR_RETRY));
+    page->WallClock.Version = 4;
+    page->Info.Flags = 0;
+    TEST_CHECK(reader.Read(&time) == HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED));
+}
+
+static void TestPvClockHostTime() {
+    constexpr uint64_t TscHz = 2000000000, NsPerSec = 1000000000;
+
+    auto page = std::make_shared<TestHostTimePage>();
+    PvClockComputeScale(TscHz, &page->Info.TscToSystemMul, &page->Info.TscShift);
+    page->Info.TscTimestamp = 5000;
+    page->Info.HostTime = 1700000000 * NsPerSec;
+    page->Info.Error = 150;
+    page->Tsc = 5000 + TscHz / 2;
+
+    PvClockHostTimeReader reader(page);
+    unsigned __int64 time, error;
+    TEST_CHECK(reader.Read(&time, &error) == HRESULT_FROM_WIN32(ERROR_NOT_READY));
+    TEST_CHECK(page->Pins == 0);
+
+    page->Info.Flags = PVCLOCK_HOST_TIME_VALID_BIT;
+    TEST_CHECK(SUCCEEDED(reader.Read(&time, &error)));
+    auto expected = FILETIME_UNIX_EPOCH + (1700000000 * NsPerSec + NsPerSec / 2) / 100;
+    TEST_CHECK(time + 1 >= expected && time <= expected);
+    // the error bound rounds up
+    TEST_CHECK(error == 2);
+    TEST_CHECK(page->Pins == 0);
+
+    page->Info.Version = 7;
+    TEST_CHECK(reader.Read(&time, &error) == HRESULT_FROM_WIN32(ERROR_RETRY));
+    TEST_CHECK(page->Pins == 0);
+
+    page->Mapped = false;
+    TEST_CHECK(reader.Read(&time, &error) == HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED));
+
+    PvClockPin pin;
+    TEST_CHECK(pin.Acquire());
+    pin.Release();
+    pin.Revoke();
+    TEST_CHECK(!pin.Acquire());
+}
+
+static void TestSampleRing() {
+    struct Value {
+        unsigned __int64 Index;
+        unsigned __int64 Square;
+    };
+    SampleRing<Value, 4> ring;
+    Value value{};
+    TEST_CHECK(ring.ReadLatest(&value) == 0);
+
+    // several laps of the ring, the newest always wins
+    for (unsigned __int64 i = 1; i <= 10; i++) {
+        ring.Push(Value{.Index = i, .Square = i * i});
+        TEST_CHECK(ring.ReadLatest(&value) == i);
+        TEST_CHECK(value.Index == i && value.Square == i * i);
+    }
+    TEST_CHECK(ring.ReadLatest(&value) == 10);
+}
+
+// A removed device that another thread still holds a snapshot of is destroyed on the worker thread once the snapshot
+// is dropped, never on the thread dropping it
+static void TestDeviceRetire() {
+    const std::wstring path = L"\\\\?\\sim#xeniface#0";
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    platform->AddInterface(path);
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    TEST_CHECK(WaitUntil([&] { return worker.GetStartup() != XenIfaceStartup::Enumerating; }));
+    TEST_CHECK(worker.GetStartup() == XenIfaceStartup::Found);
+
+    auto device = worker.GetDevice();
+    TEST_CHECK(device != nullptr);
+    platform->RemoveInterface(path);
+    TEST_CHECK(WaitUntil([&] { return !worker.GetDevice(); }));
+    TEST_CHECK(!device->IsOpen());
+    TEST_CHECK(platform->TakeDestroyedOn().empty());
+
+    device.reset();
+    std::vector<std::thread::id> destroyedOn;
+    TEST_CHECK(WaitUntil([&] {
+        destroyedOn = platform->TakeDestroyedOn();
+        return !destroyedOn.empty();
+    }));
+    TEST_CHECK(destroyedOn.size() == 1 && destroyedOn[0] != std::this_thread::get_id());
+}
+
+// Every host time read bumping the suspend count: each burst is taken MaxStraddledBursts times and the round fails.
+// Then a single suspend stepping the host clock mid-burst: that burst is dropped, the retry succeeds, and as the
+// filters start over the step is published at once rather than rejected as an outlier.
+static void TestStraddledBursts() {
+    SimClock systemClock;
+    TestSystemClock = &systemClock;
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    auto options = TestFastOptions();
+    options.SuspendRate = 1;
+    platform->SetOptions(options);
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+
+    {
+        XenTimeMetrics metrics;
+        XenIfaceWorker worker(platform, metrics);
+        {
+            XenTimeSampler sampler(TestCallbacks, worker, metrics);
+            sampler.Configure(TestSamplerConfig());
+            TEST_CHECK(WaitUntil([&] { return metrics.FailedRounds.Load() >= 2; }));
+        }
+        TEST_CHECK(metrics.StraddledBursts.Load() == XenTimeSampler::MaxStraddledBursts * metrics.FailedRounds.Load());
+        TEST_CHECK(metrics.SuspendEpochs.Load() == metrics.StraddledBursts.Load());
+        TEST_CHECK(metrics.SamplesPublished.Load() == 0);
+    }
+
+    options.SuspendRate = 0;
+    platform->SetOptions(options);
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    XenTimeSampler sampler(TestCallbacks, worker, metrics);
+    sampler.Configure(TestSamplerConfig());
+    TEST_CHECK(WaitUntil([&] { return metrics.SamplesPublished.Load() >= 2 * ClockFilter::DefaultDepth; }));
+    auto rejected = metrics.RejectedOffsets.Load() + metrics.UntrustedRounds.Load();
+
+    // the one suspend turns itself off, whichever read of the burst it lands on
+    options.SuspendRate = 1;
+    options.OnSuspend = [&platform] {
+        platform->GetHostClock().Step(TIME_S(1));
+        auto once = platform->GetOptions();
+        once.SuspendRate = 0;
+        platform->SetOptions(once);
+    };
+    platform->SetOptions(options);
+    TEST_CHECK(WaitUntil([&] { return metrics.SuspendEpochs.Load() == 1; }));
+
+    // samples from before the suspend are no longer handed out, and none after it carries the old offset
+    auto published = metrics.SamplesPublished.Load();
+    TimeSample sample;
+    unsigned __int64 sequence = 0;
+    unsigned int samples = 0;
+    TEST_CHECK(WaitUntil([&] {
+        if (sampler.GetLatest(&sample, &sequence)) {
+            samples++;
+            TEST_CHECK(std::abs(sample.toOffset - TIME_S(1)) < TIME_MS(100));
+        }
+        return metrics.SamplesPublished.Load() >= published + 2 * ClockFilter::DefaultDepth;
+    }));
+    TEST_CHECK(samples > 0);
+    TEST_CHECK(metrics.StraddledBursts.Load() == 1);
+    TEST_CHECK(metrics.SuspendEpochs.Load() == 1);
+    TEST_CHECK(metrics.FailedRounds.Load() == 0);
+    TEST_CHECK(metrics.RejectedOffsets.Load() + metrics.UntrustedRounds.Load() == rejected);
+}
+
+// A request whose completion the test delivers by hand, into a buffer of its own as a driver would
+class TestRequest : public XenIfaceRequest {
+public:
+    FILETIME Output{};
+    unsigned int Cancels = 0;
+
+protected:
+    void Cancel() override {
+        Cancels++;
+    }
+};
+
+// A request completing after its deadline is cancelled and abandoned; it stays alive with its buffer until the late
+// completion, which also releases its in-flight slot. Past MaxInFlight, a device fails new requests at once.
+static void TestRequestDeadline() {
+    auto inFlight = std::make_shared<std::atomic<unsigned int>>(0);
+    auto request = std::make_shared<TestRequest>();
+    TEST_CHECK(SUCCEEDED(request->Start(inFlight)));
+    TEST_CHECK(inFlight->load() == 1);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+    TEST_CHECK(request->Wait(deadline) == HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+    TEST_CHECK(request->Cancels == 1);
+
+    std::weak_ptr<TestRequest> abandoned = request;
+    auto driver = request.get();
+    request.reset();
+    TEST_CHECK(!abandoned.expired());
+    TEST_CHECK(inFlight->load() == 1);
+    driver->Output = FILETIME{.dwLowDateTime = 1, .dwHighDateTime = 2};
+    driver->Complete(S_OK);
+    TEST_CHECK(abandoned.expired());
+    TEST_CHECK(inFlight->load() == 0);
+
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    auto options = TestFastOptions();
+    options.StallRate = 1;
+    options.StallLatency = std::chrono::milliseconds(500);
+    options.IgnoreCancel = true;
+    platform->SetOptions(options);
+    const std::wstring path = L"\\\\?\\sim#xeniface#0";
+    platform->AddInterface(path);
+    std::shared_ptr<IXenIfaceDevice> device;
+    TEST_CHECK(SUCCEEDED(platform->Open(path, nullptr, device)));
+    if (!device)
+        return;
+
+    // each abandoned read completes into its own request, never into time
+    const FILETIME unset{.dwLowDateTime = 0xdeadbeef, .dwHighDateTime = 0xdeadbeef};
+    for (unsigned int i = 0; i < XenIfaceRequest::MaxInFlight; i++) {
+        auto time = unset;
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+        TEST_CHECK(device->GetHostTime(&time, deadline) == HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+        TEST_CHECK(time.dwLowDateTime == unset.dwLowDateTime && time.dwHighDateTime == unset.dwHighDateTime);
+    }
+
+    options.StallRate = 0;
+    platform->SetOptions(options);
+    auto time = unset;
+    auto start = std::chrono::steady_clock::now();
+    TEST_CHECK(device->GetHostTime(&time, start + std::chrono::seconds(5)) == HRESULT_FROM_WIN32(ERROR_BUSY));
+    TEST_CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+    TEST_CHECK(time.dwLowDateTime == unset.dwLowDateTime && time.dwHighDateTime == unset.dwHighDateTime);
+
+    // the late completions give the slots back
+    TEST_CHECK(WaitUntil([&] {
+        return SUCCEEDED(device->GetHostTime(&time, std::chrono::steady_clock::now() + std::chrono::seconds(1)));
+    }));
+}
+
+// Pushes from dom0 arriving while the sampler is busy with a round: they coalesce into a single run of PushRounds
+// announced rounds, the first of which already has the step the first push was for.
+static void TestPushRounds() {
+    SimClock systemClock;
+    TestSystemClock = &systemClock;
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    platform->SetOptions(TestFastOptions());
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+    SimTimeDaemon daemon(*platform, false);
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    XenTimeSampler sampler(TestCallbacks, worker, metrics);
+    auto config = TestSamplerConfig();
+    config.Interval = std::chrono::milliseconds(50);
+    sampler.Configure(config);
+
+    // the push that finds the event channel bound has its own rounds, wait them out
+    TEST_CHECK(WaitUntil([&] { return daemon.Notify(); }));
+    TEST_CHECK(WaitUntil([&] { return TestAlerts.load() >= XenTimeSampler::PushRounds; }));
+    TEST_CHECK(TestAlerts.load() == XenTimeSampler::PushRounds);
+    auto alerts = TestAlerts.load();
+    auto pushes = metrics.PushNotifications.Load();
+
+    TestHeld = false;
+    TestHold = true;
+    TEST_CHECK(WaitUntil([&] { return TestHeld.load(); }));
+    auto rounds = metrics.Rounds.Load();
+    // each delivered before the next, the event channel would coalesce them otherwise
+    TEST_CHECK(daemon.Step(TIME_S(1)));
+    TEST_CHECK(WaitUntil([&] { return metrics.PushNotifications.Load() == pushes + 1; }));
+    for (unsigned int i = 2; i <= 5; i++) {
+        TEST_CHECK(daemon.Notify());
+        TEST_CHECK(WaitUntil([&] { return metrics.PushNotifications.Load() == pushes + i; }));
+    }
+    TestHold = false;
+
+    // the held round, the announced ones and the one after at the regular interval
+    TEST_CHECK(WaitUntil([&] { return metrics.Rounds.Load() >= rounds + XenTimeSampler::PushRounds + 2; }));
+    TEST_CHECK(TestAlerts.load() - alerts == XenTimeSampler::PushRounds);
+
+    TimeSample sample;
+    unsigned __int64 sequence = 0;
+    TEST_CHECK(sampler.GetLatest(&sample, &sequence));
+    TEST_CHECK(std::abs(sample.toOffset - TIME_S(1)) < TIME_MS(100));
+}
+
+// Holdover through device outages: none before DriftModel is ready; then samples whose dispersion grows with the time
+// since the last real one, up to HoldoverLimit and not beyond; and a fresh allowance once the device has been back.
+static void TestHoldover() {
+    SimClock systemClock;
+    TestSystemClock = &systemClock;
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    platform->SetOptions(TestFastOptions());
+    const std::wstring path = L"\\\\?\\sim#xeniface#0";
+    platform->AddInterface(path);
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    XenTimeSampler sampler(TestCallbacks, worker, metrics);
+    auto config = TestSamplerConfig();
+    config.Interval = std::chrono::milliseconds(20);
+    config.HoldoverLimit = std::chrono::milliseconds(500);
+    auto limitMs = static_cast<unsigned __int64>(config.HoldoverLimit.count());
+    sampler.Configure(config);
+
+    auto outage = [&] {
+        // the device goes away in the middle of a round
+        TestHeld = false;
+        TestHold = true;
+        TEST_CHECK(WaitUntil([&] { return TestHeld.load(); }));
+        platform->RemoveInterface(path);
+        TEST_CHECK(WaitUntil([&] { return !worker.GetDevice(); }));
+        unsigned __int64 removedAt;
+        TEST_CHECK(SUCCEEDED(TestGetTimeSysInfo(TSI_TickCount, &removedAt)));
+        TestHold = false;
+        return removedAt;
+    };
+    auto idleRounds = [&] { return metrics.PendingRounds.Load() + metrics.FailedRounds.Load(); };
+
+    // the startup rounds are ResumeInterval apart, plenty to catch the sampler after its first sample
+    TEST_CHECK(WaitUntil([&] { return metrics.SamplesPublished.Load() >= 1; }));
+    outage();
+    auto published = metrics.SamplesPublished.Load();
+    TEST_CHECK(published < DriftModel::MinPoints);
+    auto idle = idleRounds();
+    TEST_CHECK(WaitUntil([&] { return idleRounds() >= idle + 5; }));
+    TEST_CHECK(metrics.HoldoverRounds.Load() == 0);
+    TEST_CHECK(metrics.SamplesPublished.Load() == published);
+
+    platform->AddInterface(path);
+    TEST_CHECK(WaitUntil([&] { return metrics.SamplesPublished.Load() >= published + 2 * DriftModel::MinPoints; }));
+    auto removedAt = outage();
+    TEST_CHECK(WaitUntil([&] { return metrics.HoldoverRounds.Load() > 0; }));
+    idle = idleRounds();
+
+    // the first sample handed out may still be from the round the device went away in, the rest are held over
+    TimeSample sample;
+    unsigned __int64 sequence = 0;
+    sampler.GetLatest(&sample, &sequence);
+    std::vector<TimeSample> heldOver;
+    TEST_CHECK(WaitUntil([&] {
+        if (sampler.GetLatest(&sample, &sequence))
+            heldOver.push_back(sample);
+        return idleRounds() >= idle + 3;
+    }));
+    TEST_CHECK(heldOver.size() >= 2);
+    for (size_t i = 1; i < heldOver.size(); i++)
+        TEST_CHECK(heldOver[i].tpDispersion >= heldOver[i - 1].tpDispersion);
+    if (heldOver.size() >= 2) {
+        TEST_CHECK(heldOver.back().tpDispersion > heldOver.front().tpDispersion);
+        // the limit runs from the last real sample, which came before the device went away
+        TEST_CHECK(heldOver.back().nSysTickCount <= removedAt + limitMs + 1);
+        TEST_CHECK(heldOver.back().nSysTickCount >= removedAt + limitMs / 2);
+    }
+    for (const auto &held : heldOver)
+        TEST_CHECK(std::abs(held.toOffset) < TIME_MS(10));
+
+    auto holdover = metrics.HoldoverRounds.Load();
+    idle = idleRounds();
+    TEST_CHECK(WaitUntil([&] { return idleRounds() >= idle + 5; }));
+    TEST_CHECK(metrics.HoldoverRounds.Load() == holdover);
+    TEST_CHECK(!sampler.GetLatest(&sample, &sequence));
+
+    // real samples again, and with them the full limit for the next outage
+    published = metrics.SamplesPublished.Load();
+    platform->AddInterface(path);
+    TEST_CHECK(WaitUntil([&] { return metrics.SamplesPublished.Load() >= published + 2 * DriftModel::MinPoints; }));
+    TEST_CHECK(metrics.HoldoverRounds.Load() == holdover);
+    outage();
+    TEST_CHECK(WaitUntil([&] { return metrics.HoldoverRounds.Load() > holdover; }));
+}
+
+// The queue on its own: full, first in first out around the ring, and letting go of values once popped; then
+// producers racing for slots, whose values must all come out, each producer's in order
+static void TestRequestQueue() {
+    RequestQueue<std::shared_ptr<int>, 4> queue;
+    for (int i = 0; i < 4; i++)
+        TEST_CHECK(queue.TryPush(std::make_shared<int>(i)));
+    auto extra = std::make_shared<int>(4);
+    TEST_CHECK(!queue.TryPush(std::move(extra)));
+    // left alone when full
+    TEST_CHECK(extra && *extra == 4);
+    std::shared_ptr<int> popped;
+    for (int i = 0; i < 4; i++)
+        TEST_CHECK(queue.TryPop(&popped) && *popped == i);
+    TEST_CHECK(!queue.TryPop(&popped));
+
+    std::weak_ptr<int> weak;
+    for (int i = 0; i < 10; i++) {
+        auto pushed = std::make_shared<int>(i);
+        weak = pushed;
+        TEST_CHECK(queue.TryPush(std::move(pushed)));
+        TEST_CHECK(queue.TryPop(&popped) && *popped == i);
+        popped.reset();
+        TEST_CHECK(weak.expired());
+    }
+
+    constexpr unsigned int Producers = 4;
+    constexpr unsigned __int64 Values = 20000;
+    RequestQueue<unsigned __int64, 64> shared;
+    std::vector<std::jthread> producers;
+    for (unsigned int producer = 0; producer < Producers; producer++) {
+        producers.emplace_back([&shared, producer] {
+            for (unsigned __int64 i = 0; i < Values; i++) {
+                while (!shared.TryPush(static_cast<unsigned __int64>(producer) << 32 | i))
+                    std::this_thread::yield();
+            }
+        });
+    }
+    unsigned __int64 next[Producers] = {};
+    for (unsigned __int64 received = 0; received < Producers * Values;) {
+        unsigned __int64 value;
+        if (!shared.TryPop(&value)) {
+            std::this_thread::yield();
+            continue;
+        }
+        auto producer = value >> 32;
+        TEST_CHECK(producer < Producers);
+        if (producer < Producers) {
+            TEST_CHECK((value & 0xffffffff) == next[producer]);
+            next[producer] = (value & 0xffffffff) + 1;
+        }
+        received++;
+    }
+    for (auto count : next)
+        TEST_CHECK(count == Values);
+}
+
+// The worker's side of the queue. Held in its push handler, it can't drain the queue while XenStore changes: the
+// first QueueSize are queued, the rest overflow. Released, it coalesces the queued ones into a single update and
+// enumerates again for what overflowed, ending up with the last value written.
+static void TestWorkerEvents() {
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    platform->SetOptions(TestFastOptions());
+    platform->AddInterface(L"\\\\?\\sim#xeniface#0");
+    SimTimeDaemon daemon(*platform, false);
+
+    XenTimeMetrics metrics;
+    XenIfaceWorker worker(platform, metrics);
+    std::atomic<bool> hold = false, held = false;
+    worker.SetPushHandler([&] {
+        while (hold.load()) {
+            held.store(true);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    TEST_CHECK(WaitUntil([&] { return daemon.Notify(); }));
+    hold = true;
+    // held up in the channel until the last push has been handled
+    TEST_CHECK(daemon.Notify());
+    TEST_CHECK(WaitUntil([&] { return held.load(); }));
+
+    auto overflows = metrics.EventOverflows.Load();
+    auto coalesced = metrics.EventsCoalesced.Load();
+    constexpr unsigned int Writes = XenIfaceWorker::QueueSize + 36;
+    for (unsigned int i = 1; i <= Writes; i++)
+        platform->StoreWrite(XenHostSync::Path, "stratum=2 leap=0 dispersion=" + std::to_string(i * 1000));
+    TEST_CHECK(metrics.EventOverflows.Load() - overflows == Writes - XenIfaceWorker::QueueSize);
+    TEST_CHECK(metrics.EventsCoalesced.Load() == coalesced);
+
+    hold = false;
+    TEST_CHECK(WaitUntil([&] { return metrics.EventsCoalesced.Load() - coalesced == XenIfaceWorker::QueueSize - 1; }));
+    TEST_CHECK(WaitUntil([&] {
+        auto state = worker.GetHostSync();
+        return state.Valid && state.Dispersion == Writes * 10;
+    }));
+    TEST_CHECK(worker.GetDevice() != nullptr);
+}
+
+static std::atomic<unsigned int> TestLogged;
+
+static HRESULT __stdcall TestCountLogEvent(WORD type, WCHAR *facility, WCHAR *message) {
+    UNREFERENCED_PARAMETER(type);
+    UNREFERENCED_PARAMETER(facility);
+    UNREFERENCED_PARAMETER(message);
+    TestLogged++;
+    return S_OK;
+}
+
+// The per-site token bucket on a virtual clock, then through the writer thread
+static void TestLogRateLimit() {
+    static const char SiteA[] = "a", SiteB[] = "b";
+    constexpr auto Interval = LogRateLimiter::RefillInterval;
+    LogRateLimiter limiter;
+    auto now = std::chrono::steady_clock::time_point() + std::chrono::hours(1);
+    unsigned __int64 suppressed;
+    for (unsigned int i = 0; i < LogRateLimiter::Burst; i++)
+        TEST_CHECK(limiter.Admit(SiteA, now, &suppressed) && suppressed == 0);
+    for (int i = 0; i < 5; i++)
+        TEST_CHECK(!limiter.Admit(SiteA, now, &suppressed) && suppressed == 0);
+    // a bucket of its own
+    TEST_CHECK(limiter.Admit(SiteB, now, &suppressed) && suppressed == 0);
+
+    // one token per interval, and the message it lets out mentions the ones held back
+    TEST_CHECK(!limiter.Admit(SiteA, now + Interval - std::chrono::nanoseconds(1), &suppressed));
+    TEST_CHECK(limiter.Admit(SiteA, now + Interval, &suppressed) && suppressed == 6);
+    TEST_CHECK(!limiter.Admit(SiteA, now + Interval, &suppressed) && suppressed == 0);
+
+    // a long quiet spell refills the bucket, but no further than Burst, and none of it is saved up for later
+    now += 100 * Interval + Interval / 2;
+    TEST_CHECK(limiter.Admit(SiteA, now, &suppressed) && suppressed == 1);
+    for (unsigned int i = 1; i < LogRateLimiter::Burst; i++)
+        TEST_CHECK(limiter.Admit(SiteA, now, &suppressed) && suppressed == 0);
+    TEST_CHECK(!limiter.Admit(SiteA, now, &suppressed));
+
+    // part of an interval counts towards the next token
+    TEST_CHECK(limiter.Admit(SiteA, now + 5 * Interval / 2, &suppressed) && suppressed == 1);
+    TEST_CHECK(limiter.Admit(SiteA, now + 5 * Interval / 2, &suppressed));
+    TEST_CHECK(!limiter.Admit(SiteA, now + 5 * Interval / 2, &suppressed));
+    TEST_CHECK(limiter.Admit(SiteA, now + 3 * Interval, &suppressed) && suppressed == 1);
+    TEST_CHECK(!limiter.Admit(SiteA, now + 3 * Interval, &suppressed));
+
+    LogStatistics before, after;
+    {
+        LogWriter writer;
+        LogGetStatistics(&before);
+        for (int i = 0; i < 25; i++)
+            TimeProvLog(TestCountLogEvent, LogTimeProvEventTypeWarning, L"Round %d failed", i);
+        LogFlush();
+        LogGetStatistics(&after);
+    }
+    TEST_CHECK(TestLogged.load() == LogRateLimiter::Burst);
+    TEST_CHECK(after.Suppressed - before.Suppressed == 25 - LogRateLimiter::Burst);
+    TEST_CHECK(after.Dropped == before.Dropped);
+}
+
+// What goes to XenStore on each pass: every key at first, then only those that moved beyond their threshold, and
+// again whatever failed to be written
+static void TestStatus() {
+    const std::wstring path = L"\\\\?\\sim#xeniface#0";
+    auto platform = std::make_shared<SimXenIfacePlatform>();
+    platform->SetOptions(TestFastOptions());
+    platform->AddInterface(path);
+    std::shared_ptr<IXenIfaceDevice> device;
+    TEST_CHECK(SUCCEEDED(platform->Open(path, nullptr, device)));
+    if (!device)
+        return;
+    auto read = [&](PCSTR name) {
+        std::string value;
+        platform->StoreRead(std::string(XenTimeStatus::Path) + "/" + name, &value);
+        return value;
+    };
+    auto deadline = [] { return std::chrono::steady_clock::now() + std::chrono::seconds(5); };
+    constexpr unsigned __int64 Threshold = 1000;
+    constexpr std::chrono::seconds Interval(60);
+
+    auto now = std::chrono::steady_clock::now();
+    XenTimeStatus status;
+    TEST_CHECK(!status.IsDue(now + Interval - std::chrono::seconds(1), Interval));
+    TEST_CHECK(status.IsDue(now + Interval + std::chrono::seconds(1), Interval));
+
+    // 60 rounds in a minute
+    auto rounds = [&](unsigned int count, signed __int64 offset, XenTimeSource source) {
+        auto sample = TestSample(offset, 200, 50);
+        for (unsigned int i = 0; i < count; i++)
+            status.AddRound(S_OK, &sample, source);
+    };
+    rounds(60, 1000, XenTimeSource::Ioctl);
+    now += Interval;
+    TEST_CHECK(SUCCEEDED(status.Publish(now, Threshold, device.get(), deadline())));
+    TEST_CHECK(platform->GetStoreWrites() == 6);
+    TEST_CHECK(read("offset") == "100000" && read("delay") == "20000" && read("dispersion") == "5000");
+    TEST_CHECK(read("source") == "ioctl" && read("rate") == "60" && read("error") == "0");
+    TEST_CHECK(!status.IsDue(now + Interval - std::chrono::seconds(1), Interval));
+    TEST_CHECK(status.IsDue(now + Interval, Interval));
+
+    // within the threshold
+    rounds(60, 1000 + Threshold / 2, XenTimeSource::Ioctl);
+    now += Interval;
+    TEST_CHECK(SUCCEEDED(status.Publish(now, Threshold, device.get(), deadline())));
+    TEST_CHECK(platform->GetStoreWrites() == 6);
+    TEST_CHECK(read("offset") == "100000");
+
+    // the offset beyond it, the rate within RateThreshold of the one written
+    rounds(66, 1000 + 3 * Threshold / 2, XenTimeSource::Ioctl);
+    now += Interval;
+    TEST_CHECK(SUCCEEDED(status.Publish(now, Threshold, device.get(), deadline())));
+    TEST_CHECK(platform->GetStoreWrites() == 7);
+    TEST_CHECK(read("offset") == "250000" && read("rate") == "60");
+
+    // a change of source or error is always written, a withheld round is no error
+    rounds(59, 2500, XenTimeSource::Holdover);
+    status.AddRound(HRESULT_FROM_WIN32(ERROR_GEN_FAILURE), nullptr, XenTimeSource::None);
+    now += Interval;
+    TEST_CHECK(SUCCEEDED(status.Publish(now, Threshold, device.get(), deadline())));
+    TEST_CHECK(platform->GetStoreWrites() == 9);
+    TEST_CHECK(read("source") == "none" && read("error") == "8007001f" && read("offset") == "250000");
+    status.AddRound(S_FALSE, nullptr, XenTimeSource::None);
+    TEST_CHECK(SUCCEEDED(status.Publish(now + Interval, Threshold, device.get(), deadline())));
+    TEST_CHECK(read("error") == "0");
+
+    // after a migration everything is written again, and what fails is tried again on the next pass
+    auto writes = platform->GetStoreWrites();
+    auto options = platform->GetOptions();
+    options.StoreError = HRESULT_FROM_WIN32(ERROR_GEN_FAILURE);
+    platform->SetOptions(options);
+    status.Invalidate();
+    TEST_CHECK(status.Publish(now + 2 * Interval, Threshold, device.get(), deadline()) == options.StoreError);
+    TEST_CHECK(platform->GetStoreWrites() == writes);
+    options.StoreError = S_OK;
+    platform->SetOptions(options);
+    TEST_CHECK(SUCCEEDED(status.Publish(now + 3 * Interval, Threshold, device.get(), deadline())));
+    TEST_CHECK(platform->GetStoreWrites() == writes + 6);
+}
+
+// What dom0's time service writes, as the worker parses it
+static void TestHostSync() {
+    XenHostSyncState state;
+    TEST_CHECK(SUCCEEDED(XenHostSync::Parse("stratum=2 dispersion=1500000 leap=0", &state)));
+    TEST_CHECK(state.Valid && state.Stratum == 2 && state.Leap == XenHostLeapNone && state.Dispersion == 15000);
+    TEST_CHECK(state.IsSynchronized());
+    // any order and spacing, unknown fields ignored, no dispersion is none
+    TEST_CHECK(SUCCEEDED(XenHostSync::Parse("  leap=1 offset=7  stratum=16 ", &state)));
+    TEST_CHECK(state.Valid && state.Stratum == 16 && state.Leap == XenHostLeapInsert && state.Dispersion == 0);
+    TEST_CHECK(!state.IsSynchronized());
+    TEST_CHECK(SUCCEEDED(XenHostSync::Parse("stratum=1 leap=3", &state)));
+    TEST_CHECK(!state.IsSynchronized());
+
+    static const PCSTR invalid[] = {
+        "",
+        "stratum=2",
+        "leap=0",
+        "stratum=17 leap=0",
+        "stratum=2 leap=4",
+        "stratum=-1 leap=0",
+        "stratum=+1 leap=0",
+        "stratum= 2 leap=0",
+        "stratum=2x leap=0",
+        "stratum leap=0",
+        "stratum=2 leap=0 dispersion=",
+    };
+    for (auto value : invalid) {
+        TEST_CHECK(XenHostSync::Parse(value, &state) == E_INVALIDARG);
+        TEST_CHECK(!state.Valid);
+    }
+
+    // the packed cache keeps all of it, a dispersion too large for it saturates first
+    XenHostSync sync;
+    TEST_CHECK(!sync.Get().Valid);
+    TEST_CHECK(SUCCEEDED(XenHostSync::Parse("stratum=15 leap=2 dispersion=18446744073709551615", &state)));
+    sync.Set(state);
+    auto packed = sync.Get();
+    TEST_CHECK(packed.Valid && packed.Stratum == 15 && packed.Leap == XenHostLeapDelete);
+    TEST_CHECK(state.Dispersion == (1ULL << 56) - 1 && packed.Dispersion == state.Dispersion);
+    TEST_CHECK(SUCCEEDED(XenHostSync::Parse("stratum=3 leap=0 dispersion=2000", &state)));
+    sync.Set(state);
+    packed = sync.Get();
+    TEST_CHECK(packed.Valid && packed.Stratum == 3 && packed.Leap == XenHostLeapNone && packed.Dispersion == 20);
+    sync.Set(XenHostSyncState{});
+    TEST_CHECK(!sync.Get().Valid);
+
+    ULONG id;
+    TEST_CHECK(SUCCEEDED(XenHostSync::ParseEventChannel("5", &id)) && id == 5);
+    TEST_CHECK(SUCCEEDED(XenHostSync::ParseTimePage("4294967295", &id)) && id == 4294967295UL);
+    static const PCSTR invalidIds[] = {"", "0", "4294967296", "12 ", " 12", "-1", "+1", "0x10"};
+    for (auto value : invalidIds) {
+        id = 1;
+        TEST_CHECK(XenHostSync::ParseEventChannel(value, &id) == E_INVALIDARG && id == 0);
+        id = 1;
+        TEST_CHECK(XenHostSync::ParseTimePage(value, &id) == E_INVALIDARG && id == 0);
+    }
+}
+
+struct TestMode {
+    const char *Name;
+    void (*Run)();
+};
+
+static const TestMode TestModes[] = {
+    {"histogram", TestHistogram},
+    {"metricssection", TestMetricsSection},
+    {"telemetry", TestTelemetry},
+    {"schedule", TestSchedule},
+    {"schedule-polls", TestSchedulePolls},
+    {"driftmodel", TestDriftModel},
+    {"clockfilter", TestClockFilter},
+    {"localtime", TestLocalTimeConverter},
+    {"dispersion", TestDispersion},
+    {"offsetfilter", TestOffsetFilter},
+    {"offsetfilter-step", TestOffsetFilterStep},
+    {"pvclock", TestPvClock},
+    {"hosttimepage", TestPvClockHostTime},
+    {"samplering", TestSampleRing},
+    {"retire", TestDeviceRetire},
+    {"straddle", TestStraddledBursts},
+    {"request", TestRequestDeadline},
+    {"push", TestPushRounds},
+    {"holdover", TestHoldover},
+    {"requestqueue", TestRequestQueue},
+    {"eventqueue", TestWorkerEvents},
+    {"logging", TestLogRateLimit},
+    {"status", TestStatus},
+    {"hostsync", TestHostSync},
+};
+
+static void Usage(const char *program) {
+    fprintf(stderr, "usage: %s <test>\n", program);
+    for (const auto &mode : TestModes)
+        fprintf(stderr, "    %s\n", mode.Name);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    for (const auto &mode : TestModes) {
+        if (!strcmp(argv[1], mode.Name)) {
+            mode.Run();
+            printf("%s: %d failures\n", mode.Name, TestFailures);
+            return TestFailures ? 1 : 0;
+        }
+    }
+
+    Usage(argv[0]);
+    return 2;
+}
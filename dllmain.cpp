@@ -3,13 +3,14 @@
 
 #include "Globals.hpp"
 #include "Logging.hpp"
+#include "Win32XenIface.hpp"
 #include "XenTimeProvider.hpp"
 
 HRESULT CALLBACK
 TimeProvOpen(_In_ PWSTR wszName, _In_ TimeProvSysCallbacks *pSysCallbacks, _Out_ TimeProvHandle *phTimeProv) {
     if (CompareStringOrdinal(XenTimeProviderName, -1, wszName, -1, TRUE) == CSTR_EQUAL) {
         try {
-            *phTimeProv = new XenTimeProvider(pSysCallbacks);
+            *phTimeProv = new XenTimeProvider(pSysCallbacks, std::make_shared<Win32XenIfacePlatform>());
             return S_OK;
         }
         CATCH_RETURN();